@@ -83,6 +83,7 @@ _add_member_to_cache(dax_state *ds, int index, char *desc) {
         new->name = strdup(name);
         new->type = dax_string_to_type(ds, type);
         new->count = count;
+        new->byte = new->bit = 0;
         new->next = NULL;
         //--printf("_add_member() - name = %s type = 0x%X count = %ld\n", new->name, new->type, new->count);
         /* Add the new member to the end of the linked list */
@@ -101,51 +102,112 @@ _add_member_to_cache(dax_state *ds, int index, char *desc) {
     return 0;
 }
 
+/* Puts the members of the datatype in a hash table keyed on the name so that
+ * resolving a member in a tagname doesn't have to compare the name to every
+ * member before it.  Open addressing with linear probing.  If we can't get
+ * the memory the table is left out and the members are searched in order. */
+static void
+_build_member_table(datatype *dt)
+{
+    cdt_member *this;
+    unsigned int count = 0, size, n;
+
+    for(this = dt->members; this != NULL; this = this->next) count++;
+    for(size = 4; size < count * 2; size <<= 1);
+    dt->mtable = calloc(size, sizeof(cdt_member *));
+    if(dt->mtable == NULL) return;
+    dt->mtable_size = size;
+    for(this = dt->members; this != NULL; this = this->next) {
+        n = name_hash(this->name) & (size - 1);
+        while(dt->mtable[n] != NULL) n = (n + 1) & (size - 1);
+        dt->mtable[n] = this;
+    }
+}
+
+/* Returns the member of the datatype with the given name or NULL */
+static cdt_member *
+_find_member(datatype *dt, const char *name)
+{
+    cdt_member *this;
+    unsigned int n;
+
+    if(dt->mtable == NULL) {
+        this = dt->members;
+        while(this != NULL && strcmp(name, this->name)) {
+            this = this->next;
+        }
+        return this;
+    }
+    n = name_hash(name) & (dt->mtable_size - 1);
+    while((this = dt->mtable[n]) != NULL) {
+        if(strcmp(name, this->name) == 0) return this;
+        n = (n + 1) & (dt->mtable_size - 1);
+    }
+    return NULL;
+}
+
+/* Works out where each member of the custom datatype is and the size of the
+ * whole thing.  This is only done once for each type so that finding a member
+ * doesn't mean adding up all the members before it. */
+static int
+_figure_offsets(dax_state *ds, int index)
+{
+    unsigned int pos = 0; /* Bit position within the data area */
+    int size;
+    cdt_member *this;
+
+    /* The members don't move if the datatype array is reallocated when
+     * the types of the members are retrieved */
+    this = ds->datatypes[index].members;
+    while (this != NULL) {
+        /* Anything but a bool is aligned to the next byte.  To align it we
+         * set all the lower three bits to 1 and then increment. */
+        if(this->type != DAX_BOOL && pos % 8 != 0) {
+            pos |= 0x07;
+            pos++;
+        }
+        this->byte = pos / 8;
+        this->bit = pos % 8;
+        if(this->type == DAX_BOOL) {
+            pos += this->count; /* BOOLs are easy just add the number of bits */
+        } else {
+            size = dax_get_typesize(ds, this->type);
+            if(size < 0) return size;
+            pos += size * this->count * 8;
+        }
+        this = this->next;
+    }
+    if(pos) {
+        ds->datatypes[index].size = (pos - 1)/8 + 1;
+    }
+    if(ds->datatypes[index].mtable == NULL) {
+        _build_member_table(&ds->datatypes[index]);
+    }
+    return 0;
+}
+
 /*!
  * Calculate the size (in bytes) of the datatype
  */
 int
 dax_get_typesize(dax_state *ds, tag_type type)
 {
-    int size = 0;
-    unsigned int pos = 0; /* Bit position within the data area */
-    cdt_member *this;
+    int result, index;
 
     type &= ~DAX_QUEUE; /* Delete the Queue bit from the type */
     if( dax_type_to_string(ds, type) == NULL )
         return ERR_ARG;
 
     if(IS_CUSTOM(type)) {
-        this = ds->datatypes[CDT_TO_INDEX(type)].members;
-        while (this != NULL) {
-            if(this->type == DAX_BOOL) {
-                pos += this->count; /* BOOLs are easy just add the number of bits */
-            } else {
-                /* Since it's not a bool we need to align to the next byte.
-                 * To align it we set all the lower three bits to 1 and then
-                 * increment. */
-                if(pos % 8 != 0) { /* Do nothing if already aligned */
-                    pos |= 0x07;
-                    pos++;
-                }
-                if(IS_CUSTOM(this->type)) {
-                    pos += (dax_get_typesize(ds, this->type) * this->count) * 8;
-                } else {
-                    /* This gets the size in bits */
-                    pos += TYPESIZE(this->type) * this->count;
-                }
-            }
-            this = this->next;
-        }
-        if(pos) {
-            size = (pos - 1)/8 + 1;
-        } else {
-            size = 0;
+        index = CDT_TO_INDEX(type);
+        if(ds->datatypes[index].size == 0) {
+            result = _figure_offsets(ds, index);
+            if(result) return result;
         }
+        return ds->datatypes[index].size;
     } else { /* Not IS_CUSTOM() */
-        size = TYPESIZE(type) / 8; /* Size in bytes */
+        return TYPESIZE(type) / 8; /* Size in bytes */
     }
-    return size;
 }
 
 /* Retrieves a pointer to the datatype array element identified by type
@@ -196,7 +258,10 @@ add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
         /* Set both pointers to NULL */
         for(n = 0; n < DAX_DATATYPE_SIZE; n++) {
             ds->datatypes[n].name = NULL;
+            ds->datatypes[n].size = 0;
             ds->datatypes[n].members = NULL;
+            ds->datatypes[n].mtable = NULL;
+            ds->datatypes[n].mtable_size = 0;
         }
         ds->datatype_size = DAX_DATATYPE_SIZE;
     }
@@ -213,7 +278,10 @@ add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
             /* Set both pointers to NULL */
             for(n = ds->datatype_size; n < ds->datatype_size + DAX_DATATYPE_SIZE; n++) {
                 ds->datatypes[n].name = NULL;
+                ds->datatypes[n].size = 0;
                 ds->datatypes[n].members = NULL;
+                ds->datatypes[n].mtable = NULL;
+                ds->datatypes[n].mtable_size = 0;
             }
             ds->datatype_size += DAX_DATATYPE_SIZE;
         } else {
@@ -252,10 +320,11 @@ dax_cdt_new(char *name, int *error)
     if(strlen(name) > DAX_TAGNAME_SIZE) {
         result = ERR_2BIG;
     } else {
-        new = malloc(sizeof(dax_cdt *));
+        new = malloc(sizeof(dax_cdt));
         if(new == NULL) {
             result = ERR_ALLOC;
         } else {
+            new->size = 0;
             new->members = NULL;
             new->name = strdup(name);
             if(new->name == NULL) {
@@ -303,6 +372,7 @@ dax_cdt_member(dax_state *ds, dax_cdt *cdt, char *name, tag_type type, unsigned
     if(new->name == NULL) return ERR_ALLOC;
     new->type = type;
     new->count = count;
+    new->byte = new->bit = 0;
     new->next = NULL;
 
     /* Put it in the linked list */
@@ -549,38 +619,16 @@ _parse_next_member(dax_state *ds, tag_type lasttype, tag_handle *h, char *str, i
         return index;
     }
 
-    if(dax_type_to_string(ds, lasttype) == NULL) {
+    /* This makes sure that the offsets of the members have been figured */
+    if(dax_get_typesize(ds, lasttype) <= 0) {
         return ERR_NOTFOUND; /* This is a serious problem here */
     }
 
-    this = ds->datatypes[CDT_TO_INDEX(lasttype)].members;
-
-    while(this != NULL) {
-        /* Start by adding all the bytes of the members before the
-         * one we are looking for */
-
-        if(strcmp(name, this->name)) {
-            if(this->type == DAX_BOOL) {
-                h->bit += this->count;
-                if(h->bit > 7) {
-                    h->byte += h->bit / 8;
-                    h->bit %= 8;
-                }
-            } else {
-                /* Gotta step up one if the last member was a bool */
-                if(h->type == DAX_BOOL) h->byte++;
-                h->byte += dax_get_typesize(ds, this->type) * this->count;
-                h->bit = 0;
-            }
-            h->type = this->type; /* We need to keep track of the last type */
-
-            this = this->next;
-        } else { /* Here we have found it */
-            break;
-        }
-
-    }
+    this = _find_member(&ds->datatypes[CDT_TO_INDEX(lasttype)], name);
     if(this == NULL) return ERR_NOTFOUND;
+    /* Custom datatypes always start on a byte boundary */
+    h->byte += this->byte;
+    h->bit = this->bit;
 
     if(nextname) { /* Not the last item */
         if(isdigit(nextname[0])) {
@@ -597,18 +645,14 @@ _parse_next_member(dax_state *ds, tag_type lasttype, tag_handle *h, char *str, i
             h->byte += dax_get_typesize(ds, this->type) * index;
         }
     } else { /* We are the last item */
-        if(h->type == DAX_BOOL && this->type != DAX_BOOL) {
-            h->byte++;
-            h->bit = 0;
-        }
-
         h->type = this->type;
         if(index != ERR_NOTFOUND){
             if(count == 0 ) count = 1;
             if((index + count) > this->count ) return ERR_2BIG;
             if(this->type == DAX_BOOL) {
-                h->byte += index / 8;
-                h->bit += index % 8;
+                h->bit += index;
+                h->byte += h->bit / 8;
+                h->bit %= 8;
                 /* Two bits across the byte boundry require two bytes */
                 h->size = (h->bit + count - 1) / 8 - (h->bit / 8) + 1;
                 h->count = count;
@@ -739,10 +783,16 @@ dax_tag_handle(dax_state *ds, tag_handle *h, char *str, int count)
     if(h == NULL || ds == NULL || str == NULL) {
         return ERR_ARG;
     }
+    /* We may have already done this one */
+    if(check_cache_handle(ds, str, count, h) == 0) {
+        return 0;
+    }
     bzero(h, sizeof(tag_handle)); /* Initialize h */
     result = _dax_tag_handle(ds, h, str, strlen(str) + 1, count);
     if(result) {
         bzero(h, sizeof(tag_handle)); /* Reset h in case of error */
+    } else {
+        cache_handle_add(ds, str, count, h);
     }
     return result;
 }
@@ -769,8 +819,6 @@ dax_cdt_iter(dax_state *ds, tag_type type, void *udata, void (*callback)(cdt_ite
     cdt_member *this;
     cdt_iter iter;
     int result;
-    int byte = 0;
-    int bit = 0;
     int index = 0;
 
     if(type == 0) { /* iterate through the custom types */
@@ -791,34 +839,20 @@ dax_cdt_iter(dax_state *ds, tag_type type, void *udata, void (*callback)(cdt_ite
         if(dt == NULL) {
             return result;
         }
-
-        this = dt->members;
+        /* This figures the offsets of the members */
+        result = dax_get_typesize(ds, type);
+        if(result < 0) {
+            return result;
+        }
+        /* Getting the size may have moved the datatype array */
+        this = ds->datatypes[CDT_TO_INDEX(type)].members;
         while(this != NULL) {
             iter.name = this->name;
             iter.type = this->type;
             iter.count = this->count;
-            iter.bit = bit;
-            iter.byte = byte;
+            iter.bit = this->bit;
+            iter.byte = this->byte;
             callback(iter, udata); /* Call the callback */
-            /* No sense in calculating the offsets if we're done */
-            if(this->next != NULL) {
-                if(this->type == DAX_BOOL) {
-                    bit += this->count % 8;
-                    byte += this->count / 8;
-                    if(bit > 7) { /* adjust for the overflow */
-                        bit %= 8;
-                        byte ++;
-                    }
-                    /* if the next one is not a BOOL then we should align */
-                    if(this->next->type != DAX_BOOL && bit != 0) {
-                        bit = 0;
-                        byte++;
-                    }
-                } else { /* Not this->type == DAX_BOOL */
-                    bit = 0;
-                    byte += dax_get_typesize(ds, this->type) * this->count;
-                }
-            }
             this = this->next;
         }
     }
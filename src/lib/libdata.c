@@ -21,51 +21,153 @@
 
 #include <libdax.h>
 #include <libcommon.h>
+#include <arpa/inet.h>
 
 /* Tag Cache Handling Code
- * The tag cache is a doubly linked circular list
- * the head pointer is fixed at the top of the list
- * tag searched for will bubble up one item in the list
- * each time it's found.  This will make the top of the list
- * the most searched for tags and the bottom the lesser used tags.
+ * The tag cache keeps the definitions of the tags that were retrieved from
+ * the server last so that we don't have to ask again.  The nodes are kept
+ * in a doubly linked circular list in the order that they were used.  The
+ * head is the most recently used and the one before the head is the least
+ * recently used, which is the one that is thrown out when the cache is full.
+ * Each node is also in two hash tables, one keyed on the name and one on the
+ * index, so that the lookups don't have to go through the list.  The tables
+ * are chained and are sized when the cache is initialized so that they are
+ * never more than half full.
+ *
+ * The handles that dax_tag_handle() works out are kept in another cache that
+ * is keyed on the string and the count.  It works the same way but it only
+ * has the one hash table.  The handles for a tag are thrown out whenever
+ * cache_tag_del() is called for that tag, which happens when the tag is
+ * deleted or changed.
+ *
+ * The cache has it's own lock because the connection thread takes tags out
+ * of it when the server tells us that they have been deleted, and that can
+ * happen while another thread is holding the main lock waiting for a
+ * response from the connection thread.
  */
 
-/* TODO: I need a way to invalidate the tag cache so that changes
-   to the tag can be put into the tag cache */
+#define HANDLE_CACHE_BUCKETS (DAX_HANDLE_CACHE_SIZE * 2)
+
+static inline uint32_t
+_index_hash(tag_index idx)
+{
+    return (uint32_t)idx * 0x9E3779B1U;
+}
 
 int
 init_tag_cache(dax_state *ds)
 {
+    uint32_t size;
+
     ds->cache_head = NULL;
     ds->cache_limit = strtol(dax_get_attr(ds, "cachesize"), NULL, 0);
     ds->cache_count = 0;
+    ds->cache_hits = 0;
+    ds->cache_misses = 0;
+    if(ds->cache_limit < 0) ds->cache_limit = 0;
+    for(size = 16; size < (uint32_t)ds->cache_limit * 2; size <<= 1);
+    ds->cache_names = calloc(size, sizeof(tag_cnode *));
+    ds->cache_indexes = calloc(size, sizeof(tag_cnode *));
+    if(ds->cache_names == NULL || ds->cache_indexes == NULL) {
+        free(ds->cache_names);
+        free(ds->cache_indexes);
+        ds->cache_names = ds->cache_indexes = NULL;
+        ds->cache_buckets = 0;
+        ds->cache_limit = 0;
+        return ERR_ALLOC;
+    }
+    ds->cache_buckets = size;
+    ds->handle_head = NULL;
+    ds->handle_count = 0;
+    /* We can live without this one */
+    ds->handle_table = calloc(HANDLE_CACHE_BUCKETS, sizeof(handle_cnode *));
     return 0;
 }
 
-static void
-_free_node(dax_state *ds, tag_cnode *this) {
-    if(this->next != ds->cache_head) {
-        _free_node(ds, this->next);
+void
+free_tag_cache(dax_state *ds) {
+    tag_cnode *this, *next;
+    handle_cnode *hthis, *hnext;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->cache_head != NULL) {
+        this = ds->cache_head;
+        do {
+            next = this->next;
+            free(this);
+            this = next;
+        } while(this != ds->cache_head);
+        ds->cache_head = NULL;
     }
-    free(this);
+    free(ds->cache_names);
+    free(ds->cache_indexes);
+    ds->cache_names = ds->cache_indexes = NULL;
+    ds->cache_buckets = 0;
+    ds->cache_count = 0;
+    if(ds->handle_head != NULL) {
+        hthis = ds->handle_head;
+        do {
+            hnext = hthis->next;
+            free(hthis);
+            hthis = hnext;
+        } while(hthis != ds->handle_head);
+        ds->handle_head = NULL;
+    }
+    free(ds->handle_table);
+    ds->handle_table = NULL;
+    ds->handle_count = 0;
+    pthread_mutex_unlock(&ds->cache_lock);
 }
 
-void
-free_tag_cache(dax_state *ds) {
-	if(ds->cache_head != NULL) {
-        _free_node(ds, ds->cache_head);
+/* Takes the node out of the list */
+static inline void
+_list_remove(dax_state *ds, tag_cnode *this)
+{
+    if(this->next == this) {
         ds->cache_head = NULL;
-	}
+    } else {
+        this->next->prev = this->prev;
+        this->prev->next = this->next;
+        if(ds->cache_head == this) {
+            ds->cache_head = this->next;
+        }
+    }
 }
 
+/* Puts the node at the head of the list */
+static inline void
+_list_push(dax_state *ds, tag_cnode *this)
+{
+    if(ds->cache_head == NULL) {
+        this->next = this;
+        this->prev = this;
+    } else {
+        this->next = ds->cache_head;
+        this->prev = ds->cache_head->prev;
+        ds->cache_head->prev->next = this;
+        ds->cache_head->prev = this;
+    }
+    ds->cache_head = this;
+}
+
+/* Takes the node out of both of the hash tables */
+static void
+_hash_remove(dax_state *ds, tag_cnode *this)
+{
+    tag_cnode **pp;
+    uint32_t mask = ds->cache_buckets - 1;
+
+    for(pp = &ds->cache_names[this->hash & mask]; *pp != this; pp = &(*pp)->name_next);
+    *pp = this->name_next;
+    for(pp = &ds->cache_indexes[_index_hash(this->idx) & mask]; *pp != this; pp = &(*pp)->idx_next);
+    *pp = this->idx_next;
+}
 
-/* This function assigns the data to *tag and bubbles
-   this up one node in the list */
+/* This function assigns the data to *tag and moves the node to the
+ * head of the list.  Call with the cache_lock held. */
 static inline void
 _cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
 {
-    tag_cnode *before, *after;
-
     /* Store the return values in tag */
     strcpy(tag->name, this->name);
     tag->idx = this->idx;
@@ -73,27 +175,11 @@ _cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
     tag->count = this->count;
     tag->attr = this->attr;
 
-  /* Bubble up:
-    'after' is set to the node that we swap with
-    'before' is set to the node that will be before
-    us after the swap.  The special case is when our
-    node will become the first one, then we move the head. */
-    if(this != ds->cache_head) { /* Do nothing if we are already at the top */
-        /* If there are only two then we do it the easy way */
-        if(ds->cache_count == 2) {
-            ds->cache_head = ds->cache_head->next;
-        } else {
-            if(this == ds->cache_head->next) ds->cache_head = this;
-            after = this->prev;
-            before = after->prev;
-            before->next = this;
-            after->prev = this;
-            after->next = this->next;
-            this->next->prev = after;
-            this->next = after;
-            this->prev = before;
-        }
+    if(this != ds->cache_head) {
+        _list_remove(ds, this);
+        _list_push(ds, this);
     }
+    ds->cache_hits++;
 }
 
 /* Used to check if a tag with the given index is in the
@@ -103,26 +189,22 @@ _cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
 int
 check_cache_index(dax_state *ds, tag_index idx, dax_tag *tag)
 {
-    tag_cnode *this;
+    tag_cnode *this = NULL;
 
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
-        return ERR_NOTFOUND;
-    }
-    if(ds->cache_head->idx != idx) {
-        this = this->next;
-
-        while(this != ds->cache_head && this->idx != idx) {
-            this = this->next;
-        }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->cache_buckets) {
+        this = ds->cache_indexes[_index_hash(idx) & (ds->cache_buckets - 1)];
+        while(this != NULL && this->idx != idx) {
+            this = this->idx_next;
         }
     }
-
+    if(this == NULL) {
+        ds->cache_misses++;
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_NOTFOUND;
+    }
     _cache_hit(ds, this, tag);
-
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
@@ -131,116 +213,260 @@ check_cache_index(dax_state *ds, tag_index idx, dax_tag *tag)
  * ERR_NOTFOUND otherwise */
 int
 check_cache_name(dax_state *ds, char *name, dax_tag *tag)
+{
+    tag_cnode *this = NULL;
+    uint32_t hash;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->cache_buckets) {
+        hash = name_hash(name);
+        this = ds->cache_names[hash & (ds->cache_buckets - 1)];
+        while(this != NULL && (this->hash != hash || strcmp(this->name, name))) {
+            this = this->name_next;
+        }
+    }
+    if(this == NULL) {
+        ds->cache_misses++;
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_NOTFOUND;
+    }
+    _cache_hit(ds, this, tag);
+    pthread_mutex_unlock(&ds->cache_lock);
+    return 0;
+}
+
+static tag_cnode *
+_find_index(dax_state *ds, tag_index idx)
 {
     tag_cnode *this;
 
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
-        return ERR_NOTFOUND;
+    this = ds->cache_indexes[_index_hash(idx) & (ds->cache_buckets - 1)];
+    while(this != NULL && this->idx != idx) {
+        this = this->idx_next;
     }
-    if( strcmp(ds->cache_head->name, name) ) {
-        this = this->next;
+    return this;
+}
 
-        while(this != ds->cache_head && strcmp(this->name, name)) {
-            this = this->next;
+/* The handle cache list works just like the tag cache list above */
+static inline void
+_handle_list_remove(dax_state *ds, handle_cnode *this)
+{
+    if(this->next == this) {
+        ds->handle_head = NULL;
+    } else {
+        this->prev->next = this->next;
+        this->next->prev = this->prev;
+        if(ds->handle_head == this) {
+            ds->handle_head = this->next;
         }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
+    }
+}
+
+static inline void
+_handle_list_push(dax_state *ds, handle_cnode *this)
+{
+    if(ds->handle_head == NULL) {
+        this->next = this;
+        this->prev = this;
+    } else {
+        this->next = ds->handle_head;
+        this->prev = ds->handle_head->prev;
+        ds->handle_head->prev->next = this;
+        ds->handle_head->prev = this;
+    }
+    ds->handle_head = this;
+}
+
+/* Takes the node out of the handle cache and frees it.  Call with the
+ * cache_lock held. */
+static void
+_handle_remove(dax_state *ds, handle_cnode *this)
+{
+    handle_cnode **pp;
+
+    for(pp = &ds->handle_table[this->hash % HANDLE_CACHE_BUCKETS]; *pp != this; pp = &(*pp)->hash_next);
+    *pp = this->hash_next;
+    _handle_list_remove(ds, this);
+    ds->handle_count--;
+    free(this);
+}
+
+/* Throws out all of the cached handles that point to the tag.  This has to
+ * look at all of them but it only happens when a tag is deleted or changed.
+ * Call with the cache_lock held. */
+static void
+_handle_purge(dax_state *ds, tag_index idx)
+{
+    handle_cnode *this, *next;
+    int n, count;
+
+    this = ds->handle_head;
+    count = ds->handle_count;
+    for(n = 0; n < count; n++) {
+        next = this->next;
+        if(this->h.index == idx) {
+            _handle_remove(ds, this);
         }
+        this = next;
     }
-    _cache_hit(ds, this, tag);
+}
 
+/* Looks for the handle that was made from the string and count.  Sets *h
+ * and returns zero if it's found and returns ERR_NOTFOUND otherwise */
+int
+check_cache_handle(dax_state *ds, char *str, int count, tag_handle *h)
+{
+    handle_cnode *this = NULL;
+    uint32_t hash;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->handle_table != NULL) {
+        hash = name_hash(str);
+        this = ds->handle_table[hash % HANDLE_CACHE_BUCKETS];
+        while(this != NULL && (this->hash != hash || this->count != count || strcmp(this->str, str))) {
+            this = this->hash_next;
+        }
+    }
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_NOTFOUND;
+    }
+    *h = this->h;
+    if(this != ds->handle_head) {
+        _handle_list_remove(ds, this);
+        _handle_list_push(ds, this);
+    }
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
+/* Adds the handle that was made from the string and count to the handle
+ * cache.  The least recently used one is thrown out if it's full. */
+int
+cache_handle_add(dax_state *ds, char *str, int count, tag_handle *h)
+{
+    handle_cnode *new;
+    uint32_t hash;
+
+    new = malloc(sizeof(handle_cnode) + strlen(str) + 1);
+    if(new == NULL) return ERR_ALLOC;
+    hash = name_hash(str);
+    new->hash = hash;
+    new->count = count;
+    new->h = *h;
+    strcpy(new->str, str);
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->handle_table == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        free(new);
+        return 0;
+    }
+    if(ds->handle_count >= DAX_HANDLE_CACHE_SIZE) {
+        _handle_remove(ds, ds->handle_head->prev);
+    }
+    new->hash_next = ds->handle_table[hash % HANDLE_CACHE_BUCKETS];
+    ds->handle_table[hash % HANDLE_CACHE_BUCKETS] = new;
+    _handle_list_push(ds, new);
+    ds->handle_count++;
+    pthread_mutex_unlock(&ds->cache_lock);
+    return 0;
+}
 
-/* Adds a tag to the cache */
+/* Adds a tag to the cache.  If the cache is full the least recently
+ * used tag is thrown out to make room. */
 int
 cache_tag_add(dax_state *ds, dax_tag *tag)
 {
     tag_cnode *new;
+    uint32_t mask;
 
-    if(ds->cache_head == NULL) { /* First one */
-        //--printf("adding {%d} to the beginning\n", tag->handle);
-        new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = new;
-            new->prev = new;
-            ds->cache_head = new;
-            ds->cache_count++;
-        } else {
-            return ERR_ALLOC;
-        }
-    } else if(ds->cache_count < ds->cache_limit) { /* Add to end */
-        //--printf("adding {%d} to the end\n", tag->handle);
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->cache_limit == 0 || ds->cache_buckets == 0) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return 0;
+    }
+    /* A tag with the same index is replaced */
+    new = _find_index(ds, tag->idx);
+    if(new != NULL) {
+        _hash_remove(ds, new);
+        _list_remove(ds, new);
+    } else if(ds->cache_count < ds->cache_limit) {
         new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = ds->cache_head;
-            new->prev = ds->cache_head->prev;
-            ds->cache_head->prev->next = new;
-            ds->cache_head->prev = new;
-            ds->cache_count++;
-        } else {
+        if(new == NULL) {
+            pthread_mutex_unlock(&ds->cache_lock);
             return ERR_ALLOC;
         }
+        ds->cache_count++;
     } else {
-        //--printf("Just putting {%s}  last\n", tag->name);
+        /* Reuse the least recently used one */
         new = ds->cache_head->prev;
+        _hash_remove(ds, new);
+        _list_remove(ds, new);
     }
     strcpy(new->name, tag->name);
     new->idx = tag->idx;
     new->type = tag->type;
     new->count = tag->count;
     new->attr = tag->attr;
-    //--print_cache();
-
+    new->hash = name_hash(new->name);
+    mask = ds->cache_buckets - 1;
+    new->name_next = ds->cache_names[new->hash & mask];
+    ds->cache_names[new->hash & mask] = new;
+    new->idx_next = ds->cache_indexes[_index_hash(new->idx) & mask];
+    ds->cache_indexes[_index_hash(new->idx) & mask] = new;
+    _list_push(ds, new);
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
-/* This function deletes the tag in the cache given by 'idx'
- * It returns 0 on success and ERR_NOTFOUND if the tag is not in the cache */
+/* This function deletes the tag in the cache given by 'idx' along with any
+ * handles to that tag.  It returns 0 on success and ERR_NOTFOUND if the tag
+ * is not in the cache */
 int
 cache_tag_del(dax_state *ds, tag_index idx) {
-    tag_cnode *this, *head;
+    tag_cnode *this = NULL;
 
-    /* Search for the tag */
-    if(ds->cache_head != NULL) {
-        head = ds->cache_head;
-        this = head;
-    } else {
-        return ERR_NOTFOUND;
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->handle_table != NULL) {
+        _handle_purge(ds, idx);
     }
-    if( head->idx != idx ) {
-        this = this->next;
-
-        while(this != head && (this->idx != idx)) {
-            this = this->next;
-        }
-        if(this == head) {
-            return ERR_NOTFOUND;
-        }
+    if(ds->cache_buckets) {
+        this = _find_index(ds, idx);
     }
-
-    /* If we get this far the tag was found and 'this' should point to
-     * the tag we want to delete */
-    if(this->next == this) { /* This is the Last One */
-        ds->cache_head = NULL;
-    } else {
-        /* disconnect module */
-        (this->next)->prev = this->prev;
-        (this->prev)->next = this->next;
-        /* don't want current to be pointing to the one we are deleting */
-        if(head == this) {
-            ds->cache_head = this->next;
-        }
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_NOTFOUND;
     }
+    _hash_remove(ds, this);
+    _list_remove(ds, this);
     ds->cache_count--;
-    /* free allocated memory */
+    pthread_mutex_unlock(&ds->cache_lock);
     free(this);
     return 0;
 }
 
+/*!
+ * Retrieve the counters for the library's tag cache.  The hits and misses
+ * are counted from the time that the module connected to the server.
+ *
+ * @param ds Pointer to the dax state object
+ * @param stats Pointer to the structure that will be filled in
+ * @returns Zero on success or an error code otherwise
+ */
+int
+dax_tag_cache_stats(dax_state *ds, dax_cache_stats *stats)
+{
+    if(stats == NULL) return ERR_ARG;
+    pthread_mutex_lock(&ds->cache_lock);
+    stats->hits = ds->cache_hits;
+    stats->misses = ds->cache_misses;
+    stats->count = ds->cache_count;
+    stats->limit = ds->cache_limit;
+    pthread_mutex_unlock(&ds->cache_lock);
+    return 0;
+}
+
 
 /* Type specific reading and writing functions.  These should be the most common
  * methods to read and write tags to the sever.*/
@@ -612,3 +838,25 @@ group_write_format(dax_state *ds, tag_group_id *id, uint8_t *buff) {
     return 0;
 }
 
+
+/* Puts the members in a group change message from the server into the
+ * group's data.  Each member is its index in the group followed by its data. */
+int
+group_delta_format(dax_state *ds, tag_group_id *id, uint8_t *buff, uint32_t size) {
+    uint32_t pos = 0, n;
+    tag_handle *h;
+    int result;
+
+    while(pos + 4 <= size) {
+        n = ntohl(*(uint32_t *)&buff[pos]);
+        pos += 4;
+        if(n >= (uint32_t)id->count) return ERR_MSG_BAD;
+        h = &id->handles[n];
+        if(pos + h->size > size) return ERR_MSG_BAD;
+        memcpy(&id->data[id->offsets[n]], &buff[pos], h->size);
+        result = _read_format(ds, h->type, h->count, &id->data[id->offsets[n]], 0);
+        if(result) return result;
+        pos += h->size;
+    }
+    return 0;
+}
@@ -50,23 +50,44 @@ typedef struct optattr {
     struct optattr *next;
 } optattr;
 
-/* This is the structure for our tag cache */
+/* This is the structure for our tag cache.  See libdata.c */
 typedef struct tag_cnode {
     tag_index idx;
     unsigned int type;
     unsigned int count;
     unsigned int attr;
-    struct tag_cnode *next;
+    uint32_t hash;                 /* Hash of the name */
+    struct tag_cnode *next;        /* List in the order that they were used */
     struct tag_cnode *prev;
+    struct tag_cnode *name_next;   /* Chain in the name hash table */
+    struct tag_cnode *idx_next;    /* Chain in the index hash table */
     char name[DAX_TAGNAME_SIZE + 1];
 } tag_cnode;
 
+/* The handles that dax_tag_handle() has worked out are kept in a cache too
+ * so that the string doesn't have to be parsed again.  See libdata.c */
+#ifndef DAX_HANDLE_CACHE_SIZE
+# define DAX_HANDLE_CACHE_SIZE 256
+#endif
+
+typedef struct handle_cnode {
+    uint32_t hash;                 /* Hash of the string */
+    int count;                     /* Count that was asked for with the string */
+    tag_handle h;
+    struct handle_cnode *next;     /* List in the order that they were used */
+    struct handle_cnode *prev;
+    struct handle_cnode *hash_next;
+    char str[];
+} handle_cnode;
+
 /* This is the compound datatype member definition.  The 
  * members are represented as a linked list */
 struct cdt_member {
     char *name;
     tag_type type;
     int count;
+    unsigned int byte; /* Offset of the member within the datatype.  These */
+    unsigned int bit;  /* are set when the size of the type is figured */
     struct cdt_member *next;
 };
 
@@ -76,7 +97,10 @@ typedef struct cdt_member cdt_member;
  * datatype. */
 struct datatype{
     char *name;
+    int size;  /* Size of the type in bytes.  Zero until it's figured */
     cdt_member *members;
+    cdt_member **mtable;      /* Members hashed by name.  Built with the size */
+    unsigned int mtable_size; /* Number of slots in mtable.  Power of two */
 };
 
 typedef struct datatype datatype;
@@ -85,13 +109,24 @@ struct tag_group_id {
     uint32_t index;     /* Unique identifier that the server uses */
     int count;           /* Number of tag handles in the group */
     int size;            /* Total size of the group's data in bytes */
-    uint8_t options;    /* Not implemented yet */
+    uint8_t options;    /* GROUP_OPT_* flags */
     tag_handle *handles; /* Array of tag handles that describes the group */
+    /* The rest is only used if the group is subscribed */
+    uint8_t *data;       /* Latest data that the server sent */
+    uint32_t *offsets;   /* Offset of each member within the data */
+    void *udata;         /* The user data to be sent with callback() */
+    void (*callback)(dax_state *ds, void *udata); /* Called when the data changes */
+    int refs;            /* Number of event threads using the group right now */
+    uint8_t deleted;     /* dax_group_del() was called while refs was non-zero */
+    uint32_t seq;        /* Event sequence number of the last change applied */
 };
 
 typedef struct tag_group_id tag_group_id;
 
-/* Right now the event_db is stored within the dax_state as an array. */
+/* The event_db is a hash table that is stored within the dax_state.  Empty
+ * slots have an idx of EVENT_DB_EMPTY.  See libevent.c */
+#define EVENT_DB_EMPTY 0xFFFFFFFF
+
 typedef struct event_db {
     uint32_t idx;  /* Tag index of the event */
     uint32_t id;   /* Individual id of the event */
@@ -112,10 +147,21 @@ struct dax_state {
     int id;     /* ID uniquely identifies the module to the server */
     int sfd;   /* Server's File Descriptor */
     unsigned int reformat; /* Flags to show how to reformat the incoming data */
+    uint32_t max_transfer; /* Largest message the server will take in chunks */
+    uint8_t *shm;          /* Server's shared memory segment if we have it mapped */
+    size_t shm_size;       /* Size of the shared memory mapping */
     int logflags;
-    tag_cnode *cache_head; /* First node in the cache list */
+    tag_cnode *cache_head; /* Most recently used node in the cache list */
     int cache_limit;       /* Total number of nodes that we'll allocate */
     int cache_count;       /* How many nodes we actually have */
+    tag_cnode **cache_names;   /* Hash table of the cache keyed on the name */
+    tag_cnode **cache_indexes; /* Hash table of the cache keyed on the index */
+    uint32_t cache_buckets;    /* Size of both tables.  Always a power of two */
+    uint64_t cache_hits, cache_misses;
+    handle_cnode *handle_head;   /* Most recently used node in the handle cache */
+    handle_cnode **handle_table; /* Hash table of the handle cache */
+    int handle_count;
+    pthread_mutex_t cache_lock; /* Protects both caches.  See libdata.c */
     datatype *datatypes;
     unsigned int datatype_size;
     pthread_mutex_t lock;
@@ -123,15 +169,23 @@ struct dax_state {
     pthread_barrier_t connect_barrier; /* Synchronize the connection thread */
     pthread_mutex_t event_lock, msg_lock; /* Locks for the message handling functions */
     pthread_cond_t event_cond, msg_cond; /* Condition variables for the message handling */
-    event_db *events;      /* Array of events stored for this connection */
-    int event_size;        /* Current size of the events array */
-    int event_count;       /* Total number of events stored in the array */
+    event_db *events;      /* Hash table of events stored for this connection */
+    int event_size;        /* Number of slots in the events table.  Power of two */
+    int event_count;       /* Total number of events stored in the table */
     int event_data_size;   /* Size of the event data that is stored here */
     char *event_data;      /* Pointer to the event data that was returned */
-    dax_message **emsg_queue; /* Event Message FIFO Queue */
-    int emsg_queue_size;     /* Total size of the Event Message Queue */
-    int emsg_queue_count;    /* number of entries in the event message queue */
-    //int emsg_queue_read;     /* index to the next event to read in the queue */
+    /* Event message ring.  The connection thread is the only one that puts
+     * messages in and the event functions take them out.  See libevent.c */
+    dax_message *emsg_ring;  /* Fixed message slots */
+    uint8_t *emsg_done;      /* Set when the slot has been dispatched */
+    uint32_t emsg_ring_size; /* Number of slots.  Always a power of two */
+    uint32_t emsg_head;      /* Next slot to be filled by the connection thread */
+    uint32_t emsg_read;      /* Next slot to be dispatched.  Protected by event_lock */
+    uint32_t emsg_tail;      /* Oldest slot that is still being used */
+    int emsg_waiters;        /* Number of threads waiting on event_cond */
+    unsigned int emsg_lost;  /* Events thrown away because the ring was full */
+    tag_group_id **groups;   /* Subscribed groups indexed by the server's index */
+    uint32_t groups_size;    /* Protected by event_lock */
     dax_message *last_msg;   /* The last message received on the socket */
     void (*dax_debug)(const char *output);
     void (*dax_error)(const char *output);
@@ -142,7 +196,10 @@ struct dax_state {
 #define MAX_TIMEOUT      30000
 #define DEFAULT_TIMEOUT  "1000"
 
-#define EVENT_QUEUE_SIZE 8 /* Initial size of the event queue */
+#define EVENT_QUEUE_SIZE 64 /* Default number of slots in the event queue */
+
+#define TAG_LIST_PAGE_SIZE 65536 /* Bytes of tag definitions asked for at once */
+#define DEFAULT_EVENT_QUEUE "64"
 
 /* Data Conversion Functions */
 #define REF_INT_SWAP 0x0001
@@ -188,6 +245,19 @@ dax_lreal stom_lreal(dax_lreal);
 int mtos_generic(tag_type type, void *dst, void *src);
 int stom_generic(tag_type type, void *dst, void *src);
 
+/* FNV-1a hash of a name.  Used by the tag cache and the datatype members */
+static inline uint32_t
+name_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 /* These functions handle the tag cache */
 int init_tag_cache(dax_state *ds);
 void free_tag_cache(dax_state *ds);
@@ -195,6 +265,13 @@ int check_cache_index(dax_state *, tag_index, dax_tag *);
 int check_cache_name(dax_state *, char *, dax_tag *);
 int cache_tag_add(dax_state *, dax_tag *);
 int cache_tag_del(dax_state *, tag_index);
+int check_cache_handle(dax_state *, char *, int, tag_handle *);
+int cache_handle_add(dax_state *, char *, int, tag_handle *);
+
+/* These functions read tag data from the shared memory segment */
+int shmem_attach(dax_state *ds, char *name);
+void shmem_detach(dax_state *ds);
+int shmem_read(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size);
 
 int opt_get_msgtimeout(dax_state *);
 int opt_lua_init_func(dax_state *);
@@ -203,14 +280,22 @@ datatype *get_cdt_pointer(dax_state *, tag_type, int *);
 int add_cdt_to_cache(dax_state *, tag_type type, char *typedesc);
 int dax_cdt_get(dax_state *ds, tag_type type, char *name);
 
+int init_event_queue(dax_state *ds, int size);
+void free_event_queue(dax_state *ds);
 int push_event(dax_state *ds, dax_message *msg);
+void wake_event_waiters(dax_state *ds);
 dax_message *pop_event(dax_state *ds);
+void release_event(dax_state *ds, dax_message *msg);
 int add_event(dax_state *ds, dax_id id, void *udata, void (*callback)(dax_state *ds, void *udata),
               void (*free_callback)(void *));
 int del_event(dax_state *ds, dax_id id);
+int init_event_db(dax_state *ds);
+void free_event_db(dax_state *ds);
 int exec_event(dax_state *ds, dax_id id);
 
 int group_read_format(dax_state *ds, tag_group_id *id, uint8_t *buff);
 int group_write_format(dax_state *ds, tag_group_id *id, uint8_t *buff);
+int group_delta_format(dax_state *ds, tag_group_id *id, uint8_t *buff, uint32_t size);
+void group_free(tag_group_id *id);
 
 #endif /* !__LIBDAX_H */
@@ -84,57 +84,235 @@ dax_event_type_to_string(int type) {
     }
 }
 
-/* Store the event information into a database internal to the library.  This is
- * where the callbacks and the userdata are stored.  The server simply sends an ID
- */
+/* The event database is where the callbacks and the userdata are stored.
+ * The server simply sends an ID.  It is a hash table keyed on the tag index
+ * and the event id that uses open addressing with linear probing.  The table
+ * is doubled when it gets half full and deletes move the entries that follow
+ * back into the hole so there are no tombstones.  The table is protected by
+ * the event_lock because events are dispatched from a different thread than
+ * the one that adds them. */
+#define EVENT_DB_START_SIZE 16
+
+static inline uint32_t
+_event_hash(uint32_t idx, uint32_t id)
+{
+    uint32_t hash;
+
+    hash = idx * 0x9E3779B1U ^ id;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BU;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/* Returns the slot that holds the event or -1 if it's not there.
+ * Call with the event_lock held */
+static int
+_event_find(dax_state *ds, uint32_t idx, uint32_t id)
+{
+    uint32_t mask, n;
+
+    mask = ds->event_size - 1;
+    for(n = _event_hash(idx, id) & mask; ds->events[n].idx != EVENT_DB_EMPTY; n = (n + 1) & mask) {
+        if(ds->events[n].idx == idx && ds->events[n].id == id) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static int
+_event_db_grow(dax_state *ds)
+{
+    event_db *new_db;
+    uint32_t mask, n, i;
+
+    new_db = malloc(ds->event_size * 2 * sizeof(event_db));
+    if(new_db == NULL) {
+        return ERR_ALLOC;
+    }
+    for(n = 0; n < ds->event_size * 2; n++) {
+        new_db[n].idx = EVENT_DB_EMPTY;
+    }
+    mask = ds->event_size * 2 - 1;
+    for(n = 0; n < ds->event_size; n++) {
+        if(ds->events[n].idx != EVENT_DB_EMPTY) {
+            i = _event_hash(ds->events[n].idx, ds->events[n].id) & mask;
+            while(new_db[i].idx != EVENT_DB_EMPTY) i = (i + 1) & mask;
+            new_db[i] = ds->events[n];
+        }
+    }
+    free(ds->events);
+    ds->events = new_db;
+    ds->event_size *= 2;
+    return 0;
+}
+
+int
+init_event_db(dax_state *ds)
+{
+    int n;
+
+    ds->events = malloc(EVENT_DB_START_SIZE * sizeof(event_db));
+    if(ds->events == NULL) {
+        return ERR_ALLOC;
+    }
+    for(n = 0; n < EVENT_DB_START_SIZE; n++) {
+        ds->events[n].idx = EVENT_DB_EMPTY;
+    }
+    ds->event_size = EVENT_DB_START_SIZE;
+    ds->event_count = 0;
+    return 0;
+}
+
+/* Frees the event database and calls the free_callback() function of every
+ * event that has one. */
+void
+free_event_db(dax_state *ds)
+{
+    int n;
+
+    if(ds->events == NULL) return;
+    for(n = 0; n < ds->event_size; n++) {
+        if(ds->events[n].idx != EVENT_DB_EMPTY && ds->events[n].free_callback) {
+            ds->events[n].free_callback(ds->events[n].udata);
+        }
+    }
+    free(ds->events);
+    ds->events = NULL;
+    ds->event_size = 0;
+    ds->event_count = 0;
+}
+
+/* Store the event information into the database internal to the library. */
 int
 add_event(dax_state *ds, dax_id id, void *udata, void (*callback)(dax_state *ds, void *udata),
           void (*free_callback)(void *udata))
 {
-    event_db *new_db;
+    uint32_t mask;
+    int n;
 
-    /* check to see if we need to grow the database */
-    if(ds->event_count == ds->event_size) {
-        /* For now we just double the size */
-        new_db = realloc(ds->events, (ds->event_size * 2) * sizeof(event_db));
-        if(new_db != NULL) {
-            ds->events = new_db;
-            ds->event_size *= 2;
-        } else {
+    pthread_mutex_lock(&ds->event_lock);
+    /* Keep the table no more than half full */
+    if((ds->event_count + 1) * 2 > ds->event_size) {
+        if(_event_db_grow(ds)) {
+            pthread_mutex_unlock(&ds->event_lock);
             return ERR_ALLOC;
         }
     }
-    /* For now we are just putting these in unsorted and the search
-     * routine in the dispatch function will be a simple linear search */
-    /* TODO: Sort this array and add binary search to event_dispatch() */
-    ds->events[ds->event_count].idx = id.index;
-    ds->events[ds->event_count].id = id.id;
-    ds->events[ds->event_count].udata = udata;
-    ds->events[ds->event_count].callback = callback;
-    ds->events[ds->event_count].free_callback = free_callback;
-
-    ds->event_count++;
+    mask = ds->event_size - 1;
+    n = _event_find(ds, id.index, id.id);
+    if(n < 0) { /* The server could give us an id that we already have */
+        for(n = _event_hash(id.index, id.id) & mask; ds->events[n].idx != EVENT_DB_EMPTY; n = (n + 1) & mask);
+        ds->event_count++;
+    }
+    ds->events[n].idx = id.index;
+    ds->events[n].id = id.id;
+    ds->events[n].udata = udata;
+    ds->events[n].callback = callback;
+    ds->events[n].free_callback = free_callback;
+    pthread_mutex_unlock(&ds->event_lock);
     return 0;
 }
 
-/* Finds the event in the list and removes it.  It also calls the free_callback()
- * function if it is assigned */
+/* Finds the event in the database and removes it.  It also calls the
+ * free_callback() function if it is assigned */
 int
 del_event(dax_state *ds, dax_id id)
 {
-    int n;
+    event_db ev;
+    uint32_t mask, hole, n, home;
+    int slot;
 
-    for(n = 0; n < ds->event_count; n++) {
-        if(ds->events[n].idx == id.index && ds->events[n].id == id.id) {
-            memmove(&ds->events[n], &ds->events[n+1], sizeof(event_db) * (ds->event_count - n-1));
-            if(ds->events[n].free_callback) {
-                ds->events[n].free_callback(ds->events[n].udata);
-            }
-            ds->event_count--;
-            return 0;
+    pthread_mutex_lock(&ds->event_lock);
+    slot = _event_find(ds, id.index, id.id);
+    if(slot < 0) {
+        pthread_mutex_unlock(&ds->event_lock);
+        return ERR_NOTFOUND;
+    }
+    ev = ds->events[slot];
+    /* Move any entries that follow back into the hole if they are
+     * allowed to be there */
+    mask = ds->event_size - 1;
+    hole = slot;
+    for(n = (hole + 1) & mask; ds->events[n].idx != EVENT_DB_EMPTY; n = (n + 1) & mask) {
+        home = _event_hash(ds->events[n].idx, ds->events[n].id) & mask;
+        if(((n - home) & mask) >= ((n - hole) & mask)) {
+            ds->events[hole] = ds->events[n];
+            hole = n;
         }
     }
-    return ERR_NOTFOUND;
+    ds->events[hole].idx = EVENT_DB_EMPTY;
+    ds->event_count--;
+    pthread_mutex_unlock(&ds->event_lock);
+
+    if(ev.free_callback) {
+        ev.free_callback(ev.udata);
+    }
+    return 0;
+}
+
+/* Returns the sequence number of an event message that is in the ring.  The
+ * first event that is received is number one.  The message has been claimed
+ * but not released so it's somewhere between emsg_tail and emsg_read.  Call
+ * with the event_lock held. */
+static uint32_t
+_event_seq(dax_state *ds, dax_message *msg)
+{
+    uint32_t tail;
+
+    tail = ds->emsg_tail;
+    return tail + (((msg - ds->emsg_ring) - tail) & (ds->emsg_ring_size - 1)) + 1;
+}
+
+/* Puts the changes to a subscribed group into the group's data and calls
+ * the group's callback after the last message of the change.  The id is
+ * given the group's index on the server and an index of -1 since it's not
+ * a tag.  We hold a reference on the group while we use it so that
+ * dax_group_del() on another thread can't free it out from under us. */
+static int
+_dispatch_group(dax_state *ds, dax_message *msg, dax_id *id)
+{
+    tag_group_id *gid = NULL;
+    uint32_t index, flags;
+    int result, deleted;
+    void (*callback)(dax_state *ds, void *udata) = NULL;
+    void *udata = NULL;
+
+    if(msg->size < GROUP_DELTA_HDR_SIZE) return ERR_MSG_BAD;
+    index = ntohl(*(uint32_t *)(&msg->data[0]));
+    flags = ntohl(*(uint32_t *)(&msg->data[4]));
+
+    pthread_mutex_lock(&ds->event_lock);
+    if(index < ds->groups_size) {
+        gid = ds->groups[index];
+    }
+    if(gid != NULL) gid->refs++;
+    pthread_mutex_unlock(&ds->event_lock);
+    if(gid == NULL) {
+        dax_error(ds, "dax_event_dispatch() received a change for a group that is not subscribed");
+        return ERR_NOTFOUND;
+    }
+    result = group_delta_format(ds, gid, (uint8_t *)&msg->data[GROUP_DELTA_HDR_SIZE],
+                                msg->size - GROUP_DELTA_HDR_SIZE);
+    pthread_mutex_lock(&ds->event_lock);
+    if(result == 0) gid->seq = _event_seq(ds, msg);
+    if(result == 0 && (flags & GROUP_DELTA_LAST) && !gid->deleted) {
+        callback = gid->callback;
+        udata = gid->udata;
+    }
+    deleted = (--gid->refs == 0 && gid->deleted);
+    pthread_mutex_unlock(&ds->event_lock);
+    if(deleted) group_free(gid);
+    if(result) return result;
+    if(callback != NULL) {
+        callback(ds, udata);
+    }
+    if(id != NULL) {
+        id->id = index;
+        id->index = -1;
+    }
+    return 0;
 }
 
 /* This function deals with a single event.
@@ -151,46 +329,167 @@ dispatch_event(dax_state *ds, dax_message *msg, dax_id *id)
 {
     int n;
     uint32_t idx, eid;
+    void *udata = NULL;
+    void (*callback)(dax_state *ds, void *udata) = NULL;
 
+    if((msg->msg_type & 0xFF) == EVENT_GROUP) {
+        return _dispatch_group(ds, msg, id);
+    }
     idx =      ntohl(*(uint32_t *)(&msg->data[0]));
     eid =      ntohl(*(uint32_t *)(&msg->data[4]));
+
+    pthread_mutex_lock(&ds->event_lock);
+    n = _event_find(ds, idx, eid);
+    if(n >= 0) {
+        callback = ds->events[n].callback;
+        udata = ds->events[n].udata;
+    }
+    pthread_mutex_unlock(&ds->event_lock);
+    if(n < 0) {
+        dax_error(ds, "dax_event_dispatch() received an event that does not exist in database");
+        return ERR_GENERIC;
+    }
     /* we just store the pointer to the message data in case the callback needs it
      * This data can be retrieved in the callback by dax_event_get_data() */
     ds->event_data = &msg->data[8];
     ds->event_data_size = msg->size-8;
-    for(n = 0; n < ds->event_count; n ++) {
-        if(ds->events[n].idx == idx && ds->events[n].id == eid) {
-            if(ds->events[n].callback != NULL) {
-                ds->events[n].callback(ds, ds->events[n].udata);
-            }
-            if(id != NULL) {
-                id->id = eid;
-                id->index = idx;
-            }
-            ds->event_data = NULL; /* This indicates that the data is out of scope now */
-            return 0;
-        }
+    if(callback != NULL) {
+        callback(ds, udata);
+    }
+    if(id != NULL) {
+        id->id = eid;
+        id->index = idx;
     }
     ds->event_data = NULL; /* This indicates that the data is out of scope now */
-    dax_error(ds, "dax_event_dispatch() received an event that does not exist in database");
-    return ERR_GENERIC;
+    return 0;
 }
 
-static void
-_pop_event(dax_state *ds, dax_message *msg) {
-    int n;
+/* The event messages that come in from the server are kept in a ring of
+ * fixed message slots that is allocated when we connect.  The connection
+ * thread is the only producer and it doesn't need a lock to put a message
+ * in.  It fills the slot at emsg_head and then moves the head.  The event
+ * functions claim the slot at emsg_read with the event_lock held, run the
+ * callback right from the slot and then release it.  emsg_tail follows
+ * behind and only moves past slots that have been released so the producer
+ * never writes over a slot that a callback is still using.  When the ring is
+ * full the new event is thrown away.  The indexes just keep counting up and
+ * are masked to get the slot. */
+int
+init_event_queue(dax_state *ds, int size)
+{
+    uint32_t n;
+
+    if(size < 2) size = 2;
+    /* Round up to a power of two */
+    for(n = 2; n < size; n <<= 1);
+    free_event_queue(ds);
+    ds->emsg_ring = malloc(sizeof(dax_message) * n);
+    ds->emsg_done = malloc(n);
+    if(ds->emsg_ring == NULL || ds->emsg_done == NULL) {
+        free_event_queue(ds);
+        return ERR_ALLOC;
+    }
+    ds->emsg_ring_size = n;
+    ds->emsg_head = 0;
+    ds->emsg_read = 0;
+    ds->emsg_tail = 0;
+    ds->emsg_waiters = 0;
+    ds->emsg_lost = 0;
+    return 0;
+}
+
+void
+free_event_queue(dax_state *ds)
+{
+    free(ds->emsg_ring);
+    free(ds->emsg_done);
+    ds->emsg_ring = NULL;
+    ds->emsg_done = NULL;
+    ds->emsg_ring_size = 0;
+}
+
+/* Puts a copy of the event message in the ring.  This should only be called
+ * from the connection thread.  Call wake_event_waiters() afterwards. */
+int
+push_event(dax_state *ds, dax_message *msg)
+{
+    dax_message *slot;
+    uint32_t head;
+
+    head = ds->emsg_head;
+    if(head - __atomic_load_n(&ds->emsg_tail, __ATOMIC_ACQUIRE) >= ds->emsg_ring_size) {
+        if(ds->emsg_lost++ % 20 == 0) { /* We only log every 20 of these */
+            dax_error(ds, "Event received from the server is lost.  Total = %u\n", ds->emsg_lost);
+        }
+        return ERR_OVERFLOW;
+    }
+    slot = &ds->emsg_ring[head & (ds->emsg_ring_size - 1)];
+    slot->msg_type = msg->msg_type;
+    slot->size = msg->size;
+    slot->fd = msg->fd;
+    memcpy(slot->data, msg->data, msg->size);
+    ds->emsg_done[head & (ds->emsg_ring_size - 1)] = 0;
+    __atomic_store_n(&ds->emsg_head, head + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Wakes up any threads that are blocked in dax_event_wait().  We only take
+ * the lock if somebody is actually waiting. */
+void
+wake_event_waiters(dax_state *ds)
+{
+    if(__atomic_load_n(&ds->emsg_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&ds->event_lock);
+        pthread_cond_broadcast(&ds->event_cond);
+        pthread_mutex_unlock(&ds->event_lock);
+    }
+}
+
+/* Returns the next message in the ring or NULL if there aren't any.
+ * Call with the event_lock held. */
+static dax_message *
+_claim_event(dax_state *ds)
+{
+    dax_message *msg;
 
-    msg->msg_type = ds->emsg_queue[0]->msg_type;
-    msg->size = ds->emsg_queue[0]->size;
-    msg->fd = ds->emsg_queue[0]->fd;
-    memcpy(msg->data, ds->emsg_queue[0]->data, ds->emsg_queue[0]->size);
-    free(ds->emsg_queue[0]); /* Free the top one */
-    /* Move the rest up */
-    for(n = 0;n<ds->emsg_queue_count-1;n++) {
-        ds->emsg_queue[n] = ds->emsg_queue[n+1];
+    if(ds->emsg_read == __atomic_load_n(&ds->emsg_head, __ATOMIC_SEQ_CST)) {
+        return NULL;
     }
-    ds->emsg_queue_count--;
+    msg = &ds->emsg_ring[ds->emsg_read & (ds->emsg_ring_size - 1)];
+    ds->emsg_read++;
+    return msg;
 }
+
+/* Takes the next event message off of the queue without copying it.  The
+ * message stays valid until it is given back with release_event().  Returns
+ * NULL if the queue is empty. */
+dax_message *
+pop_event(dax_state *ds)
+{
+    dax_message *msg;
+
+    pthread_mutex_lock(&ds->event_lock);
+    msg = _claim_event(ds);
+    pthread_mutex_unlock(&ds->event_lock);
+    return msg;
+}
+
+/* Gives the slot back so that the connection thread can use it again */
+void
+release_event(dax_state *ds, dax_message *msg)
+{
+    uint32_t tail;
+
+    pthread_mutex_lock(&ds->event_lock);
+    ds->emsg_done[msg - ds->emsg_ring] = 1;
+    tail = ds->emsg_tail;
+    while(tail != ds->emsg_read && ds->emsg_done[tail & (ds->emsg_ring_size - 1)]) {
+        tail++;
+    }
+    __atomic_store_n(&ds->emsg_tail, tail, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ds->event_lock);
+}
+
 /*!
  * Blocks waiting for an event to happen.  If an event is found it
  * will run the callback function for that event.
@@ -208,31 +507,38 @@ dax_event_wait(dax_state *ds, int timeout, dax_id *id)
 {
     int result;
     struct timespec ts;
-    dax_message msg;
+    dax_message *msg;
 
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout/1000;
+    ts.tv_nsec += timeout%1000 * 1e6;
+    if(ts.tv_nsec >= 1e9) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1e9;
+    }
     pthread_mutex_lock(&ds->event_lock);
-    while(ds->emsg_queue_count == 0) {
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += timeout/1000;
-        ts.tv_nsec += timeout%1000 * 1e6;
-        if(ts.tv_nsec > 1e9) {
-            ts.tv_sec++;
-            ts.tv_nsec -= 1e9;
+    while((msg = _claim_event(ds)) == NULL) {
+        /* The connection thread checks emsg_waiters after it moves the head
+         * so we have to look at the ring again after we increment it */
+        __atomic_add_fetch(&ds->emsg_waiters, 1, __ATOMIC_SEQ_CST);
+        if((msg = _claim_event(ds)) != NULL) {
+            __atomic_sub_fetch(&ds->emsg_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
         }
         result = pthread_cond_timedwait(&ds->event_cond, &ds->event_lock, &ts);
+        __atomic_sub_fetch(&ds->emsg_waiters, 1, __ATOMIC_SEQ_CST);
         if(result == ETIMEDOUT) {
             pthread_mutex_unlock(&ds->event_lock);
             return ERR_TIMEOUT;
         }
         assert(result == 0);
     }
-    /* We should have a message once we get here */
-    /* Pop the message off of the event queue before we dispatch
-     * the event so that we can turn control back over to the connection
-     * thread. */
-    _pop_event(ds, &msg);
     pthread_mutex_unlock(&ds->event_lock);
-    return dispatch_event(ds, &msg, id);
+    /* The callback runs right from the slot in the queue.  The lock is not
+     * held so that the connection thread and other threads can keep going. */
+    result = dispatch_event(ds, msg, id);
+    release_event(ds, msg);
+    return result;
 }
 
 /*!
@@ -250,15 +556,14 @@ dax_event_wait(dax_state *ds, int timeout, dax_id *id)
 int
 dax_event_poll(dax_state *ds, dax_id *id)
 {
-    dax_message msg;
-    pthread_mutex_lock(&ds->event_lock);
-    if(ds->emsg_queue_count > 0) {
-        _pop_event(ds, &msg);
-        pthread_mutex_unlock(&ds->event_lock);
-        return dispatch_event(ds, &msg, id);
-    }
-    pthread_mutex_unlock(&ds->event_lock);
-    return ERR_NOTFOUND;
+    dax_message *msg;
+    int result;
+
+    msg = pop_event(ds);
+    if(msg == NULL) return ERR_NOTFOUND;
+    result = dispatch_event(ds, msg, id);
+    release_event(ds, msg);
+    return result;
 }
 
 /*!
@@ -288,3 +593,20 @@ dax_event_get_data(dax_state *ds, void* buff, int len) {
     memcpy(buff, ds->event_data, size);
     return size;
 }
+
+/*!
+ * Returns a mark for the point that the connection thread has reached in the
+ * stream of events from the server.  The events and the responses come in on
+ * the same socket so every event that the server sent before the response to
+ * a message has a sequence number at or below the mark that is taken after
+ * that message returns.  Compare it to dax_group_get_seq() to tell whether a
+ * group's data was sent before or after the server handled a write.
+ *
+ * @param ds   Pointer to the dax state object
+ * @returns    The sequence number of the last event that was received
+ */
+uint32_t
+dax_event_mark(dax_state *ds)
+{
+    return __atomic_load_n(&ds->emsg_head, __ATOMIC_SEQ_CST);
+}
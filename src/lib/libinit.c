@@ -50,31 +50,47 @@ dax_init(char *name)
     ds->msgtimeout = 0;
     ds->sfd = -1;       /* Server's File Descriptor */
     ds->reformat = 0;  /* Flags to show how to reformat the incoming data */
+    ds->max_transfer = MSG_DATA_SIZE; /* Until the server tells us otherwise */
+    ds->shm = NULL;    /* Shared memory segment */
+    ds->shm_size = 0;
     ds->logflags = 0;
     /* Tag Cache */
     ds->cache_head = NULL;     /* First node in the cache list */
     ds->cache_limit = 0;       /* Total number of nodes that we'll allocate */
     ds->cache_count = 0;       /* How many nodes we actually have */
+    ds->cache_names = NULL;
+    ds->cache_indexes = NULL;
+    ds->cache_buckets = 0;
+    ds->cache_hits = 0;
+    ds->cache_misses = 0;
+    ds->handle_head = NULL;
+    ds->handle_table = NULL;
+    ds->handle_count = 0;
     /* datatype list */
     ds->datatypes = NULL;
     ds->datatype_size = 0;
-    /* Event list array */
-    ds->events = malloc(sizeof(event_db));
-    if(ds->events == NULL) {
+    /* Event database */
+    if(init_event_db(ds)) {
+        free(ds->modulename);
+        free(ds);
+        return NULL;
+    }
+    /* Event Message Queue.  This is sized again from the configuration when we connect */
+    ds->emsg_ring = NULL;
+    ds->emsg_done = NULL;
+    ds->groups = NULL;
+    ds->groups_size = 0;
+    if(init_event_queue(ds, EVENT_QUEUE_SIZE)) {
+        free_event_db(ds);
         free(ds->modulename);
         free(ds);
         return NULL;
     }
-    ds->event_size = 1;
-    ds->event_count = 0;
-    /* Event Message FIFO Queue */
-    ds->emsg_queue = malloc(sizeof(dax_message *)*EVENT_QUEUE_SIZE);
-    ds->emsg_queue_size = EVENT_QUEUE_SIZE;     /* Total size of the Event Message Queue */
-    ds->emsg_queue_count = 0;    /* number of entries in the event message queue */
     /* Initialize locks and condition variables */
     pthread_mutex_init(&ds->lock, NULL);
     pthread_mutex_init(&ds->event_lock, NULL);
     pthread_mutex_init(&ds->msg_lock, NULL);
+    pthread_mutex_init(&ds->cache_lock, NULL);
     pthread_cond_init(&ds->event_cond, NULL);
     pthread_cond_init(&ds->msg_cond, NULL);
 
@@ -99,10 +115,11 @@ dax_free(dax_state *ds)
 {
     pthread_mutex_unlock(&ds->lock);
     pthread_mutex_destroy(&ds->lock);
+    shmem_detach(ds);
     free(ds->modulename);
-    /* TODO: gotta loop through and free the udata in the events. */
-    free(ds->events);
-    free(ds->emsg_queue);
+    free_event_db(ds);
+    free_event_queue(ds);
+    free(ds->groups);
     free(ds);
     return 0;
 }
@@ -27,37 +27,72 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <math.h>
 
 
 /* These are the generic message functions.  They simply send the message of
- * the type given by command, attach the payload.  The payloads size should be
- * given in bytes */
+ * the type given by command, attach the payload.  The payload is given as
+ * a list of pieces in iov so that the callers don't have to copy large data
+ * areas together first.  If the payload won't fit in a single message it is
+ * split into frames and every frame but the last has the MSG_CHUNK flag set. */
 static int
-_message_send(dax_state *ds, int command, void *payload, size_t size)
+_message_sendv(dax_state *ds, int command, struct iovec *iov, int iovcnt)
 {
-    int result;
+    int result, n;
+    size_t size, chunk, index, piece;
     char buff[DAX_MSGMAX];
 
     if(ds->sfd < 0) {
     	return ERR_DISCONNECTED;
     }
-    /* We always send the size and command in network order */
-    ((uint32_t *)buff)[0] = htonl(size + MSG_HDR_SIZE);
-    ((uint32_t *)buff)[1] = htonl(command);
-    memcpy(&buff[MSG_HDR_SIZE], payload, size);
-
-    /* TODO: We need to set some kind of timeout here.  This could block
-       forever if something goes wrong.  It may be a signal or something too. */
-    result = write(ds->sfd, buff, size + MSG_HDR_SIZE);
-    if(result < 0) {
-    /* TODO: Should we handle the case when this returns due to a signal */
-        dax_error(ds, "_message_send: %s", strerror(errno));
-        return ERR_MSG_SEND;
-    }
+    size = 0;
+    for(n = 0; n < iovcnt; n++) size += iov[n].iov_len;
+
+    n = 0;
+    piece = 0; /* Position within iov[n] */
+    do {
+        chunk = size > MSG_DATA_SIZE ? MSG_DATA_SIZE : size;
+        /* We always send the size and command in network order */
+        ((uint32_t *)buff)[0] = htonl(chunk + MSG_HDR_SIZE);
+        ((uint32_t *)buff)[1] = htonl(size > chunk ? command | MSG_CHUNK : command);
+        /* Fill the frame from the pieces */
+        index = 0;
+        while(index < chunk) {
+            if(piece == iov[n].iov_len) {
+                n++;
+                piece = 0;
+                continue;
+            }
+            result = MIN(chunk - index, iov[n].iov_len - piece);
+            memcpy(&buff[MSG_HDR_SIZE + index], (char *)iov[n].iov_base + piece, result);
+            index += result;
+            piece += result;
+        }
+        /* TODO: We need to set some kind of timeout here.  This could block
+           forever if something goes wrong.  It may be a signal or something too. */
+        result = write(ds->sfd, buff, chunk + MSG_HDR_SIZE);
+        if(result < 0) {
+        /* TODO: Should we handle the case when this returns due to a signal */
+            dax_error(ds, "_message_send: %s", strerror(errno));
+            return ERR_MSG_SEND;
+        }
+        size -= chunk;
+    } while(size > 0);
     return 0;
 }
 
+/* Sends a message with a single payload */
+static int
+_message_send(dax_state *ds, int command, void *payload, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = payload;
+    iov.iov_len = size;
+    return _message_sendv(ds, command, &iov, 1);
+}
+
 /* This function retrieves a single message from the given fd. */
 static int
 _message_get(int fd, dax_message *msg) {
@@ -114,50 +149,75 @@ _message_get(int fd, dax_message *msg) {
 static int
 _message_recv(dax_state *ds, int command, void *payload, size_t *size, int response)
 {
-	int result;
+	int result, overflow = 0;
     struct timespec timeout;
+    size_t index = 0;
 
     pthread_mutex_lock(&ds->msg_lock);
-    while(ds->last_msg == NULL) {
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += ds->msgtimeout/1000;
-        timeout.tv_nsec += ds->msgtimeout%1000 *1e6;
-        if(timeout.tv_nsec>1e9) {
-            timeout.tv_sec++;
-            timeout.tv_nsec-=1e9;
-        }
-        result = pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &timeout);
-        if(result == ETIMEDOUT) {
-            printf(" - _message_recv() Timeout\n");
-            pthread_mutex_unlock(&ds->msg_lock);
-            return ERR_TIMEOUT;
+    while(1) {
+        while(ds->last_msg == NULL) {
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += ds->msgtimeout/1000;
+            timeout.tv_nsec += ds->msgtimeout%1000 *1e6;
+            if(timeout.tv_nsec>1e9) {
+                timeout.tv_sec++;
+                timeout.tv_nsec-=1e9;
+            }
+            result = pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &timeout);
+            if(result == ETIMEDOUT) {
+                printf(" - _message_recv() Timeout\n");
+                pthread_mutex_unlock(&ds->msg_lock);
+                return ERR_TIMEOUT;
+            }
+            assert(result == 0);
         }
-        assert(result == 0);
-    }
-    assert(ds->last_msg != NULL);
-    if(ds->last_msg->msg_type == (command | MSG_ERROR)) {
-        result = stom_dint((*(int32_t *)&ds->last_msg->data[0]));
-        free(ds->last_msg);
-        ds->last_msg = NULL;
-        pthread_mutex_unlock(&ds->msg_lock);
-        return result;
-    }  else if(ds->last_msg->msg_type == (command | (response ? MSG_RESPONSE : 0))) {
-        if(size) {
-            memcpy(payload, ds->last_msg->data, ds->last_msg->size);
-            *size = ds->last_msg->size;
+        assert(ds->last_msg != NULL);
+        if(ds->last_msg->msg_type == (command | MSG_ERROR)) {
+            result = stom_dint((*(int32_t *)&ds->last_msg->data[0]));
+            break;
+        } else if((ds->last_msg->msg_type & ~MSG_CHUNK) == (command | (response ? MSG_RESPONSE : 0))) {
+            if(index == 0 && !(ds->last_msg->msg_type & MSG_CHUNK)) {
+                /* The usual single message response */
+                if(size) {
+                    memcpy(payload, ds->last_msg->data, ds->last_msg->size);
+                    *size = ds->last_msg->size;
+                }
+                result = 0;
+                break;
+            }
+            /* Pieces of a large response go straight into the caller's buffer.
+             * If it won't fit we still have to read the rest of the pieces. */
+            if(size == NULL || index + ds->last_msg->size > *size) {
+                overflow = 1;
+            }
+            if(!overflow) {
+                memcpy((char *)payload + index, ds->last_msg->data, ds->last_msg->size);
+                index += ds->last_msg->size;
+            }
+            if(!(ds->last_msg->msg_type & MSG_CHUNK)) {
+                if(overflow) {
+                    result = ERR_2BIG;
+                } else {
+                    *size = index;
+                    result = 0;
+                }
+                break;
+            }
+            /* Let the connection thread give us the next piece */
+            free(ds->last_msg);
+            ds->last_msg = NULL;
+            pthread_cond_broadcast(&ds->msg_cond);
+        } else {
+            dax_error(ds, "Received a response of a different type than expected\n");
+            result = ERR_GENERIC;
+            break;
         }
-        free(ds->last_msg);
-        ds->last_msg = NULL;
-        pthread_mutex_unlock(&ds->msg_lock);
-        return 0;
-    } else {
-        free(ds->last_msg);
-        ds->last_msg = NULL;
-        pthread_mutex_unlock(&ds->msg_lock);
-        dax_error(ds, "Received a response of a different type than expected\n");
-        return ERR_GENERIC;
     }
-    return 0;
+    free(ds->last_msg);
+    ds->last_msg = NULL;
+    pthread_cond_broadcast(&ds->msg_cond);
+    pthread_mutex_unlock(&ds->msg_lock);
+    return result;
 }
 
 
@@ -248,7 +308,7 @@ _mod_register(dax_state *ds, char *name)
     /* For registration we send the data in network order no matter what */
     /* TODO: The timeout is not actually implemented */
     *((uint32_t *)&buff[0]) = htonl(1000);       /* Timeout  */
-    *((uint32_t *)&buff[4]) = htonl(CONNECT_SYNC);  /* registration flags */
+    *((uint32_t *)&buff[4]) = htonl(CONNECT_SYNC | CONNECT_EVENT_BATCH | CONNECT_TAG_NOTIFY);  /* registration flags */
     strcpy(&buff[CON_HDR_SIZE], name);                /* The rest is the name */
 
     dax_debug(ds, LOG_COMM, "Sending registration for name - %s", ds->modulename);
@@ -263,6 +323,19 @@ _mod_register(dax_state *ds, char *name)
 
     /* Store the unique ID that the server has sent us. */
     ds->id =  *((uint32_t *)&msg.data[0]);
+    /* Newer servers tell us the largest message that they'll take in chunks */
+    if(msg.size >= 34) {
+        ds->max_transfer = *((uint32_t *)&msg.data[30]);
+    } else {
+        ds->max_transfer = MSG_DATA_SIZE;
+    }
+    /* If we are on the same host the server sends the name of it's shared
+     * memory segment so that we can read tag data directly */
+    if(msg.size > 34 && msg.data[msg.size - 1] == '\0') {
+        pthread_mutex_lock(&ds->lock);
+        shmem_attach(ds, &msg.data[34]);
+        pthread_mutex_unlock(&ds->lock);
+    }
     /* Here we check to see if the data that we got in the registration message is in the same
        format as we use here on the client module. This should be offloaded to a separate
        function that can determine what needs to be done to the incoming and outgoing data to
@@ -288,22 +361,48 @@ _mod_register(dax_state *ds, char *name)
     return ds->reformat;
 }
 
+/* The server sends all the events that fired while it was handling a single
+ * message in one EVENT_BATCH message.  The data is just the event messages
+ * one after the other so we split them up and put each one in the queue. */
+static int
+_unpack_events(dax_state *ds, dax_message *batch)
+{
+    dax_message msg;
+    uint32_t pos, size;
+    int result = 0;
+
+    pos = 0;
+    while(pos + MSG_HDR_SIZE <= batch->size) {
+        size = ntohl(*(uint32_t *)&batch->data[pos]);
+        if(size > batch->size - pos - MSG_HDR_SIZE) {
+            dax_error(ds, "Bad event batch received from the server\n");
+            result = ERR_MSG_BAD;
+            break;
+        }
+        msg.size = size;
+        msg.msg_type = ntohl(*(uint32_t *)&batch->data[pos + 4]);
+        msg.fd = batch->fd;
+        memcpy(msg.data, &batch->data[pos + MSG_HDR_SIZE], size);
+        push_event(ds, &msg);
+        pos += MSG_HDR_SIZE + size;
+    }
+    wake_event_waiters(ds);
+    return result;
+}
+
 /* This function retrieves one message using the _message_get() function and decides whether
- * to add the message to a FIFO of event messages or to store it on last_msg.  The event FIFO
- * and the last_msg pointer are both protected by a condition variable.  This function is
- * called from the connection thread and functions that expect to either receive a response
- * message or an event use these condition variables to wait on these mechanims. */
+ * to add the message to the event queue or to store it on last_msg.  The last_msg pointer is
+ * protected by a condition variable.  This function is called from the connection thread and
+ * functions that expect to receive a response message wait on that condition variable.
+ * Events are put in the event queue without any allocation, see libevent.c */
 static int
 _read_next_message(dax_state *ds)
 {
-    static unsigned int events_lost;
-    dax_message *msg;
-    int result, n;
-
-    msg = malloc(sizeof(dax_message));
-    if(msg == NULL) return ERR_ALLOC;
+    dax_message msg, *new;
+    int result;
+    struct timespec timeout;
 
-    result = _message_get(ds->sfd, msg);
+    result = _message_get(ds->sfd, &msg);
     if(result) {
         if(result == ERR_DISCONNECTED) {
             dax_error(ds, "Server disconnected abruptly\n");
@@ -312,38 +411,49 @@ _read_next_message(dax_state *ds)
         } else {
             dax_error(ds, "_message_get() returned error %d\n", result);
         }
-        free(msg);
         return result;
     }
-    if(msg->msg_type & MSG_EVENT) { /* Events we store in the FIFO */
-        pthread_mutex_lock(&ds->event_lock);
-        if(ds->emsg_queue_count == ds->emsg_queue_size) {/* FIFO is full */
-            if(events_lost % 20 == 0) { /* We only log every 20 of these */
-                events_lost++;
-                dax_error(ds, "Event received from the server is lost.  Total = %u\n", events_lost);
-            }
-            free(ds->emsg_queue[0]); /* Free the top one */
-            for(n = 0;n<ds->emsg_queue_size-1;n++) {
-                ds->emsg_queue[n] = ds->emsg_queue[n+1];
-            }
-            ds->emsg_queue[ds->emsg_queue_size - 1] = msg;
-        } else {
-            ds->emsg_queue[ds->emsg_queue_count] = msg;
-            ds->emsg_queue_count++;
+    if(msg.msg_type == (MSG_EVENT | EVENT_BATCH)) {
+        return _unpack_events(ds, &msg);
+    } else if(msg.msg_type == (MSG_EVENT | EVENT_TAG_DELETED)) {
+        /* The cache has it's own lock so we can do this right here */
+        if(msg.size >= 4) {
+            cache_tag_del(ds, ntohl(*(uint32_t *)&msg.data[0]));
         }
-        pthread_mutex_unlock(&ds->event_lock);
-        pthread_cond_signal(&ds->event_cond);
+    } else if(msg.msg_type & MSG_EVENT) { /* Events we store in the queue */
+        push_event(ds, &msg);
+        wake_event_waiters(ds);
     } else { /* All other messages we put here */
+        new = malloc(sizeof(dax_message));
+        if(new == NULL) return ERR_ALLOC;
+        new->size = msg.size;
+        new->msg_type = msg.msg_type;
+        new->fd = msg.fd;
+        memcpy(new->data, msg.data, msg.size);
         pthread_mutex_lock(&ds->msg_lock);
-        ds->last_msg = msg;
+        /* If the last message hasn't been picked up yet we wait for it.  This
+         * happens with large responses that are split into several frames.
+         * If nobody picks it up then it's stale and we throw it away. */
+        while(ds->last_msg != NULL) {
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += ds->msgtimeout/1000 + 1;
+            if(pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &timeout) == ETIMEDOUT) {
+                free(ds->last_msg);
+                ds->last_msg = NULL;
+            }
+        }
+        ds->last_msg = new;
         pthread_mutex_unlock(&ds->msg_lock);
-        pthread_cond_signal(&ds->msg_cond);
+        pthread_cond_broadcast(&ds->msg_cond);
     }
     return 0;
 }
 
 static void
 _connection_cleanup(dax_state *ds) {
+    pthread_mutex_lock(&ds->lock);
+    shmem_detach(ds);
+    pthread_mutex_unlock(&ds->lock);
     ds->sfd = -1;
     if(ds->last_msg != NULL) free(ds->last_msg);
     ds->last_msg = NULL;
@@ -355,10 +465,18 @@ static void *
 _connection_thread(void *arg)
 {
     int result;
-
+    char *attr;
     dax_state *ds;
     ds = (dax_state *)arg;
 
+    /* The event queue is sized before we connect so that it's never
+     * changed while events are coming in */
+    attr = dax_get_attr(ds, "eventqueue");
+    if(attr != NULL) {
+        pthread_mutex_lock(&ds->event_lock);
+        init_event_queue(ds, strtol(attr, NULL, 0));
+        pthread_mutex_unlock(&ds->event_lock);
+    }
     /* This is the connection that we used for all the functional
      * request / response messages. */
     ds->sfd = _get_connection(ds);
@@ -556,6 +674,94 @@ dax_tag_add(dax_state *ds, tag_handle *h, char *name, tag_type type, int count,
     return result;
 }
 
+/*!
+ * Adds several tags to the tag server with a single message.  This is
+ * much faster than calling dax_tag_add() for each tag when a module has
+ * a lot of tags to create.
+ * @param ds The pointer to the dax state object
+ * @param tags Array of tag definitions.  The name, type, count and attr
+ *             members should be set for each tag.  The idx member will be
+ *             set to the index of the tag or to the error code if that
+ *             tag could not be added.
+ * @param handles Array of tag handles that will be filled in for each tag
+ *                that is added.  NULL may be passed if the caller is not
+ *                interested in the tag handles
+ * @param count The number of tags in the arrays
+ *
+ * @returns Zero if all of the tags were added, the first error that
+ *          was returned for one of the tags or an error code if the
+ *          message failed
+ */
+int
+dax_tag_add_multi(dax_state *ds, dax_tag *tags, tag_handle *handles, int count)
+{
+    int result, n, first = 0;
+    size_t size, len, offset = 0;
+    char *buff;
+    tag_index *results;
+
+    if(count <= 0) return ERR_ARG;
+    size = 0;
+    for(n = 0; n < count; n++) {
+        if(tags[n].count == 0) return ERR_ARG;
+        if((len = strlen(tags[n].name)) > DAX_TAGNAME_SIZE) return ERR_2BIG;
+        if(len == 0) return ERR_TAG_BAD;
+        size += len + 13;
+    }
+    if(size > MSG_DATA_SIZE && size > ds->max_transfer) {
+        return ERR_2BIG;
+    }
+    buff = malloc(size);
+    results = malloc(sizeof(tag_index) * count);
+    if(buff == NULL || results == NULL) {
+        free(buff);
+        free(results);
+        return ERR_ALLOC;
+    }
+    for(n = 0; n < count; n++) {
+        *((uint32_t *)&buff[offset]) = mtos_udint(tags[n].type);
+        *((uint32_t *)&buff[offset + 4]) = mtos_udint(tags[n].count);
+        *((uint32_t *)&buff[offset + 8]) = mtos_udint(tags[n].attr);
+        strcpy(&buff[offset + 12], tags[n].name);
+        offset += strlen(tags[n].name) + 13;
+    }
+
+    pthread_mutex_lock(&ds->lock);
+    result = _message_send(ds, MSG_TAG_MADD, buff, size);
+    free(buff);
+    if(result == 0) {
+        size = sizeof(tag_index) * count;
+        result = _message_recv(ds, MSG_TAG_MADD, (char *)results, &size, 1);
+    }
+    if(result == 0) {
+        for(n = 0; n < count; n++) {
+            tags[n].idx = results[n];
+            if(tags[n].idx < 0) {
+                if(first == 0) first = tags[n].idx;
+                continue;
+            }
+            if(handles != NULL) {
+                handles[n].index = tags[n].idx;
+                handles[n].byte = 0;
+                handles[n].bit = 0;
+                handles[n].type = tags[n].type;
+                handles[n].count = tags[n].count;
+                if(tags[n].type == DAX_BOOL) {
+                    handles[n].size = (tags[n].count - 1)/8 +1;
+                } else {
+                    handles[n].size = tags[n].count * dax_get_typesize(ds, tags[n].type);
+                }
+            }
+            cache_tag_del(ds, tags[n].idx);
+            cache_tag_add(ds, &tags[n]);
+        }
+        result = first;
+    }
+    pthread_mutex_unlock(&ds->lock);
+    free(results);
+    return result;
+}
+
 /*!
  * Delete a tag from the tagserver.
  * 
@@ -692,6 +898,100 @@ dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index idx)
     return 0;
 }
 
+/* Checks the tag definitions in a MSG_TAG_LIST response and takes the
+ * tags that have changed out of the tag cache.  Returns the number of tags
+ * or an error if the message is bad. */
+static int
+_tag_list_check(dax_state *ds, uint8_t *buff, size_t size, uint32_t since)
+{
+    size_t pos;
+    int count = 0;
+
+    for(pos = TAG_LIST_HDR_SIZE; pos < size; pos += TAG_LIST_ENTRY_SIZE + buff[pos + 16]) {
+        if(pos + TAG_LIST_ENTRY_SIZE > size || pos + TAG_LIST_ENTRY_SIZE + buff[pos + 16] > size ||
+           buff[pos + 16] > DAX_TAGNAME_SIZE) {
+            return ERR_MSG_BAD;
+        }
+        if(since) {
+            cache_tag_del(ds, stom_dint(*(int32_t *)&buff[pos]));
+        }
+        count++;
+    }
+    return count;
+}
+
+/*!
+ * Retrieve the definitions of all the tags in the server or only the ones
+ * that have changed since an earlier call.  The server keeps a catalogue
+ * generation that goes up every time a tag is added, deleted or changed.
+ * The tags are retrieved many at a time so this is much faster than calling
+ * dax_tag_byindex() for every index.  Tags that have changed are taken out
+ * of the library's tag cache.
+ *
+ * @param ds Pointer to the dax state object
+ * @param since The generation that was returned from the last call.  If
+ *              zero all of the tags are returned.
+ * @param generation Pointer to where the current generation will be written.
+ *                   Pass this as since the next time.  Can be NULL.
+ * @param callback Function that is called for each tag.  Tags that have
+ *                 been deleted since the last call have a type of zero.
+ * @param udata Pointer that is passed to the callback
+ * @returns Zero on success or an error code otherwise
+ */
+int
+dax_tag_list(dax_state *ds, uint32_t since, uint32_t *generation,
+             void (*callback)(dax_state *ds, dax_tag *tag, void *udata), void *udata)
+{
+    int result = 0, count, len;
+    size_t size, bsize, pos;
+    uint32_t request[3];
+    tag_index start = 0;
+    uint8_t *buff;
+    dax_tag tag;
+
+    bsize = MIN(ds->max_transfer, TAG_LIST_PAGE_SIZE);
+    bsize = MAX(bsize, MSG_DATA_SIZE);
+    buff = malloc(bsize);
+    if(buff == NULL) return ERR_ALLOC;
+    while(start >= 0) {
+        request[0] = mtos_dint(start);
+        request[1] = mtos_udint(since);
+        request[2] = mtos_udint(bsize);
+        pthread_mutex_lock(&ds->lock);
+        result = _message_send(ds, MSG_TAG_LIST, request, sizeof(request));
+        if(result == 0) {
+            size = bsize;
+            result = _message_recv(ds, MSG_TAG_LIST, buff, &size, 1);
+        }
+        if(result == 0 && size < TAG_LIST_HDR_SIZE) {
+            result = ERR_MSG_BAD;
+        }
+        if(result == 0) {
+            count = _tag_list_check(ds, buff, size, since);
+            if(count < 0) result = count;
+        }
+        pthread_mutex_unlock(&ds->lock);
+        if(result) break;
+        /* Anything that changes after the first page is caught next time */
+        if(start == 0 && generation != NULL) {
+            *generation = stom_udint(*(uint32_t *)&buff[0]);
+        }
+        start = stom_dint(*(int32_t *)&buff[4]);
+        for(pos = TAG_LIST_HDR_SIZE; pos < size; pos += TAG_LIST_ENTRY_SIZE + len) {
+            tag.idx = stom_dint(*(int32_t *)&buff[pos]);
+            tag.type = stom_udint(*(uint32_t *)&buff[pos + 4]);
+            tag.count = stom_udint(*(uint32_t *)&buff[pos + 8]);
+            tag.attr = stom_udint(*(uint32_t *)&buff[pos + 12]);
+            len = buff[pos + 16];
+            memcpy(tag.name, &buff[pos + TAG_LIST_ENTRY_SIZE], len);
+            tag.name[len] = '\0';
+            if(callback != NULL) callback(ds, &tag, udata);
+        }
+    }
+    free(buff);
+    return result;
+}
+
 /*!
  * Raw low level database read.  The data will be retrieved exactly
  * like it appears in the server.  It is up to the module to convert
@@ -713,16 +1013,22 @@ dax_read(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size)
     int result = 0;
     uint8_t buff[14];
 
-    /* If we try to read more data that can be held in a single message we return an error */
-    if(size > MSG_DATA_SIZE) {
+    /* Reads that are larger than a single message come back in chunks
+     * if the server can handle it. */
+    if(size > MSG_DATA_SIZE && size > ds->max_transfer) {
         return ERR_2BIG;
     }
 
+    pthread_mutex_lock(&ds->lock);
+    /* Local modules can read the data right out of the server's shared memory */
+    if(ds->shm != NULL && shmem_read(ds, idx, offset, data, size) == 0) {
+        pthread_mutex_unlock(&ds->lock);
+        return 0;
+    }
     *((tag_index *)&buff[0]) = mtos_dint(idx);
     *((uint32_t *)&buff[4]) = mtos_dint(offset);
     *((uint32_t *)&buff[8]) = mtos_dint(size);
-    
-    pthread_mutex_lock(&ds->lock);
+
     result = _message_send(ds, MSG_TAG_READ, (void *)buff, sizeof(buff));
     if(result) {
         pthread_mutex_unlock(&ds->lock);
@@ -760,26 +1066,28 @@ dax_write(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size
 {
     size_t sendsize;
     int result;
-    char buff[MSG_DATA_SIZE];
+    char buff[8];
+    struct iovec iov[2];
 
-    /* This calculates the amount of data that we can send with a single message
-       It subtracts a handle_t from the data size for use as the tag handle and
-       an int, because we'll send the handle and the offset.*/
+    /* This calculates the amount of data that we will send.  It adds a handle_t
+       to the data size for use as the tag handle and an int for the offset. */
     sendsize = size + sizeof(tag_index) + sizeof(uint32_t);
-    /* It is assumed that the flags that we want to set are the first 4 bytes are in *data */
-    /* If we try to read more data that can be held in a single message we return an error */
-    if(sendsize > MSG_DATA_SIZE) {
+    /* Anything larger than a single message is sent in chunks if the server
+     * can handle it. */
+    if(sendsize > MSG_DATA_SIZE && sendsize > ds->max_transfer) {
         return ERR_2BIG;
     }
 
     /* Write the data to the message buffer */
     *((tag_index *)&buff[0]) = mtos_dint(idx);
     *((uint32_t *)&buff[4]) = mtos_dint(offset); 
-    
-    memcpy(&buff[8], data, size);
+    iov[0].iov_base = buff;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
 
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_TAG_WRITE, buff, sendsize);
+    result = _message_sendv(ds, MSG_TAG_WRITE, iov, 2);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
@@ -817,25 +1125,30 @@ int
 dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data, void *mask, size_t size)
 {
     size_t sendsize;
-    uint8_t buff[MSG_DATA_SIZE];
+    uint8_t buff[8];
+    struct iovec iov[3];
     int result;
 
-    /* This calculates the amount of data that we can send with a single message
-       It subtracts a handle_t from the data size for use as the tag handle.*/
+    /* This calculates the amount of data that we will send.  It adds a handle_t
+       and the offset to the size of the data and the mask.*/
     sendsize = size*2 + sizeof(tag_index) + sizeof(uint32_t);
-    /* It is assumed that the flags that we want to set are the first 4 bytes are in *data */
-    /* If we try to read more data that can be held in a single message we return an error */
-    if(sendsize > MSG_DATA_SIZE) {
+    /* Anything larger than a single message is sent in chunks if the server
+     * can handle it. */
+    if(sendsize > MSG_DATA_SIZE && sendsize > ds->max_transfer) {
         return ERR_2BIG;
     }
     /* Write the data to the message buffer */
     *((tag_index *)&buff[0]) = mtos_dint(idx);
     *((uint32_t *)&buff[4]) = mtos_dint(offset);
-    memcpy(&buff[8], data, size);
-    memcpy(&buff[8 + size], mask, size);
+    iov[0].iov_base = buff;
+    iov[0].iov_len = 8;
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
+    iov[2].iov_base = mask;
+    iov[2].iov_len = size;
 
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_TAG_MWRITE, buff, sendsize);
+    result = _message_sendv(ds, MSG_TAG_MWRITE, iov, 3);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
@@ -1080,50 +1393,85 @@ dax_tag_clr_override(dax_state *ds, tag_handle handle) {
  * Atomic operations are operations that take place on the server without the
  * possibility of another client module modifying the data in during the operation.
  * This eliminates the race condition that exists with normal read/modify/write
- * operations.
+ * operations.  If the handle covers more than one element of an array the
+ * operation is done on each of them in the same request.
  *
  * @param ds Pointer to the dax state ojbect
  * @param h  Pointer to a handle that repreents the tag or the part of the
  *           tag that we wish to apply the operation to.
- * @param data Any data that may be required by this event.  For example if
- *             the event is a Greater Than event then this data would represent
- *             the number that the tag given by the handle would be compared against.
- *             If not needed for the particular event type being created it should
- *             be set to NULL.
+ * @param data The operand for each of the elements given by the handle.  This
+ *             should be the same size as the handle.  It's not used by
+ *             ATOMIC_OP_NOT and can be NULL.  For ATOMIC_OP_CAS it's the values
+ *             to compare against followed by the new values.
  * @param operation Number representing the operation that we wish to perform.
  *
  * @returns Zero on success or an error code otherwise.
  */
 int
 dax_atomic_op(dax_state *ds, tag_handle h, void *data, uint16_t operation) {
-    size_t sendsize;
+    return dax_atomic_fetch(ds, h, data, NULL, operation);
+}
+
+/*!
+ * Same as dax_atomic_op() except that for ATOMIC_OP_CAS and
+ * ATOMIC_OP_FETCH_ADD the values that were in the tag before the operation
+ * are returned in 'prev'.  A compare and swap only changes the tag if all of
+ * the elements given by the handle match so the caller can tell whether it
+ * worked by comparing 'prev' to the values that it sent.
+ *
+ * @param ds Pointer to the dax state ojbect
+ * @param h  Pointer to a handle that repreents the tag or the part of the
+ *           tag that we wish to apply the operation to.
+ * @param data The operands.  See dax_atomic_op()
+ * @param prev Pointer to a buffer that is the size of the handle that will
+ *             be filled in with the previous values.  Can be NULL.
+ * @param operation Number representing the operation that we wish to perform.
+ *
+ * @returns Zero on success or an error code otherwise.
+ */
+int
+dax_atomic_fetch(dax_state *ds, tag_handle h, void *data, void *prev, uint16_t operation) {
+    size_t sendsize, datasize, recvsize;
     int result;
-    uint8_t buff[MSG_DATA_SIZE];
+    uint8_t buff[21];
+    struct iovec iov[2];
 
-    /* This calculates the amount of data that we can send with a single message */
-    sendsize = h.size + 21;
-    if(sendsize > MSG_DATA_SIZE) {
-        return ERR_2BIG;
-    }
     if(IS_CUSTOM(h.type)) {
         return ERR_ILLEGAL;
     }
+    datasize = h.size;
+    if(operation == ATOMIC_OP_NOT && data == NULL) datasize = 0;
+    if(operation == ATOMIC_OP_CAS) datasize *= 2;
+    if(datasize && data == NULL) return ERR_ARG;
+    /* This calculates the amount of data that we will send.  Anything larger
+     * than a single message is sent in chunks if the server can handle it. */
+    sendsize = datasize + 21;
+    if(sendsize > MSG_DATA_SIZE && sendsize > ds->max_transfer) {
+        return ERR_2BIG;
+    }
     *(dax_dint *)buff = mtos_dint(h.index);       /* Index */
     *(dax_dint *)&buff[4] = mtos_dint(h.byte);    /* Byte offset */
     *(dax_dint *)&buff[8] = mtos_dint(h.count);   /* Tag Count */
     *(dax_dint *)&buff[12] = mtos_dint(h.type);   /* Data Type */
     buff[16]=h.bit;                               /* Bit offset */
-    *(dax_dint *)&buff[17] = mtos_uint(operation);/* Operation */
-
-    memcpy(&buff[21], data, h.size);
+    *(dax_uint *)&buff[17] = mtos_uint(operation);/* Operation */
+    iov[0].iov_base = buff;
+    iov[0].iov_len = 21;
+    iov[1].iov_base = data;
+    iov[1].iov_len = datasize;
 
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_ATOMIC_OP, buff, sendsize);
+    result = _message_sendv(ds, MSG_ATOMIC_OP, iov, datasize ? 2 : 1);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
-    result = _message_recv(ds, MSG_ATOMIC_OP, buff, 0, 1);
+    if(prev != NULL && (operation == ATOMIC_OP_CAS || operation == ATOMIC_OP_FETCH_ADD)) {
+        recvsize = h.size;
+        result = _message_recv(ds, MSG_ATOMIC_OP, prev, &recvsize, 1);
+    } else {
+        result = _message_recv(ds, MSG_ATOMIC_OP, NULL, 0, 1);
+    }
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         if(result == ERR_DELETED) {
@@ -1135,6 +1483,28 @@ dax_atomic_op(dax_state *ds, tag_handle h, void *data, uint16_t operation) {
     return 0;
 }
 
+/* Returns the number of bytes of event data that are sent to the server
+ * for the given type.  BOOL data is a single byte and custom datatypes are
+ * sent whole. */
+static int
+_event_data_size(dax_state *ds, tag_type type)
+{
+    if(type == DAX_BOOL) return 1;
+    return dax_get_typesize(ds, type);
+}
+
+/* Copies the event data into the message buffer.  Custom datatypes
+ * can't be converted so they are copied as is. */
+static void
+_event_data_copy(tag_type type, void *dst, void *src, size_t size)
+{
+    if(IS_CUSTOM(type)) {
+        memcpy(dst, src, size);
+    } else {
+        mtos_generic(type, dst, src);
+    }
+}
+
 /*!
  * Add an event to the tag server.  An event is triggered when the conditions
  * given become true.
@@ -1191,8 +1561,11 @@ dax_event_add(dax_state *ds, tag_handle *h, int event_type, void *data,
     buff[24]=h->bit;                 /* Bit offset */
 
     if(data != NULL) {
-        mtos_generic(h->type, &buff[25], data);
-        size = 25 + TYPESIZE(h->type) / 8;
+        result = _event_data_size(ds, h->type);
+        if(result < 0) return result;
+        if(25 + result > MSG_DATA_SIZE) return ERR_2BIG;
+        _event_data_copy(h->type, &buff[25], data, result);
+        size = 25 + result;
     } else {
         size = 25;
     }
@@ -1225,6 +1598,108 @@ dax_event_add(dax_state *ds, tag_handle *h, int event_type, void *data,
     return 0;
 }
 
+/*!
+ * Adds several events to the tag server with a single message.  This is
+ * much faster than calling dax_event_add() for each event when a module
+ * has a lot of events to create.
+ *
+ * @param ds Pointer to the dax state object.
+ * @param events Array of event definitions.  The handle, event_type, data,
+ *               callback, udata and free_callback members are the same as
+ *               the arguments to dax_event_add().  The id member will be set
+ *               to the identifier of the event.  If the event could not be
+ *               added the id member of the id will be set to the error code.
+ * @param count The number of events in the array
+ *
+ * @returns Zero if all of the events were added, the first error that
+ *          was returned for one of the events or an error code if the
+ *          message failed
+ */
+int
+dax_event_add_multi(dax_state *ds, dax_event_def *events, int count)
+{
+    int result, n, first = 0;
+    size_t size, offset = 0, len;
+    char *buff;
+    dax_dint *results, temp;
+    dax_udint u_temp;
+    dax_id eid;
+
+    if(count <= 0) return ERR_ARG;
+    size = 0;
+    for(n = 0; n < count; n++) {
+        size += 26;
+        if(events[n].data != NULL) {
+            result = _event_data_size(ds, events[n].handle.type);
+            if(result < 0) return result;
+            /* The length has to fit in the single byte after the bit offset */
+            if(result > 0xFF) return ERR_2BIG;
+            size += result;
+        }
+    }
+    if(size > MSG_DATA_SIZE && size > ds->max_transfer) {
+        return ERR_2BIG;
+    }
+    buff = malloc(size);
+    results = malloc(sizeof(dax_dint) * count);
+    if(buff == NULL || results == NULL) {
+        free(buff);
+        free(results);
+        return ERR_ALLOC;
+    }
+    for(n = 0; n < count; n++) {
+        temp = mtos_dint(events[n].handle.index);
+        memcpy(&buff[offset], &temp, 4);
+        temp = mtos_dint(events[n].handle.byte);
+        memcpy(&buff[offset + 4], &temp, 4);
+        temp = mtos_dint(events[n].handle.count);
+        memcpy(&buff[offset + 8], &temp, 4);
+        temp = mtos_dint(events[n].handle.type);
+        memcpy(&buff[offset + 12], &temp, 4);
+        temp = mtos_dint(events[n].event_type);
+        memcpy(&buff[offset + 16], &temp, 4);
+        u_temp = mtos_udint(events[n].handle.size);
+        memcpy(&buff[offset + 20], &u_temp, 4);
+        buff[offset + 24] = events[n].handle.bit;
+        if(events[n].data != NULL) {
+            len = _event_data_size(ds, events[n].handle.type);
+            _event_data_copy(events[n].handle.type, &buff[offset + 26], events[n].data, len);
+        } else {
+            len = 0;
+        }
+        buff[offset + 25] = len;
+        offset += 26 + len;
+    }
+
+    pthread_mutex_lock(&ds->lock);
+    result = _message_send(ds, MSG_EVNT_MADD, buff, size);
+    free(buff);
+    if(result == 0) {
+        size = sizeof(dax_dint) * count;
+        result = _message_recv(ds, MSG_EVNT_MADD, (char *)results, &size, 1);
+    }
+    if(result == 0) {
+        for(n = 0; n < count; n++) {
+            events[n].id.index = events[n].handle.index;
+            events[n].id.id = results[n];
+            if(results[n] < 0) {
+                if(first == 0) first = results[n];
+                continue;
+            }
+            eid = events[n].id;
+            result = add_event(ds, eid, events[n].udata, events[n].callback, events[n].free_callback);
+            if(result) {
+                events[n].id.id = result;
+                if(first == 0) first = result;
+            }
+        }
+        result = first;
+    }
+    pthread_mutex_unlock(&ds->lock);
+    free(results);
+    return result;
+}
+
 /*!
  * Delete the given event from the tag server
  * 
@@ -1264,7 +1739,7 @@ dax_event_del(dax_state *ds, dax_id id)
         }
     }
     pthread_mutex_unlock(&ds->lock);
-    return result;
+    return 0;
 }
 
 /*!
@@ -1535,7 +2010,11 @@ dax_map_add(dax_state *ds, tag_handle *src, tag_handle *dest, dax_id *id)
  * @param result  Pointer to the result 0 = success
  * @param h       Pointer to an array of tag_handles that define the group
  * @param count   Number of handles in the array
- * @param options Options Flags <Not Implemented set to zero>
+ * @param options Options Flags.  If GROUP_OPT_SUBSCRIBE is set the server
+ *                sends the members of the group that change as events.  The
+ *                latest data can be retrieved with dax_group_get_data() and
+ *                dax_group_set_callback() assigns a function that is called
+ *                when it changes.
  * @returns       A pointer to a tag group object.  This will be filled in
  *                with all the information necessary to access this group.
  *                This will be used in all the functions that access the group.
@@ -1549,29 +2028,55 @@ dax_group_add(dax_state *ds, int *result, tag_handle *h, int count, uint8_t opti
     size_t size, group_size;
     dax_dint temp;
     dax_udint u_temp;
+    uint8_t *buff, *data = NULL;
+    uint32_t *offsets = NULL;
+    tag_group_id **groups;
 
-    uint8_t buff[MSG_DATA_SIZE];
     *result = 0;
     /* Sanity check the sizes.  These checks are redundant because
      * the server also does them but this will keep from sending the message */
-    if(count > TAG_GROUP_MAX_MEMBERS) {
+    if(count < 0 || count > TAG_GROUP_MAX_MEMBERS) {
         *result = ERR_ARG;
         return NULL;
     }
-    size = 0;
+    group_size = 0;
     for(n=0; n<count; n++) {
         group_size += h[n].size;
-        if(group_size > MSG_TAG_GROUP_DATA_SIZE) {
-            *result = ERR_2BIG;
+    }
+    /* size of the handles array + the count and the options bytes */
+    size = TAG_GROUP_HANDLE_SIZE*count + 5;
+    if(group_size > TAG_GROUP_MAX_SIZE || (group_size + 4 > MSG_DATA_SIZE && group_size + 4 > ds->max_transfer) ||
+       (size > MSG_DATA_SIZE && size > ds->max_transfer)) {
+        *result = ERR_2BIG;
+        return NULL;
+    }
+    /* Subscribed groups keep a copy of the data that the events update */
+    if(options & GROUP_OPT_SUBSCRIBE) {
+        data = calloc(1, group_size ? group_size : 1);
+        offsets = malloc(sizeof(uint32_t) * (count ? count : 1));
+        if(data == NULL || offsets == NULL) {
+            free(data);
+            free(offsets);
+            *result = ERR_ALLOC;
             return NULL;
         }
+        for(n=0, offset=0; n<count; n++) {
+            offsets[n] = offset;
+            offset += h[n].size;
+        }
     }
-    buff[0] = count;
-    buff[1] = options; /* Not implemented yet */
-    /* size of the handles array + the count and the options bytes */
-    size = 21*count + 2;
+    buff = malloc(size);
+    if(buff == NULL) {
+        free(data);
+        free(offsets);
+        *result = ERR_ALLOC;
+        return NULL;
+    }
+    u_temp = mtos_udint(count);
+    memcpy(buff, &u_temp, 4);
+    buff[4] = options;
     for(n=0; n<count; n++) {
-        offset = 21*n + 2;
+        offset = TAG_GROUP_HANDLE_SIZE*n + 5;
         temp = mtos_dint(h[n].index);
         memcpy(&buff[offset], &temp, 4);
         u_temp = mtos_udint(h[n].byte);
@@ -1587,33 +2092,70 @@ dax_group_add(dax_state *ds, int *result, tag_handle *h, int count, uint8_t opti
 
     pthread_mutex_lock(&ds->lock);
     *result = _message_send(ds, MSG_GRP_ADD, buff, size);
-
+    free(buff);
     if(*result) {
         pthread_mutex_unlock(&ds->lock);
+        free(data);
+        free(offsets);
         return NULL;
     }
-    size = MSG_DATA_SIZE;
-    *result = _message_recv(ds, MSG_GRP_ADD, buff, &size, 1);
+    size = sizeof(u_temp);
+    *result = _message_recv(ds, MSG_GRP_ADD, &u_temp, &size, 1);
     if(*result == 0) {
         id = (tag_group_id *)malloc(sizeof(tag_group_id));
         if(id == NULL) {
             pthread_mutex_unlock(&ds->lock);
+            free(data);
+            free(offsets);
             *result = ERR_ALLOC;
             return NULL;
         }
-        id->handles = (tag_handle *)malloc(sizeof(tag_handle)*count);
+        id->handles = (tag_handle *)malloc(sizeof(tag_handle)*(count ? count : 1));
         if(id->handles == NULL) {
+            free(id);
             pthread_mutex_unlock(&ds->lock);
+            free(data);
+            free(offsets);
             *result = ERR_ALLOC;
             return NULL;
         }
         memcpy(id->handles, h, sizeof(tag_handle)*count);
-        id->index = *(uint32_t *)buff;
+        id->index = u_temp;
         id->count = count;
         id->options = options;
         id->size = group_size;
+        id->data = data;
+        id->offsets = offsets;
+        id->udata = NULL;
+        id->callback = NULL;
+        id->refs = 0;
+        id->deleted = 0;
+        id->seq = 0;
+        if(data != NULL) {
+            /* The event dispatcher finds the group by the server's index */
+            pthread_mutex_lock(&ds->event_lock);
+            if(id->index >= ds->groups_size) {
+                groups = realloc(ds->groups, sizeof(tag_group_id *) * (id->index + 16));
+                if(groups == NULL) {
+                    *result = ERR_ALLOC;
+                } else {
+                    bzero(&groups[ds->groups_size], sizeof(tag_group_id *) * (id->index + 16 - ds->groups_size));
+                    ds->groups = groups;
+                    ds->groups_size = id->index + 16;
+                }
+            }
+            if(*result == 0) ds->groups[id->index] = id;
+            pthread_mutex_unlock(&ds->event_lock);
+        }
+    } else {
+        free(data);
+        free(offsets);
     }
     pthread_mutex_unlock(&ds->lock);
+    if(*result) { /* We couldn't keep track of the subscription */
+        if(id != NULL) dax_group_del(ds, id);
+        return NULL;
+    }
     return id;
 }
 
@@ -1634,16 +2176,15 @@ dax_group_read(dax_state *ds, tag_group_id *id, void *data, size_t size) {
 
     if(size < id->size) return ERR_ARG;
     u_temp = mtos_udint(id->index);
-    memcpy(data, &u_temp, 4);
 
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_GRP_READ, data, 4);
+    result = _message_send(ds, MSG_GRP_READ, &u_temp, 4);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
 
-    size = MSG_DATA_SIZE;
+    /* Large groups come back in pieces straight into the caller's buffer */
     result = _message_recv(ds, MSG_GRP_READ, data, &size, 1);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
@@ -1667,16 +2208,18 @@ int
 dax_group_write(dax_state *ds, tag_group_id *id, void *data) {
     int result;
     uint32_t u_temp;
-    char buff[MSG_DATA_SIZE];
+    struct iovec iov[2];
 
     u_temp = mtos_udint(id->index);
-    memcpy(buff, &u_temp, 4);
 
     result = group_write_format(ds, id, data);
     if(result) return result;
-    memcpy(&buff[4], data, id->size);
+    iov[0].iov_base = &u_temp;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = data;
+    iov[1].iov_len = id->size;
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_GRP_WRITE, buff, id->size+4);
+    result = _message_sendv(ds, MSG_GRP_WRITE, iov, 2);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
@@ -1705,10 +2248,92 @@ dax_group_del(dax_state *ds, tag_group_id *id) {
 
      result = _message_recv(ds, MSG_GRP_DEL, NULL, 0, 1);
      if(result == 0) {
-         free(id->handles);
-         free(id);
+         pthread_mutex_lock(&ds->event_lock);
+         if(id->data != NULL) {
+             if(id->index < ds->groups_size && ds->groups[id->index] == id) {
+                 ds->groups[id->index] = NULL;
+             }
+         }
+         /* If an event thread is in the middle of a change for this group
+          * it frees the group when it's done */
+         if(id->refs) {
+             id->deleted = 1;
+             id = NULL;
+         }
+         pthread_mutex_unlock(&ds->event_lock);
+         if(id != NULL) group_free(id);
      }
      pthread_mutex_unlock(&ds->lock);
      return result;
 }
 
+/* Frees the memory used by a tag group */
+void
+group_free(tag_group_id *id) {
+    free(id->handles);
+    free(id->data);
+    free(id->offsets);
+    free(id);
+}
+
+/* Assigns a function that is called when the server sends changes to a
+ * subscribed group.  The callback is called from dax_event_wait() or
+ * dax_event_poll() after the group's data has been updated.
+ *
+ * @param ds       Pointer to the dax state object
+ * @param id       Pointer to the tag group id returned by dax_group_add()
+ * @param callback Function that is called.  NULL removes the callback
+ * @param udata    Pointer that is passed to the callback
+ * @returns        0 on success an error code otherwise
+ */
+int
+dax_group_set_callback(dax_state *ds, tag_group_id *id,
+                       void (*callback)(dax_state *ds, void *udata), void *udata) {
+    if(id->data == NULL) return ERR_ILLEGAL;
+    pthread_mutex_lock(&ds->event_lock);
+    id->callback = callback;
+    id->udata = udata;
+    pthread_mutex_unlock(&ds->event_lock);
+    return 0;
+}
+
+/* Copies the latest data that the server has sent for a subscribed group
+ * into buff without sending a message.  The data is laid out the same way
+ * as dax_group_read() lays it out.  The data is updated by the thread that
+ * handles the events so this should be called from that thread or from
+ * the group's callback.
+ *
+ * @param ds      Pointer to the dax state object
+ * @param id      Pointer to the tag group id returned by dax_group_add()
+ * @param buff    Pointer to a buffer that will recieve the data
+ * @param size    Size of the above buffer
+ * @returns       0 on success an error code otherwise
+ */
+int
+dax_group_get_data(dax_state *ds, tag_group_id *id, void *buff, size_t size) {
+    if(id->data == NULL) return ERR_ILLEGAL;
+    if(size < id->size) return ERR_ARG;
+    memcpy(buff, id->data, id->size);
+    return 0;
+}
+
+/* Returns the event sequence number of the last change that the server sent
+ * for a subscribed group.  Like dax_group_get_data() this should be called
+ * from the thread that handles the events or from the group's callback.  If
+ * it is later than the mark that dax_event_mark() returned after a write then
+ * the server sent the change after it had handled the write.
+ *
+ * @param ds      Pointer to the dax state object
+ * @param id      Pointer to the tag group id returned by dax_group_add()
+ * @returns       The sequence number or zero if no change has been received
+ */
+uint32_t
+dax_group_get_seq(dax_state *ds, tag_group_id *id) {
+    uint32_t seq;
+
+    pthread_mutex_lock(&ds->event_lock);
+    seq = id->seq;
+    pthread_mutex_unlock(&ds->event_lock);
+    return seq;
+}
+
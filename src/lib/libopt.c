@@ -48,6 +48,7 @@ dax_init_config(dax_state *ds, char *name)
     result += dax_add_attribute(ds, "name", "name", 'N', flags, name);
     result += dax_add_attribute(ds, "cachesize", "cachesize", 'Z', flags, "8");
     result += dax_add_attribute(ds, "msgtimeout", "msgtimeout", 'O', flags, DEFAULT_TIMEOUT);
+    result += dax_add_attribute(ds, "eventqueue", "eventqueue", 'Q', flags, DEFAULT_EVENT_QUEUE);
 
     flags = CFG_CMDLINE | CFG_ARG_REQUIRED;
     result += dax_add_attribute(ds, "config", "config", 'C', flags, NULL);
@@ -0,0 +1,130 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+
+ * This file contains the code that reads tag data from the server's
+ * shared memory segment
+ */
+
+#include <libdax.h>
+#include <libcommon.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* The server tells modules that are connected through the local socket
+ * the name of it's shared memory segment when they register.  We map it
+ * read only and then dax_read() can get the tag data straight out of the
+ * segment without sending a message.  If anything about the segment or
+ * the tag doesn't look right we just return an error and the data is read
+ * from the server the old fashioned way.  These functions should be called
+ * with the ds->lock held so that the segment is not unmapped while we are
+ * reading from it. */
+
+/* Number of times that we'll try to get a clean copy of the data while the
+ * server is writing to the tag before we give up and send a message */
+#define SHM_READ_RETRIES 64
+
+/* Map the shared memory segment with the given name */
+int
+shmem_attach(dax_state *ds, char *name)
+{
+    int fd;
+    struct stat st;
+    void *shm;
+    dax_shm_header *header;
+
+    shmem_detach(ds);
+    fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) {
+        dax_debug(ds, LOG_COMM, "Unable to open shared memory segment %s - %s", name, strerror(errno));
+        return ERR_NOTFOUND;
+    }
+    if(fstat(fd, &st) || st.st_size < sizeof(dax_shm_header)) {
+        close(fd);
+        return ERR_NOTFOUND;
+    }
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED) {
+        dax_debug(ds, LOG_COMM, "Unable to map shared memory segment %s - %s", name, strerror(errno));
+        return ERR_NOTFOUND;
+    }
+    header = (dax_shm_header *)shm;
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != DAX_SHM_MAGIC ||
+       header->version != DAX_SHM_VERSION || header->size > st.st_size ||
+       header->slot_offset + (uint64_t)header->slot_count * sizeof(dax_shm_slot) > header->size) {
+        munmap(shm, st.st_size);
+        return ERR_NOTFOUND;
+    }
+    ds->shm = shm;
+    ds->shm_size = st.st_size;
+    dax_debug(ds, LOG_COMM, "Mapped shared memory segment %s, size = %lu", name, ds->shm_size);
+    return 0;
+}
+
+void
+shmem_detach(dax_state *ds)
+{
+    if(ds->shm != NULL) {
+        munmap(ds->shm, ds->shm_size);
+        ds->shm = NULL;
+        ds->shm_size = 0;
+    }
+}
+
+/* Reads size bytes from the tag at idx starting at offset into data.
+ * Returns zero on success or an error if the data has to be read from
+ * the server instead. */
+int
+shmem_read(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size)
+{
+    dax_shm_header *header;
+    dax_shm_slot *slot;
+    uint32_t seq, flags, slot_offset, slot_size;
+    int n;
+
+    if(ds->shm == NULL) return ERR_NOTFOUND;
+    header = (dax_shm_header *)ds->shm;
+    /* The server clears the magic number when it shuts down */
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != DAX_SHM_MAGIC) {
+        return ERR_NOTFOUND;
+    }
+    if(idx < 0 || idx >= header->slot_count) return ERR_NOTFOUND;
+    slot = (dax_shm_slot *)&ds->shm[header->slot_offset] + idx;
+
+    for(n = 0; n < SHM_READ_RETRIES; n++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq & 0x01) continue; /* The server is writing */
+        flags = slot->flags;
+        slot_offset = slot->offset;
+        slot_size = slot->size;
+        /* We check everything against the copies that we just made so that
+         * a slot that is changing can't send us outside of the segment */
+        if(!(flags & SHM_SLOT_VALID) || (uint64_t)offset + size > slot_size ||
+           (uint64_t)slot_offset + slot_size > ds->shm_size) {
+            if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq) return ERR_NOTFOUND;
+            continue;
+        }
+        memcpy(data, &ds->shm[slot_offset + offset], size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+    return ERR_TIMEOUT;
+}
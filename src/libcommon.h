@@ -55,17 +55,42 @@
 #define MSG_DEL_OVRD    0x001B /* Delete override */
 #define MSG_GET_OVRD    0x001C /* Read the current override mask and raw value for the given tag */
 #define MSG_SET_OVRD    0x001D /* Set or clear tag override flag */
+#define MSG_TAG_MADD    0x001E /* Add multiple tags */
+#define MSG_EVNT_MADD   0x001F /* Add multiple events */
 
 /* More to come */
 
-#define NUM_COMMANDS 29
+#define NUM_COMMANDS 31
 
 #define MSG_RESPONSE  0x01000000LL /* Flag for defining a response message */
 #define MSG_ERROR     0x02000000LL /* Flag for defining an error message */
+#define MSG_CHUNK     0x04000000LL /* More frames of this message will follow */
 #define MSG_EVENT     0x80000000LL /* Flag for defining an event message */
 
 /* These are flags for the registration command */
 #define CONNECT_SYNC  0x01 /* Used to identify the synchronous socket during registration */
+#define CONNECT_EVENT_BATCH 0x02 /* The module can receive batched event messages */
+#define CONNECT_TAG_NOTIFY  0x04 /* The module wants to know when tags are deleted */
+
+/* Events that fire while the server is handling a single message are sent to
+ * modules that asked for it at registration in a single message with this
+ * event type.  The data of that message is made up of complete event messages,
+ * header and all, one after the other. */
+#define EVENT_BATCH   0xFF
+
+/* The members of a subscribed tag group that have changed are sent in
+ * messages with this event type.  The data starts with the group index and a
+ * flags word and then for each member the member's index within the group and
+ * it's data.  A change that doesn't fit in one message is sent in more than
+ * one and the last of them has GROUP_DELTA_LAST set in the flags. */
+#define EVENT_GROUP   0xFE
+#define GROUP_DELTA_LAST 0x01
+#define GROUP_DELTA_HDR_SIZE 8
+
+/* Modules that registered with CONNECT_TAG_NOTIFY are sent a message with
+ * this event type whenever a tag is deleted so that they can take it out
+ * of their tag cache.  The data is the index of the tag. */
+#define EVENT_TAG_DELETED 0xFD
 
 /* These are the values that the registration system uses to 
    determine whether or not the module will have to reformat
@@ -85,6 +110,17 @@
 #define TAG_GET_NAME    0x01 /* Retrieve the tag by name */
 #define TAG_GET_INDEX   0x02 /* Retrieve the tag by it's index */
 
+/* The MSG_TAG_LIST command asks for the definitions of the tags that have
+ * changed since a given catalogue generation, starting at a given index.
+ * The message is the starting index, the generation and the most bytes that
+ * the response should have.  The response is the current generation, the
+ * index to start the next request at (-1 if there are no more) and then the
+ * tags.  Each tag is the index, type, count and attributes as uint32s and a
+ * length byte followed by the name without a NULL.  Deleted tags have a type
+ * of zero and no name. */
+#define TAG_LIST_HDR_SIZE   8
+#define TAG_LIST_ENTRY_SIZE 17
+
 /* Subcommands for the MSG_CDT_GET command */
 #define CDT_GET_NAME    0x01 /* Retrieve the type by name */
 #define CDT_GET_TYPE    0x02 /* Retrieve the type by it's type */
@@ -104,14 +140,59 @@
 #define MSG_TAG_DATA_SIZE (MSG_DATA_SIZE - sizeof(tag_idx_t))
 #define MSG_TAG_GROUP_DATA_SIZE (MSG_DATA_SIZE - sizeof(uint32_t))
 
+/* Messages that are larger than MSG_DATA_SIZE are split into frames.  Every
+ * frame but the last has the MSG_CHUNK flag set in the message type and the
+ * receiver puts the data back together before handling it.  This is the
+ * largest payload that the server will accept or send this way.  The server
+ * sends it's limit to the module at registration. */
+#ifndef DAX_TRANSFER_MAX
+#  define DAX_TRANSFER_MAX (16 * 1024 * 1024)
+#endif
+
+/* Modules that are running on the same host as the server can read tag data
+ * straight out of a shared memory segment instead of sending a message.  The
+ * server sends the name of the segment at registration to modules that are
+ * connected through the local socket.  The segment starts with the header
+ * below followed by an array of slots that is indexed by the tag index.  Each
+ * slot gives the location of that tag's data within the segment.  The data is
+ * protected by the sequence number in the slot.  The server makes it odd
+ * while it is changing the data or the slot and even again when it is done.
+ * A reader copies the data and then checks that the sequence number is even
+ * and has not changed while it was reading, otherwise it tries again. */
+#define DAX_SHM_MAGIC   0x44415853 /* "DAXS" */
+#define DAX_SHM_VERSION 1
+
+/* Slot flags */
+#define SHM_SLOT_VALID  0x01 /* The data in the segment can be read directly */
+
+typedef struct dax_shm_header {
+    uint32_t magic;       /* DAX_SHM_MAGIC while the server is using the segment */
+    uint32_t version;
+    uint32_t size;        /* Total size of the segment in bytes */
+    uint32_t slot_count;  /* Number of tag slots */
+    uint32_t slot_offset; /* Offset to the slot array */
+    uint32_t data_offset; /* Offset to the start of the data area */
+} dax_shm_header;
+
+typedef struct dax_shm_slot {
+    uint32_t seq;    /* Sequence number.  Odd while the server is writing */
+    uint32_t flags;
+    uint32_t offset; /* Offset to the tag data from the start of the segment */
+    uint32_t size;   /* Size of the tag data */
+} dax_shm_slot;
+
 /* This is the initial size of the group array that will be allocated
  * for each module the first time a group is added to that module */
 #define TAG_GROUP_START_COUNT 16
 /* This is the maximum number of groups that will be allocated.  After
  * this the module will receive ERR_2BIG errors when trying to add a group */
 #define TAG_GROUP_MAX_COUNT 4096
- /* Maximum number of handle members that can be sent */
-#define TAG_GROUP_MAX_MEMBERS 150
+ /* Maximum number of handle members that can be sent.  The handles are sent
+  * in one message that can be split into frames.  The data of a group can
+  * be as large as the biggest message too. */
+#define TAG_GROUP_HANDLE_SIZE 21
+#define TAG_GROUP_MAX_MEMBERS ((DAX_TRANSFER_MAX - 5) / TAG_GROUP_HANDLE_SIZE)
+#define TAG_GROUP_MAX_SIZE (DAX_TRANSFER_MAX - sizeof(uint32_t))
 
 /* This is a full sized message.  It's the largest message allowed to be sent */
 struct dax_message {
@@ -119,10 +200,11 @@ struct dax_message {
      * MSG_HDR_SIZE definition above */
     uint32_t size;     /* size of the data sent */
     uint32_t msg_type;  /* Which function to call */
-    /* Main data payload */
-    char data[MSG_DATA_SIZE];
     /* The following stuff isn't in the socket message */
     int fd;             /* We'll use the fd to identify the module*/
+    /* Main data payload.  This should stay last because messages that are put
+     * back together from chunks are allocated with a larger data area */
+    char data[MSG_DATA_SIZE];
 };
 
 /*
@@ -133,6 +133,12 @@ tag_del(char **tokens)
 }
 
 
+static void
+_list_callback(dax_state *ds, dax_tag *tag, void *udata)
+{
+    show_tag(tag->idx, *tag);
+}
+
 /* TAG LIST command function
  * If we have no arguments then we list all the tags
  * If we have a single argument then we see if it's a tagname
@@ -213,17 +219,10 @@ list_tags(char **tokens)
         }
     } else {
         /* List all tags */
-        for(n=0; n<=lastindex; n++) {
-            result = dax_tag_byindex(ds, &temp_tag, n);
-            if(result == ERR_DELETED) {
-                ; /* do nothing */
-            } else if(result) {
-                printf("Error: %d\n", result);
-                return result;
-            } else {
-                /* Otherwise show it */
-                show_tag(n, temp_tag);
-            }
+        result = dax_tag_list(ds, 0, NULL, _list_callback, NULL);
+        if(result) {
+            printf("Error: %d\n", result);
+            return result;
         }
         nextindex = 0; /* Reset this static variable so other tag lists start at the beginning */
     }
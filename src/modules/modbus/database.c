@@ -22,3 +22,276 @@
 extern dax_state *ds;
 
 
+
+/* Number of bytes in each member of the group that keeps an image current.
+ * The server only sends the members that change so smaller members mean
+ * less data when a few registers in a large table change. */
+#define IMAGE_CHUNK 128
+
+static mb_image *_image_list;
+static pthread_mutex_t _writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _writer_cond = PTHREAD_COND_INITIALIZER;
+static int _writer_started;
+static int _writer_dirty;
+
+/* Group callback.  This is called from the event thread after the server
+ * has sent all of the changes to the table.  Writes from clients that the
+ * new data might not show yet are put back over it.  That is the data that
+ * has been sent to the server and then anything that has been written since.
+ * Changes that were sent before the server handled the last batch can still
+ * be in the event queue so the sent data is kept until a change comes that
+ * the server sent after the write returned. */
+static void
+_image_update(dax_state *_ds, void *udata)
+{
+    mb_image *img = (mb_image *)udata;
+    unsigned int n;
+
+    pthread_mutex_lock(&img->lock);
+    dax_group_get_data(_ds, img->group, img->data, img->h.size);
+    if(img->fhi && !img->fbusy &&
+       (int32_t)(dax_group_get_seq(_ds, img->group) - img->fmark) > 0) {
+        bzero(&img->fmask[img->flo], img->fhi - img->flo);
+        img->flo = img->h.size;
+        img->fhi = 0;
+    }
+    for(n = img->flo; n < img->fhi; n++) {
+        img->data[n] = (img->data[n] & ~img->fmask[n]) | (img->fdata[n] & img->fmask[n]);
+    }
+    for(n = img->wlo; n < img->whi; n++) {
+        img->data[n] = (img->data[n] & ~img->wmask[n]) | (img->wdata[n] & img->wmask[n]);
+    }
+    pthread_mutex_unlock(&img->lock);
+}
+
+/* Sends the data that has been written to the image since the last time
+ * with a single masked write.  The batch is merged into fdata and fmask so
+ * that group updates that were sent before the server had it don't take the
+ * new values back out of the image.  Only the bits in smask are written. */
+static void
+_image_flush(mb_image *img)
+{
+    tag_handle h;
+    unsigned int lo, size, n;
+    int result;
+
+    pthread_mutex_lock(&img->lock);
+    if(img->whi == 0) {
+        pthread_mutex_unlock(&img->lock);
+        return;
+    }
+    lo = img->wlo;
+    size = img->whi - img->wlo;
+    for(n = lo; n < img->whi; n++) {
+        img->fdata[n] = (img->fdata[n] & ~img->wmask[n]) | (img->wdata[n] & img->wmask[n]);
+        img->fmask[n] |= img->wmask[n];
+    }
+    memcpy(&img->smask[lo], &img->wmask[lo], size);
+    bzero(&img->wmask[lo], size);
+    img->flo = MIN(img->flo, lo);
+    img->fhi = MAX(img->fhi, img->whi);
+    img->fbusy = 1;
+    img->wlo = img->h.size;
+    img->whi = 0;
+    pthread_mutex_unlock(&img->lock);
+
+    h = img->h;
+    h.byte += lo;
+    h.size = size;
+    if(h.type == DAX_BOOL) {
+        h.count = MIN(size * 8, img->h.count - lo * 8);
+    } else {
+        h.count = size / 2;
+    }
+    result = dax_mask_tag(ds, h, &img->fdata[lo], &img->smask[lo]);
+    if(result) {
+        dax_error(ds, "Unable to write tag data to server");
+    }
+    pthread_mutex_lock(&img->lock);
+    img->fbusy = 0;
+    img->fmark = dax_event_mark(ds);
+    pthread_mutex_unlock(&img->lock);
+}
+
+/* Writes to the images are sent to the server from this thread so that the
+ * port threads never have to wait on the server.  Everything that was written
+ * while the last batch was being sent goes out together in the next one. */
+static void *
+_writer_thread(void *arg)
+{
+    mb_image *img;
+
+    while(1) {
+        pthread_mutex_lock(&_writer_lock);
+        while(!_writer_dirty) {
+            pthread_cond_wait(&_writer_cond, &_writer_lock);
+        }
+        _writer_dirty = 0;
+        pthread_mutex_unlock(&_writer_lock);
+        for(img = _image_list; img != NULL; img = img->next) {
+            _image_flush(img);
+        }
+    }
+    return NULL;
+}
+
+static void
+_image_free(mb_image *img)
+{
+    free(img->data);
+    free(img->wdata);
+    free(img->wmask);
+    free(img->fdata);
+    free(img->fmask);
+    free(img->smask);
+    free(img);
+}
+
+/* Creates an image of the table tag given by 'h'.  The image is filled with
+ * the current data and a subscribed group is added to keep it current.
+ * Returns NULL if any of that fails and the caller should go to the server
+ * for each request instead.  This has to be called before the port threads
+ * are started. */
+mb_image *
+mb_image_new(tag_handle h)
+{
+    mb_image *img;
+    tag_handle *members;
+    pthread_t thread;
+    pthread_attr_t attr;
+    int count, n, result;
+
+    img = calloc(1, sizeof(mb_image));
+    if(img == NULL) return NULL;
+    img->h = h;
+    img->data = malloc(h.size);
+    img->wdata = malloc(h.size);
+    img->wmask = calloc(1, h.size);
+    img->fdata = malloc(h.size);
+    img->fmask = calloc(1, h.size);
+    img->smask = malloc(h.size);
+    if(img->data == NULL || img->wdata == NULL || img->wmask == NULL ||
+       img->fdata == NULL || img->fmask == NULL || img->smask == NULL) {
+        _image_free(img);
+        return NULL;
+    }
+    img->wlo = h.size;
+    img->whi = 0;
+    img->flo = h.size;
+    img->fhi = 0;
+    result = dax_read_tag(ds, h, img->data);
+    if(result) {
+        _image_free(img);
+        return NULL;
+    }
+
+    count = (h.size - 1) / IMAGE_CHUNK + 1;
+    members = malloc(sizeof(tag_handle) * count);
+    if(members == NULL) {
+        _image_free(img);
+        return NULL;
+    }
+    for(n = 0; n < count; n++) {
+        members[n] = h;
+        members[n].byte = h.byte + n * IMAGE_CHUNK;
+        members[n].bit = 0;
+        members[n].size = MIN(IMAGE_CHUNK, h.size - n * IMAGE_CHUNK);
+        if(h.type == DAX_BOOL) {
+            members[n].count = MIN(members[n].size * 8, h.count - n * IMAGE_CHUNK * 8);
+        } else {
+            members[n].count = members[n].size / 2;
+        }
+    }
+    img->group = dax_group_add(ds, &result, members, count, GROUP_OPT_SUBSCRIBE);
+    free(members);
+    if(img->group == NULL) {
+        _image_free(img);
+        return NULL;
+    }
+    pthread_mutex_init(&img->lock, NULL);
+    dax_group_set_callback(ds, img->group, _image_update, img);
+
+    pthread_mutex_lock(&_writer_lock);
+    img->next = _image_list;
+    _image_list = img;
+    if(!_writer_started) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, _writer_thread, NULL)) {
+            dax_error(ds, "Unable to start the register table writer thread");
+        } else {
+            _writer_started = 1;
+        }
+    }
+    pthread_mutex_unlock(&_writer_lock);
+    return img;
+}
+
+/* Copies 'count' registers or bits starting at 'index' out of the image.
+ * Bits are packed into 'data' starting at bit zero the same way that
+ * dax_read_tag() would return them. */
+void
+mb_image_read(mb_image *img, int index, int count, uint16_t *data)
+{
+    uint8_t *bits = (uint8_t *)data;
+    int n, i;
+
+    if(index < 0 || count <= 0 || index + count > img->h.count) return;
+    pthread_mutex_lock(&img->lock);
+    if(img->h.type == DAX_BOOL) {
+        bzero(bits, (count - 1) / 8 + 1);
+        for(n = 0; n < count; n++) {
+            i = index + n;
+            if(img->data[i / 8] & (0x01 << (i % 8))) {
+                bits[n / 8] |= (0x01 << (n % 8));
+            }
+        }
+    } else {
+        memcpy(data, &img->data[index * 2], count * 2);
+    }
+    pthread_mutex_unlock(&img->lock);
+}
+
+/* Puts the data that a client has written into the image and marks it to
+ * be sent to the server by the writer thread. */
+void
+mb_image_write(mb_image *img, int index, int count, uint16_t *data)
+{
+    uint8_t *bits = (uint8_t *)data;
+    unsigned int lo, hi;
+    int n, i;
+    uint8_t mask;
+
+    if(index < 0 || count <= 0 || index + count > img->h.count) return;
+    pthread_mutex_lock(&img->lock);
+    if(img->h.type == DAX_BOOL) {
+        for(n = 0; n < count; n++) {
+            i = index + n;
+            mask = 0x01 << (i % 8);
+            if(bits[n / 8] & (0x01 << (n % 8))) {
+                img->data[i / 8] |= mask;
+                img->wdata[i / 8] |= mask;
+            } else {
+                img->data[i / 8] &= ~mask;
+                img->wdata[i / 8] &= ~mask;
+            }
+            img->wmask[i / 8] |= mask;
+        }
+        lo = index / 8;
+        hi = (index + count - 1) / 8 + 1;
+    } else {
+        lo = index * 2;
+        hi = lo + count * 2;
+        memcpy(&img->data[lo], data, count * 2);
+        memcpy(&img->wdata[lo], data, count * 2);
+        memset(&img->wmask[lo], 0xFF, count * 2);
+    }
+    img->wlo = MIN(img->wlo, lo);
+    img->whi = MAX(img->whi, hi);
+    pthread_mutex_unlock(&img->lock);
+
+    pthread_mutex_lock(&_writer_lock);
+    _writer_dirty = 1;
+    pthread_cond_signal(&_writer_cond);
+    pthread_mutex_unlock(&_writer_lock);
+}
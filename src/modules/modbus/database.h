@@ -28,4 +28,29 @@
 
 void setup_command(struct mb_cmd *c, void *userdata, uint8_t *data, int datasize);
 
+/* Local copy of one of the register tables of a slave port.  The copy is
+ * kept current by a subscribed tag group and the requests from the Modbus
+ * clients are answered from it.  Writes from the clients go into the copy
+ * right away and are sent to the server later by the writer thread. */
+typedef struct mb_image {
+    tag_handle h;            /* Handle to the whole table tag */
+    tag_group_id *group;     /* Subscribed group that keeps the copy current */
+    uint8_t *data;           /* Copy of the tag data */
+    uint8_t *wdata;          /* Data written by clients that hasn't gone to the server */
+    uint8_t *wmask;          /* Bits of wdata that are waiting to be written */
+    uint8_t *fdata;          /* Data sent to the server that no change has shown yet */
+    uint8_t *fmask;
+    uint8_t *smask;          /* Bits of the batch that the writer thread is sending */
+    unsigned int wlo, whi;   /* Range of bytes in wmask that have bits set */
+    unsigned int flo, fhi;   /* Range of bytes in fmask that have bits set */
+    uint8_t fbusy;           /* The writer thread is sending a batch */
+    uint32_t fmark;          /* Event mark taken when the last batch was written */
+    pthread_mutex_t lock;
+    struct mb_image *next;
+} mb_image;
+
+mb_image *mb_image_new(tag_handle h);
+void mb_image_read(mb_image *img, int index, int count, uint16_t *data);
+void mb_image_write(mb_image *img, int index, int count, uint16_t *data);
+
 #endif
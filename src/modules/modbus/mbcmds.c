@@ -45,6 +45,16 @@ initcmd(struct mb_cmd *c)
     c->lastcrc = 0;
     c->firstrun = 0;
     bzero(&c->data_h, sizeof(tag_handle));
+    c->wdata = NULL;
+    c->queued = 0;
+    c->qnext = NULL;
+    c->tid = 0;
+    c->tries = 0;
+    bzero(&c->sent, sizeof(struct timeval));
+    c->block = NULL;
+    c->members = NULL;
+    c->member_count = 0;
+    c->scan = 0;
     c->next = NULL;
 };
 
@@ -84,6 +94,12 @@ mb_destroy_cmd(mb_cmd *cmd) {
     if(cmd->data != NULL) {
         free(cmd->data);
     }
+    if(cmd->members != NULL) {
+        free(cmd->members);
+    }
+    if(cmd->wdata != NULL) {
+        free(cmd->wdata);
+    }
     free(cmd);
 }
 
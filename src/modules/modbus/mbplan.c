@@ -0,0 +1,245 @@
+/* mbplan.c - Modbus (tm) Communications Library
+ * Copyright (C) 2022 Phil Birkelbach
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Source file for the scan planner.  Read commands that go to the same
+ * node with the same function code and are close together are merged into
+ * block reads so that they only cost one transaction on the bus.  The
+ * block reads are kept in their own list in the port and each command that
+ * is part of one points to it.  The port loops send the block in place of
+ * the commands and the data is copied back out to the commands when the
+ * response comes in.
+ */
+
+#include "modbus.h"
+
+extern dax_state *ds;
+
+/* Only plain continuous read commands are merged.  Triggered and other
+ * event driven commands have to be sent on their own. */
+static int
+_can_merge(mb_cmd *mc)
+{
+    return mc->mode == MB_CONTINUOUS && mb_is_read_cmd(mc) && mc->block == NULL;
+}
+
+/* Largest number of registers or bits that a single request can read */
+static int
+_max_length(uint8_t function)
+{
+    if(function == 1 || function == 2) return 2000;
+    return 125;
+}
+
+/* Returns true if the two commands could be read with the same request */
+static int
+_same_group(mb_cmd *a, mb_cmd *b)
+{
+    return a->ip_address.s_addr == b->ip_address.s_addr && a->port == b->port &&
+           a->node == b->node && a->function == b->function &&
+           a->interval == b->interval;
+}
+
+/* Sorts the commands so that the ones that could go together are next to
+ * each other in order of their starting register */
+static int
+_compare_cmd(const void *x, const void *y)
+{
+    mb_cmd *a = *(mb_cmd **)x;
+    mb_cmd *b = *(mb_cmd **)y;
+
+    if(a->ip_address.s_addr != b->ip_address.s_addr) {
+        return a->ip_address.s_addr < b->ip_address.s_addr ? -1 : 1;
+    }
+    if(a->port != b->port) return a->port - b->port;
+    if(a->node != b->node) return a->node - b->node;
+    if(a->function != b->function) return a->function - b->function;
+    if(a->interval != b->interval) return a->interval < b->interval ? -1 : 1;
+    if(a->m_register != b->m_register) return a->m_register - b->m_register;
+    return a->length - b->length;
+}
+
+/* Creates a block read that covers all of the given commands and adds it to
+ * the port's list of blocks */
+static int
+_add_block(mb_port *mp, mb_cmd **cmds, int count, uint16_t reg, uint16_t length)
+{
+    mb_cmd *blk, *node;
+    int n, result;
+
+    blk = mb_new_cmd(NULL);
+    if(blk == NULL) return MB_ERR_ALLOC;
+    result = mb_set_command(blk, cmds[0]->node, cmds[0]->function, reg, length);
+    if(result == 0) {
+        blk->members = malloc(sizeof(mb_cmd *) * count);
+        if(blk->members == NULL) result = MB_ERR_ALLOC;
+    }
+    if(result) {
+        mb_destroy_cmd(blk);
+        return result;
+    }
+    blk->mode = MB_CONTINUOUS;
+    blk->ip_address = cmds[0]->ip_address;
+    blk->port = cmds[0]->port;
+    blk->interval = cmds[0]->interval;
+    for(n = 0; n < count; n++) {
+        blk->members[n] = cmds[n];
+        cmds[n]->block = blk;
+    }
+    blk->member_count = count;
+
+    if(mp->blocks == NULL) {
+        mp->blocks = blk;
+    } else {
+        node = mp->blocks;
+        while(node->next != NULL) node = node->next;
+        node->next = blk;
+    }
+    return 0;
+}
+
+/* Looks through the commands on a master port and merges the read commands
+ * that can be read together into block reads.  Two commands are merged if
+ * there are no more than mp->maxgap registers between them and the block
+ * would still be a legal request.  This should be called once after all of
+ * the commands have been added and before the port is started. */
+int
+mb_plan_commands(mb_port *mp)
+{
+    mb_cmd **list, *mc, *first;
+    int count, n, i, lo, hi, end, result = 0;
+
+    if(mp->type != MB_MASTER || mp->maxgap < 0) return 0;
+    count = 0;
+    for(mc = mp->commands; mc != NULL; mc = mc->next) {
+        if(_can_merge(mc)) count++;
+    }
+    if(count < 2) return 0;
+    list = malloc(sizeof(mb_cmd *) * count);
+    if(list == NULL) return MB_ERR_ALLOC;
+    n = 0;
+    for(mc = mp->commands; mc != NULL; mc = mc->next) {
+        if(_can_merge(mc)) list[n++] = mc;
+    }
+    qsort(list, count, sizeof(mb_cmd *), _compare_cmd);
+
+    n = 0;
+    while(n < count) {
+        first = list[n];
+        lo = first->m_register;
+        hi = lo + first->length; /* One past the last register */
+        for(i = n + 1; i < count && _same_group(first, list[i]); i++) {
+            end = list[i]->m_register + list[i]->length;
+            if(list[i]->m_register > hi + mp->maxgap) break;
+            if(MAX(hi, end) - lo > _max_length(first->function)) break;
+            hi = MAX(hi, end);
+        }
+        if(i - n > 1) {
+            result = _add_block(mp, &list[n], i - n, lo, hi - lo);
+            if(result) break;
+        }
+        n = i;
+    }
+    free(list);
+    return result;
+}
+
+/* Returns the baudrate as a number from the termios speed */
+static int
+_baud_value(int baudrate)
+{
+    switch(baudrate) {
+        case B300: return 300;
+        case B600: return 600;
+        case B1200: return 1200;
+        case B1800: return 1800;
+        case B2400: return 2400;
+        case B4800: return 4800;
+        case B9600: return 9600;
+        case B19200: return 19200;
+        case B38400: return 38400;
+        case B57600: return 57600;
+#ifdef B76800
+        case B76800: return 76800;
+#endif
+        case B115200: return 115200;
+        default: return 0;
+    }
+}
+
+/* Number of bytes on the wire for the request and the response of a
+ * read command */
+static int
+_transaction_bytes(mb_port *mp, mb_cmd *mc)
+{
+    int data;
+
+    if(mc->function == 1 || mc->function == 2) {
+        data = (mc->length - 1) / 8 + 1;
+    } else {
+        data = mc->length * 2;
+    }
+    if(mp->protocol == MB_TCP) {
+        return 12 + 9 + data; /* MBAP header and no checksum */
+    }
+    return 8 + 5 + data;
+}
+
+/* Estimate of how long a transaction takes on a serial line in mSec.  This
+ * is the time to send both messages and the 3.5 character silent interval
+ * before each one plus the port's intercommand delay.  It doesn't include
+ * how long the slave takes to answer. */
+static double
+_transaction_time(mb_port *mp, mb_cmd *mc)
+{
+    int baud, bits;
+
+    baud = _baud_value(mp->baudrate);
+    if(baud == 0) return 0.0;
+    bits = 1 + mp->databits + mp->stopbits + (mp->parity == MB_NONE ? 0 : 1);
+    return (_transaction_bytes(mp, mc) + 7) * bits * 1000.0 / baud + mp->delay;
+}
+
+/* Prints the block reads for the port and how many requests and how much
+ * bus time they save on each scan */
+void
+mb_print_plan(FILE *fd, mb_port *mp)
+{
+    mb_cmd *blk;
+    int n, before = 0, after = 0, bbefore = 0, bafter = 0;
+    double tbefore = 0.0, tafter = 0.0;
+
+    fprintf(fd, "  Blk  Node  FC Register Len Cmds\n");
+    n = 0;
+    for(blk = mp->blocks; blk != NULL; blk = blk->next) {
+        fprintf(fd, " %4d  %4d  %2d %5d   %4d %3d\n", n++, blk->node, blk->function,
+                blk->m_register, blk->length, blk->member_count);
+        before += blk->member_count;
+        after++;
+        bafter += _transaction_bytes(mp, blk);
+        tafter += _transaction_time(mp, blk);
+        for(int i = 0; i < blk->member_count; i++) {
+            bbefore += _transaction_bytes(mp, blk->members[i]);
+            tbefore += _transaction_time(mp, blk->members[i]);
+        }
+    }
+    fprintf(fd, "Block reads replace %d requests with %d, %d bytes with %d\n",
+            before, after, bbefore, bafter);
+    if(mp->devtype == MB_SERIAL && tbefore > 0.0) {
+        fprintf(fd, "Estimated bus time saved: %.1f mSec of %.1f mSec\n",
+                tbefore - tafter, tbefore);
+    }
+}
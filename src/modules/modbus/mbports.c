@@ -19,6 +19,7 @@
  */
 
 #include "modbus.h"
+#include <poll.h>
 
 extern dax_state *ds;
 
@@ -49,9 +50,16 @@ initport(mb_port *p)
     p->input_size = 0;
     p->coil_size = 0;
     p->disc_size = 0;
-    p->buff_head = NULL;
-    FD_ZERO(&(p->fdset));
-    p->maxfd = 0;
+    bzero(&p->hold_tag, sizeof(tag_handle));
+    bzero(&p->input_tag, sizeof(tag_handle));
+    bzero(&p->coil_tag, sizeof(tag_handle));
+    bzero(&p->disc_tag, sizeof(tag_handle));
+    p->cache = 0;
+    bzero(p->image, sizeof(p->image));
+    p->epollfd = -1;
+    p->clients = NULL;
+    p->client_size = 0;
+    p->client_count = 0;
     p->running = 0;
     p->inhibit = 0;
     p->commands = NULL;
@@ -64,7 +72,15 @@ initport(mb_port *p)
     p->connection_size = MB_INIT_CONNECTION_SIZE;
     p->connection_count = 0;
     p->persist = 1;
+    p->window = 4;
+    p->maxgap = 0;
+    p->blocks = NULL;
+    p->scan = 0;
     pthread_mutex_init(&p->send_lock, NULL);
+    p->qhead = NULL;
+    p->qtail = NULL;
+    pthread_mutex_init(&p->queue_lock, NULL);
+    pthread_cond_init(&p->queue_cond, NULL);
 };
 
 static int
@@ -160,12 +176,13 @@ openport(mb_port *m_port)
     return fd;
 }
 
-/* Opens a IP socket instead of a serial port for both
-   the TCP protocol and the LAN protocol. */
-int
-openIPport(mb_port *mp, struct in_addr address, uint16_t port)
+/* Starts a connection on a non blocking IP socket for both the TCP protocol
+   and the LAN protocol.  Returns the file descriptor or -1 on failure.
+   *inprogress is set if the connection hasn't finished yet. */
+static int
+_start_connect(mb_port *mp, struct in_addr address, uint16_t port, int *inprogress)
 {
-    int fd = 0;
+    int fd = -1;
     struct sockaddr_in addr;
     int result;
 
@@ -174,20 +191,63 @@ openIPport(mb_port *mp, struct in_addr address, uint16_t port)
     } else if (mp->socket == UDP_SOCK) {
         fd = socket(AF_INET, SOCK_DGRAM, 0);
     }
+    if(fd < 0) return -1;
+
+    result = fcntl(fd, F_SETFL, O_NONBLOCK);
+    if(result) {
+        dax_error(ds, "Unable to set socket to non blocking");
+        close(fd);
+        return -1 ;
+    }
 
     addr.sin_family = AF_INET;
     addr.sin_addr = address;
     addr.sin_port = htons(port);
 
+    *inprogress = 0;
     result = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-
     if(result == -1) {
+        if(errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        *inprogress = 1;
+    }
+    return fd;
+}
+
+/* Checks the result of a connection that was in progress once the socket
+   is writable.  Returns zero if the connection was made and -1 otherwise */
+int
+mb_finish_connection(int fd)
+{
+    int error;
+    socklen_t len;
+
+    len = sizeof(error);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
         return -1;
     }
-    result = fcntl(fd, F_SETFL, O_NONBLOCK);
-    if(result) {
-        dax_error(ds, "Unable to set socket to non blocking");
-        return -1 ;
+    return 0;
+}
+
+/* Opens a IP socket instead of a serial port for both
+   the TCP protocol and the LAN protocol.  The socket is non blocking
+   and we only wait for the connection for the port timeout. */
+int
+openIPport(mb_port *mp, struct in_addr address, uint16_t port)
+{
+    int fd, inprogress;
+    struct pollfd pfd;
+
+    fd = _start_connect(mp, address, port, &inprogress);
+    if(fd < 0 || !inprogress) return fd;
+    /* Wait for the connection to finish */
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    if(poll(&pfd, 1, mp->timeout) != 1 || mb_finish_connection(fd)) {
+        close(fd);
+        return -1;
     }
     return fd;
 }
@@ -238,6 +298,7 @@ mb_destroy_port(mb_port *port)
 
     /* destroys all of the commands */
     _free_cmd(port->commands);
+    _free_cmd(port->blocks);
 }
 
 /* This function sets the port up as a normal serial port. 'device' is the system device file that represents
@@ -354,13 +415,13 @@ mb_close_port(mb_port *port)
 
     if(port->devtype == MB_NETWORK) {
         for(int n=0; n<port->connection_count; n++) {
-            result = close(port->connections[n].fd);
-            port->connections[n].addr.s_addr = 0x0000;
-            port->connections[n].port = 0;
-            port->connections[n].fd = 0;
-            if(result) {
-                dax_error(ds, "Error closing network file descriptor %d", port->connections[n].fd);
+            if(port->connections[n].fd > 0) {
+                result = close(port->connections[n].fd);
+                if(result) {
+                    dax_error(ds, "Error closing network file descriptor %d", port->connections[n].fd);
+                }
             }
+            bzero(&port->connections[n], sizeof(tcp_connection));
         }
         port->connection_count = 0;
     } else {
@@ -382,6 +443,19 @@ mb_set_maxfailures(mb_port *port, int maxfailures, int inhibit)
     return 0;
 }
 
+/* Sets the most requests that the TCP client will send on one connection
+ * before it waits for the responses.  Devices that can't handle more than
+ * one transaction at a time should use 1. */
+int
+mb_set_window(mb_port *port, int window)
+{
+    if(window < 1 || window > MB_MAX_WINDOW) {
+        return MB_ERR_BAD_ARG;
+    }
+    port->window = window;
+    return 0;
+}
+
 unsigned char
 mb_get_port_protocol(mb_port *port) {
     return port->protocol;
@@ -494,30 +568,93 @@ _get_next_connection(mb_port *mp) {
 
 /* This function retrieves a connection from the ports connection pool
  * if the conneciton does not exist then it attempts to make the connection
- * and stores that in the pool for later.  Returns the file descriptor
- * on success or an error otherwise*/
+ * and stores that in the pool for later.  Connections that have been dropped
+ * are opened again.  Returns the index of the connection in the pool on
+ * success or an error otherwise*/
 int
-mb_get_connection(mb_port *mp, struct in_addr address, uint16_t port) {
+mb_get_connection_index(mb_port *mp, struct in_addr address, uint16_t port) {
     int n, fd;
+    tcp_connection *tc;
 
     for(n=0;n<mp->connection_count;n++) {
-        if(mp->connections[n].addr.s_addr == address.s_addr && mp->connections[n].port == port) {
+        tc = &mp->connections[n];
+        if(tc->addr.s_addr == address.s_addr && tc->port == port) {
             /* We found one that matches */
-            DF("Found existing connection %d at index %d", mp->connections[n].fd, n)
-            return mp->connections[n].fd;
+            if(tc->fd > 0 && !tc->connecting) return n;
+            DF("Reopening connection at index %d", n);
+            if(tc->fd > 0) close(tc->fd);
+            tc->connecting = 0;
+            tc->fd = openIPport(mp, address, port);
+            if(tc->fd < 0) {
+                tc->fd = 0;
+                return MB_ERR_OPEN;
+            }
+            return n;
         }
     }
     /* If we get here we didn't find one */
     n = _get_next_connection(mp);
+    if(n < 0) return n;
     DF("Opening new connection at index %d", n);
     fd = openIPport(mp, address, port);
-    if(fd>=0) {
-        mp->connections[n].addr = address;
-        mp->connections[n].port = port;
-        mp->connections[n].fd = fd;
+    if(fd < 0) {
+        mp->connection_count--;
+        return MB_ERR_OPEN;
     }
+    bzero(&mp->connections[n], sizeof(tcp_connection));
+    mp->connections[n].addr = address;
+    mp->connections[n].port = port;
+    mp->connections[n].fd = fd;
     DF("Got connection %d\n", fd);
-    return fd;
+    return n;
+}
+
+/* Same as mb_get_connection_index() except that it doesn't wait for the
+ * connection to be made.  If the connection is still being made when this
+ * returns the connecting flag is set and the caller should wait for the
+ * socket to be writable and then call mb_finish_connection().  A connection
+ * that has the failed flag set is not tried again. */
+int
+mb_start_connection(mb_port *mp, struct in_addr address, uint16_t port) {
+    int n, fd, inprogress;
+    tcp_connection *tc;
+
+    for(n=0;n<mp->connection_count;n++) {
+        tc = &mp->connections[n];
+        if(tc->addr.s_addr == address.s_addr && tc->port == port) break;
+    }
+    if(n == mp->connection_count) {
+        n = _get_next_connection(mp);
+        if(n < 0) return n;
+        DF("Opening new connection at index %d", n);
+        tc = &mp->connections[n];
+        bzero(tc, sizeof(tcp_connection));
+        tc->addr = address;
+        tc->port = port;
+    } else {
+        if(tc->fd > 0) return n;
+        if(tc->failed) return MB_ERR_OPEN;
+        DF("Reopening connection at index %d", n);
+    }
+    fd = _start_connect(mp, address, port, &inprogress);
+    if(fd < 0) {
+        tc->failed = 1;
+        return MB_ERR_OPEN;
+    }
+    tc->fd = fd;
+    tc->connecting = inprogress;
+    if(inprogress) gettimeofday(&tc->started, NULL);
+    return n;
+}
+
+/* Same as above but returns the file descriptor of the connection */
+int
+mb_get_connection(mb_port *mp, struct in_addr address, uint16_t port) {
+    int n;
+
+    n = mb_get_connection_index(mp, address, port);
+    if(n < 0) return n;
+    return mp->connections[n].fd;
 }
 
 
@@ -592,6 +729,17 @@ mb_print_portconfig(FILE *fd, mb_port *mp)
     fprintf(fd, "Max Failures: %d\n", mp->maxattempts);
     fprintf(fd, "Inhibit Time: %d Seconds\n", mp->inhibit_time);
     fprintf(fd, "Persist Connection: %s\n", mp->persist ? "Yes" : "No");
+    if(mp->protocol == MB_TCP) {
+        fprintf(fd, "Window: %d\n", mp->window);
+    }
+    if(mp->maxgap >= 0) {
+        fprintf(fd, "Block Read Gap: %d\n", mp->maxgap);
+    } else {
+        fprintf(fd, "Block Reads: Disabled\n");
+    }
+    if(mp->type == MB_SLAVE) {
+        fprintf(fd, "Cache Tables: %s\n", mp->cache ? "Yes" : "No");
+    }
 
     mc = mp->commands;
     if(mc == NULL) fprintf(fd, "No commands configured for this port\n");
@@ -620,6 +768,9 @@ mb_print_portconfig(FILE *fd, mb_port *mp)
             }
         }
     }
+    if(mp->blocks != NULL) {
+        mb_print_plan(fd, mp);
+    }
     if(mp->type == MB_SLAVE) {
         fprintf(fd, "Slave ID: %d\n", mp->slaveid);
         fprintf(fd, "Coils: %d\n", mp->coil_size);
@@ -16,150 +16,235 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  * 
  * Source file for TCP Server functionality
+ *
+ * Each server port has it's own epoll instance that watches the listening
+ * socket and all of the connected clients.  The state for each client is
+ * kept in an array in the port that is indexed by the file descriptor.
+ * Every complete request that arrives with a read() is answered in order
+ * and the responses are sent together.  A partial request at the end of
+ * the buffer is kept until the rest of it arrives.  If a client isn't
+ * reading it's responses we stop reading it's requests until it does.
  */
 
 #include "modbus.h"
+#include <netinet/tcp.h>
+
+#ifndef HAVE_SYS_EPOLL_H
+# error "The Modbus TCP server requires epoll()"
+#endif
+#include <sys/epoll.h>
 
 extern dax_state *ds;
 
-/* These two functions are wrappers to deal with adding and deleting
-   file descriptors to the global _fdset and dealing with _maxfd */
-static void
-_add_fd(mb_port *port, int fd)
-{
-    FD_SET(fd, &(port->fdset));
-    if(fd > port->maxfd) port->maxfd = fd;
-}
+/* Maximum number of events that we'll retrieve with each epoll_wait() call */
+#define SERVER_EPOLL_EVENTS 64
+/* Starting size of the array of clients.  It doubles when it needs to */
+#define SERVER_START_CLIENTS 64
 
-static void
-_del_fd(mb_port *port, int fd)
+/* Changes the events that we are waiting for on a client socket.  We wait
+ * for it to be readable normally and writable when it's backed up. */
+static int
+_set_events(mb_port *port, int fd, uint32_t events)
 {
-    int n, tmpfd = 0;
-    
-    FD_CLR(fd, &(port->fdset));
-    
-    /* If it's the largest one then we need to re-figure _maxfd */
-    if(fd == port->maxfd) {
-        for(n = 0; n <= port->maxfd; n++) {
-            if(FD_ISSET(n, &(port->fdset))) {
-                tmpfd = n;
-            }
-        }
-        port->maxfd = tmpfd;
-    }
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(port->epollfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
 static int
 _add_connection(mb_port *port, int fd)
 {
-    struct client_buffer *new;
-
+    struct client_buffer *new, **newarray;
+    struct epoll_event ev;
+    int newsize, flag = 1;
+
+    if(fd >= port->client_size) {
+        newsize = port->client_size ? port->client_size : SERVER_START_CLIENTS;
+        while(newsize <= fd) newsize *= 2;
+        newarray = realloc(port->clients, newsize * sizeof(struct client_buffer *));
+        if(newarray == NULL) return MB_ERR_ALLOC;
+        bzero(&newarray[port->client_size], (newsize - port->client_size) * sizeof(struct client_buffer *));
+        port->clients = newarray;
+        port->client_size = newsize;
+    }
     new = malloc(sizeof(struct client_buffer));
     if(new == NULL) return MB_ERR_ALLOC;
-
     new->fd = fd;
     new->buffindex = 0;
-
-    if(port->buff_head == NULL) {
-        /* If it's the first one just put it on top */
-        new->next = NULL;
-    } else {
-        /* Just jam the thing onto the top of the list */
-        new->next = port->buff_head;
+    new->outindex = 0;
+    new->blocked = 0;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    /* The responses are small and the clients are waiting on them */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if(epoll_ctl(port->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(new);
+        return MB_ERR_SOCKET;
     }
-    port->buff_head = new;
-    _add_fd(port, fd);
+    port->clients[fd] = new;
+    port->client_count++;
     return 0;
 }
 
-/* Loops through the client buffer linked list of the port and sets
- * the index to 0, effectively deleting the buffers. */
 static int
-_clear_buffers(mb_port *port)
+_del_connection(mb_port *port, int fd)
 {
-    struct client_buffer *this;
-
-    this = port->buff_head;
-
-    while(this != NULL) {
-        this->buffindex = 0;
-        this = this->next;
+    epoll_ctl(port->epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    if(fd < port->client_size && port->clients[fd] != NULL) {
+        free(port->clients[fd]);
+        port->clients[fd] = NULL;
+        port->client_count--;
     }
     return 0;
 }
 
+/* Sends as much of the waiting responses as the socket will take.  Returns
+ * zero if they were all sent, 1 if some are still waiting or an error */
 static int
-_del_connection(mb_port *port, int fd)
+_flush(struct client_buffer *cc)
 {
-
-    close(fd);
-    _del_fd(port, fd);
-    return 0;
+    int result, sent = 0;
+
+    while(sent < cc->outindex) {
+        result = send(cc->fd, &cc->obuff[sent], cc->outindex - sent, MSG_NOSIGNAL);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return MB_ERR_NO_SOCKET;
+        }
+        sent += result;
+    }
+    if(sent) {
+        memmove(cc->obuff, &cc->obuff[sent], cc->outindex - sent);
+        cc->outindex -= sent;
+    }
+    return cc->outindex ? 1 : 0;
 }
 
-static struct client_buffer *
-_get_buff_ptr(mb_port *port, int fd)
+/* Answers every complete request in the receive buffer.  The responses are
+ * put in the send buffer and it is flushed whenever it might not have room
+ * for the next one.  If the socket won't take any more we stop and leave
+ * the rest of the requests in the buffer.  Returns 1 in that case. */
+static int
+_handle_requests(mb_port *port, struct client_buffer *cc)
 {
-    struct client_buffer *this;
+    int result = 0, offset = 0;
+    uint16_t msgsize;
+    unsigned char *frame, *out;
 
-    this = port->buff_head;
-    while(this != NULL) {
-        if(this->fd == fd) {
-            return this;
+    while(cc->buffindex - offset > 5) {
+        frame = &cc->buff[offset];
+        COPYWORD(&msgsize, (uint16_t *)&frame[4]); /* Get the Modbus Message size */
+        if(frame[2] != 0 || frame[3] != 0 || msgsize < 2 || msgsize + 6 > MB_TCP_ADU_LEN) {
+            return MB_ERR_OVERFLOW;
         }
-        this = this->next;
+        if(cc->buffindex - offset < msgsize + 6) break; /* Wait for the rest */
+        if(cc->outindex + MB_TCP_ADU_LEN > MB_CLIENT_BUFF_SIZE) {
+            result = _flush(cc);
+            if(result) break;
+        }
+        if(port->in_callback) {
+            port->in_callback(port, frame, msgsize + 6);
+        }
+        /* The response is built in the send buffer since it can be larger
+         * than the request and would run over the next one */
+        out = &cc->obuff[cc->outindex];
+        memcpy(out, frame, msgsize + 6);
+        offset += msgsize + 6;
+        result = create_response(port, &out[6], MB_TCP_ADU_LEN - 6);
+        if(result > 0) { /* We have a response */
+            msgsize = result;
+            COPYWORD(&out[4], &msgsize);
+            if(port->out_callback) {
+                port->out_callback(port, out, result + 6);
+            }
+            cc->outindex += result + 6;
+        } else if(result < 0) {
+            dax_error(ds, "Error Code Returned %d", result);
+        }
+        result = 0;
+    }
+    if(offset) {
+        memmove(cc->buff, &cc->buff[offset], cc->buffindex - offset);
+        cc->buffindex -= offset;
     }
-    return NULL;
+    return result;
+}
+
+/* Handles the requests that are waiting, sends the responses and then
+ * waits for the socket to be writable if it's full or readable if not */
+static int
+_service(mb_port *port, struct client_buffer *cc)
+{
+    int result;
+
+    result = _handle_requests(port, cc);
+    if(result < 0) return result;
+    if(result == 0 && cc->outindex) {
+        result = _flush(cc);
+        if(result < 0) return result;
+    }
+    if(result && !cc->blocked) {
+        cc->blocked = 1;
+        _set_events(port, cc->fd, EPOLLOUT);
+    } else if(!result && cc->blocked) {
+        cc->blocked = 0;
+        _set_events(port, cc->fd, EPOLLIN);
+    }
+    return 0;
 }
 
 static int
 _mb_read(mb_port *port, int fd)
 {
-    int result, size;
-    unsigned char buff[100];
+    int result;
     struct client_buffer *cc;
-    uint16_t msgsize;
+    struct timeval now;
 
-    size = 100;
-    result = read(fd, buff, size);
+    cc = port->clients[fd];
+    assert(cc != NULL); /* If we get this far cc should exist in the port */
+
+    gettimeofday(&now, NULL);
+    /* A partial request that has been sitting longer than the timeout
+     * isn't going to be finished so we throw it away */
+    if(cc->buffindex && ((now.tv_sec - cc->last.tv_sec) * 1000 +
+                         (now.tv_usec - cc->last.tv_usec) / 1000) > port->timeout) {
+        cc->buffindex = 0;
+    }
+    if(cc->buffindex == MB_CLIENT_BUFF_SIZE) { /* Shouldn't happen but read() would return 0 */
+        return _service(port, cc);
+    }
+    result = read(fd, &cc->buff[cc->buffindex], MB_CLIENT_BUFF_SIZE - cc->buffindex);
     if(result < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
         return MB_ERR_RECV_FAIL;
     } if(result == 0) { /* EOF means the other guy is closed */
         return MB_ERR_NO_SOCKET;
     }
-
-    cc = _get_buff_ptr(port, fd);
-    assert(cc != NULL); /* If we get this far cc should exist in the port */
-
-    /* Check that we haven't received too big of a message */
-    if((result + cc->buffindex) > MB_BUFF_SIZE) {
-        return MB_ERR_OVERFLOW;
-    }
-    memcpy(&(cc->buff[cc->buffindex]), buff, result); /* Copy the new data to the buffer */
     cc->buffindex += result;
-    if(cc->buffindex > 5) {
-        COPYWORD(&msgsize, (uint16_t *)&cc->buff[4]); /* Get the Modbus Message size */
-        if(cc->buffindex >= (msgsize + 6)) {
-            if(port->in_callback) {
-                port->in_callback(port, cc->buff, cc->buffindex);
-            }
+    cc->last = now;
+    return _service(port, cc);
+}
 
-            result = create_response(port, &(cc->buff[6]), MB_BUFF_SIZE - 6);
-            if(result > 0) { /* We have a response */
-                msgsize = result;
-                COPYWORD(&(cc->buff[4]), &msgsize);
-                if(port->out_callback) {
-                    port->out_callback(port, cc->buff, result + 6);
-                }
-                write(cc->fd, cc->buff, result + 6);
-                cc->buffindex = 0;
-            } else if(result < 0) {
-                fprintf(stderr, "Error Code Returned %d\n", result);
-                return result;
-            }
-        }
-    }
-    return 0;
+/* Called when a client that we couldn't send to is writable again */
+static int
+_mb_write(mb_port *port, int fd)
+{
+    struct client_buffer *cc;
+    int result;
+
+    cc = port->clients[fd];
+    assert(cc != NULL);
+    result = _flush(cc);
+    if(result) return result < 0 ? result : 0;
+    return _service(port, cc);
 }
 
 /* Open a socket to listen */
@@ -167,12 +252,14 @@ static int
 _server_listen(mb_port *port)
 {
     struct sockaddr_in addr;
-    int fd;
+    struct epoll_event ev;
+    int fd, flag = 1;
 
     fd = socket(AF_INET, SOCK_STREAM, 0);
     if(fd < 0) {
         return -1;
     }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
     bzero(&addr, sizeof(addr));
 
     addr.sin_family = AF_INET;
@@ -181,69 +268,107 @@ _server_listen(mb_port *port)
 
     if(bind(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
     	fprintf(stderr, "Failed to bind\n");
+        close(fd);
         return -1;
     }
-    if(listen(fd, 5) < 0) {
+    if(listen(fd, SOMAXCONN) < 0) {
     	fprintf(stderr, "Failed to listen\n");
+        close(fd);
+        return -1;
+    }
+    /* Edge triggered and non-blocking so that we can accept() all
+     * of the pending connections at once */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if(epoll_ctl(port->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
         return -1;
     }
     /* We store this fd so that we know what socket we are listening on */
     port->fd = fd;
-    _add_fd(port, fd);
 
     return 0;
 }
 
+/* Closes all of the connections and the sockets so that the server can
+ * be started again */
+static void
+_server_close(mb_port *port)
+{
+    int n;
+
+    for(n = 0; n < port->client_size; n++) {
+        if(port->clients[n] != NULL) {
+            _del_connection(port, n);
+        }
+    }
+    free(port->clients);
+    port->clients = NULL;
+    port->client_size = 0;
+    if(port->fd > 0) {
+        close(port->fd);
+        port->fd = 0;
+    }
+    close(port->epollfd);
+    port->epollfd = -1;
+}
+
 /* This function blocks waiting for a message to be received.  Once a message
  * is retrieved from the system the proper handling function is called */
 int
 _receive(mb_port *port)
 {
-    fd_set tmpset;
-    struct timeval tm;
+    struct epoll_event events[SERVER_EPOLL_EVENTS];
     struct sockaddr_in addr;
-    int result, fd, n;
-    socklen_t len = 0;
+    int count, result, fd, n;
+    socklen_t len;
 
-    FD_ZERO(&tmpset);
-    FD_COPY(&(port->fdset), &tmpset);
-    tm.tv_sec = 1; /* TODO: this should be configuration */
-    tm.tv_usec = 0;
+    /* TODO: the timeout should be configuration */
+    count = epoll_wait(port->epollfd, events, SERVER_EPOLL_EVENTS, 1000);
 
-    result = select(port->maxfd + 1, &tmpset, NULL, NULL, &tm);
-
-    if(result < 0) {
+    if(count < 0) {
         /* Ignore interruption by signal */
         if(errno == EINTR) {
-            ; /* TODO: check to see if we should die here */
+            return 0; /* TODO: check to see if we should die here */
         } else {
             /* TODO: Deal with these errors */
             return MB_ERR_RECV_FAIL;
         }
-    } else if(result == 0) { /* Timeout */
-        _clear_buffers(port); /* this erases all of the _buffer nodes */
-        return 0;
-    } else {
-        for(n = 0; n <= port->maxfd; n++) {
-            if(FD_ISSET(n, &tmpset)) {
-                if(n == port->fd) { /* This is a listening socket */
-                    fd = accept(n, (struct sockaddr *)&addr, &len);
-                    if(fd < 0) {
+    }
+    for(n = 0; n < count; n++) {
+        fd = events[n].data.fd;
+        if(fd == port->fd) { /* This is a listening socket */
+            /* Edge triggered so we have to accept them all */
+            while(1) {
+                len = sizeof(addr);
+                fd = accept(port->fd, (struct sockaddr *)&addr, &len);
+                if(fd < 0) {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                         /* TODO: Need to handle these communication errors */
                         dax_error(ds, "Error Accepting socket: %s", strerror(errno));
-                    } else {
-                        dax_debug(ds, LOG_MAJOR, "Accepted socket on fd %d", n);
-                        _add_connection(port, fd);
-                    }
-                } else {
-                    result = _mb_read(port, n);
-                    if(result == MB_ERR_NO_SOCKET) { /* This is the end of file */
-                        dax_debug(ds, LOG_MAJOR, "Accepted socket on fd %d", n);
-                        _del_connection(port, n);
-                    } else if(result < 0) {
-                        return result; /* Pass the error up */
                     }
+                    break;
                 }
+                dax_debug(ds, LOG_MAJOR, "Accepted socket on fd %d", fd);
+                if(_add_connection(port, fd)) {
+                    dax_error(ds, "Unable to add connection on fd %d", fd);
+                    close(fd);
+                }
+            }
+        } else if(fd < port->client_size && port->clients[fd] != NULL) {
+            if(port->clients[fd]->blocked) {
+                result = _mb_write(port, fd);
+            } else {
+                result = _mb_read(port, fd);
+            }
+            if(result == MB_ERR_OVERFLOW) {
+                dax_error(ds, "Bad message from client on fd %d", fd);
+                _del_connection(port, fd);
+            } else if(result < 0) { /* This is the end of file or an error */
+                dax_debug(ds, LOG_MAJOR, "Connection closed on fd %d", fd);
+                _del_connection(port, fd);
             }
         }
     }
@@ -256,23 +381,23 @@ server_loop(mb_port *port)
 {
     int result;
 
+    port->epollfd = epoll_create1(0);
+    if(port->epollfd < 0) {
+        dax_error(ds, "Unable to create epoll instance - %s", strerror(errno));
+        return MB_ERR_GENERIC;
+    }
     result = _server_listen(port);
     if(result) {
         dax_error(ds, "Failed to listen on port - %s", strerror(errno));
+        _server_close(port);
         return result;
     } else {
         dax_debug(ds, LOG_MAJOR, "Listening on file descriptor %d", port->fd);
     }
     while(1) {
         result = _receive(port);
-        if(result) {
-            if(result == MB_ERR_OVERFLOW) {
-                dax_error(ds, "Buffer Overflow Attempt");
-            } else {
-                return result;
-            }
-        }
+        if(result) break;
     }
-    return -1; /* Can never get here */
+    _server_close(port);
+    return result;
 }
-
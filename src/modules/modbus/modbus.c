@@ -20,6 +20,7 @@
 
 
 #include <sys/select.h>
+#include <poll.h>
 #include <pthread.h>
 #include "modbus.h"
 
@@ -27,6 +28,100 @@ extern dax_state *ds;
 
 int master_loop(mb_port *);
 int client_loop(mb_port *);
+static int _tcp_exchange(mb_port *, mb_cmd **, int);
+static void _block_update(mb_cmd *);
+
+/* Returns the command that should actually be sent for mc on this scan.
+ * Commands that are part of a block read send the block instead, but the
+ * block is only sent once on each scan.  Returns NULL if the block has
+ * already been sent. */
+static mb_cmd *
+_scan_target(mb_port *mp, mb_cmd *mc)
+{
+    if(mc->block == NULL) return mc;
+    if(mc->block->scan == mp->scan) return NULL;
+    mc->block->scan = mp->scan;
+    return mc->block;
+}
+
+/* Puts the command on the port's queue so that the port thread will send it
+ * ahead of the commands that are due on the scan.  This is called by the
+ * event callbacks.  A command that is already waiting in the queue is not
+ * added again.  It will go out with the latest data anyway. */
+void
+mb_queue_command(mb_port *mp, mb_cmd *mc)
+{
+    pthread_mutex_lock(&mp->queue_lock);
+    if(!mc->queued) {
+        mc->queued = 1;
+        mc->qnext = NULL;
+        if(mp->qtail == NULL) {
+            mp->qhead = mc;
+        } else {
+            mp->qtail->qnext = mc;
+        }
+        mp->qtail = mc;
+    }
+    pthread_cond_signal(&mp->queue_cond);
+    pthread_mutex_unlock(&mp->queue_lock);
+}
+
+/* Stores the data tag value that came with a change event in the write
+ * command.  Once this has been called the command sends this copy instead
+ * of reading the tag from the server before each request. */
+void
+mb_mirror_data(mb_port *mp, mb_cmd *mc, uint8_t *data, int size)
+{
+    pthread_mutex_lock(&mp->queue_lock);
+    if(mc->wdata == NULL) {
+        mc->wdata = calloc(1, mc->datasize);
+    }
+    if(mc->wdata != NULL) {
+        memcpy(mc->wdata, data, MIN(size, mc->datasize));
+    }
+    pthread_mutex_unlock(&mp->queue_lock);
+}
+
+/* Takes the first command off of the port's queue.  Returns NULL if the
+ * queue is empty */
+static mb_cmd *
+_dequeue(mb_port *mp)
+{
+    mb_cmd *mc;
+
+    pthread_mutex_lock(&mp->queue_lock);
+    mc = mp->qhead;
+    if(mc != NULL) {
+        mp->qhead = mc->qnext;
+        if(mp->qhead == NULL) mp->qtail = NULL;
+        mc->qnext = NULL;
+        mc->queued = 0;
+    }
+    pthread_mutex_unlock(&mp->queue_lock);
+    return mc;
+}
+
+/* Waits for the end of the scan that started at 'start' or until a command is
+ * queued on the port.  Returns 1 if there are commands to send and 0 if the
+ * scan time is up.  Queued commands are left alone while the port is paused
+ * or inhibited. */
+static int
+_port_wait(mb_port *mp, struct timeval *start)
+{
+    struct timespec deadline;
+    long usec;
+    int result = 0, queued;
+
+    usec = start->tv_usec + mp->scanrate * 1000L;
+    deadline.tv_sec = start->tv_sec + usec / 1000000;
+    deadline.tv_nsec = (usec % 1000000) * 1000;
+    pthread_mutex_lock(&mp->queue_lock);
+    while(!(queued = (mp->enable && !mp->inhibit && mp->qhead != NULL)) && result != ETIMEDOUT) {
+        result = pthread_cond_timedwait(&mp->queue_cond, &mp->queue_lock, &deadline);
+    }
+    pthread_mutex_unlock(&mp->queue_lock);
+    return queued;
+}
 
 /* Calculates the difference between the two times */
 unsigned long long
@@ -86,76 +181,145 @@ mb_run_port(struct mb_port *m_port)
 }
 
 
-/* This is the primary event loop for a Modbus TCP client.  It calls the functions
-   to send the request and receive the responses.  It also takes care of the
-   retries and the counters. */
+/* Sends the commands in 'due' together and updates the block reads */
+static void
+_client_send(mb_port *mp, mb_cmd **due, int count)
+{
+    int n;
+
+    pthread_mutex_lock(&mp->send_lock);
+    if(_tcp_exchange(mp, due, count) > 0) {
+        mp->attempt = 0; /* Good response, reset counter */
+    }
+    pthread_mutex_unlock(&mp->send_lock);
+    for(n = 0; n < count; n++) {
+        if(due[n]->members != NULL) _block_update(due[n]);
+    }
+}
+
+/* Sends everything that is in the port's queue at once.  The whole queue is
+ * taken in one go so a command can't show up in 'due' twice.  'due' has to
+ * be big enough to hold every command on the port. */
+static void
+_client_send_queue(mb_port *mp, mb_cmd **due)
+{
+    int count = 0;
+    mb_cmd *mc;
+
+    pthread_mutex_lock(&mp->queue_lock);
+    for(mc = mp->qhead; mc != NULL; mc = mc->qnext) {
+        mc->queued = 0;
+        if(mc->enable) due[count++] = mc;
+    }
+    mp->qhead = NULL;
+    mp->qtail = NULL;
+    pthread_mutex_unlock(&mp->queue_lock);
+    if(count) _client_send(mp, due, count);
+}
+
+/* This is the primary event loop for a Modbus TCP client.  It gathers up
+   all of the commands that are due on this scan and hands them to
+   _tcp_exchange() which sends them all at once and waits for the responses.
+   The retries and the counters are taken care of there.  Commands that the
+   tagserver events have queued are sent first and are also sent as soon as
+   they are queued while the port is waiting for the next scan. */
 int
 client_loop(mb_port *mp)
 {
     long time_spent;
-    struct mb_cmd *mc;
+    int count;
+    struct mb_cmd *mc, *target;
+    struct mb_cmd **due;
     struct timeval start, end;
 
     mp->running = 1; /* Tells the world that we are going */
     mp->attempt = 0;
     mp->dienow = 0;
 
+    /* The commands are all added before the port is started so this
+     * will be big enough for every command that can be due on a scan */
+    count = 0;
+    for(mc = mp->commands; mc != NULL; mc = mc->next) count++;
+    due = malloc(sizeof(mb_cmd *) * (count ? count : 1));
+    if(due == NULL) {
+        mp->running = 0;
+        return MB_ERR_ALLOC;
+    }
+
     while(1) {
         gettimeofday(&start, NULL);
+        mp->scan++;
         if(mp->enable) { /* If enable=0 then pause for the scanrate and try again. */
-            mc = mp->commands;
-
-            while(mc != NULL) {
+            _client_send_queue(mp, due);
+            count = 0;
+            for(mc = mp->commands; mc != NULL; mc = mc->next) {
                 /* Only if the command is enabled and the interval counter is over */
                 if(mc->enable && (mc->mode & MB_CONTINUOUS) && (++mc->icount >= mc->interval)) {
                     mc->icount = 0;
-                    if(mp->maxattempts) {
-                        mp->attempt++;
-                    }
-                    if( mb_send_command(mp, mc) > 0 ) {
-                        mp->attempt = 0; /* Good response, reset counter */
+                    if((target = _scan_target(mp, mc)) != NULL) {
+                        due[count++] = target;
                     }
-//                    if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
-//                        mp->inhibit_temp = 0;
-//                        mp->inhibit = 1;
-//                    }
                 }
-                if(mp->delay > 0) usleep(mp->delay * 1000);
-                mc = mc->next; /* get next command from the linked list */
-            } /* End of while for sending commands */
+            }
+            if(count) _client_send(mp, due, count);
         }
         /* This calculates the length of time that it took to send the messages on this port
-           and then subtracts that time from the port's scanrate and calls usleep to hold
-           for the right amount of time.  */
+           and then waits out the rest of the port's scanrate.  Queued commands are
+           sent while we wait. */
         gettimeofday(&end, NULL);
         time_spent = (end.tv_sec-start.tv_sec)*1000 + (end.tv_usec/1000 - start.tv_usec/1000);
         /* If it takes longer than the scanrate then just go again instead of sleeping */
         if(time_spent < mp->scanrate) {
             if(!mp->persist) {
+                pthread_mutex_lock(&mp->send_lock);
                 mb_close_port(mp);
+                pthread_mutex_unlock(&mp->send_lock);
             }
             mp->scanning = 0; /* We're going to assume this is atomic for now */
-            usleep((mp->scanrate - time_spent) * 1000);
+            while(_port_wait(mp, &start)) {
+                _client_send_queue(mp, due);
+                if(!mp->persist) {
+                    pthread_mutex_lock(&mp->send_lock);
+                    mb_close_port(mp);
+                    pthread_mutex_unlock(&mp->send_lock);
+                }
+            }
             mp->scanning = 1;
         }
     }
     /* Close the port */
     mb_close_port(mp);
+    free(due);
     mp->dienow = 0;
     mp->running = 0;
     return MB_ERR_PORTFAIL;
 }
 
 
+/* Sends the commands that the tagserver events have queued on the port */
+static void
+_master_send_queue(mb_port *mp)
+{
+    mb_cmd *mc;
+
+    while((mc = _dequeue(mp)) != NULL) {
+        if(mb_send_command(mp, mc) > 0) {
+            mp->attempt = 0; /* Good response, reset counter */
+        }
+        if(mp->delay > 0) usleep(mp->delay * 1000);
+    }
+}
+
 /* This is the primary event loop for a Modbus master.  It calls the functions
    to send the request and receive the responses.  It also takes care of the
-   retries and the counters. */
+   retries and the counters.  Queued commands go ahead of each command in the
+   scan and are sent as soon as they are queued while the port is waiting. */
 int
 master_loop(mb_port *mp)
 {
     long time_spent;
     int result;
-    struct mb_cmd *mc;
+    struct mb_cmd *mc, *target;
     struct timeval start, end;
     unsigned char bail = 0;
 
@@ -165,18 +329,26 @@ master_loop(mb_port *mp)
 
     while(1) {
         gettimeofday(&start, NULL);
+        mp->scan++;
         if(mp->enable && !mp->inhibit) { /* If enable=0 then pause for the scanrate and try again. */
             mc = mp->commands;
             while(mc != NULL && !bail) {
+                _master_send_queue(mp);
                 /* Only if the command is enabled and the interval counter is over */
                 if(mc->enable && (mc->mode & MB_CONTINUOUS) && (++mc->icount >= mc->interval)) {
                     mc->icount = 0;
+                    target = _scan_target(mp, mc);
+                    if(target == NULL) { /* Block was already read on this scan */
+                        mc = mc->next;
+                        continue;
+                    }
                     if(mp->maxattempts) {
                         mp->attempt++;
                     }
-                    if( mb_send_command(mp, mc) > 0 ) {
+                    if( mb_send_command(mp, target) > 0 ) {
                         mp->attempt = 0; /* Good response, reset counter */
                     }
+                    if(target->members != NULL) _block_update(target);
                     if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
                         bail = 1;
                         mp->inhibit_temp = 0;
@@ -199,8 +371,8 @@ master_loop(mb_port *mp)
             }
         }
         /* This calculates the length of time that it took to send the messages on this port
-           and then subtracts that time from the port's scanrate and calls usleep to hold
-           for the right amount of time.  */
+           and then waits out the rest of the port's scanrate.  Queued commands are
+           sent while we wait. */
         gettimeofday(&end, NULL);
         time_spent = (end.tv_sec-start.tv_sec)*1000 + (end.tv_usec/1000 - start.tv_usec/1000);
         /* If it takes longer than the scanrate then just go again instead of sleeping */
@@ -208,7 +380,9 @@ master_loop(mb_port *mp)
             if(!mp->persist) {
                 mb_close_port(mp);
             }
-            usleep((mp->scanrate - time_spent) * 1000);
+            while(_port_wait(mp, &start)) {
+                _master_send_queue(mp);
+            }
         }
     }
     /* Close the port */
@@ -254,7 +428,7 @@ sendRTUrequest(mb_port *mp, mb_cmd *cmd)
             }
             break;
         case 6:
-            temp = *cmd->data;
+            temp = *(uint16_t *)cmd->data;
             /* If the command is contiunous go, if conditional then
              check the last checksum against the current datatable[] */
             if(cmd->enable == MB_CONTINUOUS || (temp != cmd->lastcrc)) {
@@ -388,17 +562,18 @@ getASCIIresponse(uint8_t *buff, mb_port *mp)
     return 0;
 }
 
-/* This function formulates and sends the Modbus TCP client request */
+/* This function formulates the Modbus TCP client request in buff with the
+ * given transaction ID.  Returns the length of the message or 0 if the
+ * command doesn't need to be sent */
 static int
-sendTCPrequest(mb_port *mp, mb_cmd *cmd)
+buildTCPrequest(uint8_t *buff, mb_cmd *cmd, uint16_t tid)
 {
-    uint8_t buff[MB_FRAME_LEN];
-    uint16_t crc, temp, length;
+    uint16_t crc, temp, length = 0;
 
     /* build the request message */
     /* MBAP Header minus the length.  We'll set it later */
-    buff[0] = 0x77;  /* Transaction ID */
-    buff[1] = 0x70;  /* Transaction ID */
+    buff[0] = tid >> 8;   /* Transaction ID */
+    buff[1] = tid & 0xFF; /* Transaction ID */
     buff[2] = 0x00;  /* Protocol ID */
     buff[3] = 0x00;  /* Protocol ID */
     /* Modbus RTU PDU */
@@ -420,7 +595,7 @@ sendTCPrequest(mb_port *mp, mb_cmd *cmd)
                 COPYWORD(&buff[8], &cmd->m_register);
                 if(temp) buff[10] = 0xff;
                 else     buff[10] = 0x00;
-                buff[5] = 0x00;
+                buff[11] = 0x00;
                 cmd->firstrun = 1;
                 cmd->lastcrc = temp;
                 length = 6;
@@ -430,7 +605,7 @@ sendTCPrequest(mb_port *mp, mb_cmd *cmd)
             }
             break;
         case 6: /* Write single Holding Register */
-            temp = *cmd->data;
+            temp = *(uint16_t *)cmd->data;
             /* If the command is continuous go, if conditional then
              check the last checksum against the current datatable[] */
             if(cmd->enable == MB_CONTINUOUS || (temp != cmd->lastcrc)) {
@@ -457,7 +632,6 @@ sendTCPrequest(mb_port *mp, mb_cmd *cmd)
                 COPYWORD(&buff[8], &cmd->m_register);
                 COPYWORD(&buff[10], &cmd->length);
                 buff[12] = (cmd->length-1)/8 + 1;
-                printf("Bytes = %d\n", buff[12]);
                 for(int n = 0; n < buff[12]; n++) {
                     buff[13+n] = cmd->data[n];
                 }
@@ -488,60 +662,12 @@ sendTCPrequest(mb_port *mp, mb_cmd *cmd)
         default:
             break;
     }
+    if(length == 0) return 0;
     /* Go back and put the length in the MBAP Header */
     COPYWORD(&buff[4], &length);
-    /* Send Request */
-    cmd->requests++; /* Increment the request counter */
-    tcflush(mp->fd, TCIOFLUSH);
-    /* Send the buffer to the callback routine. */
-    if(mp->out_callback) {
-        mp->out_callback(mp, buff, length + 6);
-    }
-
-    return write(mp->fd, buff, length + 6);
-}
-
-/*
- * This function immediately tries to read data from the file handle.
-
- * Returns 0 on timeout
- * Returns the length of the message on success
- */
-static int
-getTCPresponse(uint8_t *buff, mb_port *mp)
-{
-    uint8_t tempbuff[MB_FRAME_LEN];
-    struct timeval timeout;
-    int result;
-    fd_set readfs, errfs;
-
-
-    timeout.tv_usec = (mp->timeout % 1000) * 1000;
-    timeout.tv_sec = mp->timeout / 1000;
-    FD_ZERO(&readfs);
-    FD_SET(mp->fd, &readfs);
-    FD_ZERO(&errfs);
-    FD_SET(mp->fd, &errfs);
-    result = select(mp->fd+1, &readfs, NULL, &errfs, &timeout);
-    if(FD_ISSET(mp->fd, &readfs)) {
-        /* TODO Can we really assume that we'll get the whole thing in one read() */
-        result = read(mp->fd, tempbuff, MB_BUFF_SIZE);
-    }
-    if(result > 0) { /* Is there any data in buffer? */
-        if(mp->in_callback) {
-            mp->in_callback(mp, tempbuff, result);
-        }
-        /* We have to convert the TCP message to it's RTU equivalent,
-         * because that is what the calling function is expecting. */
-        result -= 6;
-        memcpy(buff, &tempbuff[6], result);
-    }
-    return result;
+    return length + 6;
 }
 
-
-
-
 /*!
  * This function takes the message buffer and the current command and
  * determines what to do with the message.  It may write data to the
@@ -589,16 +715,25 @@ handleresponse(uint8_t *buff, mb_cmd *cmd)
 }
 
 /* This function is called before a write command request is sent.  It's purpose
- * is to read the data from the tagserver and put it in the command buffer.  First
- * it checks to see if we have already retrieved our handle from the
- * tag server.  If not then we attempt to retrieve it.  Then we make sure that
+ * is to read the data from the tagserver and put it in the command buffer.  If
+ * the change events are keeping a copy of the tag in the command then that is
+ * used and the server isn't asked at all.  Otherwise it first checks to see
+ * if we have already retrieved our handle from the tag server.  If not then we attempt to retrieve it.  Then we make sure that
  * the sizes of the tag and the command buffer are the same and adjust if necessary.
  * If the handles has been retrieved then we simply read the data from the
  * tagserver and put it in the command data buffer so that it can be sent. */
 static int
-_get_write_data(mb_cmd *mc) {
+_get_write_data(mb_port *mp, mb_cmd *mc) {
     int result;
 
+    pthread_mutex_lock(&mp->queue_lock);
+    if(mc->wdata != NULL) {
+        memcpy(mc->data, mc->wdata, mc->datasize);
+        pthread_mutex_unlock(&mp->queue_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&mp->queue_lock);
+
     if(mc->data_h.index == 0) {
         result = dax_tag_handle(ds, &mc->data_h, mc->data_tag, mc->tagcount);
         if(result) return result;
@@ -614,6 +749,55 @@ _get_write_data(mb_cmd *mc) {
     return dax_read_tag(ds, mc->data_h, mc->data);
 }
 
+static int _send_read_data(mb_cmd *mc);
+
+/* Copies the data that came back for a block read out to each of the commands
+ * that make up the block and sends it to the tag server */
+static int
+_scatter_block(mb_cmd *blk)
+{
+    mb_cmd *mc;
+    int n, i, bit, result = 0;
+
+    for(n = 0; n < blk->member_count; n++) {
+        mc = blk->members[n];
+        if(!mc->enable) continue;
+        bit = mc->m_register - blk->m_register;
+        if(mc->function == 3 || mc->function == 4) {
+            memcpy(mc->data, &blk->data[bit * 2], mc->length * 2);
+        } else {
+            for(i = 0; i < mc->length; i++, bit++) {
+                if(blk->data[bit / 8] & (0x01 << (bit % 8))) {
+                    mc->data[i / 8] |= (0x01 << (i % 8));
+                } else {
+                    mc->data[i / 8] &= ~(0x01 << (i % 8));
+                }
+            }
+        }
+        if(_send_read_data(mc)) result = MB_ERR_GENERIC;
+    }
+    return result;
+}
+
+/* After a block read has been sent the status of the block is copied to
+ * each of the commands so they look the same as if they had been sent */
+static void
+_block_update(mb_cmd *blk)
+{
+    mb_cmd *mc;
+    int n;
+
+    for(n = 0; n < blk->member_count; n++) {
+        mc = blk->members[n];
+        mc->requests = blk->requests;
+        mc->responses = blk->responses;
+        mc->timeouts = blk->timeouts;
+        mc->crcerrors = blk->crcerrors;
+        mc->exceptions = blk->exceptions;
+        mc->lasterror = blk->lasterror;
+    }
+}
+
 /* This function is called after a command response has been received.  It's purpose
  * is to put the data into the tagserver.  It first checks to see if we have already
  * retrieved our handle from the tag server.  If not then we attempt to retrieve it.
@@ -624,6 +808,8 @@ static int
 _send_read_data(mb_cmd *mc) {
     int result;
 
+    if(mc->members != NULL) return _scatter_block(mc);
+
     if(mc->data_h.index == 0) {
         result = dax_tag_handle(ds, &mc->data_h, mc->data_tag, mc->tagcount);
         if(result) return result;
@@ -640,6 +826,336 @@ _send_read_data(mb_cmd *mc) {
 }
 
 
+/* These are the functions for the Modbus TCP client.  Rather than sending
+ * one request and waiting for it's response before sending the next, the
+ * client sends the requests for all of the commands at once, to all of the
+ * servers, and then matches the responses to the requests by the transaction
+ * ID in the MBAP header.  Each connection can have up to mp->window requests
+ * waiting for a response.  Those requests are kept in the connection's
+ * window[] array at their transaction ID modulo MB_MAX_WINDOW.  The commands
+ * that still need to be sent are kept in a simple ring. */
+typedef struct tcp_queue {
+    mb_cmd **cmds;
+    int size;
+    int head;
+    int count;
+} tcp_queue;
+
+static inline void
+_queue_push(tcp_queue *q, mb_cmd *mc)
+{
+    q->cmds[(q->head + q->count++) % q->size] = mc;
+}
+
+static inline mb_cmd *
+_queue_pop(tcp_queue *q)
+{
+    mb_cmd *mc;
+
+    mc = q->cmds[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    return mc;
+}
+
+/* Returns the number of milliseconds between the two times */
+static inline long
+_msec_since(struct timeval *then, struct timeval *now)
+{
+    return (now->tv_sec - then->tv_sec) * 1000 + (now->tv_usec - then->tv_usec) / 1000;
+}
+
+/* The request for this command didn't get a response.  We put it back in the
+ * queue to be sent again if it has any retries left */
+static void
+_tcp_fail(mb_port *mp, tcp_queue *q, mb_cmd *mc)
+{
+    mc->timeouts++;
+    mc->lasterror = ME_TIMEOUT;
+    if(mc->tries <= mp->retries) {
+        _queue_push(q, mc);
+    }
+}
+
+/* Closes the connection and fails all the requests that are waiting on it.
+ * They'll be sent again on a new connection.  Returns the number of requests
+ * that were taken out of the window */
+static int
+_tcp_drop(mb_port *mp, tcp_queue *q, tcp_connection *tc)
+{
+    int n, count = 0;
+    mb_cmd *mc;
+
+    for(n = 0; n < MB_MAX_WINDOW; n++) {
+        mc = tc->window[n];
+        if(mc != NULL) {
+            tc->window[n] = NULL;
+            count++;
+            _tcp_fail(mp, q, mc);
+        }
+    }
+    close(tc->fd);
+    tc->fd = 0;
+    tc->inflight = 0;
+    tc->buffindex = 0;
+    return count;
+}
+
+/* The connection couldn't be made.  The commands that are waiting on it will
+ * be failed the next time that they come out of the queue */
+static void
+_tcp_connect_fail(tcp_connection *tc)
+{
+    close(tc->fd);
+    tc->fd = 0;
+    tc->connecting = 0;
+    tc->failed = 1;
+}
+
+/* Builds the request for the command and sends it on the connection with a
+ * transaction ID that lands on an empty spot in the window.  The caller should
+ * make sure that there is room in the window.  Returns 1 if the request was
+ * sent, 0 if the command doesn't need to be sent and an error otherwise */
+static int
+_tcp_send(mb_port *mp, tcp_connection *tc, mb_cmd *mc)
+{
+    uint8_t buff[MB_FRAME_LEN];
+    int length, result;
+
+    /* Retrieve the data from the tag server the first time */
+    if(mc->tries == 0 && mb_is_write_cmd(mc)) {
+        _get_write_data(mp, mc);
+    }
+    while(tc->window[tc->tid % MB_MAX_WINDOW] != NULL) tc->tid++;
+    length = buildTCPrequest(buff, mc, tc->tid);
+    if(length == 0) return 0;
+
+    mc->tid = tc->tid++;
+    mc->tries++;
+    mc->requests++; /* Increment the request counter */
+    /* Send the buffer to the callback routine. */
+    if(mp->out_callback) {
+        mp->out_callback(mp, buff, length);
+    }
+    result = write(tc->fd, buff, length);
+    if(result != length) {
+        return MB_ERR_GENERIC;
+    }
+    gettimeofday(&mc->sent, NULL);
+    tc->window[mc->tid % MB_MAX_WINDOW] = mc;
+    tc->inflight++;
+    return 1;
+}
+
+/* Handles a response that has been matched to it's command */
+static void
+_tcp_response(mb_cmd *mc, uint8_t *buff)
+{
+    int result;
+
+    result = handleresponse(buff, mc); /* Returns 0 on success + on failure */
+    if(result > 0) {
+        mc->exceptions++;
+        mc->lasterror = result | ME_EXCEPTION;
+    } else { /* Everything is good */
+        mc->lasterror = 0;
+        /* Send the data to the tag server */
+        if(mb_is_read_cmd(mc)) {
+            _send_read_data(mc);
+        }
+    }
+}
+
+/* Reads whatever is waiting on the connection and handles every complete
+ * response that is in the buffer.  A response that doesn't match a request
+ * in the window is a late response to a request that has already timed out
+ * and is thrown away.  Returns the number of responses that were matched or
+ * an error if the connection should be dropped. */
+static int
+_tcp_receive(mb_port *mp, tcp_connection *tc)
+{
+    int result, length, offset, count = 0;
+    uint16_t tid;
+    uint8_t *frame;
+    mb_cmd *mc;
+
+    result = read(tc->fd, &tc->buff[tc->buffindex], MB_FRAME_LEN - tc->buffindex);
+    if(result == 0) return MB_ERR_RECV_FAIL; /* The server closed the connection */
+    if(result < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return MB_ERR_RECV_FAIL;
+    }
+    tc->buffindex += result;
+    offset = 0;
+    while(tc->buffindex - offset >= 6) {
+        frame = &tc->buff[offset];
+        length = (frame[4] << 8) | frame[5];
+        /* If the header doesn't make sense we've lost our place in the stream */
+        if(frame[2] != 0 || frame[3] != 0 || length < 2 || length + 6 > MB_TCP_ADU_LEN) {
+            return MB_ERR_RECV_FAIL;
+        }
+        if(tc->buffindex - offset < length + 6) break; /* Wait for the rest */
+        if(mp->in_callback) {
+            mp->in_callback(mp, frame, length + 6);
+        }
+        tid = (frame[0] << 8) | frame[1];
+        mc = tc->window[tid % MB_MAX_WINDOW];
+        if(mc != NULL && mc->tid == tid) {
+            tc->window[tid % MB_MAX_WINDOW] = NULL;
+            tc->inflight--;
+            /* handleresponse() expects an RTU message which is what
+             * follows the MBAP header less the checksum */
+            _tcp_response(mc, &frame[6]);
+            count++;
+        }
+        offset += length + 6;
+    }
+    if(offset) {
+        memmove(tc->buff, &tc->buff[offset], tc->buffindex - offset);
+        tc->buffindex -= offset;
+    }
+    return count;
+}
+
+/* Sends the requests for all of the commands in cmds[] and waits until every
+ * one of them has either gotten a response or has run out of retries.  The
+ * time that this takes is about the time it takes the slowest server to
+ * answer instead of the sum of them all.  Returns the number of responses
+ * that were received, or MB_ERR_OPEN if there were none and we couldn't
+ * connect to one of the servers. */
+static int
+_tcp_exchange(mb_port *mp, mb_cmd **cmds, int count)
+{
+    mb_cmd *ring[count];
+    mb_cmd *mc;
+    tcp_queue q;
+    tcp_connection *tc;
+    struct pollfd pfds[mp->connection_count + count];
+    int pconn[mp->connection_count + count];
+    struct timeval now;
+    long wait, age;
+    int n, i, pending, nfds, result;
+    int inflight = 0, responses = 0, openfail = 0;
+
+    q.cmds = ring;
+    q.size = count;
+    q.head = 0;
+    q.count = 0;
+    for(n = 0; n < count; n++) {
+        cmds[n]->tries = 0;
+        _queue_push(&q, cmds[n]);
+    }
+    /* Servers that couldn't be reached last time get tried again */
+    for(n = 0; n < mp->connection_count; n++) {
+        mp->connections[n].failed = 0;
+    }
+
+    while(q.count || inflight) {
+        /* Send everything that there is room for in the windows */
+        pending = q.count;
+        while(pending--) {
+            mc = _queue_pop(&q);
+            n = mb_start_connection(mp, mc->ip_address, mc->port);
+            if(n < 0) {
+                /* Count it as a request that timed out so that the command's
+                 * status shows that the server can't be reached.  The connect
+                 * is only tried once per exchange so the rest of the commands
+                 * for the same server fail right away. */
+                openfail++;
+                mc->requests++;
+                mc->timeouts++;
+                mc->lasterror = ME_TIMEOUT;
+                continue;
+            }
+            tc = &mp->connections[n];
+            if(tc->connecting || tc->inflight >= mp->window) {
+                _queue_push(&q, mc); /* We'll get it next time around */
+                continue;
+            }
+            result = _tcp_send(mp, tc, mc);
+            if(result > 0) {
+                inflight++;
+                if(mp->delay > 0) usleep(mp->delay * 1000);
+            } else if(result < 0) {
+                inflight -= _tcp_drop(mp, &q, tc);
+                _tcp_fail(mp, &q, mc);
+            }
+        }
+        /* Wait for responses and connections but only until the oldest
+         * request or connection times out */
+        gettimeofday(&now, NULL);
+        wait = mp->timeout;
+        nfds = 0;
+        for(n = 0; n < mp->connection_count; n++) {
+            tc = &mp->connections[n];
+            if(tc->connecting) {
+                pfds[nfds].fd = tc->fd;
+                pfds[nfds].events = POLLOUT;
+                pconn[nfds++] = n;
+                age = _msec_since(&tc->started, &now);
+                if(mp->timeout - age < wait) wait = mp->timeout - age;
+                continue;
+            }
+            if(tc->inflight == 0) continue;
+            pfds[nfds].fd = tc->fd;
+            pfds[nfds].events = POLLIN;
+            pconn[nfds++] = n;
+            for(i = 0; i < MB_MAX_WINDOW; i++) {
+                if(tc->window[i] != NULL) {
+                    age = _msec_since(&tc->window[i]->sent, &now);
+                    if(mp->timeout - age < wait) wait = mp->timeout - age;
+                }
+            }
+        }
+        if(nfds == 0) continue;
+        if(wait < 0) wait = 0;
+        result = poll(pfds, nfds, wait);
+        if(result < 0 && errno != EINTR) {
+            dax_error(ds, "Poll failed on port %s - %s", mp->name, strerror(errno));
+        }
+        for(i = 0; result > 0 && i < nfds; i++) {
+            if(pfds[i].revents == 0) continue;
+            tc = &mp->connections[pconn[i]];
+            if(tc->connecting) {
+                if(mb_finish_connection(tc->fd)) {
+                    _tcp_connect_fail(tc);
+                } else {
+                    tc->connecting = 0;
+                }
+                continue;
+            }
+            n = _tcp_receive(mp, tc);
+            if(n < 0) {
+                inflight -= _tcp_drop(mp, &q, tc);
+            } else {
+                inflight -= n;
+                responses += n;
+            }
+        }
+
+        /* Anything that has waited longer than the timeout is a timeout */
+        gettimeofday(&now, NULL);
+        for(n = 0; n < mp->connection_count; n++) {
+            tc = &mp->connections[n];
+            if(tc->connecting && _msec_since(&tc->started, &now) >= mp->timeout) {
+                _tcp_connect_fail(tc);
+            }
+            for(i = 0; tc->inflight && i < MB_MAX_WINDOW; i++) {
+                mc = tc->window[i];
+                if(mc != NULL && _msec_since(&mc->sent, &now) >= mp->timeout) {
+                    tc->window[i] = NULL;
+                    tc->inflight--;
+                    inflight--;
+                    _tcp_fail(mp, &q, mc);
+                }
+            }
+        }
+    }
+    if(responses == 0 && openfail) return MB_ERR_OPEN;
+    return responses;
+}
+
+
 /*!
  * External function to send a Modbus commaond (mc) to port (mp).  The function
  * sets some function pointers to the functions that handle the port protocol and
@@ -654,6 +1170,7 @@ mb_send_command(mb_port *mp, mb_cmd *mc)
     uint8_t buff[MB_FRAME_LEN]; /* Modbus Frame buffer */
     int try = 1;
     int result, msglen;
+    unsigned int requests;
     static int (*sendrequest)(struct mb_port *, struct mb_cmd *) = NULL;
     static int (*getresponse)(uint8_t *,struct mb_port *) = NULL;
 
@@ -668,25 +1185,23 @@ mb_send_command(mb_port *mp, mb_cmd *mc)
         sendrequest = sendASCIIrequest;
         getresponse = getASCIIresponse;
     } else if(mp->protocol == MB_TCP) {
-        sendrequest = sendTCPrequest;
-        getresponse = getTCPresponse;
+        /* TCP commands go through the same machinery as the client loop */
+        pthread_mutex_lock(&mp->send_lock);
+        requests = mc->requests;
+        result = _tcp_exchange(mp, &mc, 1);
+        if(!mp->scanning && !mp->persist) mb_close_port(mp);
+        pthread_mutex_unlock(&mp->send_lock);
+        if(result != 0) return result;
+        /* Should be 0 when a conditional command simply doesn't run */
+        if(mc->requests == requests) return 0;
+        return 0 - mc->lasterror;
     } else {
         return -1;
     }
     pthread_mutex_lock(&mp->send_lock);
-    if(mp->protocol == MB_TCP) {
-        /* We get our fd from the pool for TCP connections and put it in the
-         * port fd.  This just keeps it consistent with the serial port functions
-         * so that we don't have to pass the fd to the send/get functions */
-        mp->fd = mb_get_connection(mp, mc->ip_address, mc->port);
-        if(mp->fd < 0) {
-            pthread_mutex_unlock(&mp->send_lock);
-            return MB_ERR_OPEN;
-        }
-    }
     /* Retrieve the data from the tag server */
     if(mb_is_write_cmd(mc)) {
-        result = _get_write_data(mc);
+        result = _get_write_data(mp, mc);
     }
     do { /* retry loop */
         result = sendrequest(mp, mc);
@@ -753,9 +1268,6 @@ _read_bits_response(mb_port *port, unsigned char *buff, int size, int mbreg)
 
     COPYWORD(&index, (uint16_t *)&buff[2]); /* Starting Address */
     COPYWORD(&count, (uint16_t *)&buff[4]); /* Number of disc/coils requested */
-    if(port->slave_read) { /* Call the callback function if it has been set */
-        port->slave_read(port, mbreg, index, count, reg);
-    }
     if(mbreg == MB_REG_COIL) {
         regsize = port->coil_size;
     } else {
@@ -768,6 +1280,10 @@ _read_bits_response(mb_port *port, unsigned char *buff, int size, int mbreg)
     if((index + count) > regsize) {
         return _create_exception(buff, ME_BAD_ADDRESS);
     }
+    /* The callback is only called once we know the request is inside the table */
+    if(port->slave_read) {
+        port->slave_read(port, mbreg, index, count, reg);
+    }
     buff[2] = (count - 1)/8+1;
 
     bit = 0;
@@ -803,9 +1319,6 @@ _read_words_response(mb_port *port, unsigned char *buff, int size, int mbreg)
 
     COPYWORD(&index, (uint16_t *)&buff[2]); /* Starting Address */
     COPYWORD(&count, (uint16_t *)&buff[4]); /* Number of words/coils */
-    if(port->slave_read) { /* Call the callback function if it has been set */
-        port->slave_read(port, mbreg, index, count, reg);
-    }
     if(mbreg == MB_REG_HOLDING) {
         regsize = port->hold_size;
     } else {
@@ -818,6 +1331,9 @@ _read_words_response(mb_port *port, unsigned char *buff, int size, int mbreg)
     if((index + count) > regsize) {
         return _create_exception(buff, ME_BAD_ADDRESS);
     }
+    if(port->slave_read) {
+        port->slave_read(port, mbreg, index, count, reg);
+    }
     buff[2] = count * 2;
     for(n = 0; n < count; n++) {
         COPYWORD(&buff[3+(n*2)], &reg[n]);
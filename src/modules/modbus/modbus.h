@@ -151,23 +151,50 @@
 #define MB_INIT_CONNECTION_SIZE 16
 /* Maximum number of connections that can be in the pool */
 #define MB_MAX_CONNECTION_SIZE 2048
-
-/* This is used in the port for client connections for the TCP Server */
+/* The most requests that the TCP client can have waiting for a response on
+ * one connection.  The requests are kept in the connection at their
+ * transaction ID modulo this number so it should be a power of two. */
+#define MB_MAX_WINDOW 16
+/* Largest Modbus TCP message, MBAP header and all */
+#define MB_TCP_ADU_LEN 260
+
+/* Size of the receive and send buffers for each client of the TCP server.
+ * They hold several messages so that a client can send requests back to
+ * back without waiting for each response. */
+#define MB_CLIENT_BUFF_SIZE (MB_TCP_ADU_LEN * 4)
+
+/* This is used in the port for client connections for the TCP Server.  The
+ * port keeps an array of pointers to these indexed by file descriptor. */
 struct client_buffer {
     int fd;                /* File descriptor of the socket */
     int buffindex;         /* index where the next character will be placed */
-    unsigned char buff[MB_BUFF_SIZE];   /* data buffer */
-    struct client_buffer *next;
+    int outindex;          /* Number of bytes in obuff that haven't been sent */
+    uint8_t blocked;       /* The socket is full and we are waiting to send */
+    struct timeval last;   /* When data last arrived */
+    unsigned char buff[MB_CLIENT_BUFF_SIZE];  /* Requests */
+    unsigned char obuff[MB_CLIENT_BUFF_SIZE]; /* Responses waiting to be sent */
 };
 
 /* This structure represents a single connection to a TCP server.
  * There is a dynamic array of these in the port that are basically
- * used as a connection pool. If fd is not zero then we are connected.
+ * used as a connection pool. If fd is not zero then we are connected or
+ * the connection is being made if the connecting flag is set.
+ * The requests that have been sent on the connection and are waiting
+ * for a response are kept in window[] so that the responses can be
+ * matched to them by the transaction ID.
  */
 typedef struct tcp_connection {
     struct in_addr addr;
     uint16_t port;
     int fd;
+    uint16_t tid;                         /* Next transaction ID to use */
+    uint8_t connecting;                   /* The connect hasn't finished yet */
+    uint8_t failed;                       /* The connect failed on this exchange */
+    struct timeval started;               /* When the connect was started */
+    int inflight;                         /* Number of requests in window[] */
+    struct mb_cmd *window[MB_MAX_WINDOW]; /* Requests waiting for a response */
+    int buffindex;                        /* Number of bytes in buff[] */
+    uint8_t buff[MB_FRAME_LEN];           /* Partial responses */
 } tcp_connection;
 
 
@@ -198,6 +225,18 @@ typedef struct mb_cmd {
     char *data_tag;          /* Tagname for the tag that will represent the data for this command. */
     uint32_t tagcount;       /* Number of tag items to read/write */
     tag_handle data_h;       /* Handle to data tag */
+    uint8_t *wdata;          /* Copy of the data tag kept current by change events (write commands) */
+    uint8_t queued;          /* The command is waiting in the port's queue */
+    struct mb_cmd *qnext;    /* Next command in the port's queue */
+
+    uint16_t tid;            /* Transaction ID of the request that is in flight (TCP) */
+    int tries;               /* Number of times the request has been sent this time */
+    struct timeval sent;     /* When the request was last sent */
+
+    struct mb_cmd *block;    /* Block read that this command is read with */
+    struct mb_cmd **members; /* Commands that this block read is made up of */
+    int member_count;
+    unsigned int scan;       /* Last port scan that the block read was sent on */
 
     struct mb_cmd* next;
 } mb_cmd;
@@ -240,10 +279,13 @@ typedef struct mb_port {
     char *disc_name;
     unsigned int disc_size;    /* size of the internal bank of coils */
     tag_handle disc_tag;
+    uint8_t cache;             /* Answer requests from local copies of the tables */
+    struct mb_image *image[4]; /* Local copies of the tables indexed by MB_REG_* - 1 */
 
-    fd_set fdset;
-    int maxfd;
-    struct client_buffer *buff_head; /* Head of a linked list of client connection buffers */
+    int epollfd;                     /* epoll instance for the TCP server */
+    struct client_buffer **clients;  /* TCP server connections indexed by file descriptor */
+    int client_size;                 /* Size of the clients array */
+    int client_count;                /* Number of connected clients */
 
     struct mb_cmd *commands;  /* Linked list of Modbus commands */
     int fd;                   /* File descriptor to the port */
@@ -259,9 +301,17 @@ typedef struct mb_port {
     int connection_size;
     int connection_count;
     uint8_t persist;              /* If true the port(s) stay open */
+    int window;                   /* Most requests in flight on a single connection */
+    int maxgap;                   /* Most unused registers to read to merge two commands, -1 = don't */
+    struct mb_cmd *blocks;        /* Linked list of block reads that are sent in place of commands */
+    unsigned int scan;            /* Port scan counter */
     uint8_t scanning;             /* A flag to tell us if we are currently scanning the port */
 
     pthread_mutex_t send_lock;
+    struct mb_cmd *qhead;         /* Commands that events have queued to be sent right away */
+    struct mb_cmd *qtail;
+    pthread_mutex_t queue_lock;   /* Protects the queue and the wdata of the commands */
+    pthread_cond_t queue_cond;    /* Signaled when a command is queued */
     tag_handle command_h;         /* Handle to command tag */
     mb_cmd *cmd;                  /* Pointer to the asynchronous command structure */
 
@@ -295,6 +345,7 @@ int mb_set_network_port(mb_port *port, const char *ipaddress, unsigned int bindp
 int mb_set_protocol(mb_port *port, unsigned char type, unsigned char protocol, uint8_t slaveid);
 int mb_set_scan_rate(mb_port *port, int rate);
 int mb_set_maxfailures(mb_port *port, int maxfailures, int inhibit);
+int mb_set_window(mb_port *port, int window);
 
 int mb_set_holdreg_size(mb_port *port, unsigned int size);
 int mb_set_inputreg_size(mb_port *port, unsigned int size);
@@ -304,6 +355,9 @@ int mb_set_discrete_size(mb_port *port, unsigned int size);
 int mb_open_port(mb_port *port);
 int mb_close_port(mb_port *port);
 int mb_get_connection(mb_port *mp, struct in_addr address, uint16_t port);
+int mb_get_connection_index(mb_port *mp, struct in_addr address, uint16_t port);
+int mb_start_connection(mb_port *mp, struct in_addr address, uint16_t port);
+int mb_finish_connection(int fd);
 /* Set callback functions that are called any time data is read or written over the port */
 void mb_set_msgout_callback(mb_port *, void (*outfunc)(mb_port *,uint8_t *,unsigned int));
 void mb_set_msgin_callback(mb_port *, void (*infunc)(mb_port *,uint8_t *,unsigned int));
@@ -330,12 +384,18 @@ int mb_is_read_cmd(mb_cmd *cmd);
 /* End New Interface */
 int mb_run_port(mb_port *);
 int mb_send_command(mb_port *, mb_cmd *);
+void mb_queue_command(mb_port *, mb_cmd *);
+void mb_mirror_data(mb_port *, mb_cmd *, uint8_t *, int);
 
 void mb_print_portconfig(FILE *fd, mb_port *mp);
 
 /* Port Functions - defined in modports.c */
 int add_cmd(mb_port *p, mb_cmd *mc);
 
+/* Scan planning functions - defined in mbplan.c */
+int mb_plan_commands(mb_port *mp);
+void mb_print_plan(FILE *fd, mb_port *mp);
+
 /* TCP Server Functions - defined in mbserver.c */
 int server_loop(mb_port *port);
 
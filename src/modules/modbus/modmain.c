@@ -61,6 +61,11 @@ _slave_write_callback(mb_port *port, int reg, int index, int count, uint16_t *da
     int result;
     tag_handle h;
 
+    /* If we have a copy of the table the writer thread sends it to the server */
+    if(port->image[reg - 1] != NULL) {
+        mb_image_write(port->image[reg - 1], index, count, data);
+        return;
+    }
     /* We're going to cheat and build our own tag_handle */
     /* We're assuming that the server loop won't call this function
      * with bad data. */
@@ -111,6 +116,10 @@ _slave_read_callback(mb_port *port, int reg, int index, int count, uint16_t *dat
     int result;
     tag_handle h;
 
+    if(port->image[reg - 1] != NULL) {
+        mb_image_read(port->image[reg - 1], index, count, data);
+        return;
+    }
     /* We're going to cheat and build our own tag_handle */
     /* We're assuming that the server loop won't call this function
      * with bad data. */
@@ -154,18 +163,51 @@ _slave_read_callback(mb_port *port, int reg, int index, int count, uint16_t *dat
     }
 }
 
+/* Copies the tag data that came with the event into the command.  The data
+ * starts at the byte that holds the first bit of a BOOL tag so the bits are
+ * moved down to bit zero the same way dax_read_tag() would do it. */
+static void
+_mirror_event(dax_state *_ds, event_ud *event) {
+    tag_handle h = event->h;
+    uint8_t raw[h.size], bits[h.size];
+    int n, size;
+
+    size = dax_event_get_data(_ds, raw, h.size);
+    if(size <= 0) return; /* Not a write command so there is no data */
+    if(h.type == DAX_BOOL) {
+        bzero(bits, h.size);
+        for(n = 0; n < h.count && (h.bit + n) / 8 < size; n++) {
+            if(raw[(h.bit + n) / 8] & (0x01 << (h.bit + n) % 8)) {
+                bits[n / 8] |= (0x01 << n % 8);
+            }
+        }
+        mb_mirror_data(event->port, event->cmd, bits, h.size);
+    } else {
+        mb_mirror_data(event->port, event->cmd, raw, size);
+    }
+}
+
+/* Keeps the data of a write command current without sending it */
+static void
+_mirror_callback(dax_state *_ds, void *ud) {
+    _mirror_event(_ds, (event_ud *)ud);
+}
+
+/* The port thread sends the command.  We only queue it here so that the
+ * events are never held up waiting on the bus. */
 static void
 _change_callback(dax_state *_ds, void *ud) {
     event_ud *event = (event_ud *)ud;
     DF("Change callback");
-    mb_send_command(event->port, event->cmd);
+    _mirror_event(_ds, event);
+    mb_queue_command(event->port, event->cmd);
 }
 
 static void
 _trigger_callback(dax_state *_ds, void *ud) {
     uint8_t bit=0;
     event_ud *event = (event_ud *)ud;
-    mb_send_command(event->port, event->cmd);
+    mb_queue_command(event->port, event->cmd);
     dax_write_tag(_ds, event->h, &bit);
 }
 
@@ -279,6 +321,26 @@ _add_async_command_tag(mb_port *port) {
     return 0;
 }
 
+/* Make local copies of the slave port's tables so that the requests can be
+ * answered without going to the server.  If we can't make one we'll just
+ * read and write the tag on each request for that table. */
+static void
+_setup_images(mb_port *port)
+{
+    tag_handle *tags[4] = {&port->hold_tag, &port->input_tag, &port->coil_tag, &port->disc_tag};
+    unsigned int sizes[4] = {port->hold_size, port->input_size, port->coil_size, port->disc_size};
+    int n;
+
+    if(!port->cache) return;
+    for(n = 0; n < 4; n++) {
+        if(sizes[n] == 0 || tags[n]->size == 0) continue;
+        port->image[n] = mb_image_new(*tags[n]);
+        if(port->image[n] == NULL) {
+            dax_error(ds, "Unable to make a local copy of the tables for port %s", port->name);
+        }
+    }
+}
+
 /* Setup slave ports tags and set the read/write callbacks */
 static int
 _setup_port(mb_port *port)
@@ -312,6 +374,7 @@ _setup_port(mb_port *port)
             result = dax_tag_add(ds, &port->disc_tag, port->disc_name, DAX_BOOL, size, 0);
             if(result) dax_error(ds, "Failed to add discrete input tag for port %s", port->name);
         }
+        _setup_images(port);
         /* TODO: We probably don't need these to be callbacks anymore since we got rid of the library */
         mb_set_slave_write_callback(port, _slave_write_callback);
         mb_set_slave_read_callback(port, _slave_read_callback);
@@ -355,89 +418,105 @@ _setup_port(mb_port *port)
     return 0;
 }
 
+/* Adds an event of the given type to the tag for the command.  If 'mirror' is
+ * set the event sends the tag data along with it and the command keeps a copy
+ * of that data, which is filled with the current value of the tag here.  The
+ * copy is what the command sends so the port never has to read the tag. */
+static int
+_add_command_event(mb_port *port, mb_cmd *mc, char *tagname, int count, int type,
+                   void (*callback)(dax_state *, void *), int mirror) {
+    int result;
+    dax_id id;
+    event_ud *ud;
+
+    ud = malloc(sizeof(event_ud));
+    if(ud == NULL) return ERR_ALLOC;
+    ud->port = port;
+    ud->cmd = mc;
+    result = dax_tag_handle(ds, &ud->h, tagname, count);
+    if(result) {
+        dax_error(ds, "Unable to find tag %s for command event", tagname);
+        free(ud);
+        return result;
+    }
+    result = dax_event_add(ds, &ud->h, type, NULL, &id, callback, ud, _free_ud);
+    DF("dax_event_add() returned %d",result);
+    if(result) {
+        dax_error(ds, "Unable to add event for tag %s", tagname);
+        free(ud);
+        return result;
+    }
+    if(mirror) {
+        uint8_t buff[ud->h.size];
+
+        if(ud->h.size != mc->datasize) {
+            dax_error(ds, "Tag size and Modbus request size are different.  Data will be truncated");
+        }
+        result = dax_event_options(ds, id, EVENT_OPT_SEND_DATA);
+        if(result == 0) {
+            result = dax_read_tag(ds, ud->h, buff);
+        }
+        if(result) {
+            dax_error(ds, "Unable to get the data for tag %s", tagname);
+            dax_event_del(ds, id); /* This frees ud */
+            return result;
+        }
+        /* The events are handled on this thread so nothing newer can come
+         * in before this */
+        mb_mirror_data(port, mc, buff, ud->h.size);
+    }
+    return 0;
+}
+
 /* This function scans the commands in the port and sets up the events that are
- * supposed to send that command.  It increments an error counter so that the
- * calling function can call it repeatedly until all of the tags have been created.*/
+ * supposed to send that command.  Write commands all get an event that keeps
+ * a copy of their data current.  For the event driven commands that same event
+ * queues the command to be sent.  It returns the number of errors so that the
+ * calling function can call it repeatedly until all of the events have been
+ * created. The mode bits are turned off as the events are added so that we
+ * don't do them again. */
 static int
 _setup_master_events(mb_port *port) {
-    int result=0;
+    int errors = 0, write;
     struct mb_cmd *mc;
-    event_ud *ud; /* This is the userdata for change and trigger events */
 
-    mc = port->commands;
-    while(mc != NULL) {
+    for(mc = port->commands; mc != NULL; mc = mc->next) {
+        if(mc->data_tag == NULL) continue;
+        write = mb_is_write_cmd(mc);
         if(mc->mode & MB_ONWRITE) {
-            ud = malloc(sizeof(event_ud));
-            if(ud == NULL) return ERR_ALLOC;
-            ud->port = port;
-            ud->cmd = mc;
-            result = dax_tag_handle(ds, &ud->h, mc->data_tag, mc->tagcount);
-            if(result) {
-                dax_error(ds, "Unable to find tag for command write event");
-                free(ud);
-                result++;
+            if(_add_command_event(port, mc, mc->data_tag, mc->tagcount, EVENT_WRITE,
+                                  _change_callback, write)) {
+                errors++;
             } else {
-                result = dax_event_add(ds, &ud->h, EVENT_WRITE, NULL, NULL, _change_callback, ud, _free_ud);
-                if(result) {
-                    dax_error(ds, "Unable to add event for command write event");
-                    free(ud);
-                    result++;
-                } else {
-                    /* Success... Turn the mode bit off so that we don't do this again if
-                     * the function is called again. We turn of the change bit if it's set
-                     * since a change event would be redundant */
-                    mc->mode &= ~(MB_ONWRITE | MB_ONCHANGE);
-                }
+                /* A change event would be redundant */
+                mc->mode &= ~(MB_ONWRITE | MB_ONCHANGE);
             }
         }
         if(mc->mode & MB_ONCHANGE) {
-            ud = malloc(sizeof(event_ud));
-            if(ud == NULL) return ERR_ALLOC;
-            ud->port = port;
-            ud->cmd = mc;
-            result = dax_tag_handle(ds, &ud->h, mc->data_tag, mc->tagcount);
-            if(result) {
-                dax_error(ds, "Unable to find tag for command change event");
-                free(ud);
-                result++;
+            if(_add_command_event(port, mc, mc->data_tag, mc->tagcount, EVENT_CHANGE,
+                                  _change_callback, write)) {
+                errors++;
             } else {
-                result = dax_event_add(ds, &ud->h, EVENT_CHANGE, NULL, NULL, _change_callback, ud, _free_ud);
-                DF("dax_event_add() returned %d",result);
-                if(result) {
-                    dax_error(ds, "Unable to add event for command change event");
-                    free(ud);
-                    result++;
-                } else {
-                    /* Success */
-                    mc->mode &= ~(MB_ONCHANGE);
-                }
+                mc->mode &= ~(MB_ONCHANGE);
+            }
+        }
+        /* Commands that aren't sent by the data tag events still need the copy */
+        if(write && mc->wdata == NULL && !(mc->mode & (MB_ONWRITE | MB_ONCHANGE))) {
+            if(_add_command_event(port, mc, mc->data_tag, mc->tagcount, EVENT_CHANGE,
+                                  _mirror_callback, 1)) {
+                errors++;
             }
         }
         if(mc->mode & MB_TRIGGER) {
-            ud = malloc(sizeof(event_ud));
-            if(ud == NULL) return ERR_ALLOC;
-            ud->port = port;
-            ud->cmd = mc;
-            result = dax_tag_handle(ds, &ud->h, mc->trigger_tag, 1);
-            if(result) {
-                dax_error(ds, "Unable to find tag for command trigger event");
-                free(ud);
-                result++;
+            if(_add_command_event(port, mc, mc->trigger_tag, 1, EVENT_SET,
+                                  _trigger_callback, 0)) {
+                errors++;
             } else {
-                result = dax_event_add(ds, &ud->h, EVENT_SET, NULL, NULL, _trigger_callback, ud, _free_ud);
-                if(result) {
-                    dax_error(ds, "Unable to add event for command trigger event");
-                    free(ud);
-                    result++;
-                } else {
-                    /* Success */
-                    mc->mode &= ~(MB_TRIGGER);
-                }
+                mc->mode &= ~(MB_TRIGGER);
             }
         }
-        mc = mc->next;
     }
-    return result;
+    return errors;
 }
 
 int
@@ -506,8 +585,8 @@ main (int argc, const char * argv[]) {
         /* for the first minute or until we have all the errors clear in the event
          * setting logic we try to setup the events in the master port */
         if(master_errors && loop_count < 60) {
+            master_errors = 0;
             for(n = 0; n < config.portcount; n++) {
-                master_errors = 0;
                 master_errors += _setup_master_events(config.ports[n]);
             }
         }
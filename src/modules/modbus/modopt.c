@@ -361,6 +361,29 @@ _add_port(lua_State *L)
     lua_pop(L, 1);
     mb_set_maxfailures(p, maxfailures, inhibit);
 
+    lua_getfield(L, -1, "window");
+    tmp = (unsigned int)lua_tonumber(L, -1);
+    if(tmp > 0 && mb_set_window(p, tmp)) {
+        dax_error(ds, "Window for port %s should be between 1 and %d", p->name, MB_MAX_WINDOW);
+    }
+    lua_pop(L, 1);
+
+    /* Commands that are no more than this many registers apart are read
+     * together.  A negative number turns this off */
+    lua_getfield(L, -1, "maxgap");
+    if(!lua_isnil(L, -1)) {
+        p->maxgap = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    /* If this is set slave ports answer requests from a local copy of the
+     * tables instead of going to the server for each one */
+    lua_getfield(L, -1, "cache");
+    if(!lua_isnil(L, -1)) {
+        p->cache = lua_toboolean(L, -1) ? 1 : 0;
+    }
+    lua_pop(L, 1);
+
     lua_getfield(L, -1, "persist");
     if(lua_toboolean(L, -1)) {
         p->persist = 1;
@@ -530,7 +553,7 @@ _add_command(lua_State *L)
 int
 modbus_configure(int argc, const char *argv[])
 {
-    int flags, result = 0;
+    int flags, n, result = 0;
     
     _init_config();
     dax_init_config(ds, "modbus");
@@ -546,7 +569,12 @@ modbus_configure(int argc, const char *argv[])
     dax_clear_luafunction(ds, "add_command");
 
     dax_free_config(ds);
-    
+
+    for(n = 0; n < config.portcount; n++) {
+        if(mb_plan_commands(config.ports[n])) {
+            dax_error(ds, "Unable to plan block reads for port %s", config.ports[n]->name);
+        }
+    }
     printconfig();
 
     return 0;
@@ -149,6 +149,10 @@ extern "C" {
 
 /* Event Options */
 #define EVENT_OPT_SEND_DATA  0x01 /* Send the affected data with the event */
+#define EVENT_OPT_COALESCE   0x02 /* Only send the latest if the event fires more than once in a batch */
+
+/* Tag group options */
+#define GROUP_OPT_SUBSCRIBE  0x01 /* The server sends the members that change */
 
 /* Atomic Operations */
 #define ATOMIC_OP_INC  0x0001  /* Increment */
@@ -159,6 +163,10 @@ extern "C" {
 #define ATOMIC_OP_NOR  0x0006  /* Bitwise NOR */
 #define ATOMIC_OP_NAND 0x0007  /* Bitwise NAND */
 #define ATOMIC_OP_XOR  0x0008  /* Bitwise XOR */
+#define ATOMIC_OP_MIN  0x0009  /* Keep the lesser of the two */
+#define ATOMIC_OP_MAX  0x000A  /* Keep the greater of the two */
+#define ATOMIC_OP_CAS  0x000B  /* Compare and swap */
+#define ATOMIC_OP_FETCH_ADD 0x000C /* Add and return the previous value */
 
 
 /* Defines the maximum length of a tagname */
@@ -262,6 +270,22 @@ typedef struct dax_id
 
 /*! Opaque pointer for storing a dax_state object in the library */
 typedef struct dax_state dax_state;
+
+/*!
+ * Definition of one event for dax_event_add_multi().  The members are the
+ * same as the arguments to dax_event_add().  The id is filled in when the
+ * event is added.  If the event could not be added the id member of the
+ * id is set to the error code.
+ */
+typedef struct dax_event_def {
+    tag_handle handle;
+    int event_type;
+    void *data;       /* Data for the EQUAL, GREATER, LESS and DEADBAND events */
+    void (*callback)(dax_state *ds, void *udata);
+    void *udata;
+    void (*free_callback)(void *udata);
+    dax_id id;
+} dax_event_def;
 /*! Opaque pointer for tag group */
 typedef struct tag_group_id tag_group_id;
 
@@ -330,6 +354,7 @@ int dax_mod_set(dax_state *ds, uint8_t cmd, void *param);  /* Set module paramet
 
 /* Adds a tag to the opendax server database. */
 int dax_tag_add(dax_state *ds, tag_handle *h, char *name, tag_type type, int count, uint32_t attr);
+int dax_tag_add_multi(dax_state *ds, dax_tag *tags, tag_handle *handles, int count);
 
 /* Delete the tag give by index */
 int dax_tag_del(dax_state *ds, tag_index index);
@@ -338,6 +363,19 @@ int dax_tag_del(dax_state *ds, tag_index index);
 int dax_tag_byname(dax_state *ds, dax_tag *tag, char *name);
 /* Get tag by index */
 int dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index index);
+/* Counters for the library's tag cache */
+typedef struct dax_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    int count;            /* Number of tags in the cache */
+    int limit;            /* Most tags that the cache will hold */
+} dax_cache_stats;
+
+int dax_tag_cache_stats(dax_state *ds, dax_cache_stats *stats);
+
+/* Get all the tags or the ones that have changed since the generation */
+int dax_tag_list(dax_state *ds, uint32_t since, uint32_t *generation,
+                 void (*callback)(dax_state *ds, dax_tag *tag, void *udata), void *udata);
 
 /* The handle is a complete description of where in the tagbase the
  * data that we wish to retrieve is located.  This can be used in place
@@ -391,11 +429,13 @@ int dax_tag_set_override(dax_state *ds, tag_handle handle);
 int dax_tag_clr_override(dax_state *ds, tag_handle handle);
 
 int dax_atomic_op(dax_state *ds, tag_handle handle, void *data, uint16_t operation);
+int dax_atomic_fetch(dax_state *ds, tag_handle handle, void *data, void *prev, uint16_t operation);
 
 /* Event handling functions */
 int dax_event_add(dax_state *ds, tag_handle *handle, int event_type, void *data,
                   dax_id *id, void (*callback)(dax_state *ds, void *udata), void *udata,
                   void (*free_callback)(void *udata));
+int dax_event_add_multi(dax_state *ds, dax_event_def *events, int count);
 int dax_event_del(dax_state *ds, dax_id id);
 int dax_event_get(dax_state *ds, dax_id id);
 int dax_event_options(dax_state *ds, dax_id id, uint32_t options);
@@ -403,6 +443,7 @@ int dax_event_wait(dax_state *ds, int timeout, dax_id *id);
 int dax_event_poll(dax_state *ds, dax_id *id);
 //int dax_event_get_fd(dax_state *ds);
 int dax_event_get_data(dax_state *ds, void* buff, int len);
+uint32_t dax_event_mark(dax_state *ds);
 
 /* Event Utility Functions */
 int dax_event_string_to_type(char *string);
@@ -444,6 +485,10 @@ tag_group_id *dax_group_add(dax_state *ds, int *result, tag_handle *h, int count
 int dax_group_read(dax_state *ds, tag_group_id *id, void *buff, size_t size);
 int dax_group_write(dax_state *ds, tag_group_id *id, void *buff);
 int dax_group_del(dax_state *ds, tag_group_id *id);
+int dax_group_set_callback(dax_state *ds, tag_group_id *id,
+                           void (*callback)(dax_state *ds, void *udata), void *udata);
+int dax_group_get_data(dax_state *ds, tag_group_id *id, void *buff, size_t size);
+uint32_t dax_group_get_seq(dax_state *ds, tag_group_id *id);
 
 /* Convenience functions for converting strings to basic DAX values and back */
 int dax_val_to_string(char *buff, int size, tag_type type, void *val, int index);
@@ -21,6 +21,9 @@
 #include <common.h>
 #include "tagbase.h"
 #include "func.h"
+#include "shmem.h"
+#include "groups.h"
+#include "retain.h"
 #include <ctype.h>
 #include <assert.h>
 
@@ -48,113 +51,208 @@ extern _dax_tag_db *_db;
 // #define DAX_LREAL   0x0046
 
 
-static int
-_atomic_inc(tag_handle h, void *data) {
-    /* We only operate on one member at a time */
-    if(h.count != 1) return ERR_ILLEGAL;
-    switch(h.type) {
-        case DAX_BYTE:
-            *(dax_byte *)&_db[h.index].data[h.byte] += *(dax_byte *)data;
-            return 0;
-        case DAX_SINT:
-        case DAX_CHAR:
-            *(dax_sint *)&_db[h.index].data[h.byte] += *(dax_sint *)data;
-            return 0;
-        case DAX_UINT:
-        case DAX_WORD:
-            *(dax_uint *)&_db[h.index].data[h.byte] += *(dax_uint *)data;
-            return 0;
-        case DAX_INT:
-            *(dax_int *)&_db[h.index].data[h.byte] += *(dax_int *)data;
-            return 0;
-        case DAX_UDINT:
-        case DAX_DWORD:
-        case DAX_TIME:
-            *(dax_udint *)&_db[h.index].data[h.byte] += *(dax_udint *)data;
-            return 0;
-        case DAX_DINT:
-            *(dax_dint *)&_db[h.index].data[h.byte] += *(dax_dint *)data;
-            return 0;
-        case DAX_ULINT:
-        case DAX_LWORD:
-            *(dax_ulint *)&_db[h.index].data[h.byte] += *(dax_ulint *)data;
-            return 0;
-        case DAX_LINT:
-            *(dax_lint *)&_db[h.index].data[h.byte] += *(dax_lint *)data;
-            return 0;
-        case DAX_REAL:
-            *(dax_real *)&_db[h.index].data[h.byte] += *(dax_real *)data;
-            return 0;
-        case DAX_LREAL:
-            *(dax_lreal *)&_db[h.index].data[h.byte] += *(dax_lreal *)data;
-            return 0;
+/* Each of these functions applies the operation to 'count' elements of the
+ * given type at 'dest' one at a time with the matching element of 'data'.
+ * The operation is checked before anything is changed so that nothing is
+ * changed if it isn't allowed.  memcpy() is used to get at the elements
+ * because they may not be aligned in the tag data. */
+#define ATOMIC_LOOP(TYPE, EXPR) \
+    for(n = 0; n < count; n++) { \
+        memcpy(&x, &dest[n * sizeof(TYPE)], sizeof(TYPE)); \
+        memcpy(&y, &data[n * sizeof(TYPE)], sizeof(TYPE)); \
+        EXPR; \
+        memcpy(&dest[n * sizeof(TYPE)], &x, sizeof(TYPE)); \
     }
-    return 0;
+
+#define INTEGER_OP(NAME, TYPE) \
+static int \
+NAME(uint8_t *dest, uint8_t *data, int count, uint16_t op) \
+{ \
+    TYPE x, y = 0; \
+    int n; \
+ \
+    switch(op) { \
+        case ATOMIC_OP_INC: \
+        case ATOMIC_OP_FETCH_ADD: \
+            ATOMIC_LOOP(TYPE, x += y); \
+            return 0; \
+        case ATOMIC_OP_DEC: \
+            ATOMIC_LOOP(TYPE, x -= y); \
+            return 0; \
+        case ATOMIC_OP_NOT: \
+            for(n = 0; n < count; n++) { \
+                memcpy(&x, &dest[n * sizeof(TYPE)], sizeof(TYPE)); \
+                x = ~x; \
+                memcpy(&dest[n * sizeof(TYPE)], &x, sizeof(TYPE)); \
+            } \
+            return 0; \
+        case ATOMIC_OP_OR: \
+            ATOMIC_LOOP(TYPE, x |= y); \
+            return 0; \
+        case ATOMIC_OP_AND: \
+            ATOMIC_LOOP(TYPE, x &= y); \
+            return 0; \
+        case ATOMIC_OP_NOR: \
+            ATOMIC_LOOP(TYPE, x = ~(x | y)); \
+            return 0; \
+        case ATOMIC_OP_NAND: \
+            ATOMIC_LOOP(TYPE, x = ~(x & y)); \
+            return 0; \
+        case ATOMIC_OP_XOR: \
+            ATOMIC_LOOP(TYPE, x ^= y); \
+            return 0; \
+        case ATOMIC_OP_MIN: \
+            ATOMIC_LOOP(TYPE, if(y < x) x = y); \
+            return 0; \
+        case ATOMIC_OP_MAX: \
+            ATOMIC_LOOP(TYPE, if(y > x) x = y); \
+            return 0; \
+    } \
+    return ERR_NOTIMPLEMENTED; \
 }
 
+/* The bitwise operations don't make any sense on floating point numbers */
+#define FLOAT_OP(NAME, TYPE) \
+static int \
+NAME(uint8_t *dest, uint8_t *data, int count, uint16_t op) \
+{ \
+    TYPE x, y; \
+    int n; \
+ \
+    switch(op) { \
+        case ATOMIC_OP_INC: \
+        case ATOMIC_OP_FETCH_ADD: \
+            ATOMIC_LOOP(TYPE, x += y); \
+            return 0; \
+        case ATOMIC_OP_DEC: \
+            ATOMIC_LOOP(TYPE, x -= y); \
+            return 0; \
+        case ATOMIC_OP_MIN: \
+            ATOMIC_LOOP(TYPE, if(y < x) x = y); \
+            return 0; \
+        case ATOMIC_OP_MAX: \
+            ATOMIC_LOOP(TYPE, if(y > x) x = y); \
+            return 0; \
+        case ATOMIC_OP_NOT: \
+        case ATOMIC_OP_OR: \
+        case ATOMIC_OP_AND: \
+        case ATOMIC_OP_NOR: \
+        case ATOMIC_OP_NAND: \
+        case ATOMIC_OP_XOR: \
+            return ERR_ILLEGAL; \
+    } \
+    return ERR_NOTIMPLEMENTED; \
+}
+
+INTEGER_OP(_atomic_byte, dax_byte)
+INTEGER_OP(_atomic_sint, dax_sint)
+INTEGER_OP(_atomic_uint, dax_uint)
+INTEGER_OP(_atomic_int, dax_int)
+INTEGER_OP(_atomic_udint, dax_udint)
+INTEGER_OP(_atomic_dint, dax_dint)
+INTEGER_OP(_atomic_ulint, dax_ulint)
+INTEGER_OP(_atomic_lint, dax_lint)
+FLOAT_OP(_atomic_real, dax_real)
+FLOAT_OP(_atomic_lreal, dax_lreal)
+
 static int
-_atomic_dec(tag_handle h, void *data) {
-    /* We only operate on one member at a time */
-    if(h.count != 1) return ERR_ILLEGAL;
+_atomic_apply(tag_handle h, uint8_t *dest, uint8_t *data, uint16_t op) {
     switch(h.type) {
         case DAX_BYTE:
-            *(dax_byte *)&_db[h.index].data[h.byte] -= *(dax_byte *)data;
-            return 0;
+            return _atomic_byte(dest, data, h.count, op);
         case DAX_SINT:
         case DAX_CHAR:
-            *(dax_sint *)&_db[h.index].data[h.byte] -= *(dax_sint *)data;
-            return 0;
+            return _atomic_sint(dest, data, h.count, op);
         case DAX_UINT:
         case DAX_WORD:
-            *(dax_uint *)&_db[h.index].data[h.byte] -= *(dax_uint *)data;
-            return 0;
+            return _atomic_uint(dest, data, h.count, op);
         case DAX_INT:
-            *(dax_int *)&_db[h.index].data[h.byte] -= *(dax_int *)data;
-            return 0;
+            return _atomic_int(dest, data, h.count, op);
         case DAX_UDINT:
         case DAX_DWORD:
         case DAX_TIME:
-            *(dax_udint *)&_db[h.index].data[h.byte] -= *(dax_udint *)data;
-            return 0;
+            return _atomic_udint(dest, data, h.count, op);
         case DAX_DINT:
-            *(dax_dint *)&_db[h.index].data[h.byte] -= *(dax_dint *)data;
-            return 0;
+            return _atomic_dint(dest, data, h.count, op);
         case DAX_ULINT:
         case DAX_LWORD:
-            *(dax_ulint *)&_db[h.index].data[h.byte] -= *(dax_ulint *)data;
-            return 0;
+            return _atomic_ulint(dest, data, h.count, op);
         case DAX_LINT:
-            *(dax_lint *)&_db[h.index].data[h.byte] -= *(dax_lint *)data;
-            return 0;
+            return _atomic_lint(dest, data, h.count, op);
         case DAX_REAL:
-            *(dax_real *)&_db[h.index].data[h.byte] -= *(dax_real *)data;
-            return 0;
+            return _atomic_real(dest, data, h.count, op);
         case DAX_LREAL:
-            *(dax_lreal *)&_db[h.index].data[h.byte] -= *(dax_lreal *)data;
-            return 0;
+            return _atomic_lreal(dest, data, h.count, op);
     }
-    return 0;
+    return ERR_ILLEGAL;
 }
 
-
+/* Performs the operation on all of the elements of the tag that are given
+ * by the handle.  'data' holds one operand for each element and 'size' is
+ * the size of that data.  ATOMIC_OP_NOT doesn't need any and ATOMIC_OP_CAS
+ * needs the values to compare against followed by the new values.  The
+ * tag data from before the operation is copied to 'prev' if it isn't NULL.
+ * The events, groups and mappings are checked once for the whole range
+ * instead of once for each element. */
 int
-atomic_op(tag_handle h, void *data, uint16_t op) {
+atomic_op(tag_handle h, void *data, int size, void *prev, uint16_t op) {
+    int result, typesize, range;
+    uint32_t tagsize;
+    uint8_t *dest;
 
-    /* We don't do these on custom data types */
-    if(IS_CUSTOM(h.type)) {
+    if(h.index < 0 || h.index >= get_tagindex()) {
+        return ERR_ARG;
+    }
+    if(_db[h.index].data == NULL) {
+        return ERR_DELETED;
+    }
+    /* We don't do these on custom data types, bits or virtual tags */
+    if(IS_CUSTOM(h.type) || h.type == DAX_BOOL || _db[h.index].attr & TAG_ATTR_VIRTUAL) {
         return ERR_ILLEGAL;
     }
-    switch(op) {
-        case ATOMIC_OP_INC:
-            if(h.type == DAX_BOOL) return ERR_ILLEGAL;
-            return _atomic_inc(h, data);
-        case ATOMIC_OP_DEC:
-            if(h.type == DAX_BOOL) return ERR_ILLEGAL;
-            return _atomic_dec(h, data);
+    if(_db[h.index].attr & TAG_ATTR_READONLY) {
+        return ERR_READONLY;
     }
-    /* The rest of the data types are not done yet */
-    /* TODO Finish the bitwise operators */
-    return ERR_NOTIMPLEMENTED;
-    //return 0;
+    /* The handle has to be for the tag's own type unless it points at a
+     * member of a custom data type */
+    if(!IS_CUSTOM(_db[h.index].type) && h.type != _db[h.index].type) {
+        return ERR_ARG;
+    }
+    typesize = type_size(h.type);
+    if(typesize <= 0) return ERR_ARG;
+    if(h.count < 1) return ERR_ARG;
+    /* The count comes from the message so check it before multiplying */
+    tagsize = tag_get_size(h.index);
+    if(h.byte > tagsize || h.count > (tagsize - h.byte) / typesize) {
+        return ERR_2BIG;
+    }
+    range = typesize * h.count;
+    if(op == ATOMIC_OP_CAS) {
+        if(size != range * 2) return ERR_ARG;
+    } else if(op != ATOMIC_OP_NOT) {
+        if(size != range) return ERR_ARG;
+    }
+    dest = &_db[h.index].data[h.byte];
+    if(prev != NULL) {
+        memcpy(prev, dest, range);
+    }
+    if(op == ATOMIC_OP_CAS) {
+        /* The whole range is swapped or none of it is */
+        if(memcmp(dest, data, range)) return 0;
+        shmem_write_begin(h.index);
+        memcpy(dest, (uint8_t *)data + range, range);
+        shmem_write_end(h.index);
+    } else {
+        shmem_write_begin(h.index);
+        result = _atomic_apply(h, dest, data, op);
+        shmem_write_end(h.index);
+        if(result) return result;
+    }
+    event_check(h.index, h.byte, range);
+    group_check(h.index, h.byte, range);
+    map_check(h.index, h.byte, range);
+    if(_db[h.index].attr & TAG_ATTR_RETAIN) {
+        ret_tag_write(h.index);
+    }
+    return 0;
 }
-
@@ -29,128 +29,190 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <pthread.h>
 
 /* Notes:
- Okay here is how all this works.  To keep from having to have a buffer for
- each module and to keep from having some arbitrary amount of buffers for
- new modules we are going to share some buffers.  Each buffer has a file
- descriptor associated with it.  When the socket code decides that it needs
- to read information from a socket it will use these functions to find a buffer
- that is associated with the file descriptor.  If there isn't one associated
- with the file descriptor then it tries to find a free one.  If it can't
- find a free one then it'll create a new one.  There is a minimum number
- of buffers that will be kept allocated all the time to keep from calling
- malloc() and free() too much.
-
- There will be quite a few denial of service attacks that can be done here
- and I'll have to figure out a way to keep things limping along if some
- socket starts sending data to gum up the works.
+ Each connected socket gets it's own receive buffer and the buffers are kept
+ in an array that is indexed directly by the file descriptor so finding the
+ buffer for a socket is a single lookup.  The buffer is large enough to hold
+ several messages.  Every complete message that arrives with a read() is
+ dispatched in order and whatever is left over, the beginning of the next
+ message, is moved to the front of the buffer to be completed by the next
+ read().  This lets the modules send requests back to back without waiting
+ for each response.
+
+ Messages that are too large for a single frame arrive as a series of frames
+ with the MSG_CHUNK flag set on all but the last one.  The data from these is
+ collected in a separate chunk buffer and the whole message is dispatched
+ when the last frame arrives.
+
+ Buffers are allocated when a socket first sends data and are released when
+ the socket is closed.  A small number of released buffers, min_buffers, are
+ kept on a free list to keep from calling malloc() and free() too much.
 */
 
+/* Size of each receive buffer.  Must be at least DAX_MSGMAX */
+#define BUFF_SIZE (DAX_MSGMAX * 4)
 
 typedef struct dax_BuffNode {
-    int fd;
     int index; /* Index of the next available char in the buffer */
-    unsigned char buffer[DAX_MSGMAX];
+    unsigned char buffer[BUFF_SIZE];
+    unsigned char *chunk;  /* Large message being put back together from chunks */
+    uint32_t chunk_size;   /* Bytes in the chunk buffer, including the header */
+    uint32_t chunk_alloc;  /* Allocated size of the chunk buffer */
+    int chunk_error;       /* Error that will be returned when the last chunk arrives */
     struct dax_BuffNode *next;
 } dax_buffnode;
 
-/* This is the head of the data buffer list */
-static dax_buffnode *_buffer;
-
-/* Allocate and initialize a buffer node */
-static dax_buffnode *
-_new_buffnode(void)
-{
-    dax_buffnode *node;
-
-    node = malloc(sizeof(dax_buffnode));
-    if(node == NULL) return NULL;
-    node->fd = 0;
-    node->index = 0;
-    node->next = NULL;
+/* Array of buffer pointers indexed by file descriptor */
+static dax_buffnode **_buffers;
+static int _buffsize;
+/* List of released buffers that we keep around for reuse */
+static dax_buffnode *_freelist;
+static int _freecount;
+/* Protects the array and the free list since the worker threads share them */
+static pthread_mutex_t _buffer_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    return node;
-}
-
-/* Create the initial linked list of buffer nodes */
+/* Allocate the array and the initial free buffers */
 int
 buff_initialize(void)
 {
     int n, count;
-    dax_buffnode *node, *last;
+    dax_buffnode *node;
 
-    count = opt_min_buffers();
-    last = NULL;
+    _buffsize = DEFAULT_BUFF_FDS;
+    _buffers = xcalloc(_buffsize, sizeof(dax_buffnode *));
+    if(_buffers == NULL) {
+        xfatal("Unable to allocate the communication buffer array");
+    }
 
+    count = opt_min_buffers();
     for(n = 0; n < count; n++) {
-        node = _new_buffnode();
+        node = malloc(sizeof(dax_buffnode));
         if(node == NULL) {
             xfatal("Unable to allocate all of the communication buffers");
         }
-        if(n == 0) {
-            _buffer = node;
-        } else {
-            last->next = node;
-        }
-        last = node;
+        node->next = _freelist;
+        _freelist = node;
+        _freecount++;
     }
     return 0;
 }
 
-/* Return the index of the buffer node that is either presently
-   assigned to the fd or if there isn't one a free one */
+/* Return the buffer that is assigned to the fd.  If there isn't one we
+ * assign one from the free list or allocate a new one. */
 static dax_buffnode *
 find_buff_slot(int fd)
 {
-    dax_buffnode *node, *firstfree, *result;
+    dax_buffnode *node, **newarray;
+    int newsize;
 
-    node = _buffer;
-    firstfree = NULL;
+    if(fd < 0) return NULL;
+    pthread_mutex_lock(&_buffer_lock);
+    if(fd >= _buffsize) {
+        newsize = _buffsize;
+        while(newsize <= fd) newsize *= 2;
+        newarray = realloc(_buffers, newsize * sizeof(dax_buffnode *));
+        if(newarray == NULL) {
+            pthread_mutex_unlock(&_buffer_lock);
+            return NULL;
+        }
+        bzero(&newarray[_buffsize], (newsize - _buffsize) * sizeof(dax_buffnode *));
+        _buffers = newarray;
+        _buffsize = newsize;
+    }
+    node = _buffers[fd];
+    if(node == NULL) {
+        if(_freelist != NULL) {
+            node = _freelist;
+            _freelist = node->next;
+            _freecount--;
+        } else {
+            node = malloc(sizeof(dax_buffnode));
+        }
+        if(node != NULL) {
+            node->index = 0;
+            node->chunk = NULL;
+            node->chunk_size = 0;
+            node->chunk_alloc = 0;
+            node->chunk_error = 0;
+            node->next = NULL;
+            _buffers[fd] = node;
+        }
+    }
+    pthread_mutex_unlock(&_buffer_lock);
+    return node;
+}
 
-    while(node != NULL) {
-        if(node->fd == fd) /* found it */
-            return node;
-        else if(node->fd == 0 && firstfree == NULL)
-            firstfree = node;  /* store a free one for later */
-        node = node->next;
+/* Releases the chunk buffer */
+static void
+_chunk_free(dax_buffnode *node)
+{
+    free(node->chunk);
+    node->chunk = NULL;
+    node->chunk_size = 0;
+    node->chunk_alloc = 0;
+    node->chunk_error = 0;
+}
+
+/* Adds the data portion of the frame in buff to the chunk buffer.  The header
+ * of the chunk buffer is kept up to date so that it looks like one big
+ * message to msg_dispatcher() */
+static int
+_chunk_add(dax_buffnode *node, unsigned char *buff, uint32_t size)
+{
+    unsigned char *newchunk;
+    uint32_t newsize;
+
+    size -= MSG_HDR_SIZE;
+    if(node->chunk_error) return node->chunk_error;
+    if(node->chunk == NULL) {
+        node->chunk_size = MSG_HDR_SIZE;
     }
-    /* couldn't find one that matched the fd so
-     * if we have one that was free return it */
-    if(firstfree != NULL) {
-        result = firstfree;
-    } else {
-        result = _new_buffnode();
-        if(result != NULL) {
-            node = _buffer;
-            /* double linked list would eliminate this ??? */
-            while(node->next != NULL) node = node->next;
-            node->next = result;
+    if(node->chunk_size - MSG_HDR_SIZE + size > DAX_TRANSFER_MAX) {
+        node->chunk_error = ERR_2BIG;
+        return ERR_2BIG;
+    }
+    if(node->chunk_size + size > node->chunk_alloc) {
+        newsize = node->chunk_alloc ? node->chunk_alloc : DAX_MSGMAX * 4;
+        while(newsize < node->chunk_size + size) newsize *= 2;
+        newchunk = realloc(node->chunk, newsize);
+        if(newchunk == NULL) {
+            node->chunk_error = ERR_ALLOC;
+            return ERR_ALLOC;
         }
+        node->chunk = newchunk;
+        node->chunk_alloc = newsize;
     }
-    if(result) result->fd = fd;
-    return result;
+    memcpy(&node->chunk[node->chunk_size], &buff[MSG_HDR_SIZE], size);
+    node->chunk_size += size;
+    *(uint32_t *)&node->chunk[0] = htonl(node->chunk_size);
+    *(uint32_t *)&node->chunk[4] = htonl(ntohl(*(uint32_t *)&buff[4]) & ~MSG_CHUNK);
+    return 0;
 }
 
+/* Reads whatever data is waiting on the socket and dispatches every complete
+ * message that is in the buffer.  A partial message at the end is kept for
+ * the next time. */
 int
 buff_read(int fd)
 {
     dax_buffnode *node;
-    size_t result;
-    uint32_t size;
+    ssize_t result;
+    uint32_t size, type;
+    int pos, error = 0;
 
     node = find_buff_slot(fd);
 
     /* If we can't get a buffer then return error */
     if(node == NULL) return ERR_ALLOC;
 
-    /* We don't want to read too much now do we */
-    size = DAX_MSGMAX - node->index;
-    result = read(fd, &node->buffer[node->index], size);
+    result = read(fd, &node->buffer[node->index], BUFF_SIZE - node->index);
     //--Problem with xread() see func.c
     //--result = xread(fd, &node->buffer[node->index], size);
 
     if(result < 0) {
+        if(errno == EAGAIN || errno == EINTR) return 0;
         xerror("Unable to read data from socket %d", fd);
         return ERR_MSG_RECV;
     } if(result == 0) { /* EOF means the other guy is closed */
@@ -159,67 +221,66 @@ buff_read(int fd)
     }
 
     node->index += result;
-
-    /* Check the size and let the caller know how it turns out. */
+    pos = 0;
     /* First four bytes of a message should always be the size of
        the message and it should be in network byte order */
-    size = ntohl(*(uint32_t *)node->buffer);
-    if(node->index < (size - 1)) {
-        return ERR_MSG_BAD;
-    } else if(node->index >= (size - 1)) {
-        return msg_dispatcher(fd, node->buffer);
-    }else if(size > DAX_MSGMAX) {
-        return ERR_2BIG;
+    while(node->index - pos >= MSG_HDR_SIZE) {
+        size = ntohl(*(uint32_t *)&node->buffer[pos]);
+        if(size < MSG_HDR_SIZE || size > DAX_MSGMAX) {
+            /* We have lost our place in the stream so we throw it all away */
+            xerror("Bad message size %u received on socket %d", size, fd);
+            node->index = 0;
+            return ERR_MSG_BAD;
+        }
+        if(node->index - pos < size) break; /* Wait for the rest */
+        type = ntohl(*(uint32_t *)&node->buffer[pos + 4]);
+        if(type & MSG_CHUNK || node->chunk != NULL || node->chunk_error) {
+            /* Part of a large message */
+            _chunk_add(node, &node->buffer[pos], size);
+            if(!(type & MSG_CHUNK)) { /* That was the last piece */
+                if(node->chunk_error) {
+                    result = node->chunk_error;
+                    msg_send_error(fd, type, result);
+                } else {
+                    result = msg_dispatcher(fd, node->chunk);
+                }
+                _chunk_free(node);
+            } else {
+                result = 0;
+            }
+        } else {
+            result = msg_dispatcher(fd, &node->buffer[pos]);
+        }
+        if(result) error = result;
+        pos += size;
     }
-    return 0;
+    /* Move the partial message to the front of the buffer */
+    if(pos > 0) {
+        memmove(node->buffer, &node->buffer[pos], node->index - pos);
+        node->index -= pos;
+    }
+    return error;
 }
 
-/* TODO: Check boundary conditions where min_buffers = 0 or 1.  Shouldn't
-   be able to equal 0 but try to break it. */
-
-/* This frees the message buffer associated with 'fd' */
+/* This frees the message buffer associated with 'fd'.  Should be called
+ * when the socket is closed */
 void
 buff_free(int fd)
 {
     dax_buffnode *node;
-    node = _buffer;
-
-    while(node != NULL) {
-        if(node->fd == fd) {
-            node->fd = 0;
-            node->index = 0;
-            return;
-        }
-        node = node->next;
-    }
-}
 
-/* This function essentially marks all of the buffers as free.  If there are
- * more than min_buffers it'll free() the last one.  Kindof a poor boy
- * garbage collection. */
-void
-buff_freeall(void)
-{
-    int n;
-    dax_buffnode *node, *last;
-
-    n = 0;
-    node = _buffer;
-    last = NULL;
-
-    while(node != NULL) {
-        node->fd = 0;
-        node->index = 0;
-        n++;
-        /* If we are the last node, there are more than min_buffers nodes in the list
-           and last is not NULL then free the last node */
-        if(node->next == NULL && n > opt_min_buffers() && last != NULL) {
-            free(node);
-            node = NULL;
-            last->next = NULL;
+    pthread_mutex_lock(&_buffer_lock);
+    if(fd >= 0 && fd < _buffsize && _buffers[fd] != NULL) {
+        node = _buffers[fd];
+        _buffers[fd] = NULL;
+        _chunk_free(node);
+        if(_freecount < opt_min_buffers()) {
+            node->next = _freelist;
+            _freelist = node;
+            _freecount++;
         } else {
-            last = node;
-            node = node->next;
+            free(node);
         }
     }
+    pthread_mutex_unlock(&_buffer_lock);
 }
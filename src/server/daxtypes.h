@@ -30,16 +30,30 @@
 #define MFLAG_RESTART       0x01
 #define MFLAG_OPENPIPES     0x02
 #define MFLAG_REGISTER      0x04
+#define MFLAG_EVENT_BATCH   0x08 /* Module can unpack batched event messages */
+#define MFLAG_EVENT_PENDING 0x10 /* Module has events waiting in it's batch */
+#define MFLAG_TAG_NOTIFY    0x20 /* Module is told when tags are deleted */
 
 /* Flag bits for the tag data groups */
 #define GRP_FLAG_NOT_EMPTY  0x01
+#define GRP_FLAG_VIRTUAL    0x02 /* Some of the members are virtual tags */
 
-/* Tag groups are an array of handles in each module */
+/* A piece of the data in a tag group.  Members that follow each other in
+ * the same tag are put together into a single run when the group is added */
+typedef struct group_run_t {
+    tag_index idx;     /* Tag that the data comes from */
+    uint32_t offset;   /* Byte offset within the tag */
+    uint32_t size;     /* Number of bytes */
+} group_run;
+
+/* Tag groups are an array of runs in each module */
 typedef struct tag_group_t {
     uint8_t flags;    /* option flags for the group */
     unsigned int size; /* amount of memory needed to transfer this group */
-    uint8_t count;    /* number of members in this group */
-    tag_handle *members;
+    uint32_t count;    /* number of members in this group */
+    uint32_t run_count; /* number of runs that the members were put into */
+    group_run *runs;
+    struct group_sub_t *sub; /* Change tracking if the module subscribed.  See groups.c */
 } tag_group;
 
 /* Modules are implemented as a circular doubly linked list */
@@ -55,6 +69,11 @@ typedef struct dax_Module {
     int event_count;
     tag_group *tag_groups; /* Array of tag group packet definitions */
     uint32_t groups_size;  /* Current size of the group array */
+    uint8_t *ebuff;        /* Event messages waiting to be sent as a batch */
+    uint32_t ebuff_size;   /* Number of bytes used in ebuff */
+    int ebuff_count;       /* Number of event messages in ebuff */
+    uint32_t ebatch_gen;   /* Incremented each time the batch is sent */
+    struct dax_Module *ebatch_next; /* List of modules with pending batches */
     struct dax_Module *next, *prev;
 } dax_module;
 
@@ -0,0 +1,280 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  This file contains the compare and update functions that are used by the
+ *  change, set and reset events.  Each of these events keeps a copy of the
+ *  tag data (or a bit map for set and reset) in the event's test area.  When
+ *  the tag is written we have to find out if anything hit and then bring the
+ *  test area up to date.  Rather than going through the data a byte or a bit
+ *  at a time we work on 64 bit words, or 16 or 32 bytes at a time with SSE2
+ *  or AVX2 when the CPU has it.  The bit events only need to know if any bit
+ *  hit so they are done with masks on the partial bytes at each end of the
+ *  range and the same block functions in between.
+ */
+
+#include <string.h>
+#include "evcmp.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define EVCMP_X86
+#  include <immintrin.h>
+#endif
+
+typedef int (*_update_func)(uint8_t *test, const uint8_t *data, size_t len, int op);
+
+static int _update_auto(uint8_t *test, const uint8_t *data, size_t len, int op);
+
+static _update_func _update = _update_auto;
+
+/* Compares and updates a single byte.  Only the bits in mask are considered */
+static inline int
+_update_byte(uint8_t *test, uint8_t data, uint8_t mask, int op)
+{
+    uint8_t hit, new;
+
+    switch(op) {
+        case EVCMP_CHANGE:
+            hit = *test ^ data;
+            new = data;
+            break;
+        case EVCMP_SET:
+            hit = data & ~*test;
+            new = data;
+            break;
+        default: /* EVCMP_RESET */
+            hit = ~data & ~*test;
+            new = ~data;
+            break;
+    }
+    *test = (*test & ~mask) | (new & mask);
+    return (hit & mask) != 0;
+}
+
+/* The op argument is always a constant where these are called so the
+ * compiler gets rid of the switch inside the loops */
+static inline __attribute__((always_inline)) int
+_update_word_op(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    uint64_t a, b, hit = 0;
+    size_t n;
+
+    for(n = 0; n + sizeof(uint64_t) <= len; n += sizeof(uint64_t)) {
+        memcpy(&a, &test[n], sizeof(uint64_t));
+        memcpy(&b, &data[n], sizeof(uint64_t));
+        switch(op) {
+            case EVCMP_CHANGE:
+                hit |= a ^ b;
+                break;
+            case EVCMP_SET:
+                hit |= b & ~a;
+                break;
+            default:
+                hit |= ~b & ~a;
+                b = ~b;
+                break;
+        }
+        memcpy(&test[n], &b, sizeof(uint64_t));
+    }
+    for(; n < len; n++) {
+        hit |= _update_byte(&test[n], data[n], 0xFF, op);
+    }
+    return hit != 0;
+}
+
+static int
+_update_word(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    switch(op) {
+        case EVCMP_CHANGE:
+            return _update_word_op(test, data, len, EVCMP_CHANGE);
+        case EVCMP_SET:
+            return _update_word_op(test, data, len, EVCMP_SET);
+        default:
+            return _update_word_op(test, data, len, EVCMP_RESET);
+    }
+}
+
+#ifdef EVCMP_X86
+
+static inline __attribute__((always_inline, target("sse2"))) int
+_update_sse2_op(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    __m128i a, b, hit, ones;
+    size_t n;
+
+    hit = _mm_setzero_si128();
+    ones = _mm_set1_epi8(-1);
+    for(n = 0; n + 16 <= len; n += 16) {
+        a = _mm_loadu_si128((const __m128i *)&test[n]);
+        b = _mm_loadu_si128((const __m128i *)&data[n]);
+        switch(op) {
+            case EVCMP_CHANGE:
+                hit = _mm_or_si128(hit, _mm_xor_si128(a, b));
+                break;
+            case EVCMP_SET:
+                hit = _mm_or_si128(hit, _mm_andnot_si128(a, b));
+                break;
+            default:
+                hit = _mm_or_si128(hit, _mm_xor_si128(_mm_or_si128(a, b), ones));
+                b = _mm_xor_si128(b, ones);
+                break;
+        }
+        _mm_storeu_si128((__m128i *)&test[n], b);
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128())) != 0xFFFF) {
+        _update_word_op(&test[n], &data[n], len - n, op);
+        return 1;
+    }
+    return _update_word_op(&test[n], &data[n], len - n, op);
+}
+
+static __attribute__((target("sse2"))) int
+_update_sse2(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    switch(op) {
+        case EVCMP_CHANGE:
+            return _update_sse2_op(test, data, len, EVCMP_CHANGE);
+        case EVCMP_SET:
+            return _update_sse2_op(test, data, len, EVCMP_SET);
+        default:
+            return _update_sse2_op(test, data, len, EVCMP_RESET);
+    }
+}
+
+static inline __attribute__((always_inline, target("avx2"))) int
+_update_avx2_op(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    __m256i a, b, hit, ones;
+    size_t n;
+
+    hit = _mm256_setzero_si256();
+    ones = _mm256_set1_epi8(-1);
+    for(n = 0; n + 32 <= len; n += 32) {
+        a = _mm256_loadu_si256((const __m256i *)&test[n]);
+        b = _mm256_loadu_si256((const __m256i *)&data[n]);
+        switch(op) {
+            case EVCMP_CHANGE:
+                hit = _mm256_or_si256(hit, _mm256_xor_si256(a, b));
+                break;
+            case EVCMP_SET:
+                hit = _mm256_or_si256(hit, _mm256_andnot_si256(a, b));
+                break;
+            default:
+                hit = _mm256_or_si256(hit, _mm256_xor_si256(_mm256_or_si256(a, b), ones));
+                b = _mm256_xor_si256(b, ones);
+                break;
+        }
+        _mm256_storeu_si256((__m256i *)&test[n], b);
+    }
+    if(!_mm256_testz_si256(hit, hit)) {
+        _update_word_op(&test[n], &data[n], len - n, op);
+        return 1;
+    }
+    return _update_word_op(&test[n], &data[n], len - n, op);
+}
+
+static __attribute__((target("avx2"))) int
+_update_avx2(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    switch(op) {
+        case EVCMP_CHANGE:
+            return _update_avx2_op(test, data, len, EVCMP_CHANGE);
+        case EVCMP_SET:
+            return _update_avx2_op(test, data, len, EVCMP_SET);
+        default:
+            return _update_avx2_op(test, data, len, EVCMP_RESET);
+    }
+}
+
+#endif /* EVCMP_X86 */
+
+/* The first call lands here and picks the implementation.  If two threads
+ * get here at the same time they just store the same pointer. */
+static int
+_update_auto(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    evcmp_select(EVCMP_AUTO);
+    return _update(test, data, len, op);
+}
+
+/* Choose the implementation of the block functions.  This is mostly for
+ * the tests and benchmarks, the server just uses the best one.  Returns
+ * the implementation that was selected or -1 if the CPU doesn't support
+ * the one that was asked for. */
+int
+evcmp_select(int impl)
+{
+#ifdef EVCMP_X86
+    __builtin_cpu_init();
+    if(impl == EVCMP_AUTO) {
+        if(__builtin_cpu_supports("avx2")) impl = EVCMP_AVX2;
+        else if(__builtin_cpu_supports("sse2")) impl = EVCMP_SSE2;
+        else impl = EVCMP_WORD;
+    }
+    if(impl == EVCMP_AVX2 && __builtin_cpu_supports("avx2")) {
+        _update = _update_avx2;
+        return impl;
+    }
+    if(impl == EVCMP_SSE2 && __builtin_cpu_supports("sse2")) {
+        _update = _update_sse2;
+        return impl;
+    }
+#else
+    if(impl == EVCMP_AUTO) impl = EVCMP_WORD;
+#endif
+    if(impl == EVCMP_WORD) {
+        _update = _update_word;
+        return impl;
+    }
+    return -1;
+}
+
+/* Compares len bytes of data with test according to op and then updates
+ * test.  Returns 1 if the event hit and 0 otherwise. */
+int
+evcmp_update(uint8_t *test, const uint8_t *data, size_t len, int op)
+{
+    return _update(test, data, len, op);
+}
+
+/* Same as above but only looks at count bits starting at the given bit
+ * of the first byte.  The bits in test line up with the bits in data. */
+int
+evcmp_update_bits(uint8_t *test, const uint8_t *data, int bit, int count, int op)
+{
+    int n, last, end, result = 0;
+
+    if(count <= 0) return 0;
+    n = bit / 8;
+    bit %= 8;
+    last = n * 8 + bit + count; /* One past the last bit */
+    end = last / 8;             /* Byte that holds the last bit if it's partial */
+    if(n == end) { /* All the bits are in a single byte */
+        return _update_byte(&test[n], data[n], (0xFF << bit) & (0xFF >> (8 - last % 8)), op);
+    }
+    if(bit) {
+        result |= _update_byte(&test[n], data[n], 0xFF << bit, op);
+        n++;
+    }
+    if(end > n) {
+        result |= _update(&test[n], &data[n], end - n, op);
+    }
+    if(last % 8) {
+        result |= _update_byte(&test[end], data[end], 0xFF >> (8 - last % 8), op);
+    }
+    return result;
+}
@@ -0,0 +1,44 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+
+ *  Header file for the compare and update functions that the change, set
+ *  and reset events use
+ */
+
+#ifndef __EVCMP_H
+#define __EVCMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Operations */
+#define EVCMP_CHANGE  0 /* Hit if any bit is different, test becomes data */
+#define EVCMP_SET     1 /* Hit if any bit is set in data and not in test, test becomes data */
+#define EVCMP_RESET   2 /* Hit if any bit is clear in both, test becomes ~data */
+
+/* Implementations */
+#define EVCMP_AUTO   -1 /* The best one that this CPU supports */
+#define EVCMP_WORD    0 /* 64 bit words, works everywhere */
+#define EVCMP_SSE2    1
+#define EVCMP_AVX2    2
+
+int evcmp_select(int impl);
+int evcmp_update(uint8_t *test, const uint8_t *data, size_t len, int op);
+int evcmp_update_bits(uint8_t *test, const uint8_t *data, int bit, int count, int op);
+
+#endif /* !__EVCMP_H */
@@ -21,6 +21,7 @@
 #include <common.h>
 #include "tagbase.h"
 #include "func.h"
+#include "evcmp.h"
 #include <ctype.h>
 #include <assert.h>
 
@@ -28,29 +29,116 @@ pthread_mutex_t _event_lock;
 
 extern _dax_tag_db *_db;
 
+/* Events that fire while a message is being handled are not written to the
+ * modules right away.  They are collected in a buffer in each module and
+ * sent as a single message when the handler is finished.  This way a write
+ * that fires a lot of events only costs one system call for each module.
+ * Only modules that told us at registration that they can unpack these get
+ * them.  The list of modules that have something waiting is kept for each
+ * thread because each worker handles it's own message.  The buffers are only
+ * touched with the tagbase write lock held. */
+static __thread int _batching;
+static __thread dax_module *_batch_head;
+
 /* Private function definitions */
 
+/* Write a complete event message into buff */
+static void
+_build_event(uint8_t *buff, tag_index idx, _dax_event *event, uint32_t datasize)
+{
+    *(uint32_t *)(&buff[0])  = htonl(datasize + 8); /* The size that we send */
+    *(uint32_t *)(&buff[4])  = htonl(MSG_EVENT | event->eventtype);
+    *(uint32_t *)(&buff[8])  = htonl(idx);
+    *(uint32_t *)(&buff[12])  = htonl(event->id);
+    if(datasize) {
+        memcpy(&buff[16], &_db[idx].data[event->byte], datasize);
+    }
+}
+
+/* Write the module's waiting events.  A single event is sent as it is,
+ * more than one is wrapped in an EVENT_BATCH message */
+static void
+_batch_send(dax_module *mod)
+{
+    int result;
+
+    if(mod->ebuff_count == 0) return;
+    xlog(LOG_MSG, "Sending %d events to module %d", mod->ebuff_count, mod->fd);
+    if(mod->ebuff_count == 1) {
+        result = xwrite(mod->fd, &mod->ebuff[MSG_HDR_SIZE], mod->ebuff_size - MSG_HDR_SIZE);
+    } else {
+        *(uint32_t *)(&mod->ebuff[0]) = htonl(mod->ebuff_size - MSG_HDR_SIZE);
+        *(uint32_t *)(&mod->ebuff[4]) = htonl(MSG_EVENT | EVENT_BATCH);
+        result = xwrite(mod->fd, mod->ebuff, mod->ebuff_size);
+    }
+    if(result < 0) {
+        xerror("_batch_send: %s", strerror(errno));
+    }
+    mod->ebuff_size = MSG_HDR_SIZE;
+    mod->ebuff_count = 0;
+    mod->ebatch_gen++;
+}
+
+/* Adds the event message to the module's batch.  msgsize is the size of the
+ * whole event message and it has already been checked to fit. */
+static int
+_batch_event(tag_index idx, _dax_event *event, uint32_t datasize)
+{
+    dax_module *mod;
+    uint32_t msgsize;
+
+    mod = event->notify;
+    msgsize = datasize + 16;
+    if(mod->ebuff == NULL) {
+        mod->ebuff = xmalloc(DAX_MSGMAX);
+        if(mod->ebuff == NULL) return ERR_ALLOC;
+        mod->ebuff_size = MSG_HDR_SIZE;
+    }
+    /* If this event is already in the batch we just update it */
+    if((event->options & EVENT_OPT_COALESCE) && event->batch_pos &&
+        event->batch_gen == mod->ebatch_gen) {
+        _build_event(&mod->ebuff[event->batch_pos], idx, event, datasize);
+        return 0;
+    }
+    if(mod->ebuff_size + msgsize > DAX_MSGMAX) {
+        _batch_send(mod);
+    }
+    _build_event(&mod->ebuff[mod->ebuff_size], idx, event, datasize);
+    event->batch_gen = mod->ebatch_gen;
+    event->batch_pos = mod->ebuff_size;
+    mod->ebuff_size += msgsize;
+    mod->ebuff_count++;
+    if(!(mod->flags & MFLAG_EVENT_PENDING)) {
+        mod->flags |= MFLAG_EVENT_PENDING;
+        mod->ebatch_next = _batch_head;
+        _batch_head = mod;
+    }
+    return 0;
+}
+
 static int
 _send_event(tag_index idx, _dax_event *event)
 {
     int result;
-    char buff[DAX_MSGMAX];
-    uint32_t msgsize;
+    uint8_t buff[DAX_MSGMAX];
+    uint32_t msgsize, datasize;
 
     if(event->options & EVENT_OPT_SEND_DATA) {
-        msgsize = event->size + 16; /* Calculate the total size of this message */
-        *(uint32_t *)(&buff[0])  = htonl(event->size + 8); /* The size that we send */
+        datasize = event->size;
     } else {
-        msgsize = 16; /* Calculate the total size of this message */
-        *(uint32_t *)(&buff[0])  = htonl(8); /* The size that we send */
+        datasize = 0;
     }
+    msgsize = datasize + 16; /* Calculate the total size of this message */
     if(msgsize > DAX_MSGMAX) return ERR_2BIG;
-    *(uint32_t *)(&buff[4])  = htonl(MSG_EVENT | event->eventtype);
-    *(uint32_t *)(&buff[8])  = htonl(idx);
-    *(uint32_t *)(&buff[12])  = htonl(event->id);
-    if(event->options & EVENT_OPT_SEND_DATA) {
-        memcpy(&buff[16], &_db[idx].data[event->byte], event->size);
+    if(_batching && (event->notify->flags & MFLAG_EVENT_BATCH) &&
+       msgsize <= MSG_DATA_SIZE) {
+        if(_batch_event(idx, event, datasize) == 0) return 0;
+    }
+    /* Anything that is already waiting has to go first */
+    if(event->notify->flags & MFLAG_EVENT_PENDING) {
+        _batch_send(event->notify);
     }
+    _build_event(buff, idx, event, datasize);
     xlog(LOG_MSG, "Sending %d event to module %d",
          event->eventtype, event->notify->fd);
     result = xwrite(event->notify->fd, buff, msgsize);
@@ -61,115 +149,92 @@ _send_event(tag_index idx, _dax_event *event)
     return 0;
 }
 
+/* Start collecting events.  This is called by the message dispatcher
+ * before each message is handled. */
+void
+event_batch_begin(void)
+{
+    _batching = 1;
+}
+
+/* Send all of the events that have been collected so far.  This is called
+ * before a response is sent so that a module always gets the events that
+ * were caused by a request before the response to that request. */
+void
+event_batch_send(void)
+{
+    dax_module *mod;
+
+    while(_batch_head != NULL) {
+        mod = _batch_head;
+        _batch_head = mod->ebatch_next;
+        mod->flags &= ~MFLAG_EVENT_PENDING;
+        _batch_send(mod);
+    }
+}
+
+/* Send whatever is left and stop collecting.  This has to be called before
+ * the tagbase lock is let go */
+void
+event_batch_flush(void)
+{
+    event_batch_send();
+    _batching = 0;
+}
+
+/* Throw away the module's waiting events.  The module is going away. */
+static void
+_batch_drop(dax_module *module)
+{
+    dax_module **this;
+
+    if(!(module->flags & MFLAG_EVENT_PENDING)) return;
+    for(this = &_batch_head; *this != NULL; this = &(*this)->ebatch_next) {
+        if(*this == module) {
+            *this = module->ebatch_next;
+            break;
+        }
+    }
+    module->flags &= ~MFLAG_EVENT_PENDING;
+    module->ebuff_size = MSG_HDR_SIZE;
+    module->ebuff_count = 0;
+    module->ebatch_gen++;
+}
+
+/* The change, set and reset events keep the last state of the data in the
+ * test area and the functions in evcmp.c do the compare and update */
 static inline int
 _event_change(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, len, result;
+    int len;
     uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
 
     if(event->datatype == DAX_BOOL) {
-        /* TODO: Only check the bits that have changed.  For now we are just
-         * looping through each bit in the event to see if anything has
-         * changed.  This can be made much more efficient. */
         this = (uint8_t *)event->test;
         that = (uint8_t *)&(_db[idx].data[event->byte]);
-        bit = event->bit;
-        i = 0;
-        for(n = 0; n < event->count; n++) {
-            mask = (0x01 << bit);
-            if((this[i] & mask) != (that[i] & mask)) {
-                this[i] = that[i];
-                result = 1;
-            }
-            bit++;
-            if(bit == 8) {
-                bit = 0;
-                i++;
-            }
-        }
-
+        return evcmp_update_bits(this, that, event->bit, event->count, EVCMP_CHANGE);
     } else {
         this = (uint8_t *)event->test + MAX(0, offset - event->byte);
         that = (uint8_t *)&(_db[idx].data[MAX(offset, event->byte)]);
         len = MIN(event->byte + event->size, offset + size) - MAX(offset, event->byte);
-
-        for(n = 0; n < len; n++) {
-            if(this[n] != that[n]) {
-                result = 1;
-                this[n] = that[n];
-            }
-        }
+        return evcmp_update(this, that, len, EVCMP_CHANGE);
     }
-    return result;
 }
 
-/* Checks to see if the bit is set and whether or not the event has been sent */
+/* Checks to see if the bit is set and whether or not the event has been sent.
+ * The bits in the test area are set once the event has been sent for that
+ * bit and cleared when the bit is cleared so the event will fire next time. */
 static inline int
 _event_set(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, result;
-    uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
-    /* TODO: Only check the bits that have changed.  For now we are just
-     * looping through each bit in the event to see if anything has
-     * changed.  This can be made much more efficient. */
-    this = (uint8_t *)event->test;
-    that = (uint8_t *)&(_db[idx].data[event->byte]);
-    bit = event->bit;
-    i = 0;
-    for(n = 0; n < event->count; n++) {
-        mask = (0x01 << bit);
-        if(that[i] & mask) {
-            if(!(this[i] & mask)) {
-                result = 1;
-                this[i] |= mask; /* Set flag so we don't do this next time */
-            }
-        } else {
-            this[i] &= ~mask; /* Unset flag so event will fire next time */
-        }
-        bit++;
-        if(bit == 8) {
-            bit = 0;
-            i++;
-        }
-    }
-    return result;
+    return evcmp_update_bits((uint8_t *)event->test,
+                             (uint8_t *)&(_db[idx].data[event->byte]),
+                             event->bit, event->count, EVCMP_SET);
 }
 
 static inline int
 _event_reset(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, result;
-    uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
-    /* TODO: Only check the bits that have changed.  For now we are just
-     * looping through each bit in the event to see if anything has
-     * changed.  This can be made much more efficient. */
-    this = (uint8_t *)event->test;
-    that = (uint8_t *)&(_db[idx].data[event->byte]);
-    bit = event->bit;
-    i = 0;
-    for(n = 0; n < event->count; n++) {
-        mask = (0x01 << bit);
-        if(!(that[i] & mask)) {
-            if(!(this[i] & mask)) {
-                result = 1;
-                this[i] |= mask; /* Set flag so we don't do this next time */
-            }
-        } else {
-            this[i] &= ~mask; /* Unset flag so event will fire next time */
-        }
-        bit++;
-        if(bit == 8) {
-            bit = 0;
-            i++;
-        }
-    }
-    return result;
+    return evcmp_update_bits((uint8_t *)event->test,
+                             (uint8_t *)&(_db[idx].data[event->byte]),
+                             event->bit, event->count, EVCMP_RESET);
 }
 
 static inline int
@@ -391,6 +456,104 @@ _event_hit(_dax_event *event, tag_index idx, int offset, int size) {
     return 0;
 }
 
+/* Besides the linked list, the events for each tag are kept in an array
+ * that is sorted by the first byte of the event.  The array is treated as an
+ * implicit balanced binary tree.  The middle entry of any range of the array
+ * is the root of that range and each entry keeps the largest end byte of
+ * itself and all of the entries below it.  This lets event_check() skip
+ * whole parts of the array that cannot overlap the data that was written,
+ * so a small write to a large array only looks at the events that it touches.
+ * The events are few and change rarely compared to the writes so we simply
+ * rebuild the maximums whenever an event is added or deleted.  Returns the
+ * largest end in the given range. */
+static uint32_t
+_index_build(_dax_event_range *r, int lo, int hi) {
+    int mid;
+    uint32_t max, end;
+
+    if(lo >= hi) return 0;
+    mid = lo + (hi - lo) / 2;
+    max = r[mid].end;
+    end = _index_build(r, lo, mid);
+    if(end > max) max = end;
+    end = _index_build(r, mid + 1, hi);
+    if(end > max) max = end;
+    r[mid].maxend = max;
+    return max;
+}
+
+static int
+_index_add(tag_index idx, _dax_event *event) {
+    _dax_event_range *new;
+    int lo, hi, mid, size;
+
+    if(_db[idx].evcount == _db[idx].evsize) {
+        size = _db[idx].evsize ? _db[idx].evsize * 2 : 4;
+        new = xrealloc(_db[idx].evindex, size * sizeof(_dax_event_range));
+        if(new == NULL) return ERR_ALLOC;
+        _db[idx].evindex = new;
+        _db[idx].evsize = size;
+    }
+    /* Find the first entry that starts after this one */
+    lo = 0;
+    hi = _db[idx].evcount;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(_db[idx].evindex[mid].start <= event->byte) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    memmove(&_db[idx].evindex[lo + 1], &_db[idx].evindex[lo],
+            (_db[idx].evcount - lo) * sizeof(_dax_event_range));
+    _db[idx].evindex[lo].start = event->byte;
+    _db[idx].evindex[lo].end = event->byte + event->size;
+    _db[idx].evindex[lo].event = event;
+    _db[idx].evcount++;
+    _index_build(_db[idx].evindex, 0, _db[idx].evcount);
+    return 0;
+}
+
+static void
+_index_del(tag_index idx, _dax_event *event) {
+    int n;
+
+    for(n = 0; n < _db[idx].evcount; n++) {
+        if(_db[idx].evindex[n].event == event) {
+            _db[idx].evcount--;
+            memmove(&_db[idx].evindex[n], &_db[idx].evindex[n + 1],
+                    (_db[idx].evcount - n) * sizeof(_dax_event_range));
+            _index_build(_db[idx].evindex, 0, _db[idx].evcount);
+            return;
+        }
+    }
+}
+
+/* Walks the part of the index between lo and hi in order and checks every
+ * event that overlaps the bytes from offset up to end */
+static void
+_index_check(tag_index idx, int lo, int hi, uint32_t offset, uint32_t end) {
+    _dax_event_range *r;
+    int mid;
+
+    r = _db[idx].evindex;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        /* Nothing at or below this entry reaches the written data */
+        if(r[mid].maxend <= offset) return;
+        _index_check(idx, lo, mid, offset, end);
+        /* This entry and everything after it start past the written data */
+        if(r[mid].start >= end) return;
+        if(r[mid].end > offset) {
+            if(_event_hit(r[mid].event, idx, offset, end - offset)) {
+                _send_event(idx, r[mid].event);
+            }
+        }
+        lo = mid + 1;
+    }
+}
+
 /* This function checks to see if an event has occurred.  It should be
  * called from the tag_write() function or the tag_mask_write() function.
  * If it decides that there is an event match to the data area given then
@@ -398,27 +561,10 @@ _event_hit(_dax_event *event, tag_index idx, int offset, int size) {
  * the proper module. This function assumes that the events that are stored
  * with events that make sense so it does no checking.  There is no return type
  * because there are no possible errors, and no information to pass back. */
-/* TODO: The event list should be sorted in increasing order of the bottom of
- * the range so that this function would not have to run through all of the
- * events.  For now we keep it simple. */
 void
 event_check(tag_index idx, int offset, int size) {
-    _dax_event *this;
-
-    this = _db[idx].events;
-
-    while(this != NULL) {
-        /* This is to check whether the the data rages intersect.  If this
-         * test passes then we have manipulated the data associated with
-         * this event. */
-        if(offset <= (this->byte + this->size - 1) && (offset + size -1 ) >= this->byte) {
-            if(_event_hit(this, idx, offset, size)) {
-                _send_event(idx, this);
-            }
-        }
-        this = this->next;
-    }
-    return;
+    if(_db[idx].evcount == 0 || size <= 0) return;
+    _index_check(idx, 0, _db[idx].evcount, offset, offset + size);
 }
 
 /* This function checks to see if the tag has a deleted event.  This
@@ -499,7 +645,8 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
         case EVENT_CHANGE:
             datasize = 0;
             if(event->datatype == DAX_BOOL) {
-                testsize = (event->count - 1)/8 + 1;
+                /* The bits in the test area line up with the tag data */
+                testsize = (event->bit + event->count - 1)/8 + 1;
             } else {
                 testsize = type_size(event->datatype) * event->count;
             }
@@ -512,7 +659,7 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
         case EVENT_SET:
         case EVENT_RESET:
             datasize = 0;
-            testsize = (event->count - 1)/8 + 1;
+            testsize = (event->bit + event->count - 1)/8 + 1;
             break;
         case EVENT_EQUAL:
         case EVENT_GREATER:
@@ -523,6 +670,7 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
     }
     /* Allocate the memory that we need */
     if(datasize > 0) {
+        if(data == NULL) return ERR_ARG;
         event->data = malloc(datasize);
         if(event->data == NULL) {
             xerror("event_add() - Unable to allocate memory for event data");
@@ -570,6 +718,15 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
     return 0;
 }
 
+/* Frees the memory associated with an event.  Pass a NULL pointer
+ * and bad things will happen. */
+static void
+_free_event(_dax_event *event) {
+    if(event->data != NULL) free(event->data);
+    if(event->test != NULL) free(event->test);
+    free(event);
+}
+
 /* Add the event defined.  Return the event id. 'h' is a handle to the tag
  * data that the event is tied too.  'event_type' is the type of event (see
  * opendax.h for #defines.  'data' is any data that may need to be
@@ -577,7 +734,7 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
 int
 event_add(tag_handle h, int event_type, void *data, dax_module *module)
 {
-    _dax_event *head, *new;
+    _dax_event *new;
     int result;
 
     /* Bounds check handle */
@@ -621,38 +778,28 @@ event_add(tag_handle h, int event_type, void *data, dax_module *module)
     new->datatype = h.type;
     new->eventtype = event_type;
     new->notify = module;
+    new->batch_gen = 0;
+    new->batch_pos = 0;
     result = _set_event_data(new, h.index, data);
     if(result) {
         free(new);
         return result;
     }
 
-    head = _db[h.index].events;
-    /* If the list is empty put it on top */
-    if(head == NULL) {
-        new->next = NULL;
-        _db[h.index].events = new;
-    } else {
-        /* For now we are not going to sort these events.  The right optimization
-         * would be to sort by the bottom of the range.  This way the
-         * _event_check() function could stop once the top of the updated
-         * range is greater than the bottom of the range of the event. */
-        new->next = _db[h.index].events;
-        _db[h.index].events = new;
+    /* Deleted events don't watch any data so they are only kept in the list */
+    if(event_type != EVENT_DELETED) {
+        result = _index_add(h.index, new);
+        if(result) {
+            _free_event(new);
+            return result;
+        }
     }
+    new->next = _db[h.index].events;
+    _db[h.index].events = new;
     module->event_count++; /* Increment the Module's event reference counter */
     return new->id;
 }
 
-/* Frees the memory associated with an event.  Pass a NULL pointer
- * and bad things will happen. */
-static void
-_free_event(_dax_event *event) {
-    if(event->data != NULL) free(event->data);
-    if(event->test != NULL) free(event->test);
-    free(event);
-}
-
 int
 _find_event(_dax_event **event, int index, int id) {
 	_dax_event *this;
@@ -671,51 +818,52 @@ int
 event_del(int index, int id, dax_module *module)
 {
     _dax_event *this, *last;
-    int result = ERR_NOTFOUND;
 
     if(index >= get_tagindex() || index < 0) {
         xerror("event_del() - index %d is out of range\n", index);
+        return ERR_ARG;
     }
+    last = NULL;
     this = _db[index].events;
-    if(this == NULL) return ERR_NOTFOUND;
-    if(this->id == id) {
-        if(this->notify != module) {
-            xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's event");
-            return ERR_AUTH;
-        }
-        _db[index].events = this->next;
-        _free_event(this);
-    }
-    last = this;
-    this = this->next;
     while(this != NULL) {
         if(this->id == id) {
             if(this->notify != module) {
                 xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's event");
                 return ERR_AUTH;
             }
-            last->next = this->next;
+            if(last == NULL) {
+                _db[index].events = this->next;
+            } else {
+                last->next = this->next;
+            }
+            _index_del(index, this);
             _free_event(this);
-            result = 0;
-            break; /* Uggg */
+            module->event_count--;
+            return 0;
         }
         last = this;
         this = this->next;
     }
-    module->event_count--;
-    return result;
+    return ERR_NOTFOUND;
 }
 
-/* Traverse the linked list of events and delete them all */
+/* Delete all of the events that belong to the given tag */
 int
-events_del_all(_dax_event *head) {
+events_del_all(tag_index idx) {
     _dax_event *this, *next;
-    this = head;
+
+    this = _db[idx].events;
     while(this != NULL) {
         next = this->next;
+        this->notify->event_count--;
         _free_event(this);
         this = next;
     }
+    _db[idx].events = NULL;
+    free(_db[idx].evindex);
+    _db[idx].evindex = NULL;
+    _db[idx].evcount = 0;
+    _db[idx].evsize = 0;
     return 0;
 }
 
@@ -744,8 +892,9 @@ event_opt(int index, int id, uint32_t options, dax_module *module) {
 int
 events_cleanup(dax_module *module) {
     int n, count;
-    _dax_event *this;
+    _dax_event *this, *next;
 
+    _batch_drop(module);
     count = get_tagindex();
     /* We start our scan at the bottom and work our way up.  It's probably
      * more likely that our modules events are associated with tags at the
@@ -754,10 +903,11 @@ events_cleanup(dax_module *module) {
         if(_db[n].events != NULL) {
             this = _db[n].events;
             while(this != NULL) {
+                next = this->next; /* event_del() will free this one */
                 if(this->notify == module) {
                     event_del(n, this->id, module);
                 }
-                this = this->next;
+                this = next;
             }
         }
     }
@@ -25,12 +25,131 @@
 #include "libcommon.h"
 #include "groups.h"
 #include "tagbase.h"
+#include "func.h"
+#include <pthread.h>
+#include <arpa/inet.h>
+
+extern _dax_tag_db *_db;
+
+/* Groups that are added with the GROUP_OPT_SUBSCRIBE option are sent to the
+ * module whenever the data in them changes.  Each member has a bit that is
+ * set when some part of it is written.  Each run of the group is put on a
+ * watch list for it's tag so that group_check() only has to look at the
+ * groups that actually have data in the tag that was written, and the members
+ * of the run are in order so the ones that were written can be found with a
+ * binary search.  Groups that have changed are put on the pending list and
+ * are sent at most once per interval by the publishing thread.  Only the
+ * members that changed since the last time are sent.  If the interval is zero
+ * they are sent at the end of the message that changed them instead.
+ *
+ * All of this is protected by the tagbase lock.  Members are only marked
+ * while the write lock is held and the publishing thread takes the write lock
+ * too. */
+struct group_sub_t {
+    dax_module *mod;
+    uint32_t index;      /* Index of the group in the module */
+    uint32_t count;      /* Number of members */
+    group_run *members;  /* Where each member's data is */
+    uint8_t *dirty;      /* One bit for each member that has changed */
+    int pending;         /* Set when the group is on the pending list */
+    struct group_sub_t *next;  /* Next group on the pending list */
+};
+
+typedef struct group_sub_t group_sub;
+
+typedef struct group_watch_t {
+    group_sub *sub;
+    uint32_t start, end;   /* Bytes in the tag that the run covers */
+    uint32_t first, last;  /* Members of the group that are in the run */
+    struct group_watch_t *next;
+} group_watch;
+
+static group_watch **_watch;  /* Watch lists indexed by tag */
+static tag_index _watch_size;
+static group_sub *_pending;   /* Groups that have changes waiting */
+static int _interval;         /* Milliseconds between sends */
+static pthread_t _publish_thread;
 
 static void
 _init_group(tag_group *grp) {
     grp->size = 0;
     grp->flags = 0x00;
-    grp->members = NULL;
+    grp->count = 0;
+    grp->run_count = 0;
+    grp->runs = NULL;
+    grp->sub = NULL;
+}
+
+static void
+_mark_member(group_sub *sub, uint32_t n) {
+    sub->dirty[n / 8] |= 1 << (n % 8);
+    if(! sub->pending) {
+        sub->pending = 1;
+        sub->next = _pending;
+        __atomic_store_n(&_pending, sub, __ATOMIC_RELEASE);
+    }
+}
+
+/* Puts the runs of the group on the watch lists.  first[] is the index of
+ * the first member of each run. */
+static int
+_watch_group(tag_group *group, uint32_t *first) {
+    group_watch **new, *w;
+    tag_index size;
+    uint32_t n;
+
+    for(n = 0; n < group->run_count; n++) {
+        if(group->runs[n].idx >= _watch_size) {
+            size = get_tagindex();
+            new = realloc(_watch, sizeof(group_watch *) * size);
+            if(new == NULL) return ERR_ALLOC;
+            bzero(&new[_watch_size], sizeof(group_watch *) * (size - _watch_size));
+            _watch = new;
+            _watch_size = size;
+        }
+        w = malloc(sizeof(group_watch));
+        if(w == NULL) return ERR_ALLOC;
+        w->sub = group->sub;
+        w->start = group->runs[n].offset;
+        w->end = group->runs[n].offset + group->runs[n].size;
+        w->first = first[n];
+        w->last = n + 1 < group->run_count ? first[n + 1] : group->count;
+        w->next = _watch[group->runs[n].idx];
+        _watch[group->runs[n].idx] = w;
+    }
+    return 0;
+}
+
+/* Takes the group off of the watch lists and the pending list and frees it */
+static void
+_unsubscribe(tag_group *group) {
+    group_sub *sub, **sp;
+    group_watch *w, **wp;
+    uint32_t n;
+
+    sub = group->sub;
+    if(sub == NULL) return;
+    for(n = 0; n < group->run_count; n++) {
+        if(group->runs[n].idx >= _watch_size) continue;
+        wp = &_watch[group->runs[n].idx];
+        while(*wp != NULL) {
+            w = *wp;
+            if(w->sub == sub) {
+                *wp = w->next;
+                free(w);
+            } else {
+                wp = &w->next;
+            }
+        }
+    }
+    if(sub->pending) {
+        for(sp = &_pending; *sp != sub; sp = &(*sp)->next);
+        *sp = sub->next;
+    }
+    free(sub->members);
+    free(sub->dirty);
+    free(sub);
+    group->sub = NULL;
 }
 
 
@@ -74,87 +193,221 @@ _group_add(dax_module *mod) {
 /* This adds a tag group to the given module.  It simply determines if there
  * is space on the currently allocated array and if not allocates more space.
  * The handles array is the part of the message buffer that contains the
- * tag handle data
+ * tag handle data.  The handles are checked here and put together into
+ * runs of data so that reading and writing the group doesn't have to do
+ * it all again each time.  If the GROUP_OPT_SUBSCRIBE option is set the
+ * changes to the group will be sent to the module.
  * Returns the index of the new group.
  */
 int
-group_add(dax_module *mod, uint8_t *handles, uint8_t count) {
-    int index, datasize, offset;
+group_add(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options) {
+    int index, offset, result;
+    uint32_t datasize, tagsize, n;
+    uint32_t *first = NULL;
+    tag_handle h;
+    group_run *runs, *run;
+    group_sub *sub = NULL;
+    tag_group *group;
 
     if(count > TAG_GROUP_MAX_MEMBERS) return ERR_ARG;
-    index = _group_add(mod);
-    if(index < 0) return index; /* Pass the error on up */
-    mod->tag_groups[index].members = (tag_handle *)malloc(sizeof(tag_handle) * count);
-    if(mod->tag_groups[index].members == NULL) return ERR_ALLOC;
-    /* Check to make sure the size of the group is within bounds */
+    runs = NULL;
+    if(count) {
+        runs = (group_run *)malloc(sizeof(group_run) * count);
+        if(runs == NULL) return ERR_ALLOC;
+    }
+    if(options & GROUP_OPT_SUBSCRIBE) {
+        sub = malloc(sizeof(group_sub));
+        if(sub != NULL) {
+            sub->members = malloc(sizeof(group_run) * (count ? count : 1));
+            sub->dirty = malloc(count / 8 + 1);
+        }
+        first = malloc(sizeof(uint32_t) * (count ? count : 1));
+        if(sub == NULL || sub->members == NULL || sub->dirty == NULL || first == NULL) {
+            result = ERR_ALLOC;
+            goto error;
+        }
+        sub->count = count;
+        sub->pending = 0;
+        /* The first time everything is sent */
+        memset(sub->dirty, 0xFF, count / 8 + 1);
+    }
+    run = NULL;
     datasize = 0;
-    for(int n=0; n<count; n++) {
-        offset = 21*n;
-        memcpy(&mod->tag_groups[index].members[n].index, &handles[offset], 4);
-        memcpy(&mod->tag_groups[index].members[n].byte, &handles[offset+4], 4);
-        mod->tag_groups[index].members[n].bit = handles[offset+8];
-        memcpy(&mod->tag_groups[index].members[n].count, &handles[offset+9], 4);
-        memcpy(&mod->tag_groups[index].members[n].size, &handles[offset+13], 4);
-        memcpy(&mod->tag_groups[index].members[n].type, &handles[offset+17], 4);
+    for(n = 0; n < count; n++) {
+        offset = TAG_GROUP_HANDLE_SIZE * n;
+        memcpy(&h.index, &handles[offset], 4);
+        memcpy(&h.byte, &handles[offset+4], 4);
+        h.bit = handles[offset+8];
+        memcpy(&h.count, &handles[offset+9], 4);
+        memcpy(&h.size, &handles[offset+13], 4);
+        memcpy(&h.type, &handles[offset+17], 4);
 
-        datasize += mod->tag_groups[index].members[n].size;
-        if(datasize > MSG_TAG_GROUP_DATA_SIZE) {
-            free(mod->tag_groups[index].members);
-            mod->tag_groups[index].members = NULL;
-            return ERR_2BIG;
+        if(h.index < 0 || h.index >= get_tagindex() || _db[h.index].data == NULL) {
+            result = ERR_ARG;
+            goto error;
+        }
+        /* Check to make sure the size of the group is within bounds.  The
+         * byte and size come from the message so they aren't added together
+         * where the sum could wrap. */
+        tagsize = tag_get_size(h.index);
+        if(h.size == 0 || h.byte > tagsize || h.size > tagsize - h.byte) {
+            result = ERR_2BIG;
+            goto error;
+        }
+        datasize += h.size;
+        if(datasize > TAG_GROUP_MAX_SIZE) {
+            result = ERR_2BIG;
+            goto error;
+        }
+        if(sub != NULL) {
+            /* Virtual tags don't tell us when they change and each member
+             * has to fit in a single message with it's index */
+            if(is_tag_virtual(h.index)) {
+                result = ERR_ILLEGAL;
+                goto error;
+            }
+            if(h.size > MSG_DATA_SIZE - GROUP_DELTA_HDR_SIZE - 4) {
+                result = ERR_2BIG;
+                goto error;
+            }
+            sub->members[n].idx = h.index;
+            sub->members[n].offset = h.byte;
+            sub->members[n].size = h.size;
+        }
+        if(run != NULL && run->idx == h.index && run->offset + run->size == h.byte) {
+            run->size += h.size;
+        } else {
+            run = run == NULL ? runs : run + 1;
+            run->idx = h.index;
+            run->offset = h.byte;
+            run->size = h.size;
+            if(first != NULL) first[run - runs] = n;
         }
     }
-
-    mod->tag_groups[index].flags |= GRP_FLAG_NOT_EMPTY;
-    mod->tag_groups[index].count = count;
+    index = _group_add(mod);
+    if(index < 0) { /* Pass the error on up */
+        result = index;
+        goto error;
+    }
+    group = &mod->tag_groups[index];
+    group->runs = runs;
+    group->run_count = run == NULL ? 0 : run - runs + 1;
+    group->flags = GRP_FLAG_NOT_EMPTY;
+    for(n = 0; n < group->run_count; n++) {
+        if(is_tag_virtual(runs[n].idx)) group->flags |= GRP_FLAG_VIRTUAL;
+    }
+    group->count = count;
+    group->size = datasize;
+    if(sub != NULL) {
+        sub->mod = mod;
+        sub->index = index;
+        group->sub = sub;
+        result = _watch_group(group, first);
+        free(first);
+        if(result) {
+            group_del(mod, index);
+            return result;
+        }
+        if(count) _mark_member(sub, 0);
+    }
 
     return index;
+
+error:
+    free(runs);
+    free(first);
+    if(sub != NULL) {
+        free(sub->members);
+        free(sub->dirty);
+        free(sub);
+    }
+    return result;
 }
 
+static tag_group *
+_get_group(dax_module *mod, uint32_t index) {
+    if(mod == NULL || index >= mod->groups_size) return NULL;
+    if((mod->tag_groups[index].flags & GRP_FLAG_NOT_EMPTY) == 0) return NULL;
+    return &mod->tag_groups[index];
+}
 
 /* Deletes a single tag group from the given module */
 int
 group_del(dax_module *mod, int index) {
-    if((mod->tag_groups[index].flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
+    tag_group *group;
 
-    free(mod->tag_groups[index].members);
-    mod->tag_groups[index].flags = 0x00;
-    mod->tag_groups[index].count = 0;
-    mod->groups_size--;
+    group = _get_group(mod, index);
+    if(group == NULL) return ERR_NOTFOUND;
+    _unsubscribe(group);
+    free(group->runs);
+    _init_group(group);
     return 0;
 }
 
-/* loop through the array of members and populate buff with
+/* Returns the size of the data in the group */
+int
+group_get_size(dax_module *mod, uint32_t index) {
+    tag_group *group;
+
+    group = _get_group(mod, index);
+    if(group == NULL) return ERR_NOTFOUND;
+    return group->size;
+}
+
+/* Returns true if the group can be read while other threads are reading
+ * the tag database.  Virtual tags have to be read exclusively. */
+int
+group_is_reader(dax_module *mod, uint32_t index) {
+    tag_group *group;
+
+    group = _get_group(mod, index);
+    /* group_read() will send the error */
+    if(group == NULL) return 1;
+    return (group->flags & GRP_FLAG_VIRTUAL) == 0;
+}
+
+/* loop through the array of runs and populate buff with
  * the data.*/
 int
 group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size) {
-    int n, offset=0, result;
+    int result;
+    uint32_t n, offset = 0;
     tag_group *group;
+    group_run *run;
 
-    group = &mod->tag_groups[index];
-    if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
-    if(group->size > size) return ERR_ARG;
-    for(n = 0;n<group->count;n++) {
-        result = tag_read(group->members[n].index, group->members[n].byte, &buff[offset], group->members[n].size);
-        if(result) return result;
-        offset += group->members[n].size;
+    group = _get_group(mod, index);
+    if(group == NULL) return ERR_NOTFOUND;
+    if((int)group->size > size) return ERR_ARG;
+    for(n = 0; n < group->run_count; n++) {
+        run = &group->runs[n];
+        if(_db[run->idx].data == NULL) return ERR_DELETED;
+        /* tag_read() knows how to deal with these */
+        if(_db[run->idx].attr & (TAG_ATTR_VIRTUAL | TAG_ATTR_OVERRIDE)) {
+            result = tag_read(run->idx, run->offset, &buff[offset], run->size);
+            if(result) return result;
+        } else {
+            memcpy(&buff[offset], &_db[run->idx].data[run->offset], run->size);
+        }
+        offset += run->size;
     }
     return offset;
 }
 
-/* loop through the array of members and populate buff with
- * the data.*/
+/* loop through the array of runs and write the data in buff
+ * to the tags.*/
 int
-group_write(dax_module *mod, uint32_t index, uint8_t *buff) {
-    int n, offset=0, result;
+group_write(dax_module *mod, uint32_t index, uint8_t *buff, int size) {
+    int result;
+    uint32_t n, offset = 0;
     tag_group *group;
 
-    group = &mod->tag_groups[index];
-    if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
-    for(n = 0;n<group->count;n++) {
-        result = tag_write(group->members[n].index, group->members[n].byte, &buff[offset], group->members[n].size);
+    group = _get_group(mod, index);
+    if(group == NULL) return ERR_NOTFOUND;
+    if((int)group->size > size) return ERR_ARG;
+    for(n = 0; n < group->run_count; n++) {
+        result = tag_write(group->runs[n].idx, group->runs[n].offset, &buff[offset], group->runs[n].size);
         if(result) return result;
-        offset += group->members[n].size;
+        offset += group->runs[n].size;
     }
     return offset;
 }
@@ -177,3 +430,136 @@ groups_cleanup(dax_module *mod) {
 }
 
 
+/* Marks the members of the subscribed groups that have data in the part of
+ * the tag that was written.  This is called whenever tag data is changed. */
+void
+group_check(tag_index idx, int offset, int size) {
+    group_watch *w;
+    group_sub *sub;
+    uint32_t lo, hi, mid, end;
+
+    if(idx >= _watch_size || _watch[idx] == NULL) return;
+    end = offset + size;
+    for(w = _watch[idx]; w != NULL; w = w->next) {
+        if((uint32_t)offset >= w->end || end <= w->start) continue;
+        sub = w->sub;
+        /* Find the first member that ends after the offset */
+        lo = w->first;
+        hi = w->last;
+        while(lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if(sub->members[mid].offset + sub->members[mid].size <= (uint32_t)offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for(; lo < w->last && sub->members[lo].offset < end; lo++) {
+            _mark_member(sub, lo);
+        }
+    }
+}
+
+static void
+_send_delta(group_sub *sub, uint8_t *buff, uint32_t size, uint32_t flags) {
+    *(uint32_t *)(&buff[0]) = htonl(size - MSG_HDR_SIZE);
+    *(uint32_t *)(&buff[4]) = htonl(MSG_EVENT | EVENT_GROUP);
+    *(uint32_t *)(&buff[8]) = htonl(sub->index);
+    *(uint32_t *)(&buff[12]) = htonl(flags);
+    if(xwrite(sub->mod->fd, buff, size) < 0) {
+        xerror("_send_delta: %s", strerror(errno));
+    }
+}
+
+/* Sends the members of the group that have changed to the module */
+static void
+_publish(group_sub *sub) {
+    uint8_t buff[DAX_MSGMAX];
+    uint32_t n, pos, start;
+    group_run *m;
+
+    start = MSG_HDR_SIZE + GROUP_DELTA_HDR_SIZE;
+    pos = start;
+    for(n = 0; n < sub->count; n++) {
+        /* Skip over the bytes with nothing in them */
+        if(sub->dirty[n / 8] == 0) {
+            n |= 7;
+            continue;
+        }
+        if((sub->dirty[n / 8] & (1 << (n % 8))) == 0) continue;
+        m = &sub->members[n];
+        if(_db[m->idx].data == NULL) continue;
+        if(pos + 4 + m->size > DAX_MSGMAX) {
+            _send_delta(sub, buff, pos, 0);
+            pos = start;
+        }
+        *(uint32_t *)(&buff[pos]) = htonl(n);
+        if(_db[m->idx].attr & TAG_ATTR_OVERRIDE) {
+            tag_read(m->idx, m->offset, &buff[pos + 4], m->size);
+        } else {
+            memcpy(&buff[pos + 4], &_db[m->idx].data[m->offset], m->size);
+        }
+        pos += 4 + m->size;
+    }
+    if(pos > start) {
+        _send_delta(sub, buff, pos, GROUP_DELTA_LAST);
+    }
+    bzero(sub->dirty, sub->count / 8 + 1);
+}
+
+/* Sends all of the groups that are on the pending list.  Call with the
+ * tagbase write lock held */
+static void
+_publish_pending(void) {
+    group_sub *sub;
+
+    while(_pending != NULL) {
+        sub = _pending;
+        _pending = sub->next;
+        sub->pending = 0;
+        _publish(sub);
+    }
+}
+
+static void *
+_publish_loop(void *arg) {
+    struct timespec ts;
+
+    ts.tv_sec = _interval / 1000;
+    ts.tv_nsec = (_interval % 1000) * 1000000L;
+    while(1) {
+        nanosleep(&ts, NULL);
+        /* This is just a hint so that we don't take the lock for nothing */
+        if(__atomic_load_n(&_pending, __ATOMIC_ACQUIRE) == NULL) continue;
+        tagbase_lock_write();
+        _publish_pending();
+        tagbase_unlock();
+    }
+    return NULL;
+}
+
+/* Sends the changes to the subscribed groups if there is no interval.  This
+ * is called by the message dispatcher after each message is handled. */
+void
+group_batch_flush(void) {
+    if(_interval == 0 && _pending != NULL) {
+        _publish_pending();
+    }
+}
+
+/* interval is the least number of milliseconds between the messages that
+ * are sent for a subscribed group.  If it is zero the changes are sent at the
+ * end of each message that makes them. */
+int
+groups_init(int interval) {
+    _interval = interval;
+    if(_interval > 0) {
+        if(pthread_create(&_publish_thread, NULL, _publish_loop, NULL)) {
+            xerror("Unable to start the group publishing thread");
+            _interval = 0;
+            return ERR_GENERIC;
+        }
+        pthread_detach(_publish_thread);
+    }
+    return 0;
+}
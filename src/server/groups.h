@@ -31,14 +31,22 @@
  * message.  These groups are defined by the clients and then can be
  * read and written as a whole afterwards.
  *
- * Each group is implemented as an array of tag_handles and an
- * array of groups is allocated as necessary for each module.
+ * Each group is implemented as an array of runs of data in the tags and
+ * an array of groups is allocated as necessary for each module.
+ *
+ * Groups can also be subscribed to.  The server then sends the members
+ * of the group that have changed to the module as events.
  */
 
-int group_add(dax_module *mod, uint8_t *handles, uint8_t count);
+int groups_init(int interval);
+int group_add(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options);
 int group_del(dax_module *mod, int index);
+int group_get_size(dax_module *mod, uint32_t index);
+int group_is_reader(dax_module *mod, uint32_t index);
 int group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size);
-int group_write(dax_module *mod, uint32_t index, uint8_t *buff);
+int group_write(dax_module *mod, uint32_t index, uint8_t *buff, int size);
 int groups_cleanup(dax_module *mod);
+void group_check(tag_index idx, int offset, int size);
+void group_batch_flush(void);
 
 #endif /* !__DAX_GROUPS_H */
@@ -21,12 +21,380 @@
 
 #include <common.h>
 #include "tagbase.h"
+#include "retain.h"
+#include "groups.h"
+#include "shmem.h"
 #include "func.h"
 
+/* Mappings are compiled into a short list of steps when they are added so
+ * that all map_check() has to do is move the bytes.  Whole bytes are copied
+ * with memcpy().  Bits are shifted eight at a time out of a little window
+ * of the source that is put together in the scratch buffer.  The scratch
+ * buffer is made big enough for the largest mapping when it is added.
+ *
+ * Chained mappings are not followed by recursion.  The tags that have
+ * mappings are sorted so that every mapping goes from an earlier tag to a
+ * later one.  map_add() won't make a mapping that would close a loop.  When
+ * a tag is written the tags that get new data are put in a heap by their
+ * place in that order along with the range of bytes that were changed.
+ * This way a tag that gets data from more than one path is only checked
+ * once, after all of its sources are done.  A mapping from one part of a
+ * tag to another part of the same tag doesn't check the mappings of that
+ * tag again.
+ *
+ * The mappings of each tag are also kept in an array that is sorted by the
+ * first source byte so that a write only looks at the mappings that it
+ * touches.  The order and the arrays are built again the next time that
+ * a tag is written after a mapping is added or deleted. */
+
 extern _dax_tag_db *_db;
 
-static tag_index _first_tag = -1;
-static int _mapping_hops = 0;
+typedef struct {
+    uint32_t start;      /* First source byte of the mapping */
+    uint32_t end;        /* One past the last source byte */
+    uint32_t maxend;     /* Largest end of this entry and those before it */
+    _dax_datamap *map;
+} _map_entry;
+
+static uint8_t *_scratch;
+static uint32_t _scratch_size;
+
+/* These are indexed by the tag index */
+static int *_order;          /* Place of the tag in the evaluation order */
+static uint32_t *_lo, *_hi;  /* Range of bytes that changed in a queued tag */
+static uint8_t *_queued;
+static uint32_t *_visit;     /* Used when looking for loops */
+static tag_index *_heap;     /* Queued tags, also the stack for _reaches() */
+static _map_entry **_index;  /* Mappings sorted by the first source byte */
+static int *_index_count;
+static tag_index _tag_size;
+static int _heap_count;
+static int _order_valid;
+static uint32_t _visit_gen;
+
+static int
+_grow(void)
+{
+    tag_index n;
+    void *p;
+
+    n = get_tagindex();
+    if(n <= _tag_size) return 0;
+    if((p = realloc(_order, sizeof(int) * n)) == NULL) return ERR_ALLOC;
+    _order = p;
+    if((p = realloc(_lo, sizeof(uint32_t) * n)) == NULL) return ERR_ALLOC;
+    _lo = p;
+    if((p = realloc(_hi, sizeof(uint32_t) * n)) == NULL) return ERR_ALLOC;
+    _hi = p;
+    if((p = realloc(_queued, n)) == NULL) return ERR_ALLOC;
+    _queued = p;
+    if((p = realloc(_visit, sizeof(uint32_t) * n)) == NULL) return ERR_ALLOC;
+    _visit = p;
+    if((p = realloc(_heap, sizeof(tag_index) * n)) == NULL) return ERR_ALLOC;
+    _heap = p;
+    if((p = realloc(_index, sizeof(_map_entry *) * n)) == NULL) return ERR_ALLOC;
+    _index = p;
+    if((p = realloc(_index_count, sizeof(int) * n)) == NULL) return ERR_ALLOC;
+    _index_count = p;
+    bzero(&_index[_tag_size], sizeof(_map_entry *) * (n - _tag_size));
+    bzero(&_index_count[_tag_size], sizeof(int) * (n - _tag_size));
+    bzero(&_queued[_tag_size], n - _tag_size);
+    bzero(&_visit[_tag_size], sizeof(uint32_t) * (n - _tag_size));
+    _tag_size = n;
+    return 0;
+}
+
+static int
+_entry_compare(const void *a, const void *b)
+{
+    const _map_entry *x = a, *y = b;
+
+    if(x->start < y->start) return -1;
+    if(x->start > y->start) return 1;
+    return 0;
+}
+
+/* Builds the sorted array of the mappings of the tag */
+static int
+_build_index(tag_index idx)
+{
+    _dax_datamap *this;
+    _map_entry *entry;
+    int n = 0, count;
+
+    for(this = _db[idx].mappings; this != NULL; this = this->next) n++;
+    free(_index[idx]);
+    _index[idx] = NULL;
+    _index_count[idx] = 0;
+    if(n == 0) return 0;
+    entry = malloc(sizeof(_map_entry) * n);
+    if(entry == NULL) return ERR_ALLOC;
+    n = 0;
+    for(this = _db[idx].mappings; this != NULL; this = this->next) {
+        entry[n].start = this->source.byte;
+        entry[n].end = this->source.byte + this->source.size;
+        entry[n].map = this;
+        n++;
+    }
+    count = n;
+    qsort(entry, count, sizeof(_map_entry), _entry_compare);
+    entry[0].maxend = entry[0].end;
+    for(n = 1; n < count; n++) {
+        entry[n].maxend = entry[n].end > entry[n - 1].maxend ? entry[n].end : entry[n - 1].maxend;
+    }
+    _index[idx] = entry;
+    _index_count[idx] = count;
+    return 0;
+}
+
+/* Sorts the tags so that the destination of every mapping comes after
+ * its source.  The _hi array is used to count the mappings into each tag
+ * and _heap is used as the list of tags that are ready. */
+static int
+_build_order(void)
+{
+    _dax_datamap *this;
+    tag_index n, head = 0, tail = 0;
+    int pos = 0;
+
+    if(_grow()) return ERR_ALLOC;
+    bzero(_hi, sizeof(uint32_t) * _tag_size);
+    for(n = 0; n < _tag_size; n++) {
+        if(_db[n].data == NULL) {
+            free(_index[n]);
+            _index[n] = NULL;
+            _index_count[n] = 0;
+            continue;
+        }
+        if(_build_index(n)) return ERR_ALLOC;
+        for(this = _db[n].mappings; this != NULL; this = this->next) {
+            if(this->dest.index != n) _hi[this->dest.index]++;
+        }
+    }
+    for(n = 0; n < _tag_size; n++) {
+        if(_hi[n] == 0) _heap[tail++] = n;
+    }
+    while(head < tail) {
+        n = _heap[head++];
+        _order[n] = pos++;
+        if(_db[n].data == NULL) continue;
+        for(this = _db[n].mappings; this != NULL; this = this->next) {
+            if(this->dest.index != n && --_hi[this->dest.index] == 0) {
+                _heap[tail++] = this->dest.index;
+            }
+        }
+    }
+    bzero(_hi, sizeof(uint32_t) * _tag_size);
+    _order_valid = 1;
+    return 0;
+}
+
+/* Returns 1 if there is a chain of mappings from tag 'from' to tag 'to' */
+static int
+_reaches(tag_index from, tag_index to)
+{
+    _dax_datamap *this;
+    int top = 0;
+    tag_index n;
+
+    _visit_gen++;
+    _heap[top++] = from;
+    _visit[from] = _visit_gen;
+    while(top) {
+        n = _heap[--top];
+        if(n == to) return 1;
+        if(_db[n].data == NULL) continue;
+        for(this = _db[n].mappings; this != NULL; this = this->next) {
+            if(_visit[this->dest.index] != _visit_gen) {
+                _visit[this->dest.index] = _visit_gen;
+                _heap[top++] = this->dest.index;
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+_heap_push(tag_index idx)
+{
+    int n, parent;
+
+    n = _heap_count++;
+    while(n > 0) {
+        parent = (n - 1) / 2;
+        if(_order[_heap[parent]] <= _order[idx]) break;
+        _heap[n] = _heap[parent];
+        n = parent;
+    }
+    _heap[n] = idx;
+}
+
+static tag_index
+_heap_pop(void)
+{
+    tag_index top, last;
+    int n = 0, child;
+
+    top = _heap[0];
+    last = _heap[--_heap_count];
+    while((child = 2 * n + 1) < _heap_count) {
+        if(child + 1 < _heap_count && _order[_heap[child + 1]] < _order[_heap[child]]) child++;
+        if(_order[last] <= _order[_heap[child]]) break;
+        _heap[n] = _heap[child];
+        n = child;
+    }
+    _heap[n] = last;
+    return top;
+}
+
+/* Adds the range of bytes to what needs to be checked for the tag */
+static void
+_queue(tag_index idx, uint32_t lo, uint32_t hi)
+{
+    if(_queued[idx]) {
+        if(lo < _lo[idx]) _lo[idx] = lo;
+        if(hi > _hi[idx]) _hi[idx] = hi;
+    } else {
+        _lo[idx] = lo;
+        _hi[idx] = hi;
+        _queued[idx] = 1;
+        _heap_push(idx);
+    }
+}
+
+/* Figures out the steps to copy the data for the mapping.  Bits are
+ * numbered from the start of the tag */
+static void
+_compile(_dax_datamap *map)
+{
+    uint32_t s0, d0, n, first, last;
+    uint8_t first_mask, last_mask;
+    _dax_map_op *op;
+
+    map->opcount = 0;
+    if(map->source.type != DAX_BOOL) {
+        op = &map->ops[map->opcount++];
+        op->kind = MAP_OP_COPY;
+        op->src = map->source.byte;
+        op->srcsize = map->source.size;
+        op->dest = map->dest.byte;
+        op->size = map->source.size;
+        map->dest_start = op->dest;
+        map->dest_end = op->dest + op->size;
+        return;
+    }
+    s0 = map->source.byte * 8 + map->source.bit;
+    d0 = map->dest.byte * 8 + map->dest.bit;
+    n = map->source.count;
+    first = d0 / 8;
+    last = (d0 + n - 1) / 8;
+    first_mask = 0xFF << (d0 % 8);
+    last_mask = 0xFF >> (7 - (d0 + n - 1) % 8);
+    if(first == last) first_mask = last_mask = first_mask & last_mask;
+    map->dest_start = first;
+    map->dest_end = last + 1;
+    if(s0 % 8 != d0 % 8) {
+        /* The bits have to move within the bytes */
+        op = &map->ops[map->opcount++];
+        op->kind = MAP_OP_BITS;
+        op->src = s0 / 8;
+        op->srcsize = (s0 + n - 1) / 8 - s0 / 8 + 1;
+        op->dest = first;
+        op->size = last - first + 1;
+        /* Bit position in the scratch window of the bit that goes to
+         * the first bit of the first destination byte */
+        op->shift = 8 + s0 % 8 - d0 % 8;
+        op->first_mask = first_mask;
+        op->last_mask = last_mask;
+        return;
+    }
+    /* The bits line up so the partial bytes on the ends are masked and
+     * the whole bytes in the middle are copied */
+    s0 /= 8;
+    if(first_mask != 0xFF || first == last) {
+        op = &map->ops[map->opcount++];
+        op->kind = MAP_OP_BITS;
+        op->src = s0;
+        op->srcsize = op->size = 1;
+        op->dest = first;
+        op->shift = 8;
+        op->first_mask = op->last_mask = first_mask;
+        if(first == last) return;
+        first++;
+        s0++;
+    }
+    if(last_mask != 0xFF) last--;
+    if(last + 1 > first) {
+        op = &map->ops[map->opcount++];
+        op->kind = MAP_OP_COPY;
+        op->src = s0;
+        op->dest = first;
+        op->srcsize = op->size = last + 1 - first;
+        s0 += op->size;
+    }
+    if(last_mask != 0xFF) {
+        op = &map->ops[map->opcount++];
+        op->kind = MAP_OP_BITS;
+        op->src = s0;
+        op->srcsize = op->size = 1;
+        op->dest = last + 1;
+        op->shift = 8;
+        op->first_mask = op->last_mask = last_mask;
+    }
+}
+
+/* Copies the data from the source of the mapping to the destination */
+static int
+_run_map(_dax_datamap *map)
+{
+    uint8_t *src, *dest, *w, mask, value;
+    _dax_map_op *op;
+    uint32_t j, pos;
+    int n;
+
+    src = _db[map->source.index].data;
+    dest = _db[map->dest.index].data;
+    if(dest == NULL) return ERR_DELETED;
+    shmem_write_begin(map->dest.index);
+    for(n = 0; n < map->opcount; n++) {
+        op = &map->ops[n];
+        if(op->kind == MAP_OP_COPY) {
+            memmove(&dest[op->dest], &src[op->src], op->size);
+            continue;
+        }
+        /* Put the source bytes in the scratch buffer with a zero byte
+         * on each side so the window never reads past them */
+        w = _scratch;
+        if(op->shift != 8) {
+            w[0] = 0x00;
+            memcpy(&w[1], &src[op->src], op->srcsize);
+            w[op->srcsize + 1] = w[op->srcsize + 2] = 0x00;
+        }
+        for(j = 0; j < op->size; j++) {
+            if(j == 0) {
+                mask = op->first_mask;
+            } else if(j == op->size - 1) {
+                mask = op->last_mask;
+            } else {
+                mask = 0xFF;
+            }
+            if(op->shift == 8) {
+                value = src[op->src + j];
+            } else {
+                pos = op->shift + j * 8;
+                value = (w[pos / 8] | w[pos / 8 + 1] << 8) >> (pos % 8);
+            }
+            dest[op->dest + j] = (dest[op->dest + j] & ~mask) | (value & mask);
+        }
+    }
+    shmem_write_end(map->dest.index);
+    event_check(map->dest.index, map->dest_start, map->dest_end - map->dest_start);
+    group_check(map->dest.index, map->dest_start, map->dest_end - map->dest_start);
+    if(_db[map->dest.index].attr & TAG_ATTR_RETAIN) {
+        ret_tag_write(map->dest.index);
+    }
+    return 0;
+}
 
 /* Allocates and initializes a data map node */
 static _dax_datamap *_new_map(tag_handle src, tag_handle dest)
@@ -34,19 +402,16 @@ static _dax_datamap *_new_map(tag_handle src, tag_handle dest)
     _dax_datamap *new;
 
     new = (_dax_datamap *)malloc(sizeof(_dax_datamap));
+    if(new == NULL) return NULL;
     new->id = _db[src.index].nextmap++;
     new->source = src;
     new->dest = dest;
-    new->mask = NULL;
     new->next = NULL;
-
+    _compile(new);
     return new;
 }
 
 static void _free_map(_dax_datamap *map) {
-    if(map->mask != NULL) {
-        free(map->mask);
-    }
     free(map);
 }
 
@@ -55,15 +420,8 @@ int
 map_add(tag_handle src, tag_handle dest)
 {
     _dax_datamap *new_map;
-    int bit, offset;
-    uint8_t *mask;
-//    printf("map_add() called\n");
-//    printf("src.byte = 0x%X\n", src.byte);
-//    printf("src.bit = 0x%X\n", src.bit);
-//    printf("src.size = %d\n", src.size);
-//    printf("dest.byte = 0x%X\n", dest.byte);
-//    printf("dest.bit = 0x%X\n", dest.bit);
-//    printf("dest.size = %d\n", dest.size);
+    uint8_t *scratch;
+    uint32_t size;
 
     /* Bounds check handles */
     if(src.index < 0 || src.index >= get_tagindex()) {
@@ -95,39 +453,36 @@ map_add(tag_handle src, tag_handle dest)
         xlog(LOG_ERROR, "Size of the affected destination data in the new mapping is too large");
         return ERR_2BIG;
     }
-//    if( (dest.byte + src.size) > tag_get_size(dest.index)) {
-//        xlog(LOG_ERROR, "Size of the source data in the new mapping is too large");
-//        return ERR_2BIG;
-//    }
     if( src.size > dest.size ) {
         xlog(LOG_ERROR, "Size of the source data in the new mapping is too large");
         return ERR_2BIG;
     }
-
+    if(src.type == DAX_BOOL && (src.count == 0 || dest.bit > 7 || src.bit > 7 ||
+       (dest.byte * 8 + dest.bit + src.count + 7) / 8 > tag_get_size(dest.index))) {
+        xlog(LOG_ERROR, "Bits in the new mapping don't fit in the destination");
+        return ERR_2BIG;
+    }
+    if(_grow()) return ERR_ALLOC;
+    if(src.index != dest.index && _reaches(dest.index, src.index)) {
+        xlog(LOG_ERROR, "Mapping from %s to %s would make a loop", _db[src.index].name, _db[dest.index].name);
+        return ERR_ILLEGAL;
+    }
     new_map = _new_map(src, dest);
-
-    if(src.type == DAX_BOOL) {
-        /* This basically creates a mask to write the bits that we want.
-         * We are putting the bits in mask according to the destination.
-         * The data itself will have to be shifted later when we write
-         * the data.
-         */
-        bit = dest.bit;
-        offset = 0;
-        mask = (uint8_t *)malloc(src.size);
-        bzero(mask, src.size);
-        for(int i=0; i<src.count; i++) {
-            mask[offset] |= (0x01 << bit);
-            bit++;
-            if(bit == 8) {
-                bit=0;
-                offset++;
-            }
+    if(new_map == NULL) return ERR_ALLOC;
+    /* Room for the window of the largest bit mapping */
+    size = new_map->ops[0].srcsize + new_map->ops[0].size + 3;
+    if(new_map->ops[0].kind == MAP_OP_BITS && size > _scratch_size) {
+        scratch = realloc(_scratch, size);
+        if(scratch == NULL) {
+            _free_map(new_map);
+            return ERR_ALLOC;
         }
-        new_map->mask = mask;
+        _scratch = scratch;
+        _scratch_size = size;
     }
     new_map->next = _db[src.index].mappings;
     _db[src.index].mappings = new_map;
+    _order_valid = 0;
 
     return new_map->id;
 }
@@ -135,26 +490,25 @@ map_add(tag_handle src, tag_handle dest)
 
 int
 map_del(tag_index index, int id) {
-    _dax_datamap *this, *prev;
+    _dax_datamap *this, *prev = NULL;
 
     if(index < 0 || index >= get_tagindex()) {
         return ERR_ARG;
     }
     this = _db[index].mappings;
-    if(this->id == id) {
-        _db[index].mappings = this->next;
-        _free_map(this);
-        return 0;
-    } else {
-        prev = this;
-        this = this->next;
-        while(this != NULL) {
-            if(this->id == id) {  /* Found it */
+    while(this != NULL) {
+        if(this->id == id) {  /* Found it */
+            if(prev == NULL) {
+                _db[index].mappings = this->next;
+            } else {
                 prev->next = this->next;
-                _free_map(this);
-                return 0;
             }
+            _free_map(this);
+            _order_valid = 0;
+            return 0;
         }
+        prev = this;
+        this = this->next;
     }
     return ERR_NOTFOUND;
 }
@@ -169,92 +523,54 @@ map_del_all(_dax_datamap *head) {
         _free_map(this);
         this = next;
     }
+    _order_valid = 0;
     return 0;
 }
 
+/* Called after the data in the tag has been changed.  The data for all of
+ * the mappings that the change reaches is copied in order. */
 int
-map_check(tag_index idx, int offset, uint8_t *data, int size) {
+map_check(tag_index idx, int offset, int size) {
     _dax_datamap *this;
-    uint8_t *new_data;
-    int srcByte;
-    int srcBit;
-    int destByte;
-    int destBit;
-    int result;
-
-    this = _db[idx].mappings;
-    /* If this is the first time we've been called then it means that is is the tag that started
-     * the mapping.  If we chain too many then we'll tell the user which tag started it all. */
-    if(_first_tag == -1) _first_tag = idx;
-    while(this != NULL) {
-//        printf("src.byte = 0x%X\n", this->source.byte);
-//        printf("src.bit = 0x%X\n", this->source.bit);
-//        printf("src.size = %d\n", this->source.size);
-//        printf("dest.byte = 0x%X\n", this->dest.byte);
-//        printf("dest.bit = 0x%X\n", this->dest.bit);
-//        printf("dest.size = %d\n", this->dest.size);
-
-        if(offset <= (this->source.byte + this->source.size - 1) && (offset + size -1 ) >= this->source.byte) {
-            /* Mapping Hit */
-            _mapping_hops++;
-            if(_mapping_hops > MAX_MAP_HOPS) {
-                /* TODO: conditional compilation of program exit */
-                xerror("Maximum number of chained mappings has been reached for tag %s", _db[_first_tag].name);
-                return ERR_OVERFLOW;
-            }
-            if(this->mask != NULL) {
-                /* Move the bits from their position in the source to
-                 * where they should go in the destination */
-                srcByte = 0;
-                srcBit = this->source.bit;
-                destByte = 0;
-                destBit = this->dest.bit;
-                new_data = (uint8_t *)malloc(this->source.size);
-                if(new_data == NULL) {
-                    xerror("Unable to allocate memory for map mask");
-                    return ERR_ALLOC;
-                }
-                bzero(new_data, this->source.size);
-                for(int n=0; n<this->source.count; n++) {
-                    if(data[srcByte] & (0x01 << srcBit)) {
-                        new_data[destByte] |= (0x01 << destBit);
-                    }
-                    srcBit++;
-                    destBit++;
-                    if(srcBit == 8) {
-                        srcBit = 0;
-                        srcByte++;
-                    }
-                    if(destBit == 8) {
-                        destBit = 0;
-                        destByte++;
-                    }
-                }
-//                printf("data = 0x%X\n", *(uint16_t *)new_data);
-//                printf("mask = 0x%X\n", *(uint16_t *)this->mask);
-                result = tag_mask_write(this->dest.index, this->dest.byte, new_data, this->mask, this->dest.size);
-                /* If the destination tag has been deleted then delete this map */
-                if(result == ERR_DELETED) {
-                    map_del(this->source.index, this->id);
-                }
-                free(new_data);
+    _map_entry *entry;
+    tag_index t;
+    uint32_t lo, hi;
+    int low, high, mid;
+
+    if(_db[idx].mappings == NULL) return 0;
+    if(!_order_valid && _build_order()) {
+        xerror("Unable to allocate memory for the mapping order");
+        return ERR_ALLOC;
+    }
+    _queue(idx, offset, offset + size);
+    while(_heap_count) {
+        t = _heap_pop();
+        lo = _lo[t];
+        hi = _hi[t];
+        _queued[t] = 0;
+        entry = _index[t];
+        /* Find the first mapping that starts at or after the end of the
+         * write.  Everything before that that hasn't ended yet is a hit */
+        low = 0;
+        high = _index_count[t];
+        while(low < high) {
+            mid = (low + high) / 2;
+            if(entry[mid].start < hi) {
+                low = mid + 1;
             } else {
-                //new_data = data;
-                new_data = &data[offset+this->source.byte];
-
-//                printf("data = 0x%X\n", *(uint16_t *)new_data);
-                result = tag_write(this->dest.index, this->dest.byte, new_data, this->dest.size);
-                /* If the destination tag has been deleted then delete this map */
-                if(result == ERR_DELETED) {
-                    map_del(this->source.index, this->id);
-                }
+                high = mid;
+            }
+        }
+        while(--low >= 0 && entry[low].maxend > lo) {
+            if(entry[low].end <= lo) continue;
+            this = entry[low].map;
+            /* If the destination tag has been deleted then delete this map */
+            if(_run_map(this) == ERR_DELETED) {
+                map_del(t, this->id);
+            } else if(this->dest.index != t && _db[this->dest.index].mappings != NULL) {
+                _queue(this->dest.index, this->dest_start, this->dest_end);
             }
         }
-        this = this->next;
     }
-    /* if we get here either there were no mapping hits or we are done.  In either case
-     * we reset our tracking variables. */
-    _first_tag = -1;
-    _mapping_hops = 0;
     return 0;
 }
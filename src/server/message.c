@@ -30,27 +30,48 @@
 #include "options.h"
 #include "groups.h"
 #include "virtualtag.h"
+#include "shmem.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+
+#ifndef HAVE_SYS_EPOLL_H
+# error "The tag server requires epoll()"
+#endif
 
 #define ASYNC 0
 #define RESPONSE 1
 #define ERROR 2
 
-#ifndef FD_COPY
-# define FD_COPY(x,y) memcpy((y),(x),sizeof(fd_set))
-#endif
+/* Maximum number of events that we'll retrieve with each epoll_wait() call */
+#define MSG_EPOLL_EVENTS 64
+/* Maximum number of listening sockets */
+#define MSG_MAX_LISTEN 2
 
 /* These are the listening sockets for the local UNIX domain
  *  socket and the remote TCP socket. */
-static fd_set _listenfdset;
-/* This is the set of all the sockets, both listening and conencted
- * it is used in the select() call in msg_receive() */
-static fd_set _fdset;
-static int _maxfd;
+static int _listenfd[MSG_MAX_LISTEN];
+static int _listencount;
+/* This is the epoll instance that watches all of the sockets, both
+ * listening and connected.  It is used in msg_receive() */
+static int _epollfd;
+
+/* Connected sockets are registered with EPOLLONESHOT so that once a socket
+ * is reported as readable it is disabled until a worker thread has handled
+ * it and re-armed it.  This guarantees that the messages from any one module
+ * are handled in order by a single thread.  The ready sockets are passed from
+ * msg_receive() to the worker threads through this queue. */
+static int *_readyq;
+static int _readyq_size;
+static int _readyq_read;
+static int _readyq_count;
+static pthread_mutex_t _readyq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _readyq_cond = PTHREAD_COND_INITIALIZER;
 
 /* This array holds the functions for each message command */
 /* Index 0 is not used. */
@@ -62,6 +83,7 @@ int (*cmd_arr[NUM_COMMANDS+1])(dax_message *) = {NULL};
 int msg_mod_register(dax_message *msg);
 int msg_tag_add(dax_message *msg);
 int msg_tag_del(dax_message *msg);
+int msg_tag_multi_add(dax_message *msg);
 int msg_tag_get(dax_message *msg);
 int msg_tag_list(dax_message *msg);
 int msg_tag_read(dax_message *msg);
@@ -70,6 +92,7 @@ int msg_tag_mask_write(dax_message *msg);
 int msg_mod_get(dax_message *msg);
 int msg_mod_set(dax_message *msg);
 int msg_evnt_add(dax_message *msg);
+int msg_evnt_multi_add(dax_message *msg);
 int msg_evnt_del(dax_message *msg);
 int msg_evnt_get(dax_message *msg);
 int msg_evnt_opt(dax_message *msg);
@@ -92,35 +115,163 @@ int msg_set_override(dax_message *msg);
 
 /* Generic message sending function.  If response is MSG_ERROR then it is assumed that
  * an error is being sent to the module.  In that case payload should point to a
- * single int that indicates the error */
+ * single int that indicates the error.  Payloads that are larger than a single
+ * message are sent as a series of frames with the MSG_CHUNK flag set on every
+ * frame but the last. */
 static int
 _message_send(int fd, int command, void *payload, size_t size, int response)
 {
     int result;
+    uint32_t type, chunk;
     char buff[DAX_MSGMAX];
 
-    ((uint32_t *)buff)[0] = htonl(size);
     if(response == RESPONSE) {
-        ((uint32_t *)buff)[1] = htonl(command | MSG_RESPONSE);
+        type = command | MSG_RESPONSE;
     } else if(response == ERROR) {
         xlog(LOG_MSGERR, "Returning Error %d to Module", *(int *)payload);
-        ((uint32_t *)buff)[1] = htonl(command | MSG_ERROR);
+        type = command | MSG_ERROR;
     } else {
-        ((uint32_t *)buff)[1] = htonl(command);
+        type = command;
     }
     /* Bounds check so we don't seg fault */
-    if(size > (DAX_MSGMAX - MSG_HDR_SIZE)) {
+    if(size > DAX_TRANSFER_MAX) {
         return ERR_2BIG;
     }
-    memcpy(&buff[MSG_HDR_SIZE], payload, size);
-    result = xwrite(fd, buff, size + MSG_HDR_SIZE);
-    if(result < 0) {
-        xerror("_message_send: %s", strerror(errno));
-        return ERR_MSG_SEND;
+    /* Events caused by this request go out before the response */
+    event_batch_send();
+    do {
+        chunk = size > MSG_DATA_SIZE ? MSG_DATA_SIZE : size;
+        ((uint32_t *)buff)[0] = htonl(chunk);
+        ((uint32_t *)buff)[1] = htonl(size > chunk ? type | MSG_CHUNK : type);
+        memcpy(&buff[MSG_HDR_SIZE], payload, chunk);
+        result = xwrite(fd, buff, chunk + MSG_HDR_SIZE);
+        if(result < 0) {
+            xerror("_message_send: %s", strerror(errno));
+            return ERR_MSG_SEND;
+        }
+        payload = (char *)payload + chunk;
+        size -= chunk;
+    } while(size > 0);
+    return 0;
+}
+
+/* Sends an error response for the given command to the module */
+int
+msg_send_error(int fd, int command, int error)
+{
+    return _message_send(fd, command, &error, sizeof(error), ERROR);
+}
+
+/* Returns true if fd is one of our listening sockets */
+static int
+_msg_is_listen_fd(int fd)
+{
+    int n;
+
+    for(n = 0; n < _listencount; n++) {
+        if(_listenfd[n] == fd) return 1;
     }
     return 0;
 }
 
+/* Returns true if the module on fd is connected through the local socket */
+static int
+_msg_is_local(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if(getsockname(fd, (struct sockaddr *)&addr, &len)) return 0;
+    return addr.ss_family == AF_UNIX;
+}
+
+/* Adds a listening socket to the epoll set.  Listening sockets are edge
+ * triggered and non-blocking so that msg_receive() can accept() every
+ * pending connection without stalling. */
+static void
+_msg_add_listen_fd(int fd)
+{
+    struct epoll_event ev;
+
+    if(_listencount >= MSG_MAX_LISTEN) {
+        xfatal("Too many listening sockets");
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    _listenfd[_listencount++] = fd;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    if(epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        xfatal("Unable to add listening socket to epoll set - %s", strerror(errno));
+    }
+}
+
+/* Puts the fd at the end of the ready queue and wakes up a worker thread.
+ * The queue will grow if need be.  Since each connected socket is one shot
+ * the queue can never hold more entries than we have connections. */
+static int
+_readyq_push(int fd)
+{
+    int *newq, n, i;
+
+    pthread_mutex_lock(&_readyq_lock);
+    if(_readyq_count == _readyq_size) {
+        n = _readyq_size ? _readyq_size * 2 : MSG_EPOLL_EVENTS;
+        newq = malloc(n * sizeof(int));
+        if(newq == NULL) {
+            pthread_mutex_unlock(&_readyq_lock);
+            return ERR_ALLOC;
+        }
+        /* Unwrap the old queue into the start of the new one */
+        for(i = 0; i < _readyq_count; i++) {
+            newq[i] = _readyq[(_readyq_read + i) % _readyq_size];
+        }
+        free(_readyq);
+        _readyq = newq;
+        _readyq_size = n;
+        _readyq_read = 0;
+    }
+    _readyq[(_readyq_read + _readyq_count) % _readyq_size] = fd;
+    _readyq_count++;
+    pthread_cond_signal(&_readyq_cond);
+    pthread_mutex_unlock(&_readyq_lock);
+    return 0;
+}
+
+/* Blocks until there is an fd in the ready queue and returns it */
+static int
+_readyq_pop(void)
+{
+    int fd;
+
+    pthread_mutex_lock(&_readyq_lock);
+    while(_readyq_count == 0) {
+        pthread_cond_wait(&_readyq_cond, &_readyq_lock);
+    }
+    fd = _readyq[_readyq_read];
+    _readyq_read = (_readyq_read + 1) % _readyq_size;
+    _readyq_count--;
+    pthread_mutex_unlock(&_readyq_lock);
+    return fd;
+}
+
+/* Re-enables the connected socket in the epoll set after a worker thread
+ * is finished with it.  If there is still data waiting on the socket
+ * epoll will report it again right away. */
+static void
+_msg_rearm_fd(int fd)
+{
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if(epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        xerror("Unable to rearm socket %d - %s", fd, strerror(errno));
+    }
+}
+
 /* Sets up the local UNIX domain socket for listening. */
 static int
 _msg_setup_local_socket(void)
@@ -141,11 +292,10 @@ _msg_setup_local_socket(void)
         xfatal("Unable to bind to local socket: %s", addr.sun_path);
     }
 
-    if(listen(fd, 5) < 0) {
+    if(listen(fd, SOMAXCONN) < 0) {
         xfatal("Unable to listen for some reason");
     }
-    FD_SET(fd, &_listenfdset);
-    msg_add_fd(fd);
+    _msg_add_listen_fd(fd);
 
     xlog(LOG_COMM, "Listening on local socket - %d", fd);
     return 0;
@@ -158,12 +308,14 @@ static int
 _msg_setup_remote_socket(in_addr_t ipaddress, in_port_t ipport)
 {
     struct sockaddr_in addr;
-    int fd;
+    int fd, on = 1;
 
     fd = socket(AF_INET, SOCK_STREAM, 0);
     if(fd < 0) {
         xfatal("Unable to create remote socket - %s", strerror(errno));
     }
+    /* So that a restarted server doesn't have to wait on TIME_WAIT */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
     bzero(&addr, sizeof(addr));
 
@@ -176,15 +328,10 @@ _msg_setup_remote_socket(in_addr_t ipaddress, in_port_t ipport)
         xfatal("Unable to bind remote socket - %s", strerror(errno));
     }
 
-    if(listen(fd, 5) < 0) {
+    if(listen(fd, SOMAXCONN) < 0) {
         xfatal("Unable to listen on remote socket - %s", strerror(errno));
     }
-    /* set the _remotefd set here.  This gives us a simpler way to
-     * determine if the fd that we get from the select() call in
-     * msg_receive() is a listening socket or not */
-    /* TODO: Does this need to be an fd_set?? */
-    FD_SET(fd, &_listenfdset);
-    msg_add_fd(fd);
+    _msg_add_listen_fd(fd);
 
     xlog(LOG_COMM, "Listening on remote socket - %d", fd);
     return 0;
@@ -197,9 +344,11 @@ _msg_setup_remote_socket(in_addr_t ipaddress, in_port_t ipport)
 int
 msg_setup(void)
 {
-    _maxfd = 0;
-    FD_ZERO(&_fdset);
-    FD_ZERO(&_listenfdset);
+    _listencount = 0;
+    _epollfd = epoll_create1(0);
+    if(_epollfd < 0) {
+        xfatal("Unable to create epoll instance - %s", strerror(errno));
+    }
 
     /* TODO: These should be called based on configuration options
      * for now we'll just listen on the local domain socket and bind
@@ -241,6 +390,8 @@ msg_setup(void)
     cmd_arr[MSG_DEL_OVRD]   = &msg_del_override;
     cmd_arr[MSG_GET_OVRD]   = &msg_get_override;
     cmd_arr[MSG_SET_OVRD]   = &msg_set_override;
+    cmd_arr[MSG_TAG_MADD]   = &msg_tag_multi_add;
+    cmd_arr[MSG_EVNT_MADD]  = &msg_evnt_multi_add;
 
     return 0;
 }
@@ -254,90 +405,133 @@ msg_destroy(void)
 }
 
 /* These two functions are wrappers to deal with adding and deleting
-   file descriptors to the global _fdset and dealing with _maxfd */
+   connected sockets from the epoll set */
 void
 msg_add_fd(int fd)
 {
-    FD_SET(fd, &_fdset);
-    if(fd > _maxfd) _maxfd = fd;
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+    if(epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        xerror("Unable to add socket %d to epoll set - %s", fd, strerror(errno));
+        close(fd);
+    }
 }
 
+/* The buffer has to be freed before the socket is closed.  Once it's closed
+ * accept() can hand the same fd to a new connection and a worker would find
+ * our old buffer for it. */
 void
 msg_del_fd(int fd)
 {
-    int n, tmpfd = 0;
-
-    FD_CLR(fd, &_fdset);
-
-    /* If it's the largest one then we need to re-figure _maxfd */
-    if(fd == _maxfd) {
-        for(n = 0; n <= _maxfd; n++) {
-            if(FD_ISSET(n, &_fdset)) {
-                tmpfd = n;
-            }
-        }
-        _maxfd = tmpfd;
-    }
-    close(fd); /* Just to make sure */
+    epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, NULL);
     buff_free(fd);
+    close(fd);
 }
 
-/* This function blocks waiting for a message to be received.  Once a message
- * is retrieved from the system the proper handling function is called */
+/* This function blocks waiting for activity on any of the sockets.  New
+ * connections are accepted here and connected sockets that have data waiting
+ * are handed off to the worker threads through the ready queue. */
 int
 msg_receive(void)
 {
-    fd_set tmpset;
-    struct timeval tm;
+    struct epoll_event events[MSG_EPOLL_EVENTS];
     struct sockaddr_un addr;
     int result, fd, n;
-    socklen_t len = 0;
-
-    FD_ZERO(&tmpset);
-    FD_COPY(&_fdset, &tmpset);
-    tm.tv_sec = 1; /* TODO: this should be configuration */
-    tm.tv_usec = 0;
+    socklen_t len;
 
-    result = select(_maxfd + 1, &tmpset, NULL, NULL, &tm);
+    /* TODO: the timeout should be configuration */
+    result = epoll_wait(_epollfd, events, MSG_EPOLL_EVENTS, 1000);
 
     if(result < 0) {
         /* Ignore interruption by signal */
         if(errno != EINTR) {
             /* TODO: Deal with these errors */
-            xerror("msg_receive select error: %s", strerror(errno));
+            xerror("msg_receive epoll error: %s", strerror(errno));
             return ERR_MSG_RECV;
         }
-    } else if(result == 0) { /* Timeout */
-        buff_freeall(); /* this erases all of the _buffer nodes */
         return 0;
-    } else {
-        for(n = 0; n <= _maxfd; n++) {
-            if(FD_ISSET(n, &tmpset)) {
-                if(FD_ISSET(n, &_listenfdset)) { /* This is a listening socket */
-                    fd = accept(n, (struct sockaddr *)&addr, &len);
-                    if(fd < 0) {
+    }
+    for(n = 0; n < result; n++) {
+        if(_msg_is_listen_fd(events[n].data.fd)) { /* This is a listening socket */
+            /* Edge triggered so we have to accept them all */
+            while(1) {
+                len = sizeof(addr);
+                fd = accept(events[n].data.fd, (struct sockaddr *)&addr, &len);
+                if(fd < 0) {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                         /* TODO: Need to handle these errors */
                         xerror("Error Accepting socket: %s", strerror(errno));
-                    } else {
-                        xlog(LOG_COMM, "Accepted socket on fd %d", n);
-                        msg_add_fd(fd);
-                    }
-                } else {
-                    result = buff_read(n);
-                    if(result == ERR_NO_SOCKET) { /* This is the end of file */
-                        xlog(LOG_COMM, "Connection Closed for fd %d", n);
-                        module_unregister(n);
-                        msg_del_fd(n);
-                    } else if(result < 0) {
-                        return result; /* Pass the error up */
                     }
+                    break;
                 }
+                xlog(LOG_COMM, "Accepted socket on fd %d", fd);
+                msg_add_fd(fd);
+            }
+        } else {
+            if(_readyq_push(events[n].data.fd)) {
+                xerror("Unable to queue socket %d", events[n].data.fd);
+                _msg_rearm_fd(events[n].data.fd);
             }
         }
     }
     return 0;
 }
 
+/* This is called by each of the worker threads.  It blocks until a connected
+ * socket is ready, reads from it and dispatches the message.  The socket is
+ * then re-armed in the epoll set so that the next message can be handled. */
+int
+msg_process(void)
+{
+    int fd, result;
+
+    fd = _readyq_pop();
+    result = buff_read(fd);
+    if(result == ERR_NO_SOCKET) { /* This is the end of file */
+        xlog(LOG_COMM, "Connection Closed for fd %d", fd);
+        tagbase_lock_write();
+        module_unregister(fd);
+        msg_del_fd(fd);
+        tagbase_unlock();
+        return 0;
+    }
+    _msg_rearm_fd(fd);
+    if(result < 0) {
+        return result; /* Pass the error up */
+    }
+    return 0;
+}
+
+/* Returns true if the message can be handled while other threads are
+ * reading the database.  This is only true for requests that never modify
+ * anything.  Reading a virtual tag calls a function that might, queues for
+ * instance, so those are handled exclusively.  This should be called with
+ * the database read lock held. */
+static int
+_msg_is_reader(dax_message *msg)
+{
+    tag_index idx;
+
+    switch(msg->msg_type) {
+        case MSG_TAG_READ:
+            idx = *((tag_index *)&msg->data[0]);
+            if(idx < 0 || idx >= get_tagindex()) return 1; /* tag_read() will catch it */
+            return ! is_tag_virtual(idx);
+        case MSG_GRP_READ:
+            return group_is_reader(module_find_fd(msg->fd), *((uint32_t *)&msg->data[0]));
+        case MSG_TAG_GET:
+        case MSG_TAG_LIST:
+        case MSG_CDT_GET:
+        case MSG_GET_OVRD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
 /* This handles each message.  It extracts out the dax_message structure
  * and then calls the proper message handling function.  This message will
  * unmarshal the header but it is up to the individual wrapper function to
@@ -345,23 +539,57 @@ msg_receive(void)
 int
 msg_dispatcher(int fd, unsigned char *buff)
 {
-    dax_message message;
+    dax_message message, *msg;
+    uint32_t size;
+    int result;
 
     /* The first four bytes are the size and the size is always
      * sent in network order */
-    message.size = ntohl(*(uint32_t *)buff) - MSG_HDR_SIZE;
+    size = ntohl(*(uint32_t *)buff) - MSG_HDR_SIZE;
     /* The next four bytes are the DAX command also sent in network
      * byte order. */
     message.msg_type = ntohl(*(uint32_t *)&buff[4]);
     //--printf("We've received message : command = %d, size = %d\n", message.command, message.size);
 
     if(CHECK_COMMAND(message.msg_type)) return ERR_MSG_BAD;
-    message.fd = fd;
-    memcpy(message.data, &buff[8], message.size);
-    buff_free(fd);
+    msg = &message;
+    /* Large messages that were put together from chunks need a bigger data area.
+     * Only the writes, the atomic operations and the multiple adds know what to
+     * do with that much data. */
+    if(size > MSG_DATA_SIZE) {
+        if(message.msg_type != MSG_TAG_WRITE && message.msg_type != MSG_TAG_MWRITE &&
+           message.msg_type != MSG_TAG_MADD && message.msg_type != MSG_EVNT_MADD &&
+           message.msg_type != MSG_GRP_ADD && message.msg_type != MSG_GRP_WRITE &&
+           message.msg_type != MSG_ATOMIC_OP) {
+            msg_send_error(fd, message.msg_type, ERR_2BIG);
+            return ERR_2BIG;
+        }
+        msg = malloc(sizeof(dax_message) - MSG_DATA_SIZE + size);
+        if(msg == NULL) {
+            msg_send_error(fd, message.msg_type, ERR_ALLOC);
+            return ERR_ALLOC;
+        }
+        msg->msg_type = message.msg_type;
+    }
+    msg->size = size;
+    msg->fd = fd;
+    memcpy(msg->data, &buff[8], msg->size);
     virt_set_fd(fd);
-    /* Now call the function to deal with it */
-    return (*cmd_arr[message.msg_type])(&message);
+
+    tagbase_lock_read();
+    if(! _msg_is_reader(msg)) {
+        tagbase_unlock();
+        tagbase_lock_write();
+    }
+    /* Now call the function to deal with it.  Any events that fire
+     * while we are in there are sent together when it returns */
+    event_batch_begin();
+    result = (*cmd_arr[msg->msg_type])(msg);
+    event_batch_flush();
+    group_batch_flush();
+    tagbase_unlock();
+    if(msg != &message) free(msg);
+    return result;
 }
 
 
@@ -382,7 +610,7 @@ int
 msg_mod_register(dax_message *msg)
 {
     uint32_t parint;
-    int flags, result;
+    int flags, result, size;
     char buff[DAX_MSGMAX];
     dax_module *mod;
 
@@ -402,6 +630,12 @@ msg_mod_register(dax_message *msg)
                 _message_send(msg->fd, MSG_MOD_REG, &result, sizeof(result) , ERROR);
                 return result;
             } else {
+                if(flags & CONNECT_EVENT_BATCH) {
+                    mod->flags |= MFLAG_EVENT_BATCH;
+                }
+                if(flags & CONNECT_TAG_NOTIFY) {
+                    mod->flags |= MFLAG_TAG_NOTIFY;
+                }
             	*((uint32_t *)&buff[0]) = msg->fd;   /* The fd of the module is the unique ID sent back */
                 /* This puts the test data into the buffer for sending. */
                 *((uint16_t *)&buff[4]) = REG_TEST_INT;    /* 16 bit test data */
@@ -409,10 +643,17 @@ msg_mod_register(dax_message *msg)
                 *((uint64_t *)&buff[10]) = REG_TEST_LINT;   /* 64 bit integer test data */
                 *((float *)&buff[18])    = REG_TEST_REAL;   /* 32 bit float test data */
                 *((double *)&buff[22])   = REG_TEST_LREAL;  /* 64 bit float test data */
+                *((uint32_t *)&buff[30]) = DAX_TRANSFER_MAX; /* Largest chunked message we'll handle */
+                size = 34;
+                /* Modules on this host get the name of the shared memory segment */
+                if(shmem_name() != NULL && _msg_is_local(msg->fd)) {
+                    strcpy(&buff[34], shmem_name());
+                    size += strlen(shmem_name()) + 1;
+                }
                 //Do we really need to send the name back??
                 //strncpy(&buff[30], mod->name, DAX_MSGMAX - 26 - 1);
                 //_message_send(msg->fd, MSG_MOD_REG, buff, 30 + strlen(mod->name) + 1, RESPONSE);
-                _message_send(msg->fd, MSG_MOD_REG, buff, 30 + 1, RESPONSE);
+                _message_send(msg->fd, MSG_MOD_REG, buff, size, RESPONSE);
             }
         } else { /* If the flags are bad send error */
             result = ERR_MSG_BAD;
@@ -456,6 +697,52 @@ msg_tag_add(dax_message *msg)
     return 0;
 }
 
+/* Message wrapper function for adding several tags at once.  The message
+ * is a list of tag definitions that are each laid out like the MSG_TAG_ADD
+ * message, type, count and attributes followed by the NULL terminated name.
+ * The response is the index of each tag in the same order or the error code
+ * if that tag could not be added. */
+int
+msg_tag_multi_add(dax_message *msg)
+{
+    tag_index *results;
+    uint32_t type, count, attr, offset;
+    char *name;
+    size_t len = 0;
+    int n = 0, result;
+
+    xlog(LOG_MSG | LOG_VERBOSE, "Tag Multiple Add Message from module %d, size %d", msg->fd, msg->size);
+    /* Each definition is at least 13 bytes */
+    results = malloc(sizeof(tag_index) * (msg->size / 13 + 1));
+    if(results == NULL) {
+        result = ERR_ALLOC;
+        _message_send(msg->fd, MSG_TAG_MADD, &result, sizeof(result), ERROR);
+        return result;
+    }
+    for(offset = 0; offset < msg->size; offset += 13 + len) {
+        name = &msg->data[offset + 12];
+        if(msg->size - offset < 13 ||
+           (len = strnlen(name, msg->size - offset - 12)) == msg->size - offset - 12) {
+            free(results);
+            result = ERR_MSG_BAD;
+            _message_send(msg->fd, MSG_TAG_MADD, &result, sizeof(result), ERROR);
+            return result;
+        }
+        type = *((uint32_t *)&msg->data[offset]);
+        count = *((uint32_t *)&msg->data[offset + 4]);
+        attr = *((uint32_t *)&msg->data[offset + 8]);
+        if(name[0] == '_') {
+            results[n] = ERR_ILLEGAL;
+        } else {
+            results[n] = tag_add(name, type, count, attr);
+        }
+        n++;
+    }
+    _message_send(msg->fd, MSG_TAG_MADD, results, sizeof(tag_index) * n, RESPONSE);
+    free(results);
+    return 0;
+}
+
 /* TODO: Make this function do something */
 int
 msg_tag_del(dax_message *msg)
@@ -519,10 +806,43 @@ msg_tag_get(dax_message *msg)
     return 0;
 }
 
+/* The message is the index to start with, the catalogue generation that the
+ * module already has and the size of the buffer that it wants back.  See
+ * tag_list() for the rest. */
 int
 msg_tag_list(dax_message *msg)
 {
-    xlog(LOG_MSG | LOG_VERBOSE, "Tag List Message from %d", msg->fd);
+    tag_index start, next;
+    uint32_t since, size;
+    uint8_t *buff;
+    int result;
+
+    if(msg->size < 12) {
+        result = ERR_MSG_BAD;
+        _message_send(msg->fd, MSG_TAG_LIST, &result, sizeof(result), ERROR);
+        return 0;
+    }
+    start = *((tag_index *)&msg->data[0]);
+    since = *((uint32_t *)&msg->data[4]);
+    size = *((uint32_t *)&msg->data[8]);
+    xlog(LOG_MSG | LOG_VERBOSE, "Tag List Message from %d, index %d, generation %u", msg->fd, start, since);
+    if(size > DAX_TRANSFER_MAX) size = DAX_TRANSFER_MAX;
+    if(size < TAG_LIST_HDR_SIZE + TAG_LIST_ENTRY_SIZE + DAX_TAGNAME_SIZE) {
+        result = ERR_ARG;
+        _message_send(msg->fd, MSG_TAG_LIST, &result, sizeof(result), ERROR);
+        return 0;
+    }
+    buff = malloc(size);
+    if(buff == NULL) {
+        result = ERR_ALLOC;
+        _message_send(msg->fd, MSG_TAG_LIST, &result, sizeof(result), ERROR);
+        return 0;
+    }
+    *((uint32_t *)&buff[0]) = tag_get_generation();
+    result = tag_list(start, since, &buff[TAG_LIST_HDR_SIZE], size - TAG_LIST_HDR_SIZE, &next);
+    *((tag_index *)&buff[4]) = next;
+    _message_send(msg->fd, MSG_TAG_LIST, buff, result + TAG_LIST_HDR_SIZE, RESPONSE);
+    free(buff);
     return 0;
 }
 
@@ -532,11 +852,11 @@ msg_tag_list(dax_message *msg)
 int
 msg_tag_read(dax_message *msg)
 {
-    char data[MSG_DATA_SIZE];
+    char buff[MSG_DATA_SIZE], *data;
     tag_index index;
     int result;
     uint32_t offset;
-    int size;
+    uint32_t size;
 
     index = *((tag_index *)&msg->data[0]);
     offset = *((uint32_t *)&msg->data[4]);
@@ -544,12 +864,26 @@ msg_tag_read(dax_message *msg)
 
     xlog(LOG_MSG | LOG_VERBOSE, "Tag Read Message from module %d, index %d, offset %d, size %d", msg->fd, index, offset, size);
 
-    result = tag_read(index, offset, &data, size);
+    /* Reads that won't fit in a single message are sent back in chunks */
+    data = buff;
+    if(size > DAX_TRANSFER_MAX) {
+        result = ERR_2BIG;
+    } else {
+        if(size > MSG_DATA_SIZE) {
+            data = malloc(size);
+        }
+        if(data == NULL) {
+            result = ERR_ALLOC;
+        } else {
+            result = tag_read(index, offset, data, size);
+        }
+    }
     if(result) {
         _message_send(msg->fd, MSG_TAG_READ, &result, sizeof(result), ERROR);
     } else {
-        _message_send(msg->fd, MSG_TAG_READ, &data, size, RESPONSE);
+        _message_send(msg->fd, MSG_TAG_READ, data, size, RESPONSE);
     }
+    if(data != buff) free(data);
     return 0;
 }
 
@@ -686,6 +1020,60 @@ msg_evnt_add(dax_message *msg)
     return 0;
 }
 
+/* Message wrapper function for adding several events at once.  Each event
+ * definition is laid out like the MSG_EVNT_ADD message except that there is
+ * a byte after the bit offset that gives the size of the data that follows.
+ * The response is the id of each event in the same order or the error code
+ * if that event could not be added. */
+int
+msg_evnt_multi_add(dax_message *msg)
+{
+    tag_handle h;
+    dax_dint event_type, *results;
+    dax_module *module;
+    uint32_t offset, len;
+    int n = 0, result;
+
+    xlog(LOG_MSG | LOG_VERBOSE, "Multiple Add Event Message from %d, size %d", msg->fd, msg->size);
+    module = module_find_fd(msg->fd);
+    if(module == NULL) {
+        result = ERR_NOTFOUND;
+        _message_send(msg->fd, MSG_EVNT_MADD, &result, sizeof(result), ERROR);
+        return result;
+    }
+    /* Each definition is at least 26 bytes */
+    results = malloc(sizeof(dax_dint) * (msg->size / 26 + 1));
+    if(results == NULL) {
+        result = ERR_ALLOC;
+        _message_send(msg->fd, MSG_EVNT_MADD, &result, sizeof(result), ERROR);
+        return result;
+    }
+    for(offset = 0; offset < msg->size; offset += 26 + len) {
+        if(msg->size - offset < 26 ||
+           (len = (uint8_t)msg->data[offset + 25]) > msg->size - offset - 26) {
+            free(results);
+            result = ERR_MSG_BAD;
+            _message_send(msg->fd, MSG_EVNT_MADD, &result, sizeof(result), ERROR);
+            return result;
+        }
+        memcpy(&h.index, &msg->data[offset], 4);
+        memcpy(&h.byte, &msg->data[offset + 4], 4);
+        memcpy(&h.count, &msg->data[offset + 8], 4);
+        memcpy(&h.type, &msg->data[offset + 12], 4);
+        memcpy(&event_type, &msg->data[offset + 16], 4);
+        memcpy(&h.size, &msg->data[offset + 20], 4);
+        h.bit = msg->data[offset + 24];
+        if(len > 0 && len < type_size(h.type)) {
+            results[n++] = ERR_ARG;
+        } else {
+            results[n++] = event_add(h, event_type, len ? &msg->data[offset + 26] : NULL, module);
+        }
+    }
+    _message_send(msg->fd, MSG_EVNT_MADD, results, sizeof(dax_dint) * n, RESPONSE);
+    free(results);
+    return 0;
+}
+
 int
 msg_evnt_del(dax_message *msg)
 {
@@ -702,8 +1090,8 @@ msg_evnt_del(dax_message *msg)
 
     result = event_del(idx, id, module);
 
-    if(idx >= 0) {
-        _message_send(msg->fd, MSG_EVNT_DEL, &idx, 8, RESPONSE);
+    if(result == 0) {
+        _message_send(msg->fd, MSG_EVNT_DEL, NULL, 0, RESPONSE);
     } else {
         _message_send(msg->fd, MSG_EVNT_DEL, &result, sizeof(result), ERROR);
     }
@@ -852,16 +1240,23 @@ int msg_map_get(dax_message *msg)
     return 0;
 }
 
+/* The message is the number of members (4 bytes), the options byte and
+ * then the handles of the members */
 int
 msg_group_add(dax_message *msg) {
     dax_module *mod;
     int id;
-    uint8_t count; //, options;
+    uint32_t count;
+    uint8_t options;
 
     mod = module_find_fd(msg->fd);
-    count = msg->data[0];
-    //options = msg->data[1]; /* Might use this in the future to indicate maskable groups */
-    id = group_add(mod, (uint8_t *)&msg->data[2], count);
+    count = *((uint32_t *)&msg->data[0]);
+    options = msg->data[4];
+    if(msg->size < 5 || (msg->size - 5) / TAG_GROUP_HANDLE_SIZE < count) {
+        id = ERR_MSG_BAD;
+    } else {
+        id = group_add(mod, (uint8_t *)&msg->data[5], count, options);
+    }
 
     if(id < 0) { /* Send Error */
         _message_send(msg->fd, MSG_GRP_ADD, &id, sizeof(int), ERROR);
@@ -885,27 +1280,37 @@ msg_group_del(dax_message *msg) {
     } else {
         _message_send(msg->fd, MSG_GRP_DEL, &result, sizeof(int), RESPONSE);
     }
-    printf("Message Group Delete\n");
+    xlog(LOG_MSG | LOG_VERBOSE, "Group Delete Message from module %d, group %d", msg->fd, index);
     return 0;
 }
 
+/* Groups that won't fit in a single message are sent back in chunks */
 int
 msg_group_read(dax_message *msg) {
     dax_module *mod;
     int result;
     uint32_t index;
-    uint8_t buff[MSG_TAG_GROUP_DATA_SIZE];
+    uint8_t buff[MSG_DATA_SIZE], *data;
 
     mod = module_find_fd(msg->fd);
     memcpy(&index, &msg->data[0], 4);
 
-    result = group_read(mod, index, buff, MSG_TAG_GROUP_DATA_SIZE);
+    data = buff;
+    result = group_get_size(mod, index);
+    if(result > MSG_DATA_SIZE) {
+        data = malloc(result);
+        if(data == NULL) result = ERR_ALLOC;
+    }
+    if(result >= 0) {
+        result = group_read(mod, index, data, result > MSG_DATA_SIZE ? result : MSG_DATA_SIZE);
+    }
     if(result < 0) { /* Send Error */
         _message_send(msg->fd, MSG_GRP_READ, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_GRP_READ, buff, result, RESPONSE);
+        _message_send(msg->fd, MSG_GRP_READ, data, result, RESPONSE);
     }
-    printf("Message Group Read\n");
+    if(data != buff) free(data);
+    xlog(LOG_MSG | LOG_VERBOSE, "Group Read Message from module %d, group %d", msg->fd, index);
     return 0;
 }
 
@@ -918,13 +1323,13 @@ msg_group_write(dax_message *msg) {
     mod = module_find_fd(msg->fd);
     memcpy(&index, &msg->data[0], 4);
 
-    result = group_write(mod, index, (uint8_t *)&msg->data[4]);
+    result = group_write(mod, index, (uint8_t *)&msg->data[4], msg->size - 4);
     if(result < 0) { /* Send Error */
         _message_send(msg->fd, MSG_GRP_WRITE, &result, sizeof(int), ERROR);
     } else {
         _message_send(msg->fd, MSG_GRP_WRITE, NULL, 0, RESPONSE);
     }
-    printf("Message Group Write\n");
+    xlog(LOG_MSG | LOG_VERBOSE, "Group Write Message from module %d, group %d", msg->fd, index);
     return 0;
 }
 
@@ -944,9 +1349,11 @@ msg_group_mask_write(dax_message *msg) {
 
 int
 msg_atomic_op(dax_message *msg) {
-    int result;
+    int result, size;
     tag_handle h;
     uint16_t operation;
+    uint8_t buff[MSG_DATA_SIZE];
+    uint8_t *prev = NULL;
 
     h.index = *(dax_dint *)msg->data;          /* Index */
     h.byte = *(dax_dint *)&msg->data[4];       /* Byte offset */
@@ -954,16 +1361,34 @@ msg_atomic_op(dax_message *msg) {
     h.type = *(dax_dint *)&msg->data[12];      /* Data type */
     h.bit = msg->data[16];                     /* Bit offset */
     operation = *(dax_uint *)&msg->data[17];   /* Operation */
+    if(msg->size < 21) {
+        result = ERR_MSG_BAD;
+        _message_send(msg->fd, MSG_ATOMIC_OP, &result, sizeof(int), ERROR);
+        return 0;
+    }
     h.size = msg->size - 21; /* Total message size minus the above data */
 
     xlog(LOG_MSG | LOG_VERBOSE, "Atomic Operation Message from module %d, index %d, offset %d, size %d", msg->fd, h.index, h.byte, h.size);
 
-    result = atomic_op(h, &msg->data[21], operation);
+    /* These send the data from before the operation back */
+    size = 0;
+    if(operation == ATOMIC_OP_CAS || operation == ATOMIC_OP_FETCH_ADD) {
+        size = h.size;
+        if(operation == ATOMIC_OP_CAS) size /= 2;
+        prev = size > sizeof(buff) ? malloc(size) : buff;
+        if(prev == NULL) {
+            result = ERR_ALLOC;
+            _message_send(msg->fd, MSG_ATOMIC_OP, &result, sizeof(int), ERROR);
+            return 0;
+        }
+    }
+    result = atomic_op(h, &msg->data[21], h.size, prev, operation);
     if(result < 0) { /* Send Error */
         _message_send(msg->fd, MSG_ATOMIC_OP, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_ATOMIC_OP, NULL, 0, RESPONSE);
+        _message_send(msg->fd, MSG_ATOMIC_OP, prev, size, RESPONSE);
     }
+    if(prev != NULL && prev != buff) free(prev);
     return 0;
 }
 
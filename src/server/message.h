@@ -31,16 +31,22 @@
 int msg_setup(void);
 void msg_destroy(void);
 int msg_receive(void);
+int msg_process(void);
 void msg_add_fd(int);
 void msg_del_fd(int);
 int msg_dispatcher(int, unsigned char *);
+int msg_send_error(int fd, int command, int error);
+
+/* Initial size of the array of receive buffers.  It is indexed
+ * by file descriptor and grows as needed. */
+#ifndef DEFAULT_BUFF_FDS
+#  define DEFAULT_BUFF_FDS 64
+#endif
 
 /* buffer.c functions */
 int buff_initialize(void);
 int buff_read(int fd);
-void buff_wipe(void);
 void buff_free(int);
-void buff_freeall(void);
 
 
 #endif /* !__MESSAGE_H */
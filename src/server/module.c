@@ -157,6 +157,7 @@ module_del(dax_module *mod)
         _module_count--;
         /* free allocated memory */
         if(mod->name) free(mod->name);
+        if(mod->ebuff) free(mod->ebuff);
         free(mod);
         return 0;
     }
@@ -239,6 +240,9 @@ module_unregister(int fd)
     mod = _get_module_fd(fd);
     if(mod != NULL) {
         xlog(LOG_MAJOR,"Removing module '%s' at file descriptor %d", mod->name, fd);
+        /* The socket is already closed so there is no use telling it about
+         * it's own tag going away */
+        mod->flags &= ~MFLAG_TAG_NOTIFY;
         events_cleanup(mod);
         groups_cleanup(mod);
         tag_del(mod->tagindex);
@@ -249,6 +253,28 @@ module_unregister(int fd)
 }
 
 
+/* Tells all the modules that asked for it that the tag has been deleted */
+void
+module_tag_deleted(tag_index idx)
+{
+    dax_module *mod;
+    uint32_t buff[3];
+
+    if(_current_mod == NULL) return;
+    buff[0] = htonl(sizeof(uint32_t));
+    buff[1] = htonl(MSG_EVENT | EVENT_TAG_DELETED);
+    buff[2] = htonl(idx);
+    mod = _current_mod;
+    do {
+        if(mod->flags & MFLAG_TAG_NOTIFY) {
+            if(xwrite(mod->fd, buff, sizeof(buff)) < 0) {
+                xerror("module_tag_deleted: %s", strerror(errno));
+            }
+        }
+        mod = mod->next;
+    } while(mod != _current_mod);
+}
+
 dax_module *
 module_find_fd(int fd)
 {
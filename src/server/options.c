@@ -37,6 +37,13 @@ static struct in_addr _serverip;
 static unsigned int _serverport;
 static int _verbosity;
 static int _min_buffers;
+static int _worker_threads;
+static int _shm_size;
+static char *_shm_name;
+static int _shm_group;
+static char *_retain_file;
+static int _retain_interval;
+static int _group_interval;
 
 
 /* Initialize the configuration to NULL or 0 for cleanliness */
@@ -51,6 +58,13 @@ static void initconfig(void) {
     }
     _verbosity = 0;
     _min_buffers = 0;
+    _worker_threads = 0;
+    _shm_size = -1;
+    _shm_name = NULL;
+    _shm_group = 0;
+    _retain_file = NULL;
+    _retain_interval = -1;
+    _group_interval = -1;
     _socketname = NULL;
     _serverip.s_addr = 0;
     _serverport = 0;
@@ -62,7 +76,13 @@ static void
 setdefaults(void)
 {
     if(!_min_buffers) _min_buffers = DEFAULT_MIN_BUFFERS;
+    if(_worker_threads <= 0) _worker_threads = DEFAULT_WORKER_THREADS;
     if(!_socketname) _socketname = strdup("/tmp/opendax");
+    if(_shm_size < 0) _shm_size = DEFAULT_SHM_SIZE;
+    if(!_shm_name) _shm_name = strdup("/opendax");
+    if(!_retain_file) _retain_file = strdup("retentive.db");
+    if(_retain_interval < 0) _retain_interval = DEFAULT_RETAIN_INTERVAL;
+    if(_group_interval < 0) _group_interval = DEFAULT_GROUP_INTERVAL;
     if(!_serverport) _serverport = DEFAULT_PORT;
     if(!_serverip.s_addr) inet_aton("0.0.0.0", &_serverip);
 }
@@ -79,13 +99,15 @@ parsecommandline(int argc, const char *argv[])
         {"socketname", required_argument, 0, 'S'},
         {"serverip", required_argument, 0, 'I'},
         {"serverport", required_argument, 0, 'P'},
+        {"workers", required_argument, 0, 'W'},
+        {"shmsize", required_argument, 0, 'M'},
         {"version", no_argument, 0, 'V'},
         {"verbose", no_argument, 0, 'v'},
         {0, 0, 0, 0}
     };
 
 /* Get the command line arguments */
-    while ((c = getopt_long (argc, (char * const *)argv, "C:S:I:P:Vv",options, NULL)) != -1) {
+    while ((c = getopt_long (argc, (char * const *)argv, "C:S:I:P:W:M:Vv",options, NULL)) != -1) {
         switch (c) {
         case 'C':
             _configfile = strdup(optarg);
@@ -101,6 +123,12 @@ parsecommandline(int argc, const char *argv[])
         case 'P':
             _serverport = strtol(optarg, NULL, 0);
             break;
+        case 'W':
+            _worker_threads = strtol(optarg, NULL, 0);
+            break;
+        case 'M':
+            _shm_size = strtol(optarg, NULL, 0);
+            break;
         case 'V':
             printf("%s Version %s\n", PACKAGE, VERSION);
             exit(0);
@@ -150,6 +178,48 @@ readconfigfile(void)
     }
     lua_pop(L, 1);
 
+    lua_getglobal(L, "worker_threads");
+    if(_worker_threads == 0) { /* Make sure we didn't get anything on the commandline */
+        _worker_threads = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "shm_size");
+    /* Zero is a legal value here so we check for a number */
+    if(_shm_size < 0 && lua_isnumber(L, -1)) {
+        _shm_size = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "shm_name");
+    if(_shm_name == NULL && lua_isstring(L, -1)) {
+        _shm_name = strdup(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "shm_group_read");
+    _shm_group = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "retain_file");
+    if(_retain_file == NULL && lua_isstring(L, -1)) {
+        _retain_file = strdup(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "retain_interval");
+    /* Zero is a legal value here so we check for a number */
+    if(_retain_interval < 0 && lua_isnumber(L, -1)) {
+        _retain_interval = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "group_interval");
+    if(_group_interval < 0 && lua_isnumber(L, -1)) {
+        _group_interval = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
     /* TODO: This needs to be changed to handle the new topic handlers */
     if(_verbosity == 0) { /* Make sure we didn't get anything on the commandline */
         //_verbosity = (int)lua_tonumber(L, 4);
@@ -205,3 +275,49 @@ opt_min_buffers(void)
     return _min_buffers;
 }
 
+int
+opt_worker_threads(void)
+{
+    return _worker_threads;
+}
+
+/* Size of the shared memory segment in bytes, zero if it's disabled */
+size_t
+opt_shm_size(void)
+{
+    return (size_t)_shm_size * 1024;
+}
+
+char *
+opt_shm_name(void)
+{
+    return _shm_name;
+}
+
+/* True if the members of the server's group can read the segment */
+int
+opt_shm_group(void)
+{
+    return _shm_group;
+}
+
+char *
+opt_retain_file(void)
+{
+    return _retain_file;
+}
+
+/* Milliseconds between writes of the retained tags to the file */
+int
+opt_retain_interval(void)
+{
+    return _retain_interval;
+}
+
+/* Least number of milliseconds between the changes that are sent for a
+ * subscribed tag group */
+int
+opt_group_interval(void)
+{
+    return _group_interval;
+}
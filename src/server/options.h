@@ -34,6 +34,31 @@
 #  define DEFAULT_MIN_BUFFERS 5
 #endif
 
+/* This is the default number of threads that will be started to
+   handle module messages if none is specified in the configuration */
+#ifndef DEFAULT_WORKER_THREADS
+#  define DEFAULT_WORKER_THREADS 4
+#endif
+
+/* This is the default size of the shared memory segment in kilobytes that
+   local modules use to read tag data.  Zero disables the segment */
+#ifndef DEFAULT_SHM_SIZE
+#  define DEFAULT_SHM_SIZE 4096
+#endif
+
+/* This is the default number of milliseconds between writes of the retained
+   tag data to the retention file.  Zero writes the data on every change */
+#ifndef DEFAULT_RETAIN_INTERVAL
+#  define DEFAULT_RETAIN_INTERVAL 1000
+#endif
+
+/* This is the default number of milliseconds between the messages that are
+ * sent for a subscribed tag group.  Zero sends the changes at the end of
+ * each message that makes them */
+#ifndef DEFAULT_GROUP_INTERVAL
+#  define DEFAULT_GROUP_INTERVAL 100
+#endif
+
 int opt_configure(int argc, const char *argv[]);
 
 /* These functions return the configuration parameters */
@@ -42,6 +67,16 @@ struct in_addr opt_serverip(void);
 unsigned int opt_serverport(void);
 /* Minimum number of communication buffers to allocate */
 int opt_min_buffers(void);
+/* Number of message handling threads to start */
+int opt_worker_threads(void);
+/* Shared memory segment size in bytes and name */
+size_t opt_shm_size(void);
+char *opt_shm_name(void);
+int opt_shm_group(void);
+/* Tag retention file name and flush interval in milliseconds */
+char *opt_retain_file(void);
+int opt_retain_interval(void);
+int opt_group_interval(void);
 int opt_start_timeout(void);
 
 #endif /* !__OPTIONS_H */
@@ -18,223 +18,921 @@
  *  Source code file for tag retention functions
  */
 
-/* Retention File Format
+/* Retention File Format (Version 2)
+ *
+ * The file is mapped into memory and the records are written in place.  A
+ * write to a retained tag only marks the tag as dirty.  A separate thread
+ * copies the data of all the dirty tags into the file every retain_interval
+ * milliseconds and then syncs the file.  All numbers are in host byte order.
  *
  * HEADER
  * Byte,  Size,  Type,   Description
  * 0      6      ASCII   "DAXRET", File Signature
- * 6      2      UINT16   Version
- * 8      4      UINT32   First Data Type Record Pointer
- * 12     4      UINT32   First Tag Record Pointer
- * 16     ~               Data Records
+ * 6      2      UINT16  Version
+ * 8      8              Reserved
+ * 16     ~              Tag Records
+ *
+ * The records follow the header one after the other.  A record size of
+ * zero marks the end of the records.  The data type record for a custom
+ * data type is always written before the first tag record that uses it.
  *
  * TAG RECORD (Bytes are offsets from record start)
  * Byte,  Size,  Type,   Description
- * 0      4      UINT32  Pointer to the next tag record (essentially a linked list)
- * 4      4      UINT32  The Tags Data Size
- * 8      1      UINT8   Size of the Tag Name in the record
- * 9      1      BYTE    Flags Byte
- * 10     4      UINT32  Data Type (same as OpenDAX Type)
- * 14     4      UINT32  Tag Item Count (for arrays)
- * 18     (8)    CHAR    Tag Name (Size in Byte 8)
- * 18+(8) (4)    VOID    Tag Data
+ * 0      4      UINT32  Total size of the record.  Always a multiple of 8
+ * 4      4      UINT32  CRC32 of bytes 8 through the end of the tag name
+ * 8      4      UINT32  The Tags Data Size
+ * 12     1      UINT8   Size of the Tag Name in the record
+ * 13     1      BYTE    Flags Byte
+ * 14     1      UINT8   Record Kind, RET_REC_TAG
+ * 15     1              Reserved
+ * 16     4      UINT32  Data Type (same as OpenDAX Type)
+ * 20     4      UINT32  Tag Item Count (for arrays)
+ * 24     (12)   CHAR    Tag Name (Size in Byte 12)
+ * ~      ~              Two Data Slots, the first starts on an 8 byte boundary
+ *
+ * DATA SLOT
+ * Byte,  Size,  Type,   Description
+ * 0      4      UINT32  CRC32 of bytes 4 through the end of the data
+ * 4      4      UINT32  Sequence number
+ * 8      (8)    VOID    Tag Data, padded to a multiple of 8
+ *
+ * Each flush writes the tag data into the slot that holds the older copy
+ * and gives it the next sequence number.  If we crash in the middle of a
+ * flush the other slot still has good data.  When the file is read back the
+ * slot with a good CRC and the highest sequence number is used.
  *
- * TAG FLAG BYTE
+ * DATA TYPE RECORD (Bytes are offsets from record start)
+ * Byte,  Size,  Type,   Description
+ * 0      4      UINT32  Total size of the record.  Always a multiple of 8
+ * 4      4      UINT32  CRC32 of bytes 8 through the end of the description
+ * 8      4      UINT32  Data Type description size
+ * 12     1      UINT8   Name Size
+ * 13     1      BYTE    Flags Byte
+ * 14     1      UINT8   Record Kind, RET_REC_TYPE
+ * 15     1              Reserved
+ * 16     4      UINT32  Data Type ID (same as OpenDAX)
+ * 20     4              Reserved
+ * 24     (12)   CHAR    Data Type Name
+ * 24+(12) (8)   CHAR    Data Type Description (string from serialize_datatype() function)
+ *
+ * The data type IDs are only good for one run of the server.  When the file
+ * is read the data types are created again and the tag records are given
+ * the new ID.
+ *
+ * FLAG BYTE
  * Bit,   Description
  * 0      RET_FLAG_DELETED, Tag has been deleted after initialization
  *
- * DATA TYPE RECORD (Currently Not Implemented) (Bytes are offsets from record start)
- * Byte,   Size,  Type,   Description
- * 0       4      UINT32  Pointer to the next data type record (essentially a linked list)
- * 4       2      UINT16  Data Type description size
- * 6       4      UINT32  Data Type ID (same as OpenDAX)
- * 10      1      UINT8   Name Size
- * 11      (10)   CHAR    Data Type Name
- * 11+(10) (4)    CHAR    Data Type Description (string from serialize_datatype() function)
+ * Records that are marked deleted are left in the file until there are
+ * more deleted bytes than live ones.  Then the retention thread compacts
+ * the file by copying the live records to a new file and renaming it over
+ * the old one.  The tag server keeps running while the copy is synced.
+ *
+ * Version 1 files, which kept the tags in a linked list and were written
+ * with a write() for each tag write, are read and converted.
  */
 
 #include <common.h>
 #include "retain.h"
 #include "func.h"
 #include "tagbase.h"
+#include "crc.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 extern _dax_tag_db *_db;
 
-static int _fd;
-static uint16_t _version;
-//static uint32_t _last_type_pointer;
-static uint32_t _last_tag_pointer;
-//static uint32_t _next_offset;
+#define RET_HEADER_SIZE   16
+#define RET_RECORD_SIZE   24 /* Fixed part of the tag record */
+#define RET_SLOT_HEADER   8
+#define RET_ALIGN(x)      (((x) + 7) & ~7)
+
+static int _fd = -1;
+static char *_filename;
+static uint8_t *_map;      /* Mapping of the file.  NULL if retention is off */
+static uint32_t _ret_end;  /* Offset where the next record will be written */
+static uint32_t _ret_size; /* Current size of the file */
+static uint32_t _ret_dead; /* Bytes in records that have been deleted */
+static uint32_t _ret_gen;  /* Changed whenever a record is added or deleted */
+static int _interval;      /* Milliseconds between flushes.  Zero writes through */
+
+/* Set for each custom data type that has a record in the file.  Indexed
+ * by CDT_TO_INDEX() */
+static uint8_t *_cdt_written;
+static unsigned int _cdt_size;
+
+/* Tags that have been written since the last flush.  This list and the
+ * ret_dirty flag in the tag database are changed by ret_tag_write() with the
+ * tagbase write lock held and cleared by the flush with the read lock held so
+ * they don't need a lock of their own. */
+static tag_index *_dirty;
+static int _dirty_count;
+static int _dirty_size;
+
+static pthread_t _flush_thread;
+static pthread_mutex_t _flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _flush_cond = PTHREAD_COND_INITIALIZER;
+static int _flush_running;
+static int _flush_quit;
+
+static inline uint32_t
+_rec_u32(uint32_t offset)
+{
+    return *(uint32_t *)&_map[offset];
+}
+
+static inline void
+_set_u32(uint32_t offset, uint32_t value)
+{
+    *(uint32_t *)&_map[offset] = value;
+}
+
+/* Offset of the first data slot of the record */
+static inline uint32_t
+_slot_offset(uint32_t rec, int slot)
+{
+    uint32_t first;
+
+    first = rec + RET_ALIGN(RET_RECORD_SIZE + _map[rec + 12]);
+    return first + slot * RET_ALIGN(RET_SLOT_HEADER + _rec_u32(rec + 8));
+}
+
+static inline uint32_t
+_header_crc(uint32_t rec)
+{
+    uint32_t size;
 
-/* read through the file and create the tags in the database */
+    size = RET_RECORD_SIZE - 8 + _map[rec + 12];
+    if(_map[rec + 14] == RET_REC_TYPE) size += _rec_u32(rec + 8);
+    return (uint32_t)CRC32(&_map[rec + 8], size);
+}
+
+static inline uint32_t
+_slot_crc(uint32_t slot, uint32_t size)
+{
+    return (uint32_t)CRC32(&_map[slot + 4], 4 + size);
+}
+
+/* Returns the slot with good data and the highest sequence number or -1
+ * if neither slot has been written */
 static int
-_create_tags(void) {
-    char buff[256];
-    uint8_t name_size, flags;
-    uint32_t tag_pointer, tag_size, tag_type, tag_count;
-    tag_index tag_index;
-
-    lseek(_fd, 12, SEEK_SET); /* Location of the first tag record pointer */
-    read(_fd, &tag_pointer, 4);
-    if(tag_pointer == 0) return 0; /* No tags to create, bail out */
-    while(1) {
-        lseek(_fd, tag_pointer, SEEK_SET);
-        read(_fd, &tag_pointer, 4); /* Pointer to the next tag */
-        read(_fd, &tag_size, 4);
-        read(_fd, &name_size, 1);
-        read(_fd, &flags, 1);
-        read(_fd, &tag_type, 4);
-        read(_fd, &tag_count, 4);
-        read(_fd, buff, name_size);
-        buff[name_size] = 0x00;
-        /* We don't actually delete records in the file.  We just mark the tag as deleted
-         * and then ignore it here. */
-        if((flags & RET_FLAG_DELETED) == 0x00) {
+_best_slot(uint32_t rec)
+{
+    uint32_t size, s0, s1;
+    int good0, good1;
+
+    size = _rec_u32(rec + 8);
+    s0 = _slot_offset(rec, 0);
+    s1 = _slot_offset(rec, 1);
+    good0 = _rec_u32(s0 + 4) != 0 && _rec_u32(s0) == _slot_crc(s0, size);
+    good1 = _rec_u32(s1 + 4) != 0 && _rec_u32(s1) == _slot_crc(s1, size);
+    if(good0 && good1) {
+        return (int32_t)(_rec_u32(s1 + 4) - _rec_u32(s0 + 4)) > 0 ? 1 : 0;
+    }
+    if(good0) return 0;
+    if(good1) return 1;
+    return -1;
+}
+
+/* Makes sure that there are at least size bytes in the file past _ret_end */
+static int
+_file_reserve(uint32_t size)
+{
+    uint32_t newsize;
+
+    if(_ret_end + size <= _ret_size) return 0;
+    newsize = _ret_end + size;
+    newsize = (newsize + RET_GROW_SIZE - 1) / RET_GROW_SIZE * RET_GROW_SIZE;
+    if(newsize > RET_MAP_SIZE) {
+        xerror("Tag retention file is full");
+        return ERR_2BIG;
+    }
+    if(ftruncate(_fd, newsize)) {
+        xerror("Unable to grow the tag retention file - %s", strerror(errno));
+        return ERR_GENERIC;
+    }
+    _ret_size = newsize;
+    return 0;
+}
+
+/* Copy the tag data into the older slot of the record.  The slots aren't
+ * checked here.  A slot that was torn by a crash has it's sequence number
+ * cleared when the file is read so it looks like the older one. */
+static void
+_flush_tag(tag_index idx)
+{
+    uint32_t rec, size, seq0, seq1, seq, slot;
+
+    rec = _db[idx].ret_file_pointer;
+    size = _rec_u32(rec + 8);
+    seq0 = _rec_u32(_slot_offset(rec, 0) + 4);
+    seq1 = _rec_u32(_slot_offset(rec, 1) + 4);
+    if(seq0 == 0 || (seq1 != 0 && (int32_t)(seq1 - seq0) > 0)) {
+        slot = _slot_offset(rec, 0);
+        seq = seq1 + 1;
+    } else {
+        slot = _slot_offset(rec, 1);
+        seq = seq0 + 1;
+    }
+    if(seq == 0) seq = 1; /* Zero means the slot was never written */
+    memcpy(&_map[slot + RET_SLOT_HEADER], _db[idx].data, MIN(size, tag_get_size(idx)));
+    _set_u32(slot + 4, seq);
+    _set_u32(slot, _slot_crc(slot, size));
+}
+
+/* Write the data for all of the dirty tags into the file.  Call with at
+ * least the tagbase read lock held.  Returns the number of tags written. */
+static int
+_flush_dirty(void)
+{
+    int n, count = 0;
+    tag_index idx;
+
+    for(n = 0; n < _dirty_count; n++) {
+        idx = _dirty[n];
+        /* The tag may have been deleted since it was written */
+        if(_db[idx].ret_dirty && _db[idx].ret_file_pointer) {
+            _flush_tag(idx);
+            count++;
+        }
+        _db[idx].ret_dirty = 0;
+    }
+    _dirty_count = 0;
+    return count;
+}
+
+/* Writes the record for the custom data type at the end of the file.  The
+ * types that are used by the members are written first. */
+static int
+_append_type(tag_type type)
+{
+    char *desc, *copy, *member, *last, *typename;
+    uint32_t rec, name_size, desc_size, size;
+    unsigned int index;
+    uint8_t *new;
+    tag_type mtype;
+    int result;
+
+    index = CDT_TO_INDEX(type);
+    if(index < _cdt_size && _cdt_written[index]) return 0;
+    if(index >= _cdt_size) {
+        new = realloc(_cdt_written, index + 16);
+        if(new == NULL) return ERR_ALLOC;
+        bzero(&new[_cdt_size], index + 16 - _cdt_size);
+        _cdt_written = new;
+        _cdt_size = index + 16;
+    }
+    result = serialize_datatype(type, &desc);
+    if(result < 0) return result;
+    desc_size = strlen(desc);
+    name_size = strcspn(desc, ":");
+    /* The description is NAME:member,type,count:member,type,count...  We
+     * look up the type of each member in a copy because strtok_r() writes
+     * all over it. */
+    copy = strdup(desc);
+    if(copy == NULL) {
+        free(desc);
+        return ERR_ALLOC;
+    }
+    strtok_r(copy, ":", &last);
+    while((member = strtok_r(NULL, ":", &last))) {
+        typename = strchr(member, ',');
+        if(typename == NULL) continue;
+        typename++;
+        typename[strcspn(typename, ",")] = 0x00;
+        mtype = cdt_get_type(typename);
+        if(IS_CUSTOM(mtype) && (result = _append_type(mtype))) {
+            free(copy);
+            free(desc);
+            return result;
+        }
+    }
+    free(copy);
+    size = RET_ALIGN(RET_RECORD_SIZE + name_size + desc_size);
+    result = _file_reserve(size);
+    if(result) {
+        free(desc);
+        return result;
+    }
+    rec = _ret_end;
+    bzero(&_map[rec], size);
+    _set_u32(rec + 8, desc_size);
+    _map[rec + 12] = name_size;
+    _map[rec + 14] = RET_REC_TYPE;
+    _set_u32(rec + 16, type);
+    memcpy(&_map[rec + RET_RECORD_SIZE], desc, name_size);
+    memcpy(&_map[rec + RET_RECORD_SIZE + name_size], desc, desc_size);
+    free(desc);
+    _set_u32(rec + 4, _header_crc(rec));
+    _set_u32(rec, size);
+    _ret_end += size;
+    _ret_gen++;
+    _cdt_written[index] = 1;
+    return 0;
+}
+
+/* Writes the record for the tag at the end of the file */
+static int
+_append_record(tag_index idx)
+{
+    uint32_t rec, name_size, data_size, size;
+    int result;
+
+    if(IS_CUSTOM(_db[idx].type)) {
+        result = _append_type(_db[idx].type);
+        if(result) return result;
+    }
+    name_size = strlen(_db[idx].name);
+    data_size = tag_get_size(idx);
+    size = RET_ALIGN(RET_RECORD_SIZE + name_size) + 2 * RET_ALIGN(RET_SLOT_HEADER + data_size);
+    result = _file_reserve(size);
+    if(result) return result;
+    rec = _ret_end;
+    bzero(&_map[rec], size);
+    _set_u32(rec + 8, data_size);
+    _map[rec + 12] = name_size;
+    _map[rec + 13] = 0x00;
+    _set_u32(rec + 16, _db[idx].type);
+    _set_u32(rec + 20, _db[idx].count);
+    memcpy(&_map[rec + RET_RECORD_SIZE], _db[idx].name, name_size);
+    _set_u32(rec + 4, _header_crc(rec));
+    /* The size goes in last.  Until it's there this record is the end */
+    _set_u32(rec, size);
+    _ret_end += size;
+    _ret_gen++;
+    _db[idx].ret_file_pointer = rec;
+    _flush_tag(idx);
+    return 0;
+}
+
+static void
+_mark_deleted(uint32_t rec)
+{
+    _map[rec + 13] |= RET_FLAG_DELETED;
+    _set_u32(rec + 4, _header_crc(rec));
+    _ret_dead += _rec_u32(rec);
+    _ret_gen++;
+}
+
+/* Checks that the record at offset is within the file and returns its size
+ * or zero if we are at the end of the records */
+static uint32_t
+_record_size(uint32_t offset, uint32_t filesize)
+{
+    uint32_t size;
+
+    if(offset + RET_RECORD_SIZE > filesize) return 0;
+    size = _rec_u32(offset);
+    if(size < RET_RECORD_SIZE || size % 8 || size > filesize - offset) return 0;
+    if(_map[offset + 14] == RET_REC_TYPE) {
+        if(RET_ALIGN(RET_RECORD_SIZE + _map[offset + 12] + (uint64_t)_rec_u32(offset + 8)) != size) return 0;
+    } else if(RET_ALIGN(RET_RECORD_SIZE + _map[offset + 12]) +
+              2 * (uint64_t)RET_ALIGN(RET_SLOT_HEADER + _rec_u32(offset + 8)) != size) {
+        return 0;
+    }
+    return size;
+}
+
+/* Creates the custom data type from the record and returns the new type */
+static tag_type
+_create_type(uint32_t rec)
+{
+    char *desc;
+    tag_type type;
+    int error;
+    unsigned int index;
+
+    desc = malloc(_rec_u32(rec + 8) + 1);
+    if(desc == NULL) return 0;
+    memcpy(desc, &_map[rec + RET_RECORD_SIZE + _map[rec + 12]], _rec_u32(rec + 8));
+    desc[_rec_u32(rec + 8)] = 0x00;
+    type = cdt_create(desc, &error);
+    free(desc);
+    if(type == 0) return 0;
+    index = CDT_TO_INDEX(type);
+    if(index >= _cdt_size) {
+        desc = realloc(_cdt_written, index + 16);
+        if(desc == NULL) return type;
+        bzero(&desc[_cdt_size], index + 16 - _cdt_size);
+        _cdt_written = (uint8_t *)desc;
+        _cdt_size = index + 16;
+    }
+    _cdt_written[index] = 1;
+    return type;
+}
+
+/* Read through the records in the mapped file in one pass and create the
+ * data types and the tags in the database */
+static int
+_create_tags(uint32_t filesize)
+{
+    char name[256];
+    uint32_t offset, size, old, type, types_size = 0;
+    tag_type *types = NULL, *new_types;
+    int slot;
+    tag_index idx;
+
+    offset = RET_HEADER_SIZE;
+    while((size = _record_size(offset, filesize)) != 0) {
+        /* A record with a bad header was torn while it was being changed */
+        if(_rec_u32(offset + 4) != _header_crc(offset)) {
+            xlog(LOG_ERROR, "Bad tag retention record at offset %u", offset);
+            _ret_dead += size;
+        /* We don't actually delete records in the file.  We just mark the
+         * tag as deleted and then ignore it here. */
+        } else if(_map[offset + 13] & RET_FLAG_DELETED) {
+            _ret_dead += size;
+        } else if(_map[offset + 14] == RET_REC_TYPE) {
+            /* Keep track of the ID that the type has now */
+            type = CDT_TO_INDEX(_rec_u32(offset + 16));
+            if(type >= types_size) {
+                new_types = realloc(types, sizeof(tag_type) * (type + 16));
+                if(new_types == NULL) break;
+                bzero(&new_types[types_size], sizeof(tag_type) * (type + 16 - types_size));
+                types = new_types;
+                types_size = type + 16;
+            }
+            types[type] = _create_type(offset);
+            if(types[type] == 0) {
+                xlog(LOG_ERROR, "Unable to restore retained data type at offset %u", offset);
+                _mark_deleted(offset);
+            } else {
+                /* Everything in the file uses the IDs from this run */
+                _set_u32(offset + 16, types[type]);
+                _set_u32(offset + 4, _header_crc(offset));
+            }
+        } else {
+            memcpy(name, &_map[offset + RET_RECORD_SIZE], _map[offset + 12]);
+            name[_map[offset + 12]] = 0x00;
+            type = _rec_u32(offset + 16);
+            if(IS_CUSTOM(type)) {
+                type = CDT_TO_INDEX(type) < types_size ? types[CDT_TO_INDEX(type)] : 0;
+                _set_u32(offset + 16, type);
+                _set_u32(offset + 4, _header_crc(offset));
+            }
             /* Create the tag as we found it, without the retention attribute
              * If the rest of the system doesn't add this tag with the retention
-             * attribute then it'll be removed this go around */
-            tag_index = tag_add(buff, tag_type, tag_count, 0);
-            if(tag_index < 0) return tag_index;
-            read(_fd, _db[tag_index].data, tag_size);
+             * attribute then it'll be removed when we close */
+            idx = type ? tag_add(name, type, _rec_u32(offset + 20), 0) : ERR_BADTYPE;
+            if(idx >= 0 && tag_get_size(idx) == _rec_u32(offset + 8)) {
+                slot = _best_slot(offset);
+                if(slot >= 0) {
+                    memcpy(_db[idx].data, &_map[_slot_offset(offset, slot) + RET_SLOT_HEADER],
+                           _rec_u32(offset + 8));
+                    /* The next flush has to go in the other slot */
+                    _set_u32(_slot_offset(offset, slot ^ 1) + 4, 0);
+                }
+                /* If we already had a record for this tag the newer one wins */
+                old = _db[idx].ret_file_pointer;
+                if(old) _mark_deleted(old);
+                _db[idx].ret_file_pointer = offset;
+            } else {
+                xlog(LOG_ERROR, "Unable to restore retained tag %s", name);
+                _mark_deleted(offset);
+            }
         }
-        if(tag_pointer == 0) return 0; /* We're done */
-    } /* End While */
+        offset += size;
+    }
+    free(types);
+    _ret_end = offset;
+    return 0;
 }
 
+/* Version 1 files kept a linked list of tag records.  We read them out of
+ * the mapping and then write the file over as version 2 */
+static int
+_convert_v1(uint32_t filesize)
+{
+    char name[256];
+    uint8_t name_size, flags;
+    uint32_t tag_pointer, tag_size;
+    tag_index idx, *list;
+    int count = 0, n;
+
+    list = malloc(sizeof(tag_index) * (filesize / 18 + 1));
+    if(list == NULL) return ERR_ALLOC;
+    tag_pointer = _rec_u32(12);
+    while(tag_pointer != 0 && tag_pointer + 18 <= filesize) {
+        tag_size = _rec_u32(tag_pointer + 4);
+        name_size = _map[tag_pointer + 8];
+        flags = _map[tag_pointer + 9];
+        if(tag_pointer + 18 + name_size + tag_size > filesize) break;
+        memcpy(name, &_map[tag_pointer + 18], name_size);
+        name[name_size] = 0x00;
+        if((flags & RET_FLAG_DELETED) == 0x00) {
+            idx = tag_add(name, _rec_u32(tag_pointer + 10), _rec_u32(tag_pointer + 14), 0);
+            if(idx >= 0 && tag_get_size(idx) == tag_size) {
+                memcpy(_db[idx].data, &_map[tag_pointer + 18 + name_size], tag_size);
+                list[count++] = idx;
+            }
+        }
+        tag_pointer = _rec_u32(tag_pointer);
+    }
+    bzero(&_map[8], filesize - 8);
+    _map[6] = RET_VERSION & 0xFF;
+    _map[7] = RET_VERSION >> 8;
+    _ret_end = RET_HEADER_SIZE;
+    for(n = 0; n < count; n++) {
+        _append_record(list[n]);
+    }
+    free(list);
+    return 0;
+}
+
+static void *
+_flush_loop(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&_flush_lock);
+    while(! _flush_quit) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += _interval / 1000;
+        ts.tv_nsec += (_interval % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&_flush_cond, &_flush_lock, &ts);
+        if(_flush_quit) break;
+        pthread_mutex_unlock(&_flush_lock);
+        ret_flush();
+        /* _ret_dead is only changed under the write lock so this is just
+         * a hint, ret_compact() does it properly */
+        if(_ret_dead > RET_GROW_SIZE && _ret_dead > _ret_end / 2) {
+            ret_compact();
+        }
+        pthread_mutex_lock(&_flush_lock);
+    }
+    pthread_mutex_unlock(&_flush_lock);
+    return NULL;
+}
+
+/* Opens the retention file and creates all of the tags that are in it.
+ * interval is the number of milliseconds between flushes of the retained
+ * tag data to the file.  If it is zero each write goes straight to the
+ * file. */
 int
-ret_init(char *filename) {
+ret_init(char *filename, int interval)
+{
+    struct stat st;
+    uint16_t version;
     int result;
-    char buff[8];
 
     xlog(LOG_MINOR, "Setting up Tag Retention");
     if(filename == NULL) {
         filename = "retentive.db";
     }
-    _fd = open(filename, O_RDWR);
+    _interval = interval < 0 ? 0 : interval;
+    _filename = strdup(filename);
+    if(_filename == NULL) return ERR_ALLOC;
+    _ret_dead = 0;
+    _fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
     if(_fd < 0) {
-        /* If the file does not exist we will try to create it */
-        if(errno == ENOENT) {
-            _fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-            if(_fd < 0) {
-                xerror("Unable to create Retention File, %s - %s", filename, strerror);
-                _fd = 0;
-                return ERR_GENERIC;
-            }
-            result = write(_fd, "DAXRET\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16);
-            if(result != 16) {
-                xerror("Error Writing to Retention File");
-                _fd=0;
-                return ERR_GENERIC;
-            }
-            return 0;
-        } else { /* Some other error opening the file */
-            xerror("Error Opening Retention File, %s - %s",filename, strerror(errno));
-            return ERR_GENERIC;
-        }
-    }
-    /* If we make it this far we should have the file open */
-    result = read(_fd, buff, 8);
-    if(result != 8) {
-        xerror("Error reading file signature");
-        _fd = 0;
+        xerror("Error Opening Retention File, %s - %s", filename, strerror(errno));
         return ERR_GENERIC;
     }
-    if(strncmp("DAXRET", buff, 6) != 0) {
-        xerror("File signature doesn't match");
-        _fd = 0;
+    if(fstat(_fd, &st) || st.st_size > RET_MAP_SIZE) {
+        xerror("Unable to use Retention File, %s", filename);
+        close(_fd);
+        _fd = -1;
         return ERR_GENERIC;
     }
-    memcpy(&_version, &buff[6], 2);
-
-    if(_version != 1) {
-        xerror("Wrong File Version");
-        _fd = 0;
+    /* We map the largest file that we'll allow and grow the file
+     * underneath it so that the mapping never has to move */
+    _map = mmap(NULL, RET_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(_map == MAP_FAILED) {
+        xerror("Unable to map Retention File, %s - %s", filename, strerror(errno));
+        _map = NULL;
+        close(_fd);
+        _fd = -1;
         return ERR_GENERIC;
     }
-    /* If we get here then all is good */
-    result = _create_tags();
-    /* Truncate the file and write the default header */
-    result = ftruncate(_fd, 0);
-    result = lseek(_fd, 0, SEEK_SET);
-    result = write(_fd, "DAXRET\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16);
+    _ret_size = st.st_size;
+    _ret_end = 0;
+    if(_ret_size == 0) {
+        /* New file, write the header */
+        result = _file_reserve(RET_HEADER_SIZE);
+        if(result) {
+            ret_close();
+            return result;
+        }
+        memcpy(_map, "DAXRET", 6);
+        _map[6] = RET_VERSION & 0xFF;
+        _map[7] = RET_VERSION >> 8;
+        _ret_end = RET_HEADER_SIZE;
+    } else {
+        if(_ret_size < RET_HEADER_SIZE || strncmp("DAXRET", (char *)_map, 6) != 0) {
+            xerror("File signature doesn't match");
+            munmap(_map, RET_MAP_SIZE);
+            _map = NULL;
+            close(_fd);
+            _fd = -1;
+            return ERR_GENERIC;
+        }
+        memcpy(&version, &_map[6], 2);
+        if(version == 1) {
+            xlog(LOG_MINOR, "Converting version 1 Retention File");
+            _convert_v1(_ret_size);
+        } else if(version == RET_VERSION) {
+            _create_tags(_ret_size);
+        } else {
+            xerror("Wrong File Version");
+            munmap(_map, RET_MAP_SIZE);
+            _map = NULL;
+            close(_fd);
+            _fd = -1;
+            return ERR_GENERIC;
+        }
+    }
+    msync(_map, _ret_size, MS_SYNC);
+    /* The restore left enough dead records in the file to be worth
+     * getting rid of before we start. */
+    if(_ret_dead > _ret_end / 2) {
+        ret_compact();
+    }
+    if(_interval > 0) {
+        _flush_quit = 0;
+        if(pthread_create(&_flush_thread, NULL, _flush_loop, NULL)) {
+            xerror("Unable to start the retention thread, writing through");
+            _interval = 0;
+        } else {
+            _flush_running = 1;
+        }
+    }
     return 0;
 }
 
-static int
-_write_tag_def(int index, size_t offset) {
-    unsigned char name_size, flags;
-    uint32_t data_size, tmp;
-
-    name_size = strlen(_db[index].name);
-    flags = 0x00;
-    data_size = tag_get_size(index);
-    lseek(_fd, offset, SEEK_SET);
-    tmp = 0;
-    write(_fd, &tmp, 4); /* pointer to next tag, 0 = we are the last one*/
-    write(_fd, &data_size, 4); /* size of the data area */
-    write(_fd, &name_size, 1); /* size of the tag name */
-    write(_fd, &flags, 1); /* flag byte */
-    write(_fd, &_db[index].type, 4);
-    write(_fd, &_db[index].count, 4);
-    write(_fd, _db[index].name, name_size);
-    write(_fd, _db[index].data, data_size);
-    /* This points to the offset in the file where we'll write this tags data */
-    _db[index].ret_file_pointer = offset + 18 + name_size;
-
-    return 0; /* TODO: Handle errors */
-}
-
+/* Adds the tag to the retention file.  If the tag already has a record
+ * that fits, because it was restored from the file or it was added with
+ * the retention attribute before, we just keep using that record. */
 int
-ret_add_tag(int index) {
-    uint32_t offset;
+ret_add_tag(int index)
+{
+    uint32_t rec;
+    int result;
 
     xlog(LOG_MINOR, "Adding Retained Tag at index %d", index);
-    /* TODO: Implement retaining custom data type tags */
-    if(IS_CUSTOM(_db[index].type)) return ERR_NOTIMPLEMENTED;
-    if(_fd == 0) return ERR_FILE_CLOSED;
-    offset = lseek(_fd, 0, SEEK_END); /* We're writing to the end no matter what */
-    if(_last_tag_pointer == 0) { /* This is our first tag */
-        lseek(_fd, 12, SEEK_SET); /* first tag pointer */
-        write(_fd, &offset, sizeof(offset));
-        _write_tag_def(index, offset);
-        _last_tag_pointer = offset;
-    } else {
-        _write_tag_def(index, offset);
-        lseek(_fd, _last_tag_pointer, SEEK_SET); /* Seek to the last tag */
-        /* Write the offset to the tag we just added to the previous tag */
-        write(_fd, &offset, 4);
-        _last_tag_pointer = offset;
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    rec = _db[index].ret_file_pointer;
+    if(rec) {
+        if(_rec_u32(rec + 8) == tag_get_size(index) && _rec_u32(rec + 16) == _db[index].type) {
+            return 0;
+        }
+        /* The tag has changed size so it needs a new record */
+        _mark_deleted(rec);
+        _db[index].ret_file_pointer = 0;
+    }
+    result = _append_record(index);
+    if(result) return result;
+    if(_interval == 0) {
+        msync(_map, _ret_size, MS_SYNC);
     }
     return 0;
 }
 
 int
-ret_del_tag(int index) {
-    uint32_t offset;
-    uint8_t flags = RET_FLAG_DELETED;
-    offset = _db[index].ret_file_pointer - strlen(_db[index].name - 9);
-    lseek(_fd, offset, SEEK_SET);
-    write(_fd, &flags, 1);
+ret_del_tag(int index)
+{
+    if(_map == NULL || _db[index].ret_file_pointer == 0) return 0;
+    _mark_deleted(_db[index].ret_file_pointer);
+    _db[index].ret_file_pointer = 0;
+    _db[index].ret_dirty = 0;
     return 0;
 }
 
+/* This is called on every write to a retained tag with the tagbase write
+ * lock held.  All we do is put the tag on the dirty list. */
+int
+ret_tag_write(int index)
+{
+    tag_index *new;
+    uint32_t rec, slot, end, page;
 
+    if(_map == NULL || _db[index].ret_file_pointer == 0) return 0;
+    if(_interval == 0) {
+        _flush_tag(index);
+        /* Only sync the pages that the record is on */
+        page = sysconf(_SC_PAGESIZE);
+        rec = _db[index].ret_file_pointer;
+        slot = rec & ~(page - 1);
+        end = (rec + _rec_u32(rec) + page - 1) & ~(page - 1);
+        msync(&_map[slot], MIN(end, _ret_size) - slot, MS_SYNC);
+        return 0;
+    }
+    if(_db[index].ret_dirty) return 0;
+    if(_dirty_count == _dirty_size) {
+        new = realloc(_dirty, sizeof(tag_index) * (_dirty_size ? _dirty_size * 2 : 64));
+        if(new == NULL) return ERR_ALLOC;
+        _dirty = new;
+        _dirty_size = _dirty_size ? _dirty_size * 2 : 64;
+    }
+    _dirty[_dirty_count++] = index;
+    _db[index].ret_dirty = 1;
+    return 0;
+}
+
+/* Writes the data of the tags that have changed since the last time to the
+ * file and waits for it to get to the disk.  The sync is done without the
+ * tagbase lock so the other threads can keep going. */
 int
-ret_tag_write(int index) {
-    uint32_t offset, data_size;
+ret_flush(void)
+{
+    int count;
 
-    data_size = tag_get_size(index);
-    offset = _db[index].ret_file_pointer;
-    lseek(_fd, offset, SEEK_SET);
-    write(_fd, _db[index].data, data_size);
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    tagbase_lock_read();
+    count = _flush_dirty();
+    tagbase_unlock();
+    if(count) {
+        if(msync(_map, _ret_size, MS_SYNC)) {
+            xerror("Unable to sync the tag retention file - %s", strerror(errno));
+            return ERR_GENERIC;
+        }
+    }
+    return count;
+}
+
+/* The tag records were copied in file order so the list of moves is sorted
+ * by the old offset. */
+static uint32_t
+_find_move(uint32_t *moves, uint32_t count, uint32_t offset)
+{
+    uint32_t low = 0, high = count, mid;
+
+    while(low < high) {
+        mid = (low + high) / 2;
+        if(moves[mid * 2] < offset) {
+            low = mid + 1;
+        } else if(moves[mid * 2] > offset) {
+            high = mid;
+        } else {
+            return moves[mid * 2 + 1];
+        }
+    }
     return 0;
 }
 
+/* Copies the live records to a new file and puts it in place of the old
+ * one.  The copy and the sync are done with only the read lock held so
+ * the tag server keeps going.  If a record was added or deleted while we
+ * were syncing we just throw the copy away and try again later. */
+int
+ret_compact(void)
+{
+    char *newname;
+    uint8_t *map;
+    uint32_t offset, size, end, old_end, gen, count = 0;
+    uint32_t *moves;
+    int fd, pass, full = 0;
+    tag_index n;
+
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    newname = malloc(strlen(_filename) + 5);
+    if(newname == NULL) return ERR_ALLOC;
+    sprintf(newname, "%s.new", _filename);
+    fd = open(newname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if(fd < 0) {
+        xerror("Unable to create %s - %s", newname, strerror(errno));
+        free(newname);
+        return ERR_GENERIC;
+    }
+    map = mmap(NULL, RET_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        xerror("Unable to map %s - %s", newname, strerror(errno));
+        close(fd);
+        unlink(newname);
+        free(newname);
+        return ERR_GENERIC;
+    }
+    tagbase_lock_read();
+    _flush_dirty();
+    gen = _ret_gen;
+    old_end = _ret_end;
+    /* The new file can't be any bigger than the live part of the old one.
+     * The pair of offsets for each tag that moves goes in moves[] */
+    size = _ret_end - _ret_dead + RET_GROW_SIZE;
+    moves = malloc(sizeof(uint32_t) * 2 * (get_tagindex() + 1));
+    if(moves == NULL || ftruncate(fd, size)) {
+        tagbase_unlock();
+        free(moves);
+        munmap(map, RET_MAP_SIZE);
+        close(fd);
+        unlink(newname);
+        free(newname);
+        return ERR_GENERIC;
+    }
+    memcpy(map, _map, RET_HEADER_SIZE);
+    end = RET_HEADER_SIZE;
+    /* The data types go first so that they are created before the tags
+     * that use them when the file is read. */
+    for(pass = RET_REC_TYPE; pass >= RET_REC_TAG; pass--) {
+        offset = RET_HEADER_SIZE;
+        while(offset < old_end) {
+            if(_map[offset + 14] == pass && !(_map[offset + 13] & RET_FLAG_DELETED) &&
+               _rec_u32(offset + 4) == _header_crc(offset)) {
+                if(end + _rec_u32(offset) > size) {
+                    full = 1;
+                    break;
+                }
+                memcpy(&map[end], &_map[offset], _rec_u32(offset));
+                if(pass == RET_REC_TAG) {
+                    moves[count * 2] = offset;
+                    moves[count * 2 + 1] = end;
+                    count++;
+                }
+                end += _rec_u32(offset);
+            }
+            offset += _rec_u32(offset);
+        }
+    }
+    tagbase_unlock();
+    msync(map, end, MS_SYNC);
+
+    tagbase_lock_write();
+    if(gen != _ret_gen || full) {
+        /* Something changed in the file while we were busy */
+        tagbase_unlock();
+        munmap(map, RET_MAP_SIZE);
+        close(fd);
+        unlink(newname);
+        free(newname);
+        free(moves);
+        return ERR_INUSE;
+    }
+    if(rename(newname, _filename)) {
+        xerror("Unable to rename %s - %s", newname, strerror(errno));
+        tagbase_unlock();
+        munmap(map, RET_MAP_SIZE);
+        close(fd);
+        unlink(newname);
+        free(newname);
+        free(moves);
+        return ERR_GENERIC;
+    }
+    for(n = 0; n < get_tagindex(); n++) {
+        if(_db[n].ret_file_pointer) {
+            _db[n].ret_file_pointer = _find_move(moves, count, _db[n].ret_file_pointer);
+        }
+    }
+    munmap(_map, RET_MAP_SIZE);
+    close(_fd);
+    _map = map;
+    _fd = fd;
+    /* Tags that were written while we were syncing go to the new file */
+    _flush_dirty();
+    xlog(LOG_MINOR, "Compacted the retention file from %u to %u bytes", old_end, end);
+    _ret_end = end;
+    _ret_size = size;
+    _ret_dead = 0;
+    tagbase_unlock();
+    msync(_map, _ret_size, MS_SYNC);
+    free(newname);
+    free(moves);
+    return 0;
+}
 
 int
-ret_close(void) {
-    if(_fd) close(_fd);
+ret_close(void)
+{
+    tag_index n;
+
+    if(_flush_running) {
+        pthread_mutex_lock(&_flush_lock);
+        _flush_quit = 1;
+        pthread_cond_signal(&_flush_cond);
+        pthread_mutex_unlock(&_flush_lock);
+        pthread_join(_flush_thread, NULL);
+        _flush_running = 0;
+    }
+    if(_map != NULL) {
+        tagbase_lock_write();
+        _flush_dirty();
+        /* Records for the tags that were restored but not added again
+         * with the retention attribute are dropped now */
+        for(n = 0; n < get_tagindex(); n++) {
+            if(_db[n].ret_file_pointer && (_db[n].data == NULL || !(_db[n].attr & TAG_ATTR_RETAIN))) {
+                _mark_deleted(_db[n].ret_file_pointer);
+                _db[n].ret_file_pointer = 0;
+            }
+        }
+        tagbase_unlock();
+        msync(_map, _ret_size, MS_SYNC);
+        munmap(_map, RET_MAP_SIZE);
+        _map = NULL;
+    }
+    if(_fd >= 0) close(_fd);
+    _fd = -1;
+    free(_dirty);
+    _dirty = NULL;
+    _dirty_count = _dirty_size = 0;
+    free(_cdt_written);
+    _cdt_written = NULL;
+    _cdt_size = 0;
+    free(_filename);
+    _filename = NULL;
     return 0;
 }
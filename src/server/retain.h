@@ -24,10 +24,27 @@
 
 #define RET_FLAG_DELETED 0x01
 
-int ret_init(char *filename);
+/* Record kinds */
+#define RET_REC_TAG  0
+#define RET_REC_TYPE 1
+
+#define RET_VERSION 2
+
+/* The retention file is mapped at this size when it is opened and it can't
+ * grow past it.  It is grown in RET_GROW_SIZE steps. */
+#ifndef RET_MAP_SIZE
+#  define RET_MAP_SIZE (256 * 1024 * 1024)
+#endif
+#ifndef RET_GROW_SIZE
+#  define RET_GROW_SIZE (64 * 1024)
+#endif
+
+int ret_init(char *filename, int interval);
 int ret_add_tag(int index);
 int ret_del_tag(int index);
 int ret_tag_write(int index);
+int ret_flush(void);
+int ret_compact(void);
 int ret_close(void);
 
 
@@ -21,6 +21,8 @@
 #include "message.h"
 #include "tagbase.h"
 #include "retain.h"
+#include "groups.h"
+#include "shmem.h"
 #include "func.h"
 #include <pthread.h>
 #include <syslog.h>
@@ -30,6 +32,7 @@
 static int quitflag = 0;
 
 static void messagethread(void);
+static void workerthread(void);
 void quit_signal(int);
 void catch_signal(int);
 
@@ -37,8 +40,8 @@ int
 main(int argc, const char *argv[])
 {
     struct sigaction sa;
-    pthread_t message_thread;
-	int result;
+    pthread_t message_thread, worker_thread;
+	int result, n;
 
     /* Set up the signal handlers */
     memset (&sa, 0, sizeof(struct sigaction));
@@ -56,10 +59,17 @@ main(int argc, const char *argv[])
 
     result = msg_setup();    /* This creates and sets up the message sockets */
     if(result) xerror("msg_setup() returned %d", result);
+    shmem_init();         /* Tag data is allocated from here if we can */
     initialize_tagbase(); /* initialize the tag name database */
-    /* TODO: Add retention filename from configuration */
-    ret_init(NULL);
-    /* Start the message handling thread */
+    ret_init(opt_retain_file(), opt_retain_interval());
+    groups_init(opt_group_interval());
+    /* Start the message handling threads */
+    for(n = 0; n < opt_worker_threads(); n++) {
+        if(pthread_create(&worker_thread, NULL, (void *)&workerthread, NULL)) {
+            xfatal("Unable to create worker thread");
+        }
+        pthread_detach(worker_thread);
+    }
     if(pthread_create(&message_thread, NULL, (void *)&messagethread, NULL)) {
         xfatal("Unable to create message thread");
     }
@@ -73,6 +83,7 @@ main(int argc, const char *argv[])
             xlog(LOG_MAJOR, "Quitting due to signal %d", quitflag);
             msg_destroy(); /* Clean up messaging code */
             ret_close();   /* Clean up tag retention system */
+            shmem_close(); /* Remove the shared memory segment */
             exit(0);
         }
     }
@@ -93,6 +104,21 @@ messagethread(void)
     }
 }
 
+/* These are the threads that actually handle the messages that
+ * the message thread receives.  They should never return either. */
+static void
+workerthread(void)
+{
+    int result;
+
+    while(1) {
+        result = msg_process();
+        if(result) {
+            xerror("Message handled with error: %d\n", result);
+        }
+    }
+}
+
 /* this handles shutting down of the server */
 /* TODO: There's the easy way out and then there is the hard way out.
  * I need to figure out which is which and then act appropriately.
@@ -0,0 +1,273 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+
+ *  Source code file for the shared memory segment that local modules
+ *  read tag data from
+ */
+
+/* The data areas of the tags are allocated from a shared memory segment
+ * when it is enabled so that modules running on the same host can read
+ * them without sending a message to the server.  Writes still go through
+ * the server so that events, mappings and retention all work the same.
+ *
+ * The segment is laid out as a dax_shm_header followed by the slot array
+ * and then the data area (see libcommon.h).  The data area is handed out
+ * by a simple first fit allocator.  The list of free extents is kept here
+ * in the server's private memory and each allocated block has a small
+ * header in front of it that holds the size of the block.  If the segment
+ * is full, tags just get their data from the heap like before and the
+ * modules read them with messages.
+ *
+ * All of these functions are called with the database write lock held
+ * or before the message threads are started so there is no locking here.
+ */
+
+#include <common.h>
+#include "shmem.h"
+#include "options.h"
+#include "func.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* Everything in the data area is aligned to this */
+#define SHM_ALIGN 8
+#define SHM_BLOCK_HDR SHM_ALIGN
+
+typedef struct shm_extent {
+    uint32_t offset;
+    uint32_t size;
+    struct shm_extent *next;
+} shm_extent;
+
+static uint8_t *_base = NULL;
+static size_t _size;
+static dax_shm_header *_header;
+static dax_shm_slot *_slots;
+static shm_extent *_free_head;
+
+/* Creates the shared memory segment.  Failure is not fatal, we just log
+ * the error and the server runs without it. */
+int
+shmem_init(void)
+{
+    int fd;
+    mode_t mode;
+    uint32_t slot_count, data_offset;
+
+    _size = opt_shm_size();
+    if(_size == 0) {
+        xlog(LOG_MAJOR, "Shared memory segment is disabled");
+        return 0;
+    }
+    slot_count = _size / SHM_BYTES_PER_SLOT;
+    data_offset = sizeof(dax_shm_header) + sizeof(dax_shm_slot) * slot_count;
+    data_offset = (data_offset + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+    if(_size > UINT32_MAX || data_offset >= _size) {
+        xerror("Bad shared memory segment size %lu", _size);
+        return ERR_ARG;
+    }
+    /* Get rid of any segment that was left behind by a crashed server */
+    shm_unlink(opt_shm_name());
+    /* Only our own user can read the tag data unless the group is let in */
+    mode = S_IRUSR | S_IWUSR;
+    if(opt_shm_group()) mode |= S_IRGRP;
+    fd = shm_open(opt_shm_name(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if(fd < 0) {
+        xerror("Unable to create shared memory segment %s - %s", opt_shm_name(), strerror(errno));
+        return ERR_GENERIC;
+    }
+    if(ftruncate(fd, _size)) {
+        xerror("Unable to size shared memory segment - %s", strerror(errno));
+        close(fd);
+        shm_unlink(opt_shm_name());
+        return ERR_ALLOC;
+    }
+    _base = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(_base == MAP_FAILED) {
+        xerror("Unable to map shared memory segment - %s", strerror(errno));
+        _base = NULL;
+        shm_unlink(opt_shm_name());
+        return ERR_ALLOC;
+    }
+    _free_head = xmalloc(sizeof(shm_extent));
+    if(_free_head == NULL) {
+        shmem_close();
+        return ERR_ALLOC;
+    }
+    _free_head->offset = data_offset;
+    _free_head->size = _size - data_offset;
+    _free_head->next = NULL;
+
+    /* ftruncate() gives us a zeroed segment so all the slots are invalid */
+    _header = (dax_shm_header *)_base;
+    _slots = (dax_shm_slot *)&_base[sizeof(dax_shm_header)];
+    _header->version = DAX_SHM_VERSION;
+    _header->size = _size;
+    _header->slot_count = slot_count;
+    _header->slot_offset = sizeof(dax_shm_header);
+    _header->data_offset = data_offset;
+    __atomic_store_n(&_header->magic, DAX_SHM_MAGIC, __ATOMIC_RELEASE);
+    xlog(LOG_MAJOR, "Shared memory segment %s created with size = %lu, slots = %u",
+         opt_shm_name(), _size, slot_count);
+    return 0;
+}
+
+/* Removes the segment.  The modules that still have it mapped will see
+ * the bad magic number and go back to reading with messages */
+void
+shmem_close(void)
+{
+    shm_extent *this;
+
+    if(_base == NULL) return;
+    __atomic_store_n(&_header->magic, 0, __ATOMIC_RELEASE);
+    munmap(_base, _size);
+    shm_unlink(opt_shm_name());
+    _base = NULL;
+    while(_free_head != NULL) {
+        this = _free_head;
+        _free_head = this->next;
+        xfree(this);
+    }
+}
+
+/* Returns the name of the segment or NULL if we don't have one */
+char *
+shmem_name(void)
+{
+    if(_base == NULL) return NULL;
+    return opt_shm_name();
+}
+
+/* Returns true if ptr was allocated from the segment */
+int
+shmem_owns(void *ptr)
+{
+    return _base != NULL && (uint8_t *)ptr >= _base && (uint8_t *)ptr < _base + _size;
+}
+
+/* Allocates size bytes from the data area of the segment.  The memory is
+ * zeroed.  Returns NULL if there isn't enough room left. */
+void *
+shmem_alloc(size_t size)
+{
+    shm_extent *this, *last = NULL;
+    uint32_t need;
+    uint8_t *block;
+
+    if(_base == NULL || size == 0 || size > _size) return NULL;
+    need = (size + SHM_BLOCK_HDR + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+    for(this = _free_head; this != NULL; last = this, this = this->next) {
+        if(this->size >= need) break;
+    }
+    if(this == NULL) return NULL;
+
+    block = &_base[this->offset];
+    if(this->size == need) {
+        if(last) last->next = this->next;
+        else _free_head = this->next;
+        xfree(this);
+    } else {
+        this->offset += need;
+        this->size -= need;
+    }
+    *(uint32_t *)block = need;
+    bzero(&block[SHM_BLOCK_HDR], need - SHM_BLOCK_HDR);
+    return &block[SHM_BLOCK_HDR];
+}
+
+/* Returns a block to the free list and merges it with it's neighbors */
+void
+shmem_free(void *ptr)
+{
+    shm_extent *this, *last = NULL, *new;
+    uint32_t offset, size;
+
+    if(!shmem_owns(ptr)) return;
+    offset = (uint8_t *)ptr - _base - SHM_BLOCK_HDR;
+    size = *(uint32_t *)&_base[offset];
+    /* The list is kept sorted by offset */
+    for(this = _free_head; this != NULL && this->offset < offset; last = this, this = this->next);
+
+    if(last && last->offset + last->size == offset) {
+        last->size += size;
+        if(this && last->offset + last->size == this->offset) {
+            last->size += this->size;
+            last->next = this->next;
+            xfree(this);
+        }
+    } else if(this && offset + size == this->offset) {
+        this->offset = offset;
+        this->size += size;
+    } else {
+        new = xmalloc(sizeof(shm_extent));
+        if(new == NULL) {
+            /* We'll just lose this block */
+            xerror("Unable to allocate shared memory extent");
+            return;
+        }
+        new->offset = offset;
+        new->size = size;
+        new->next = this;
+        if(last) last->next = new;
+        else _free_head = new;
+    }
+}
+
+/* Sets the slot for the tag at idx to point to data.  If data is NULL or
+ * is not in the segment then the slot is marked invalid and the modules
+ * will send a message to read that tag. */
+void
+shmem_publish(tag_index idx, void *data, size_t size)
+{
+    dax_shm_slot *slot;
+
+    if(_base == NULL || idx < 0 || idx >= _header->slot_count) return;
+    slot = &_slots[idx];
+    shmem_write_begin(idx);
+    if(data != NULL && shmem_owns(data)) {
+        slot->offset = (uint8_t *)data - _base;
+        slot->size = size;
+        slot->flags = SHM_SLOT_VALID;
+    } else {
+        slot->offset = 0;
+        slot->size = 0;
+        slot->flags = 0;
+    }
+    shmem_write_end(idx);
+}
+
+/* These two should be called on either side of anything that changes the
+ * data of the tag at idx.  The sequence number is odd between them so that
+ * readers know to try again. */
+void
+shmem_write_begin(tag_index idx)
+{
+    if(_base == NULL || idx < 0 || idx >= _header->slot_count) return;
+    __atomic_store_n(&_slots[idx].seq, _slots[idx].seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+shmem_write_end(tag_index idx)
+{
+    if(_base == NULL || idx < 0 || idx >= _header->slot_count) return;
+    __atomic_store_n(&_slots[idx].seq, _slots[idx].seq + 1, __ATOMIC_RELEASE);
+}
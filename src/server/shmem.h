@@ -0,0 +1,44 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+
+ *  Header file for the shared memory segment that local modules read
+ *  tag data from
+ */
+
+#ifndef __SHMEM_H
+#define __SHMEM_H
+
+#include <common.h>
+#include <libcommon.h>
+
+/* We allocate one tag slot in the segment for this many bytes */
+#ifndef SHM_BYTES_PER_SLOT
+#  define SHM_BYTES_PER_SLOT 64
+#endif
+
+int shmem_init(void);
+void shmem_close(void);
+char *shmem_name(void);
+void *shmem_alloc(size_t size);
+int shmem_owns(void *ptr);
+void shmem_free(void *ptr);
+void shmem_publish(tag_index idx, void *data, size_t size);
+void shmem_write_begin(tag_index idx);
+void shmem_write_end(tag_index idx);
+
+#endif /* !__SHMEM_H */
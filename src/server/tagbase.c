@@ -23,7 +23,11 @@
 #include <common.h>
 #include "tagbase.h"
 #include "retain.h"
+#include "groups.h"
+#include "module.h"
+#include "shmem.h"
 #include "func.h"
+#include <pthread.h>
 
 /* Notes:
  * The tags are stored in the server in two different arrays.  Both
@@ -37,26 +41,86 @@
  * The index of the tag in this array is used as the identifier for
  * that tag for the duration of the program.
  *
- * The second array is the index.  Each item in the index contains a pointer
- * to the name of the tag and the index where the tag data can be found in the
- * first array.  This array is kept sorted in alphabetical order for quicker
- * searching by name.  The name pointer in both arrays point to the same
- * address so the string is not duplicated.
+ * The second array is the index.  It is a hash table that uses open
+ * addressing with linear probing.  Each item in the index contains a pointer
+ * to the name of the tag, the hash of that name and the index where the tag
+ * data can be found in the first array.  Empty slots have a NULL name.  The
+ * table is doubled when it gets half full so that the probe sequences stay
+ * short.  The name pointer in both arrays point to the same address so the
+ * string is not duplicated.
  */
 
 _dax_tag_db *_db;
 static _dax_tag_index *_index;
-static tag_index  _indexsize = 0; /* Size of the database index */
+static tag_index _indexsize = 0;  /* Number of slots in the index */
+static tag_index _indexcount = 0; /* Number of tags in the index */
 static tag_index _tagnextindex = 0;   /* The next index in the database */
 static tag_index _tagcount = 0;
 static tag_index _dbsize = 0;
+static uint32_t _tag_gen = 0;  /* Catalogue generation.  See tag_list() */
 static datatype *_datatypes;
 static unsigned int _datatype_index; /* Next datatype index */
 static unsigned int _datatype_size;
 
+/* This lock protects the database from the message handling threads.
+ * Requests that only read the database hold it shared so that they can
+ * be serviced in parallel.  Anything that modifies the database, or that
+ * may cause events or mappings to fire, has to hold it exclusively. */
+static pthread_rwlock_t _db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/* Called whenever the name, type, count or attributes of a tag change */
+static inline void
+_tag_changed(tag_index idx) {
+    _db[idx].gen = ++_tag_gen;
+}
+
+/* Database locking functions.  These are called by the message
+ * dispatcher around each message handler. */
+void
+tagbase_lock_read(void)
+{
+    pthread_rwlock_rdlock(&_db_lock);
+}
+
+void
+tagbase_lock_write(void)
+{
+    pthread_rwlock_wrlock(&_db_lock);
+}
+
+void
+tagbase_unlock(void)
+{
+    pthread_rwlock_unlock(&_db_lock);
+}
 
 /* Private function definitions */
 
+/* Allocates the data area for a tag.  We try the shared memory segment
+ * first so that local modules can read the tag directly. */
+static void *
+_data_alloc(size_t size)
+{
+    void *data;
+
+    data = shmem_alloc(size);
+    if(data == NULL) {
+        data = xmalloc(size);
+    }
+    return data;
+}
+
+static void
+_data_free(void *data)
+{
+    if(shmem_owns(data)) {
+        shmem_free(data);
+    } else {
+        xfree(data);
+    }
+}
+
 /* These functions are convienience for setting status tags */
 void
 set_dbsize(tag_index x) {
@@ -126,6 +190,107 @@ tag_get_size(tag_index idx)
         return type_size(_db[idx].type)  * _db[idx].count;
 }
 
+/* The override data and mask are padded out to a whole number of 64 bit
+ * words.  osum has a bit for each of those words that is set when any part
+ * of the mask in that word is set.  Reading an overridden tag only has to
+ * look at the words that have a bit in osum so the cost depends on how much
+ * of the tag is overridden instead of how big the tag is. */
+#define OVRD_WORDS(size) (((size) + 7) / 8)
+#define OVRD_SUM_WORDS(size) ((OVRD_WORDS(size) + 63) / 64)
+
+/* Allocates the override buffers for the tag or grows them to fit the
+ * current size of the tag.  'oldsize' is the size that they were allocated
+ * for, zero if they haven't been. */
+static int
+_override_alloc(tag_index idx, int oldsize)
+{
+    int size, start;
+    void *new;
+
+    size = tag_get_size(idx);
+    new = xrealloc(_db[idx].odata, OVRD_WORDS(size) * 8);
+    if(new == NULL) return ERR_ALLOC;
+    _db[idx].odata = new;
+    new = xrealloc(_db[idx].omask, OVRD_WORDS(size) * 8);
+    if(new == NULL) return ERR_ALLOC;
+    _db[idx].omask = new;
+    new = xrealloc(_db[idx].osum, OVRD_SUM_WORDS(size) * 8);
+    if(new == NULL) return ERR_ALLOC;
+    _db[idx].osum = new;
+    start = OVRD_WORDS(oldsize) * 8;
+    bzero(&_db[idx].odata[start], OVRD_WORDS(size) * 8 - start);
+    bzero(&_db[idx].omask[start], OVRD_WORDS(size) * 8 - start);
+    start = OVRD_SUM_WORDS(oldsize);
+    bzero(&_db[idx].osum[start], (OVRD_SUM_WORDS(size) - start) * 8);
+    return 0;
+}
+
+static void
+_override_free(tag_index idx)
+{
+    xfree(_db[idx].odata);
+    xfree(_db[idx].omask);
+    xfree(_db[idx].osum);
+    _db[idx].odata = NULL;
+    _db[idx].omask = NULL;
+    _db[idx].osum = NULL;
+}
+
+/* Sets the bits in osum for the words that cover the given bytes */
+static void
+_override_summarize(tag_index idx, int offset, int size)
+{
+    int w;
+    uint64_t m;
+
+    for(w = offset / 8; w <= (offset + size - 1) / 8; w++) {
+        memcpy(&m, &_db[idx].omask[w * 8], 8);
+        if(m) {
+            _db[idx].osum[w / 64] |= 1ULL << (w % 64);
+        } else {
+            _db[idx].osum[w / 64] &= ~(1ULL << (w % 64));
+        }
+    }
+}
+
+/* Puts the override data over the top of the tag data that has already been
+ * copied to 'data'.  Whole words are done at once and only the bytes at the
+ * ends of the range are done one at a time. */
+static void
+_override_merge(tag_index idx, int offset, uint8_t *data, int size)
+{
+    int first, last, s, w, n, start, end;
+    uint64_t bits, d, m, o;
+
+    first = offset / 8;
+    last = (offset + size - 1) / 8;
+    for(s = first / 64; s <= last / 64; s++) {
+        bits = _db[idx].osum[s];
+        if(s == first / 64) bits &= ~0ULL << (first % 64);
+        if(s == last / 64 && last % 64 != 63) bits &= (1ULL << (last % 64 + 1)) - 1;
+        while(bits) {
+            w = s * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            start = w * 8;
+            end = start + 8;
+            if(start >= offset && end <= offset + size) {
+                memcpy(&d, &data[start - offset], 8);
+                memcpy(&m, &_db[idx].omask[start], 8);
+                memcpy(&o, &_db[idx].odata[start], 8);
+                d = (d & ~m) | (o & m);
+                memcpy(&data[start - offset], &d, 8);
+            } else {
+                if(start < offset) start = offset;
+                if(end > offset + size) end = offset + size;
+                for(n = start; n < end; n++) {
+                    data[n - offset] = (data[n - offset] & ~_db[idx].omask[n]) |
+                                       (_db[idx].odata[n] & _db[idx].omask[n]);
+                }
+            }
+        }
+    }
+}
+
 /* Determine whether or not the tag name is okay */
 static int
 _validate_name(char *name)
@@ -147,30 +312,48 @@ _validate_name(char *name)
     return 0;
 }
 
-/* This function searches the _index array to find the tag with
- * the given name.  It returns the index into the _index array */
+/* FNV-1a hash of the tag name */
+static uint32_t
+_name_hash(char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Returns the slot in the _index hash table that holds the given name
+ * or ERR_NOTFOUND */
 static int
-_get_by_name(char *name)
+_find_index(char *name)
 {
-    int i, min, max, try;
-
-    min = 0;
-    max = _indexsize - 1;
-    while(min <= max) {
-        try = min + ((max - min) / 2);
-
-        i = strcmp(name, _index[try].name);
-        if(i > 0) {
-            min = try + 1;
-        } else if(i < 0) {
-            max = try - 1;
-        } else {
-            return _index[try].tag_idx;
+    uint32_t hash, mask, n;
+
+    hash = _name_hash(name);
+    mask = _indexsize - 1;
+    for(n = hash & mask; _index[n].name != NULL; n = (n + 1) & mask) {
+        if(_index[n].hash == hash && strcmp(name, _index[n].name) == 0) {
+            return n;
         }
     }
     return ERR_NOTFOUND;
 }
 
+/* This function searches the _index hash table to find the tag with
+ * the given name.  It returns the index of the tag in the _db array */
+static int
+_get_by_name(char *name)
+{
+    int n;
+
+    n = _find_index(name);
+    if(n < 0) return n;
+    return _index[n].tag_idx;
+}
+
 /* This function incrememnts the reference counter for the
  * compound data type.  It assumes that the type is valid, if
  * the type is not valid, bad things will happen */
@@ -192,95 +375,99 @@ _cdt_dec_refcount(tag_type type) {
 static int
 _database_grow(void)
 {
-    _dax_tag_index *new_index;
     _dax_tag_db *new_db;
 
-    new_index = xrealloc(_index, (_dbsize *2) * sizeof(_dax_tag_index));
     new_db = xrealloc(_db, (_dbsize *2) * sizeof(_dax_tag_db));
+    if(new_db == NULL) {
+        return ERR_ALLOC;
+    }
+    _db = new_db;
+    _dbsize *= 2;
+    return 0;
+}
 
-    if(new_index != NULL && new_db != NULL) {
-        _index = new_index;
-        _db = new_db;
-        _dbsize *= 2;
-        return 0;
-    } else {
-        /* This is to shrink the one that didn't get allocated
-         so that they won't be lop sided */
-        if(new_index)
-            _index = xrealloc(_index, _dbsize * sizeof(_dax_tag_index));
-        if(new_db)
-            _db = xrealloc(_db, _dbsize * sizeof(_dax_tag_db));
+/* Doubles the size of the index hash table.  We keep the hash of each name
+ * in the table so we don't have to hash them all again here. */
+static int
+_index_grow(void)
+{
+    _dax_tag_index *new_index;
+    uint32_t mask, n, i;
 
+    new_index = xmalloc((_indexsize * 2) * sizeof(_dax_tag_index));
+    if(new_index == NULL) {
         return ERR_ALLOC;
     }
+    mask = _indexsize * 2 - 1;
+    for(n = 0; n < _indexsize; n++) {
+        if(_index[n].name != NULL) {
+            for(i = _index[n].hash & mask; new_index[i].name != NULL; i = (i + 1) & mask);
+            new_index[i] = _index[n];
+        }
+    }
+    xfree(_index);
+    _index = new_index;
+    _indexsize *= 2;
+    return 0;
 }
 
 
-/* This adds the name of the tag to the index */
+/* This adds the name of the tag to the index.  Duplicates must be checked
+ * before this function is called. */
 static int
 _add_index(char *name, tag_index index)
 {
-    int n;
     char *temp;
-    int i, min, max, try;
+    uint32_t hash, mask, n;
+
+    /* Keep the table no more than half full */
+    if((_indexcount + 1) * 2 > _indexsize) {
+        if(_index_grow()) {
+            return ERR_ALLOC;
+        }
+    }
     /* Let's allocate the memory for the string first in case it fails */
     temp = strdup(name);
     if(temp == NULL)
         return ERR_ALLOC;
 
-    if(_indexsize == 0) {
-        n = 0;
-    } else {
-        min = 0;
-        max = _indexsize - 1;
-
-        while(min <= max) {
-            try = min + ((max - min) / 2);
-            i = strcmp(name, _index[try].name);
-            if(i > 0) {
-                min = try + 1;
-            } else if(i < 0) {
-                max = try - 1;
-            } else {
-                /* It can't really get here because duplicates were checked in add_tag()
-                 * before this function was called */
-                assert(0);
-            }
-        }
-        n = min;
-        memmove(&_index[n + 1], &_index[n], (_dbsize - n - 1) * sizeof(_dax_tag_index));
-    }
+    hash = _name_hash(name);
+    mask = _indexsize - 1;
+    for(n = hash & mask; _index[n].name != NULL; n = (n + 1) & mask);
     /* Assign pointer to database node in the index */
     _index[n].tag_idx = index;
+    _index[n].hash = hash;
     /* The name pointer in the __index and the __db point to the same string */
     _index[n].name = temp;
     _db[index].name = temp;
-    _indexsize++;
+    _indexcount++;
     return 0;
 }
 
-/* Delete the entry from the index for the given tag.
- * The tag name must exist or this is an infinite loop */
+/* Delete the entry from the index for the given tag.  Instead of leaving
+ * a marker in the empty slot we move any following entries that would not
+ * be found anymore back into the hole. */
 int
 _del_index(char *name) {
-    int i, min, max, try, n=-1;
-    min = 0;
-    max = _indexsize - 1;
-
-    while(min <= max) {
-        try = min + ((max - min) / 2);
-        i = strcmp(name, _index[try].name);
-        if(i > 0) {
-            min = try + 1;
-        } else if(i < 0) {
-            max = try - 1;
-        } else {
-            n = try;
-            break;
+    int n;
+    uint32_t i, j, k, mask;
+
+    n = _find_index(name);
+    if(n < 0) return n;
+    mask = _indexsize - 1;
+    i = n;
+    for(j = (i + 1) & mask; _index[j].name != NULL; j = (j + 1) & mask) {
+        k = _index[j].hash & mask;
+        /* If the home slot of this entry is cyclically between the hole
+         * and where it is now then it can stay where it is */
+        if((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
         }
+        _index[i] = _index[j];
+        i = j;
     }
-    memmove(&_index[n], &_index[n+1], (_dbsize - n - 1) * sizeof(_dax_tag_index));
-    _indexsize--;
+    _index[i].name = NULL;
+    _indexcount--;
     return 0;
 }
 
@@ -336,7 +523,8 @@ virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vf
 
     idx = tag_add(name, type, count, 0);
     /* We just allocated this data but that was just for convenience */
-    free(_db[idx].data);
+    shmem_publish(idx, NULL, 0);
+    _data_free(_db[idx].data);
     vf.rf = rf;
     vf.wf = wf;
     _db[idx].data = xmalloc(sizeof(virt_functions));
@@ -344,6 +532,7 @@ virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vf
     memcpy(_db[idx].data, &vf, sizeof(virt_functions));
     _db[idx].attr |= TAG_ATTR_VIRTUAL;
     if(wf == NULL) _db[idx].attr |= TAG_ATTR_READONLY;
+    _tag_changed(idx);
     return 0;
 }
 
@@ -362,12 +551,13 @@ initialize_tagbase(void)
         xfatal("Unable to allocate the database");
     }
     _dbsize = DAX_TAGLIST_SIZE;
-    /* Allocate the primary database */
+    /* Allocate the index */
     _index = (_dax_tag_index *)xmalloc(sizeof(_dax_tag_index)
-            * DAX_TAGLIST_SIZE);
-    if(!_db) {
-        xfatal("Unable to allocate the database");
+            * DAX_TAGINDEX_SIZE);
+    if(!_index) {
+        xfatal("Unable to allocate the database index");
     }
+    _indexsize = DAX_TAGINDEX_SIZE;
 
     xlog(LOG_MINOR, "Database created with size = %d", _dbsize);
     /* Creates the system tags */
@@ -413,6 +603,7 @@ static void
 _set_attribute(tag_index idx, uint32_t attr) {
     /* We only let the Tag Retention attribute to be set at this point */
     if(attr & TAG_ATTR_RETAIN) {
+        if(!(_db[idx].attr & TAG_ATTR_RETAIN)) _tag_changed(idx);
         /* TODO: add tag retention */;
         ret_add_tag(idx);
         _db[idx].attr |= TAG_ATTR_RETAIN;
@@ -430,7 +621,7 @@ tag_add(char *name, tag_type type, unsigned int count, uint32_t attr)
     int n;
     void *newdata;
     unsigned int size;
-    int result;
+    int result, oldsize;
 
     if(count == 0) {
         xlog(LOG_ERROR, "tag_add() called with count = 0");
@@ -472,10 +663,33 @@ tag_add(char *name, tag_type type, unsigned int count, uint32_t attr)
         } else if(_db[n].type == type && _db[n].count < count) {
             /* If the new count is greater than the existing count then lets
              try to increase the size of the tags data */
-            newdata = xrealloc(_db[n].data, size);
+            if(_db[n].attr & TAG_ATTR_VIRTUAL) {
+                newdata = xrealloc(_db[n].data, size);
+            } else {
+                newdata = _data_alloc(size);
+                if(newdata) {
+                    memcpy(newdata, _db[n].data, tag_get_size(n));
+                    /* Readers of the shared memory have to see the move */
+                    shmem_publish(n, NULL, 0);
+                    _data_free(_db[n].data);
+                    shmem_publish(n, newdata, size);
+                }
+            }
             if(newdata) {
+                oldsize = tag_get_size(n);
                 _db[n].data = newdata;
                 _db[n].count = count;
+                /* The overrides have to cover the new part of the tag */
+                if(_db[n].odata != NULL && _override_alloc(n, oldsize)) {
+                    xerror("Unable to allocate memory to grow the overrides of tag %s", name);
+                    _override_free(n);
+                    _db[n].attr &= ~TAG_ATTR_OVERRIDE;
+                }
+                /* The retained tag needs a bigger record in the file */
+                if(_db[n].attr & TAG_ATTR_RETAIN) {
+                    ret_add_tag(n);
+                }
+                _tag_changed(n);
                 _set_attribute(n, attr);
                 return n;
             } else {
@@ -500,7 +714,7 @@ tag_add(char *name, tag_type type, unsigned int count, uint32_t attr)
         _queue_add(n, type, count);
     } else {
         /* Allocate the data area */
-        if((_db[n].data = xmalloc(size)) == NULL){
+        if((_db[n].data = _data_alloc(size)) == NULL){
             xerror("Unable to allocate memory for tag %s", name);
             return ERR_ALLOC;
         } else {
@@ -510,15 +724,25 @@ tag_add(char *name, tag_type type, unsigned int count, uint32_t attr)
     _db[n].nextevent = 1;
     _db[n].nextmap = 1;
     _db[n].events = NULL;
+    _db[n].evindex = NULL;
+    _db[n].evcount = 0;
+    _db[n].evsize = 0;
+    _db[n].mappings = NULL;
     _db[n].omask = NULL;
     _db[n].odata = NULL;
+    _db[n].osum = NULL;
+    _db[n].ret_file_pointer = 0;
+    _db[n].ret_dirty = 0;
 
     if(_add_index(name, n)) {
         /* free up our previous allocation if we can't put this in the __index */
-        free(_db[n].data);
+        _data_free(_db[n].data);
         xerror("Unable to allocate data for the tag database index");
         return ERR_ALLOC;
     }
+    if(!IS_QUEUE(type)) {
+        shmem_publish(n, _db[n].data, size);
+    }
     /* Only if everything works will we increment the count */
     if(IS_CUSTOM(type)) {
         _cdt_inc_refcount(type);
@@ -531,6 +755,7 @@ tag_add(char *name, tag_type type, unsigned int count, uint32_t attr)
     if(_db[INDEX_TAGCOUNT].data != NULL) {
         tag_write(INDEX_TAGCOUNT, 0, &_tagcount, sizeof(tag_index));
     }
+    _tag_changed(n);
     _set_attribute(n, attr);
 
     return n;
@@ -564,14 +789,19 @@ tag_del(tag_index idx)
     if(_db[idx].attr & TAG_ATTR_RETAIN) {
         ret_del_tag(idx);
     }
-    events_del_all(_db[idx].events);
+    events_del_all(idx);
     map_del_all(_db[idx].mappings);
+    _db[idx].mappings = NULL;
     _del_index(_db[idx].name);
     xfree(_db[idx].name);
-    xfree(_db[idx].data);
+    shmem_publish(idx, NULL, 0);
+    _data_free(_db[idx].data);
+    _override_free(idx);
     _db[idx].name = NULL;
     _db[idx].data = NULL;
     _tagcount--;
+    _tag_changed(idx);
+    module_tag_deleted(idx);
 
     return 0;
 }
@@ -626,6 +856,53 @@ get_tagindex(void) {
     return _tagnextindex;
 }
 
+/* Returns the catalogue generation.  It goes up by one every time a tag
+ * is added, deleted or it's definition changes. */
+uint32_t
+tag_get_generation(void) {
+    return _tag_gen;
+}
+
+/* Writes the definitions of the tags that have changed since the catalogue
+ * generation 'since' into buff, starting with the tag at index 'start'.
+ * Each one is the index, type, count and attributes as four uint32s
+ * followed by a length byte and the name without the NULL.  Tags that have
+ * been deleted are given with a type of zero and no name.  Deleted tags are
+ * left out if since is zero, since that means that the caller has nothing
+ * yet.  As many tags are written as will fit in size bytes and next is set
+ * to the index where the next call should start or -1 when there are no
+ * more.  Returns the number of bytes that were written. */
+int
+tag_list(tag_index start, uint32_t since, uint8_t *buff, int size, tag_index *next)
+{
+    tag_index n;
+    int pos = 0, len;
+
+    if(start < 0) start = 0;
+    for(n = start; n < _tagnextindex; n++) {
+        if(_db[n].gen <= since) continue;
+        if(_db[n].data == NULL && since == 0) continue;
+        len = _db[n].name == NULL ? 0 : strlen(_db[n].name);
+        if(pos + TAG_LIST_ENTRY_SIZE + len > size) {
+            *next = n;
+            return pos;
+        }
+        *(uint32_t *)&buff[pos] = n;
+        if(_db[n].data == NULL) {
+            bzero(&buff[pos + 4], 12);
+        } else {
+            *(uint32_t *)&buff[pos + 4] = _db[n].type;
+            *(uint32_t *)&buff[pos + 8] = _db[n].count;
+            *(uint32_t *)&buff[pos + 12] = _db[n].attr;
+        }
+        buff[pos + 16] = len;
+        if(len) memcpy(&buff[pos + TAG_LIST_ENTRY_SIZE], _db[n].name, len);
+        pos += TAG_LIST_ENTRY_SIZE + len;
+    }
+    *next = -1;
+    return pos;
+}
+
 /* Returns true if the tag at the given index is read only */
 int
 is_tag_readonly(tag_index idx) {
@@ -657,8 +934,6 @@ int
 tag_read(tag_index idx, int offset, void *data, int size)
 {
     virt_functions *vf;
-    int n;
-    uint8_t x, y;
 
     /* Bounds check handle */
     if(idx < 0 || idx >= _tagnextindex) {
@@ -681,15 +956,8 @@ tag_read(tag_index idx, int offset, void *data, int size)
         }
         /* Copy the data into the right place. */
         memcpy(data, &(_db[idx].data[offset]), size);
-        if(_db[idx].attr & TAG_ATTR_OVERRIDE) {
-            for(n=0; n<size; n++) {
-                 x = _db[idx].odata[n+offset] & _db[idx].omask[n+offset];
-                 y = _db[idx].data[n+offset] & ~_db[idx].omask[n+offset];
-                 ((uint8_t *)data)[n] = x | y;
-            }
-        } else {
-            /* Copy the data into the right place. */
-            memcpy(data, &(_db[idx].data[offset]), size);
+        if(_db[idx].attr & TAG_ATTR_OVERRIDE && size > 0) {
+            _override_merge(idx, offset, data, size);
         }
     }
 
@@ -722,9 +990,12 @@ tag_write(tag_index idx, int offset, void *data, int size)
             return ERR_DELETED;
         }
         /* Copy the data into the right place. */
+        shmem_write_begin(idx);
         memcpy(&(_db[idx].data[offset]), data, size);
+        shmem_write_end(idx);
         event_check(idx, offset, size);
-        map_check(idx, offset, data, size);
+        group_check(idx, offset, size);
+        map_check(idx, offset, size);
     }
 
     if(_db[idx].attr & TAG_ATTR_RETAIN) {
@@ -759,11 +1030,14 @@ tag_mask_write(tag_index idx, int offset, void *data, void *mask, int size)
     db = &_db[idx].data[offset];
     newdata = (uint8_t *)data;
     newmask = (uint8_t *)mask;
+    shmem_write_begin(idx);
     for(n = 0; n < size; n++) {
         db[n] = (newdata[n] & newmask[n]) | (db[n] & ~newmask[n]);
     }
+    shmem_write_end(idx);
     event_check(idx, offset, size);
-    map_check(idx, offset, data, size);
+    group_check(idx, offset, size);
+    map_check(idx, offset, size);
 
     if(_db[idx].attr & TAG_ATTR_RETAIN) {
         ret_tag_write(idx);
@@ -1121,21 +1395,18 @@ override_add(tag_index idx, int offset, void *data, void *mask, int size) {
         return ERR_DELETED;
     }
     tag_size = _db[idx].count * type_size(_db[idx].type);
+    if((offset + size) > tag_size) return ERR_2BIG;
+    if(size <= 0) return 0;
 
     if(_db[idx].odata == NULL) {
-        _db[idx].odata = malloc(tag_size);
-        if(_db[idx].odata == NULL) return ERR_ALLOC;
-        _db[idx].omask = malloc(tag_size);
-        if(_db[idx].omask == NULL) {
-            xfree(_db[idx].odata);
+        if(_override_alloc(idx, 0)) {
+            _override_free(idx);
             return ERR_ALLOC;
         }
-        bzero(_db[idx].odata, size);
-        bzero(_db[idx].omask, size);
     }
-    if((offset + size) > tag_size) return ERR_2BIG;
     memcpy(&_db[idx].odata[offset], data, size);
     memcpy(&_db[idx].omask[offset], mask, size);
+    _override_summarize(idx, offset, size);
 
     return 0;
 }
@@ -1155,19 +1426,23 @@ override_del(tag_index idx, int offset, void *mask, int size) {
     if(_db[idx].odata == NULL) {
         return ERR_GENERIC;
     }
+    if((offset + size) > tag_size) return ERR_2BIG;
     for(n=0;n<size;n++) {
         _db[idx].omask[n+offset] &= ~((uint8_t *)mask)[n];
         _db[idx].odata[n+offset] &= ~((uint8_t *)mask)[n];
     }
-    _db[idx].attr &= ~TAG_ATTR_OVERRIDE;
-    tag_size = _db[idx].count * type_size(_db[idx].type);
-    for(n=0;n<tag_size;n++) {
-        if(_db[idx].omask[n])  return 0;
+    if(size > 0) _override_summarize(idx, offset, size);
+    if(_db[idx].attr & TAG_ATTR_OVERRIDE) {
+        _db[idx].attr &= ~TAG_ATTR_OVERRIDE;
+        _tag_changed(idx);
+    }
+    shmem_publish(idx, _db[idx].data, tag_get_size(idx));
+    for(n = 0; n < OVRD_SUM_WORDS(tag_get_size(idx)); n++) {
+        if(_db[idx].osum[n])  return 0;
     }
     /* If we get here then we've deleted the last of the overrides for this
      * tag so we'll free the memory */
-    xfree(_db[idx].odata);
-    xfree(_db[idx].omask);
+    _override_free(idx);
 
     return 0;
 }
@@ -1198,11 +1473,17 @@ override_set(tag_index idx, uint8_t flag) {
     if(_db[idx].data == NULL) {
         return ERR_DELETED;
     }
+    /* Overridden tags are read through the server so that the override
+     * data is merged with the tag data */
     if(flag) {
         if(_db[idx].odata == NULL) return ERR_ILLEGAL;
+        if(!(_db[idx].attr & TAG_ATTR_OVERRIDE)) _tag_changed(idx);
         _db[idx].attr |= TAG_ATTR_OVERRIDE;
+        shmem_publish(idx, NULL, 0);
     } else {
+        if(_db[idx].attr & TAG_ATTR_OVERRIDE) _tag_changed(idx);
         _db[idx].attr &= ~TAG_ATTR_OVERRIDE;
+        shmem_publish(idx, _db[idx].data, tag_get_size(idx));
     }
     return 0;
 }
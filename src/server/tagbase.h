@@ -40,6 +40,12 @@
  #define DAX_TAGLIST_INC 1024
 #endif
 
+/* This is the initial number of slots in the tag name hash table.  It
+ * must be a power of two. */
+#ifndef DAX_TAGINDEX_SIZE
+ #define DAX_TAGINDEX_SIZE 2048
+#endif
+
 /* The initial size of the database */
 #ifndef DAX_DATABASE_SIZE
  #define DAX_DATABASE_SIZE 1024
@@ -51,10 +57,6 @@
 #endif
 
 
-/* This is the maximum number of mapping hops that we'll make before we print an
- * error and do some otheR drastic action. */
-#define MAX_MAP_HOPS 128
-
 /* database indexes for status tags. */
 #define INDEX_TAGCOUNT   0
 #define INDEX_LASTINDEX  1
@@ -75,14 +77,43 @@ typedef struct dax_event_t {
     void *data;          /* Data given by module */
     void *test;          /* Internal data, depends on event type */
     dax_module *notify;  /* Module to be notified of this event */
+    uint32_t batch_gen;  /* Batch generation of the module when last queued */
+    uint32_t batch_pos;  /* Where the message was put in that batch */
     struct dax_event_t *next;
 } _dax_event;
 
+/* Entry in the per tag event index.  See events.c */
+typedef struct {
+    uint32_t start;      /* First byte of the data block */
+    uint32_t end;        /* One past the last byte of the data block */
+    uint32_t maxend;     /* Largest end of this entry and those below it */
+    _dax_event *event;
+} _dax_event_range;
+
+/* Kinds of steps in a compiled mapping */
+#define MAP_OP_COPY 0  /* Straight copy of whole bytes */
+#define MAP_OP_BITS 1  /* Shift the source bits into place and mask them */
+
+/* One step in the copy plan of a mapping.  See mapping.c */
+typedef struct {
+    uint8_t kind;
+    uint8_t shift;       /* Right shift of the source window (MAP_OP_BITS) */
+    uint8_t first_mask;  /* Mask for the first destination byte (MAP_OP_BITS) */
+    uint8_t last_mask;   /* Mask for the last destination byte (MAP_OP_BITS) */
+    uint32_t src;        /* First source byte */
+    uint32_t srcsize;    /* Number of source bytes */
+    uint32_t dest;       /* First destination byte */
+    uint32_t size;       /* Number of destination bytes */
+} _dax_map_op;
+
 typedef struct dax_datamap_t {
     int id;
     tag_handle source;
     tag_handle dest;
-    uint8_t *mask;
+    uint32_t dest_start;  /* The bytes of the destination that are written */
+    uint32_t dest_end;
+    int opcount;
+    _dax_map_op ops[3];
     struct dax_datamap_t *next;
 } _dax_datamap;
 
@@ -95,28 +126,40 @@ typedef struct {
     int nextevent;           /* Counter for keeping track of event IDs */
     int nextmap;             /* Counter for keeping track of map IDs */
     _dax_event *events;      /* Linked list of events */
+    _dax_event_range *evindex; /* Events sorted by their starting byte */
+    int evcount;             /* Number of entries in evindex */
+    int evsize;              /* Allocated size of evindex */
     _dax_datamap *mappings;  /* Linked list of mappings */
     uint8_t *data;
     uint8_t *omask;        /* Override mask pointer */
     uint8_t *odata;        /* Override data pointer */
-    uint32_t ret_file_pointer; /* Pointer to the data area of the tag retention file */
+    uint64_t *osum;        /* Bit for each 64 bit word of omask that isn't zero */
+    uint32_t ret_file_pointer; /* Offset of the tag's record in the retention file */
+    uint8_t ret_dirty;       /* Set when the retained data needs to be written */
+    uint32_t gen;            /* Catalogue generation of the last change to the tag */
 } _dax_tag_db;
 
 typedef struct {
     /* TODO: Name's size is no longer fixed, should it be?
              It still is in the library.  Let's leave it for now?? */
     char *name;
+    uint32_t hash;
     int tag_idx;
 } _dax_tag_index;
 
 /* Tag Database Handling Functions */
 void initialize_tagbase(void);
+void tagbase_lock_read(void);
+void tagbase_lock_write(void);
+void tagbase_unlock(void);
 tag_index tag_add(char *name, tag_type type, unsigned int count, uint32_t attr);
 tag_index virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vfunction *wf);
 int tag_del(tag_index idx);
 int tag_get_name(char *, dax_tag *);
 int tag_get_index(int, dax_tag *);
 tag_index get_tagindex(void);
+uint32_t tag_get_generation(void);
+int tag_list(tag_index start, uint32_t since, uint8_t *buff, int size, tag_index *next);
 int is_tag_readonly(tag_index idx);
 int is_tag_virtual(tag_index idx);
 int is_tag_queue(tag_index idx);
@@ -128,7 +171,7 @@ int tag_write(tag_index handle, int offset, void *data, int size);
 int tag_mask_write(tag_index handle, int offset, void *data, void *mask, int size);
 
 /* Perform an atomic operation on the data */
-int atomic_op(tag_handle h, void *data, uint16_t op);
+int atomic_op(tag_handle h, void *data, int size, void *prev, uint16_t op);
 
 /* Custom DataType functions */
 tag_type cdt_create(char *str, int *error);
@@ -142,14 +185,17 @@ void event_check(tag_index idx, int offset, int size);
 void event_del_check(tag_index idx);
 int event_add(tag_handle h, int event_type, void *data, dax_module *module);
 int event_del(int index, int id, dax_module *module);
-int events_del_all(_dax_event *head);
+int events_del_all(tag_index idx);
 int event_opt(int index, int id, uint32_t options, dax_module *module);
 int events_cleanup(dax_module *module);
+void event_batch_begin(void);
+void event_batch_send(void);
+void event_batch_flush(void);
 
 int map_add(tag_handle src, tag_handle dest);
 int map_del(tag_index index, int id);
 int map_del_all(_dax_datamap *head);
-int map_check(tag_index idx, int offset, uint8_t *data, int size);
+int map_check(tag_index idx, int offset, int size);
 
 int override_add(tag_index idx, int offset, void *data, void *mask, int size);
 int override_del(tag_index idx, int offset, void *mask, int size);
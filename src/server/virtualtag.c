@@ -41,8 +41,8 @@
 /* This is the fd of the module of the current request.  This is so
  * that virtual functions in tagbase.c can know which module they are
  * dealing with.  There is probably a better way to do this but this works
- * for now. */
-static int _current_fd;
+ * for now.  Each message handling thread has it's own copy. */
+static __thread int _current_fd;
 
 
 void
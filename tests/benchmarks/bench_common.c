@@ -0,0 +1,87 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This contains common code for the benchmarks
+ */
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "bench_common.h"
+
+/* Starts the tagserver.  If option is not NULL it is passed to the
+ * server on the command line along with value. */
+pid_t
+bench_start_server(char *option, char *value)
+{
+    pid_t pid;
+
+    pid = fork();
+    if(pid == 0) { // Child
+        if(option != NULL) {
+            execl("../../src/server/tagserver", "../../src/server/tagserver", option, value, NULL);
+        } else {
+            execl("../../src/server/tagserver", "../../src/server/tagserver", NULL);
+        }
+        printf("Failed to launch tagserver\n");
+        exit(-1);
+    } else if(pid < 0) {
+        exit(-1);
+    }
+    usleep(200000);
+    return pid;
+}
+
+void
+bench_stop_server(pid_t pid)
+{
+    int status;
+
+    kill(pid, SIGINT);
+    waitpid(pid, &status, 0);
+    unlink("retentive.db");
+}
+
+/* Initializes and connects a new client to the server.  Exits on failure
+ * since there is no point in going on. */
+dax_state *
+bench_connect(char *name)
+{
+    dax_state *ds;
+    char *argv[] = {name, NULL};
+
+    ds = dax_init(name);
+    dax_init_config(ds, name);
+    dax_configure(ds, 1, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) {
+        printf("%s: Unable to connect to the tagserver\n", name);
+        exit(-1);
+    }
+    return ds;
+}
+
+/* Returns a monotonic time in seconds */
+double
+bench_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,34 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Common header file for the benchmarks
+ */
+
+#ifndef __BENCH_COMMON_H
+#define __BENCH_COMMON_H
+
+#include <common.h>
+#include <opendax.h>
+#include <sys/types.h>
+
+pid_t bench_start_server(char *option, char *value);
+void bench_stop_server(pid_t pid);
+dax_state *bench_connect(char *name);
+double bench_time(void);
+
+#endif /* !__BENCH_COMMON_H */
@@ -0,0 +1,148 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark compares the compare and update functions that are used
+ *  for change, set and reset events with the byte and bit loops that the
+ *  events used to have.  The data doesn't change between calls, which is
+ *  the common case where the whole range has to be looked at.
+ *
+ *  Usage: bench_evcmp [megabytes]
+ */
+
+#include <evcmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BYTES 0
+#define BENCH_BITS  1
+
+/* These are the loops from the old events.c */
+static int
+_old_change_bytes(uint8_t *this, const uint8_t *that, int len)
+{
+    int n, result = 0;
+
+    for(n = 0; n < len; n++) {
+        if(this[n] != that[n]) {
+            result = 1;
+            this[n] = that[n];
+        }
+    }
+    return result;
+}
+
+static int
+_old_set_bits(uint8_t *this, const uint8_t *that, int bit, int count)
+{
+    int n, i, result = 0;
+    uint8_t mask;
+
+    i = 0;
+    for(n = 0; n < count; n++) {
+        mask = (0x01 << bit);
+        if(that[i] & mask) {
+            if(!(this[i] & mask)) {
+                result = 1;
+                this[i] |= mask;
+            }
+        } else {
+            this[i] &= ~mask;
+        }
+        bit++;
+        if(bit == 8) {
+            bit = 0;
+            i++;
+        }
+    }
+    return result;
+}
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns megabytes per second.  impl < 0 runs the old loops */
+static double
+_run(int impl, int type, int size, double total)
+{
+    uint8_t *data, *test;
+    long n, loops;
+    double start;
+    volatile int result = 0;
+
+    data = malloc(size);
+    test = malloc(size);
+    if(data == NULL || test == NULL) exit(-1);
+    for(n = 0; n < size; n++) data[n] = rand();
+    memcpy(test, data, size);
+    if(impl >= 0) evcmp_select(impl);
+    loops = total / size;
+    start = _now();
+    for(n = 0; n < loops; n++) {
+        if(type == BENCH_BYTES) {
+            if(impl < 0) result += _old_change_bytes(test, data, size);
+            else result += evcmp_update(test, data, size, EVCMP_CHANGE);
+        } else {
+            if(impl < 0) result += _old_set_bits(test, data, 3, size * 8 - 8);
+            else result += evcmp_update_bits(test, data, 3, size * 8 - 8, EVCMP_SET);
+        }
+    }
+    start = _now() - start;
+    free(data);
+    free(test);
+    return (double)loops * size / start / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *names[] = {"old", "word", "sse2", "avx2"};
+    int sizes[] = {16, 256, 4096, 65536};
+    double total = 256e6;
+    int n, i, type;
+
+    if(argc > 1) total = strtod(argv[1], NULL) * 1e6;
+    printf("MB/sec of unchanged data checked\n");
+    for(type = BENCH_BYTES; type <= BENCH_BITS; type++) {
+        printf("%s\n%8s", type == BENCH_BYTES ? "Change event on bytes" : "Set event on BOOL bits", "size");
+        for(i = 0; i < 4; i++) printf(" %10s", names[i]);
+        printf("\n");
+        for(n = 0; n < sizeof(sizes) / sizeof(int); n++) {
+            printf("%8d", sizes[n]);
+            for(i = -1; i <= EVCMP_AVX2; i++) {
+                if(i >= 0 && evcmp_select(i) != i) {
+                    printf(" %10s", "n/a");
+                } else {
+                    /* The bit loop is slow so we give it less to do */
+                    printf(" %10.0f", _run(i, type, sizes[n], i < 0 && type == BENCH_BITS ? total / 16 : total));
+                }
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
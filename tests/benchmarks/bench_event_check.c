@@ -0,0 +1,111 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures the cost of checking events when writing to a
+ *  large array tag.  It links directly to the tag database so that there is
+ *  no messaging involved.  Each event is a change event on a single element
+ *  of the array and the events are spread evenly over the tag.  The writes
+ *  are single elements at random places in the tag with data that doesn't
+ *  change so no event messages are sent.  This is done for each combination
+ *  of array size and event count.
+ *
+ *  Usage: bench_event_check [writes]
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <opendax.h>
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+_run(dax_module *module, int tagsize, int events, int writes)
+{
+    static int tagnum = 0;
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_handle h;
+    tag_index idx;
+    dax_dint data = 0;
+    double start;
+    int n;
+
+    snprintf(name, sizeof(name), "bench%d", tagnum++);
+    idx = tag_add(name, DAX_DINT, tagsize, 0);
+    if(idx < 0) exit(-1);
+    h.index = idx;
+    h.bit = 0;
+    h.count = 1;
+    h.size = sizeof(dax_dint);
+    h.type = DAX_DINT;
+    for(n = 0; n < events; n++) {
+        h.byte = (int)((long)n * tagsize / events) * sizeof(dax_dint);
+        if(event_add(h, EVENT_CHANGE, NULL, module) < 0) exit(-1);
+    }
+    srand(1);
+    start = _now();
+    for(n = 0; n < writes; n++) {
+        tag_write(idx, (rand() % tagsize) * sizeof(dax_dint), &data, sizeof(dax_dint));
+    }
+    start = _now() - start;
+    tag_del(idx);
+    return start * 1e9 / writes;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int sizes[] = {1000, 10000, 100000};
+    int counts[] = {1, 10, 100, 1000};
+    dax_module module;
+    int writes = 1000000;
+    int n, i;
+
+    if(argc > 1) writes = strtol(argv[1], NULL, 0);
+    initialize_tagbase();
+    bzero(&module, sizeof(module));
+    module.fd = open("/dev/null", O_WRONLY);
+
+    printf("%d writes per run, nanoseconds per write\n", writes);
+    printf("%12s", "tag size");
+    for(i = 0; i < sizeof(counts) / sizeof(int); i++) {
+        printf(" %8d ev", counts[i]);
+    }
+    printf("\n");
+    for(n = 0; n < sizeof(sizes) / sizeof(int); n++) {
+        printf("%12d", sizes[n]);
+        for(i = 0; i < sizeof(counts) / sizeof(int); i++) {
+            printf(" %11.1f", _run(&module, sizes[n], counts[i], writes));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return 0;
+}
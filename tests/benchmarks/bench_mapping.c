@@ -0,0 +1,131 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures the cost of data mappings.  A large PLC tag is
+ *  mapped one element at a time into a number of HMI tags and the bits of a
+ *  BOOL array are mapped in 16 bit groups that don't line up with the
+ *  bytes.  The HMI tags are mapped again into display tags so that there is
+ *  a second level in the chain.  The whole PLC tags are written and then
+ *  single elements are written at random.
+ *
+ *  Usage: bench_mapping [writes]
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <opendax.h>
+
+#define ELEMENTS  10000 /* DINT mappings */
+#define BIT_MAPS  10000 /* 16 bit BOOL mappings */
+#define HMI_SIZE  100   /* Elements in each HMI tag */
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static tag_handle
+_handle(tag_index idx, int byte, int bit, int count, int size, tag_type type)
+{
+    tag_handle h;
+
+    h.index = idx;
+    h.byte = byte;
+    h.bit = bit;
+    h.count = count;
+    h.size = size;
+    h.type = type;
+    return h;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_index plc, bits, hmi[ELEMENTS / HMI_SIZE], hmi_bits, display[ELEMENTS / HMI_SIZE];
+    dax_dint *data;
+    uint8_t *bitdata;
+    int writes = 100000;
+    int n, offset;
+    double start;
+
+    if(argc > 1) writes = strtol(argv[1], NULL, 0);
+    initialize_tagbase();
+    plc = tag_add("plc", DAX_DINT, ELEMENTS, 0);
+    bits = tag_add("plc_bits", DAX_BOOL, BIT_MAPS * 16 + 8, 0);
+    hmi_bits = tag_add("hmi_bits", DAX_BOOL, BIT_MAPS * 16 + 8, 0);
+    if(plc < 0 || bits < 0 || hmi_bits < 0) exit(-1);
+    for(n = 0; n < ELEMENTS / HMI_SIZE; n++) {
+        snprintf(name, sizeof(name), "hmi%d", n);
+        hmi[n] = tag_add(name, DAX_DINT, HMI_SIZE, 0);
+        snprintf(name, sizeof(name), "display%d", n);
+        display[n] = tag_add(name, DAX_DINT, HMI_SIZE, 0);
+        if(hmi[n] < 0 || display[n] < 0) exit(-1);
+        if(map_add(_handle(hmi[n], 0, 0, HMI_SIZE, HMI_SIZE * 4, DAX_DINT),
+                   _handle(display[n], 0, 0, HMI_SIZE, HMI_SIZE * 4, DAX_DINT)) < 0) exit(-1);
+    }
+    for(n = 0; n < ELEMENTS; n++) {
+        if(map_add(_handle(plc, n * 4, 0, 1, 4, DAX_DINT),
+                   _handle(hmi[n / HMI_SIZE], (n % HMI_SIZE) * 4, 0, 1, 4, DAX_DINT)) < 0) exit(-1);
+    }
+    for(n = 0; n < BIT_MAPS; n++) {
+        /* Moved over by three bits */
+        if(map_add(_handle(bits, n * 2, 0, 16, 2, DAX_BOOL),
+                   _handle(hmi_bits, n * 2, 3, 16, 3, DAX_BOOL)) < 0) exit(-1);
+    }
+    data = calloc(ELEMENTS, sizeof(dax_dint));
+    bitdata = calloc(BIT_MAPS * 2 + 1, 1);
+    if(data == NULL || bitdata == NULL) exit(-1);
+
+    printf("%d DINT mappings, %d BOOL mappings\n", ELEMENTS + ELEMENTS / HMI_SIZE, BIT_MAPS);
+    start = _now();
+    for(n = 0; n < 100; n++) {
+        data[0] = n;
+        tag_write(plc, 0, data, ELEMENTS * sizeof(dax_dint));
+    }
+    printf("Whole DINT tag write  %10.1f us\n", (_now() - start) * 1e6 / 100);
+    start = _now();
+    for(n = 0; n < 100; n++) {
+        bitdata[0] = n;
+        tag_write(bits, 0, bitdata, BIT_MAPS * 2);
+    }
+    printf("Whole BOOL tag write  %10.1f us\n", (_now() - start) * 1e6 / 100);
+    srand(1);
+    start = _now();
+    for(n = 0; n < writes; n++) {
+        offset = rand() % ELEMENTS;
+        tag_write(plc, offset * sizeof(dax_dint), &data[offset], sizeof(dax_dint));
+    }
+    printf("Single DINT write     %10.1f ns\n", (_now() - start) * 1e9 / writes);
+    start = _now();
+    for(n = 0; n < writes; n++) {
+        offset = rand() % (BIT_MAPS * 2);
+        tag_write(bits, offset, &bitdata[offset], 1);
+    }
+    printf("Single BOOL byte write%10.1f ns\n", (_now() - start) * 1e9 / writes);
+    return 0;
+}
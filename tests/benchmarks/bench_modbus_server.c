@@ -0,0 +1,241 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures how many requests per second the Modbus TCP
+ *  server in the modbus module can answer with a lot of clients connected
+ *  at once.  All of the clients are sockets in this one process that are
+ *  driven with epoll.  Each one keeps 'depth' holding register reads
+ *  waiting for a response and sends another one as each response comes
+ *  back.  The responses are checked against the transaction IDs.
+ *
+ *  The tagserver and the module are started with the server configuration
+ *  from the module tests unless a port is given, in which case the server
+ *  that is already listening on that port of the local host is used.
+ *
+ *  Usage: bench_modbus_server [clients] [seconds] [depth] [port]
+ */
+
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "bench_common.h"
+
+#define MODULE "../../src/modules/modbus/daxmodbus"
+#define MODULE_CONF "../modules/modbus/conf/mb_server_cache.conf"
+#define MODULE_PORT 5513
+#define HOLD_SIZE 300 /* Size of the holding register table in MODULE_CONF */
+#define READ_LENGTH 10
+
+typedef struct bench_client {
+    int fd;
+    uint16_t tid;      /* Transaction ID for the next request */
+    uint16_t expect;   /* Transaction ID of the next response */
+    int index;         /* Bytes in buff */
+    uint8_t buff[1024];
+} bench_client;
+
+static uint64_t _errors;
+
+static pid_t
+_start_module(void)
+{
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if(pid == 0) {
+        /* The module prints every message so we throw that away */
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        execl(MODULE, MODULE, "-C", MODULE_CONF, NULL);
+        printf("Failed to launch module\n");
+        exit(-1);
+    } else if(pid < 0) {
+        exit(-1);
+    }
+    usleep(500000);
+    return pid;
+}
+
+static void
+_stop_module(pid_t pid)
+{
+    int status;
+
+    kill(pid, SIGINT);
+    waitpid(pid, &status, 0);
+}
+
+static int
+_connect(int port)
+{
+    struct sockaddr_in addr;
+    int fd, flag = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+/* Sends a request to read a few holding registers somewhere in the table */
+static int
+_send_request(bench_client *bc)
+{
+    uint8_t buff[12];
+    uint16_t addr;
+
+    addr = (bc->tid * 7) % (HOLD_SIZE - READ_LENGTH);
+    buff[0] = bc->tid >> 8;
+    buff[1] = bc->tid;
+    buff[2] = 0;
+    buff[3] = 0;
+    buff[4] = 0;
+    buff[5] = 6;
+    buff[6] = 1;
+    buff[7] = 3;
+    buff[8] = addr >> 8;
+    buff[9] = addr;
+    buff[10] = 0;
+    buff[11] = READ_LENGTH;
+    bc->tid++;
+    return write(bc->fd, buff, 12) == 12 ? 0 : -1;
+}
+
+/* Reads the responses that are waiting on the client's socket and sends a
+ * new request for each one.  Returns the number of responses */
+static int
+_receive(bench_client *bc)
+{
+    int result, count = 0, offset = 0, length;
+    uint16_t tid;
+
+    result = read(bc->fd, &bc->buff[bc->index], sizeof(bc->buff) - bc->index);
+    if(result <= 0) return result < 0 && errno == EAGAIN ? 0 : -1;
+    bc->index += result;
+    while(bc->index - offset >= 6) {
+        length = (bc->buff[offset + 4] << 8 | bc->buff[offset + 5]) + 6;
+        if(bc->index - offset < length) break;
+        tid = bc->buff[offset] << 8 | bc->buff[offset + 1];
+        if(tid != bc->expect || bc->buff[offset + 7] != 3 ||
+           bc->buff[offset + 8] != READ_LENGTH * 2) {
+            _errors++;
+        }
+        bc->expect = tid + 1;
+        offset += length;
+        count++;
+        if(_send_request(bc)) return -1;
+    }
+    memmove(bc->buff, &bc->buff[offset], bc->index - offset);
+    bc->index -= offset;
+    return count;
+}
+
+static double
+_run(int clients, double seconds, int depth, int port)
+{
+    bench_client *bc;
+    struct epoll_event ev, events[64];
+    int efd, n, i, result;
+    uint64_t total = 0;
+    double start, now;
+
+    bc = calloc(clients, sizeof(bench_client));
+    if(bc == NULL) exit(-1);
+    efd = epoll_create1(0);
+    for(n = 0; n < clients; n++) {
+        bc[n].fd = _connect(port);
+        if(bc[n].fd < 0) {
+            printf("Unable to connect client %d - %s\n", n, strerror(errno));
+            exit(-1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &bc[n];
+        epoll_ctl(efd, EPOLL_CTL_ADD, bc[n].fd, &ev);
+    }
+    for(n = 0; n < clients; n++) {
+        for(i = 0; i < depth; i++) _send_request(&bc[n]);
+    }
+    start = bench_time();
+    now = start;
+    while(now - start < seconds) {
+        result = epoll_wait(efd, events, 64, 100);
+        for(n = 0; n < result; n++) {
+            i = _receive(events[n].data.ptr);
+            if(i < 0) {
+                printf("Connection to the server was lost\n");
+                exit(-1);
+            }
+            total += i;
+        }
+        now = bench_time();
+    }
+    for(n = 0; n < clients; n++) close(bc[n].fd);
+    close(efd);
+    free(bc);
+    return total / (now - start);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int clients = 500, depth = 1, port = 0;
+    double seconds = 5.0, rate;
+    pid_t server = 0, module = 0;
+    struct rlimit rl;
+
+    if(argc > 1) clients = strtol(argv[1], NULL, 0);
+    if(argc > 2) seconds = strtod(argv[2], NULL);
+    if(argc > 3) depth = strtol(argv[3], NULL, 0);
+    if(argc > 4) port = strtol(argv[4], NULL, 0);
+
+    /* Make sure that we can open a socket for every client */
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < clients + 64) {
+        rl.rlim_cur = clients + 64 < rl.rlim_max ? clients + 64 : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if(port == 0) {
+        server = bench_start_server(NULL, NULL);
+        module = _start_module();
+        port = MODULE_PORT;
+    }
+    printf("%d clients, %d requests each in flight, %.1f seconds\n", clients, depth, seconds);
+    rate = _run(clients, seconds, depth, port);
+    printf("%16.0f requests/sec\n", rate);
+    printf("%16.1f uSec average response time\n", clients * depth * 1e6 / rate);
+    if(_errors) printf("%16llu bad responses\n", (unsigned long long)_errors);
+    if(module) _stop_module(module);
+    if(server) bench_stop_server(server);
+    return 0;
+}
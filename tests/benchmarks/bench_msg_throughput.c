@@ -0,0 +1,113 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures how the tagserver message throughput scales with
+ *  the number of worker threads.  A number of client processes each hammer
+ *  the server with tag reads for a fixed time and the total number of
+ *  completed requests per second is reported for each worker count.
+ *
+ *  Usage: bench_msg_throughput [clients] [seconds] [workers...]
+ */
+
+#include <sys/wait.h>
+#include "bench_common.h"
+
+/* Each client reads it's own tag in a loop and writes the number of
+ * requests that it completed to the pipe */
+static void
+_client(int n, double seconds, int fd)
+{
+    dax_state *ds;
+    tag_handle h;
+    char name[DAX_TAGNAME_SIZE + 1];
+    uint64_t count = 0;
+    dax_dint data[16];
+    double start;
+
+    snprintf(name, sizeof(name), "bench%d", n);
+    ds = bench_connect(name);
+    if(dax_tag_add(ds, &h, name, DAX_DINT, 16, 0)) {
+        printf("%s: Unable to add tag\n", name);
+        exit(-1);
+    }
+    start = bench_time();
+    while(bench_time() - start < seconds) {
+        if(dax_read_tag(ds, h, data)) {
+            printf("%s: Read failed\n", name);
+            break;
+        }
+        count++;
+    }
+    if(write(fd, &count, sizeof(count)) != sizeof(count)) exit(-1);
+    dax_disconnect(ds);
+    exit(0);
+}
+
+static double
+_run(char *workers, int clients, double seconds)
+{
+    pid_t server, pids[clients];
+    int fds[2], n, status;
+    uint64_t count, total = 0;
+
+    server = bench_start_server("-W", workers);
+    if(pipe(fds)) exit(-1);
+    fflush(stdout);
+    for(n = 0; n < clients; n++) {
+        pids[n] = fork();
+        if(pids[n] == 0) {
+            close(fds[0]);
+            _client(n, seconds, fds[1]);
+        }
+    }
+    close(fds[1]);
+    for(n = 0; n < clients; n++) {
+        if(read(fds[0], &count, sizeof(count)) == sizeof(count)) {
+            total += count;
+        }
+        waitpid(pids[n], &status, 0);
+    }
+    close(fds[0]);
+    bench_stop_server(server);
+    return total / seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int clients = 8, n;
+    double seconds = 2.0;
+    char *defworkers[] = {"1", "2", "4", "8"};
+    char **workers = defworkers;
+    int wcount = 4;
+
+    if(argc > 1) clients = strtol(argv[1], NULL, 0);
+    if(argc > 2) seconds = strtod(argv[2], NULL);
+    if(argc > 3) {
+        workers = &argv[3];
+        wcount = argc - 3;
+    }
+
+    printf("%d clients, %.1f seconds per run\n", clients, seconds);
+    printf("%8s %16s\n", "workers", "requests/sec");
+    for(n = 0; n < wcount; n++) {
+        printf("%8s %16.0f\n", workers[n], _run(workers[n], clients, seconds));
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures reading tags that have overrides on them.  Whole
+ *  tag reads and small reads are timed with no overrides, with a few bytes
+ *  of the tag overridden and with the whole tag overridden.  The byte at a
+ *  time merge that tag_read() used to do is timed too for comparison.
+ *
+ *  Usage: bench_override [reads]
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <opendax.h>
+
+#define TAG_SIZE   65536 /* Bytes in each tag */
+#define FEW_COUNT  8     /* Number of DINTs overridden in the sparse tag */
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* This is how the override data used to be merged */
+static void
+_byte_merge(uint8_t *dest, uint8_t *data, uint8_t *odata, uint8_t *omask, int size)
+{
+    int n;
+
+    memcpy(dest, data, size);
+    for(n = 0; n < size; n++) {
+        dest[n] = (odata[n] & omask[n]) | (data[n] & ~omask[n]);
+    }
+}
+
+static void
+_time_reads(char *label, tag_index idx, uint8_t *buff, int reads)
+{
+    double start;
+    int n, offset;
+
+    start = _now();
+    for(n = 0; n < reads / 100; n++) {
+        tag_read(idx, 0, buff, TAG_SIZE);
+    }
+    printf("%-10s whole tag read %10.1f us\n", label, (_now() - start) * 1e6 / (reads / 100));
+    srand(1);
+    start = _now();
+    for(n = 0; n < reads; n++) {
+        offset = (rand() % (TAG_SIZE / 4 - 16)) * 4;
+        tag_read(idx, offset, buff, 64);
+    }
+    printf("%-10s 64 byte read   %10.1f ns\n", label, (_now() - start) * 1e9 / reads);
+}
+
+int
+main(int argc, char *argv[])
+{
+    tag_index plain, few, all;
+    uint8_t *buff, *data, *odata, *omask;
+    dax_dint value = 0x12345678, mask = 0x0000FFFF;
+    int reads = 100000;
+    int n;
+    double start;
+
+    if(argc > 1) reads = strtol(argv[1], NULL, 0);
+    if(reads < 100) reads = 100;
+    initialize_tagbase();
+    plain = tag_add("plain", DAX_DINT, TAG_SIZE / 4, 0);
+    few = tag_add("few", DAX_DINT, TAG_SIZE / 4, 0);
+    all = tag_add("all", DAX_DINT, TAG_SIZE / 4, 0);
+    if(plain < 0 || few < 0 || all < 0) exit(-1);
+    buff = malloc(TAG_SIZE);
+    data = calloc(TAG_SIZE, 1);
+    odata = malloc(TAG_SIZE);
+    omask = malloc(TAG_SIZE);
+    if(buff == NULL || data == NULL || odata == NULL || omask == NULL) exit(-1);
+    memset(odata, 0x55, TAG_SIZE);
+    memset(omask, 0x0F, TAG_SIZE);
+
+    for(n = 0; n < FEW_COUNT; n++) {
+        if(override_add(few, (TAG_SIZE / FEW_COUNT) * n, &value, &mask, 4)) exit(-1);
+    }
+    if(override_add(all, 0, odata, omask, TAG_SIZE)) exit(-1);
+    if(override_set(few, 1) || override_set(all, 1)) exit(-1);
+
+    printf("%d byte tags, %d DINTs overridden in the sparse tag\n", TAG_SIZE, FEW_COUNT);
+    _time_reads("none", plain, buff, reads);
+    _time_reads("sparse", few, buff, reads);
+    _time_reads("full", all, buff, reads);
+    start = _now();
+    for(n = 0; n < reads / 100; n++) {
+        _byte_merge(buff, data, odata, omask, TAG_SIZE);
+    }
+    printf("%-10s whole tag read %10.1f us\n", "byte loop", (_now() - start) * 1e6 / (reads / 100));
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures the cost of writing to retained tags.  It links
+ *  directly to the tag database so that there is no messaging involved.
+ *  The first run writes to tags that are not retained and does the lseek()
+ *  and write() that every write to a retained tag used to do.  The others
+ *  write to retained tags with the retention file written through on every
+ *  change and with the changes flushed by the retention thread.  The time to
+ *  read the tags back from the file when the server starts is also given.
+ *
+ *  Usage: bench_retain [writes] [tags]
+ */
+
+#include <tagbase.h>
+#include <retain.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <opendax.h>
+
+#define TAG_SIZE 10 /* DINTs in each tag */
+#define OLD_FILE "bench_retain_old.db"
+#define RET_FILE "bench_retain.db"
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static tag_index *
+_add_tags(char *prefix, int count, uint32_t attr)
+{
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_index *idx;
+    int n;
+
+    idx = malloc(sizeof(tag_index) * count);
+    if(idx == NULL) exit(-1);
+    for(n = 0; n < count; n++) {
+        snprintf(name, sizeof(name), "%s%d", prefix, n);
+        idx[n] = tag_add(name, DAX_DINT, TAG_SIZE, attr);
+        if(idx[n] < 0) exit(-1);
+    }
+    return idx;
+}
+
+/* The way that retained tags were written before */
+static double
+_run_old(tag_index *idx, int count, int writes)
+{
+    dax_dint data[TAG_SIZE];
+    double start;
+    int fd, n, i;
+
+    fd = open(OLD_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) exit(-1);
+    bzero(data, sizeof(data));
+    srand(1);
+    start = _now();
+    for(n = 0; n < writes; n++) {
+        i = rand() % count;
+        data[0] = n;
+        tagbase_lock_write();
+        tag_write(idx[i], 0, data, sizeof(data));
+        lseek(fd, i * sizeof(data), SEEK_SET);
+        if(write(fd, data, sizeof(data)) != sizeof(data)) exit(-1);
+        tagbase_unlock();
+    }
+    start = _now() - start;
+    close(fd);
+    unlink(OLD_FILE);
+    return start * 1e9 / writes;
+}
+
+static double
+_run_new(tag_index *idx, int count, int writes)
+{
+    dax_dint data[TAG_SIZE];
+    double start;
+    int n;
+
+    bzero(data, sizeof(data));
+    srand(1);
+    start = _now();
+    for(n = 0; n < writes; n++) {
+        data[0] = n;
+        tagbase_lock_write();
+        tag_write(idx[rand() % count], 0, data, sizeof(data));
+        tagbase_unlock();
+    }
+    start = _now() - start;
+    return start * 1e9 / writes;
+}
+
+int
+main(int argc, char *argv[])
+{
+    tag_index *plain, *retained;
+    int writes = 1000000, count = 100, sync_writes;
+    double t;
+
+    if(argc > 1) writes = strtol(argv[1], NULL, 0);
+    if(argc > 2) count = strtol(argv[2], NULL, 0);
+    /* Every write syncs the file in write through mode so we don't do as many */
+    sync_writes = writes < 2000 ? writes : 2000;
+    initialize_tagbase();
+    unlink(RET_FILE);
+
+    printf("%d tags of %d DINTs, nanoseconds per write\n", count, TAG_SIZE);
+    plain = _add_tags("plain", count, 0);
+    printf("%-34s %12.1f\n", "lseek() and write() per write", _run_old(plain, count, writes));
+
+    if(ret_init(RET_FILE, 0)) exit(-1);
+    retained = _add_tags("sync", count, TAG_ATTR_RETAIN);
+    printf("%-34s %12.1f\n", "write through", _run_new(retained, count, sync_writes));
+    ret_close();
+    unlink(RET_FILE);
+
+    if(ret_init(RET_FILE, 1000)) exit(-1);
+    retained = _add_tags("ret", count, TAG_ATTR_RETAIN);
+    printf("%-34s %12.1f\n", "flushed every 1000 ms", _run_new(retained, count, writes));
+    t = _now();
+    ret_flush();
+    printf("%-34s %12.1f\n", "time to flush all the tags (us)", (_now() - t) * 1e6);
+    ret_close();
+
+    t = _now();
+    if(ret_init(RET_FILE, 1000)) exit(-1);
+    printf("%-34s %12.1f\n", "time to read the file (us)", (_now() - t) * 1e6);
+    ret_close();
+    unlink(RET_FILE);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark compares polling tags through the server's shared memory
+ *  segment with polling them with messages.  A single client reads each of
+ *  a set of tags in turn for a fixed time.  The second run starts the server
+ *  with the segment disabled so that every read is sent as a message.  Each
+ *  run is done in it's own process.
+ *
+ *  Usage: bench_shm_read [tags] [seconds]
+ */
+
+#include <sys/wait.h>
+#include "bench_common.h"
+
+static void
+_client(int tags, double seconds, int fd)
+{
+    dax_state *ds;
+    tag_handle *h;
+    char name[DAX_TAGNAME_SIZE + 1];
+    dax_dint data[16];
+    uint64_t count = 0;
+    double start;
+    int n;
+
+    ds = bench_connect("bench");
+    h = malloc(sizeof(tag_handle) * tags);
+    if(h == NULL) exit(-1);
+    for(n = 0; n < tags; n++) {
+        snprintf(name, sizeof(name), "bench%d", n);
+        if(dax_tag_add(ds, &h[n], name, DAX_DINT, 16, 0)) {
+            printf("Unable to add tag %s\n", name);
+            exit(-1);
+        }
+    }
+    start = bench_time();
+    while(bench_time() - start < seconds) {
+        for(n = 0; n < tags; n++) {
+            if(dax_read_tag(ds, h[n], data)) {
+                printf("Read failed\n");
+                exit(-1);
+            }
+        }
+        count += tags;
+    }
+    if(write(fd, &count, sizeof(count)) != sizeof(count)) exit(-1);
+    dax_disconnect(ds);
+    exit(0);
+}
+
+static double
+_run(char *shm_size, int tags, double seconds)
+{
+    pid_t server, pid;
+    int fds[2], status;
+    uint64_t count = 0;
+
+    server = bench_start_server("-M", shm_size);
+    if(pipe(fds)) exit(-1);
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0) {
+        close(fds[0]);
+        _client(tags, seconds, fds[1]);
+    }
+    close(fds[1]);
+    if(read(fds[0], &count, sizeof(count)) != sizeof(count)) count = 0;
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    bench_stop_server(server);
+    return count / seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int tags = 1000;
+    double seconds = 2.0;
+
+    if(argc > 1) tags = strtol(argv[1], NULL, 0);
+    if(argc > 2) seconds = strtod(argv[2], NULL);
+
+    printf("%d tags, %.1f seconds per run\n", tags, seconds);
+    printf("%16s %16s\n", "transport", "reads/sec");
+    printf("%16s %16.0f\n", "shared memory", _run("4096", tags, seconds));
+    printf("%16s %16.0f\n", "messages", _run("0", tags, seconds));
+    return 0;
+}
@@ -168,13 +168,17 @@ main(int argc, char *argv[])
         cache_tag_add(ds, &tags[n]);
     }
     print_cache(ds);
-    for(n=0;n<9;n++)for(n=0;n<8;n++) {
-        if(n != 7) {
-            check_cache_hit(ds, tags[n]);
-        }
+    /* The least recently used one gets thrown out */
+    check_cache_miss(ds, tags[0]);
+    for(n=1;n<9;n++) {
+        check_cache_hit(ds, tags[n]);
     }
+    /* Using one keeps it in the cache */
+    check_cache_hit(ds, tags[1]);
+    cache_tag_add(ds, &tags[9]);
+    check_cache_hit(ds, tags[1]);
+    check_cache_miss(ds, tags[2]);
     print_cache(ds);
-    check_cache_miss(ds, tags[7]);
 
     free_tag_cache(ds);
     print_cache(ds);
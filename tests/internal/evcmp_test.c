@@ -0,0 +1,125 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test checks the compare and update functions that the change, set and
+ * reset events use against a simple bit at a time version.  Every
+ * implementation that the CPU supports is tested with random data, random
+ * lengths and random bit ranges.
+ */
+
+#include <evcmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BUFF_SIZE 300
+#define TEST_COUNT 20000
+
+/* Bit at a time reference */
+static int
+_ref_update(uint8_t *test, const uint8_t *data, int bit, int count, int op)
+{
+    int n, i, b, t, d, result = 0;
+
+    for(n = bit; n < bit + count; n++) {
+        i = n / 8;
+        b = 1 << (n % 8);
+        t = test[i] & b;
+        d = data[i] & b;
+        switch(op) {
+            case EVCMP_CHANGE:
+                if(t != d) result = 1;
+                if(d) test[i] |= b; else test[i] &= ~b;
+                break;
+            case EVCMP_SET:
+                if(d && !t) result = 1;
+                if(d) test[i] |= b; else test[i] &= ~b;
+                break;
+            case EVCMP_RESET:
+                if(!d && !t) result = 1;
+                if(!d) test[i] |= b; else test[i] &= ~b;
+                break;
+        }
+    }
+    return result;
+}
+
+static void
+_random(uint8_t *buff, int size)
+{
+    int n;
+
+    for(n = 0; n < size; n++) buff[n] = rand();
+}
+
+static void
+_test_impl(int impl)
+{
+    uint8_t data[BUFF_SIZE], test[BUFF_SIZE], ref[BUFF_SIZE];
+    int n, op, bit, count, byte, len, r1, r2;
+
+    assert(evcmp_select(impl) == impl);
+    for(n = 0; n < TEST_COUNT; n++) {
+        op = rand() % 3;
+        _random(data, BUFF_SIZE);
+        _random(test, BUFF_SIZE);
+        /* Make it likely that nothing hits some of the time */
+        if(rand() % 2) {
+            if(op == EVCMP_RESET) {
+                for(len = 0; len < BUFF_SIZE; len++) test[len] = ~data[len];
+            } else {
+                memcpy(test, data, BUFF_SIZE);
+            }
+            test[rand() % BUFF_SIZE] ^= 1 << (rand() % 8);
+        }
+        memcpy(ref, test, BUFF_SIZE);
+        if(rand() % 2) {
+            /* Bytes */
+            byte = rand() % BUFF_SIZE;
+            len = rand() % (BUFF_SIZE - byte + 1);
+            r1 = evcmp_update(&test[byte], &data[byte], len, op);
+            r2 = _ref_update(&ref[byte], &data[byte], 0, len * 8, op);
+        } else {
+            /* Bits */
+            bit = rand() % 16;
+            count = rand() % (BUFF_SIZE * 8 - bit);
+            r1 = evcmp_update_bits(test, data, bit, count, op);
+            r2 = _ref_update(ref, data, bit, count, op);
+        }
+        assert(r1 == r2);
+        assert(memcmp(test, ref, BUFF_SIZE) == 0);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int impl;
+
+    srand(5678);
+    _test_impl(EVCMP_WORD);
+    for(impl = EVCMP_SSE2; impl <= EVCMP_AVX2; impl++) {
+        if(evcmp_select(impl) == impl) {
+            _test_impl(impl);
+        } else {
+            printf("Implementation %d is not supported on this CPU\n", impl);
+        }
+    }
+    return 0;
+}
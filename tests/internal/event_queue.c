@@ -18,8 +18,8 @@
  *  Main source code file for the OpenDAX Bad Module
  */
 
-/* This test program loads up the caching functions from the library and
- * tests that the functions that deal with the cache behave correctly
+/* This test program loads up the event queue functions from the library and
+ * tests that the ring of event messages behaves correctly
  */
 
 #include <libcommon.h>
@@ -31,8 +31,8 @@ int
 simple_push_test(void) {
     dax_state *ds;
     dax_message msg;
-    dax_message *eq;
-    int n, result;
+    dax_message *test;
+    int n;
 
     ds = dax_init("event_queue");
     msg.size = 10;
@@ -40,27 +40,32 @@ simple_push_test(void) {
 
     for(n=0; n<16; n++) {
         msg.fd = n+1;
-        push_event(ds, &msg);
+        assert(push_event(ds, &msg) == 0);
     }
-    eq = ds->emsg_queue;
     for(n=0; n<16; n++) {
-        assert(eq[n].fd == n+1);
+        test = pop_event(ds);
+        assert(test != NULL);
+        assert(test->fd == n+1);
+        assert(test->size == 10);
+        release_event(ds, test);
     }
+    assert(pop_event(ds) == NULL);
     dax_free(ds);
     return 0;
 }
 
 /* this puts three events on the queue and then pops them off to
- * move the pointer up in the list.  Then it adds eight more to the
+ * move the pointer up in the ring.  Then it adds eight more to the
  * queue to test that it rolls over properly */
 int
 simple_fragment_test(void) {
     dax_state *ds;
     dax_message msg;
     dax_message *eq, *test;
-    int n, result;
+    int n;
 
     ds = dax_init("event_queue");
+    assert(init_event_queue(ds, 8) == 0);
     msg.size = 10;
     msg.msg_type = 20;
     /* put three messages on the queue */
@@ -68,62 +73,73 @@ simple_fragment_test(void) {
         msg.fd = n+1;
         push_event(ds, &msg);
     }
-    eq = ds->emsg_queue;
+    eq = ds->emsg_ring;
     for(n=0; n<3; n++) {
         assert(eq[n].fd == n+1);
     }
-    /* pop them off */
+    /* pop them off.  They should come right out of the ring */
     for(n=0; n<3; n++) {
         test = pop_event(ds);
         assert(test == &eq[n]);
+        release_event(ds, test);
     }
     /* Add 8 more */
     for(n=0; n<8; n++) {
         msg.fd = n+11;
-        push_event(ds, &msg);
+        assert(push_event(ds, &msg) == 0);
     }
     /* Check that we get them properly */
     for(n=0; n<8; n++) {
         test = pop_event(ds);
         assert(test->fd == n+11);
+        release_event(ds, test);
     }
     dax_free(ds);
     return 0;
 }
 
+/* When the ring is full the new events are thrown away.  A slot that is
+ * still being used can't be filled even if the ones after it are done */
 int
-fragment_grow_test(void) {
+overflow_test(void) {
     dax_state *ds;
     dax_message msg;
-    dax_message *eq, *test;
-    int n, result;
+    dax_message *test, *first;
+    int n;
 
     ds = dax_init("event_queue");
+    assert(init_event_queue(ds, 5) == 0);
+    assert(ds->emsg_ring_size == 8);
     msg.size = 10;
     msg.msg_type = 20;
-    /* put three messages on the queue */
-    for(n=0; n<3; n++) {
+    for(n=0; n<12; n++) {
         msg.fd = n+1;
-        push_event(ds, &msg);
-    }
-    eq = ds->emsg_queue;
-    for(n=0; n<3; n++) {
-        assert(eq[n].fd == n+1);
+        if(n < 8) {
+            assert(push_event(ds, &msg) == 0);
+        } else {
+            assert(push_event(ds, &msg) == ERR_OVERFLOW);
+        }
     }
-    /* pop them off */
-    for(n=0; n<3; n++) {
+    /* Hang on to the first one and release the rest */
+    first = pop_event(ds);
+    assert(first->fd == 1);
+    for(n=1; n<8; n++) {
         test = pop_event(ds);
-        assert(test == &eq[n]);
+        assert(test->fd == n+1);
+        release_event(ds, test);
     }
-    /* Add 12 more */
-    for(n=0; n<12; n++) {
-        msg.fd = n+11;
-        push_event(ds, &msg);
+    assert(pop_event(ds) == NULL);
+    assert(push_event(ds, &msg) == ERR_OVERFLOW);
+    release_event(ds, first);
+    /* Now the whole ring is free */
+    for(n=0; n<8; n++) {
+        msg.fd = n+21;
+        assert(push_event(ds, &msg) == 0);
     }
-    /* Check that we get them properly */
-    for(n=0; n<12; n++) {
+    for(n=0; n<8; n++) {
         test = pop_event(ds);
-        assert(test->fd == n+11);
+        assert(test->fd == n+21);
+        release_event(ds, test);
     }
     dax_free(ds);
     return 0;
@@ -139,7 +155,7 @@ main(int argc, char *argv[])
     if(result) return result;
     result = simple_fragment_test();
     if(result) return result;
-    result = fragment_grow_test();
+    result = overflow_test();
     if(result) return result;
     return 0;
 }
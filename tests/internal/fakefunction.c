@@ -25,3 +25,24 @@ dax_module *
 module_find_fd(int fd) {
     return NULL;
 }
+
+void
+module_tag_deleted(tag_index idx) {
+    return;
+}
+
+/* The tagbase tests don't create the shared memory segment but shmem_test does */
+size_t
+opt_shm_size(void) {
+    return 64 * 1024;
+}
+
+char *
+opt_shm_name(void) {
+    return "/opendax_test";
+}
+
+int
+opt_shm_group(void) {
+    return 0;
+}
@@ -38,7 +38,7 @@ _test_simple(void) {
     mod.groups_size = 0;
     mod.tag_groups = NULL;
 
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
     assert(mod.groups_size == TAG_GROUP_START_COUNT);
     assert(index==0); /* Zero should be the first one */
@@ -57,7 +57,7 @@ _test_group_array_growth(void) {
     mod.tag_groups = NULL;
 
     for(n=0;n<TAG_GROUP_START_COUNT;n++) {
-        index = group_add(&mod, NULL, 0);
+        index = group_add(&mod, NULL, 0, 0);
         if(index < 0) exit(index);
         assert(index == n);
     }
@@ -65,7 +65,7 @@ _test_group_array_growth(void) {
     assert(mod.groups_size == TAG_GROUP_START_COUNT);
 
     /* Now add one more and make sure it doubles in size */
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
     assert(index == TAG_GROUP_START_COUNT);
 
@@ -86,7 +86,7 @@ _test_group_size(void) {
     mod.groups_size = 0;
     mod.tag_groups = NULL;
 
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
 
     count = MSG_TAG_GROUP_DATA_SIZE / 4;
@@ -0,0 +1,48 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/* Common functions for the tag retention tests
+ */
+
+#include <tagbase.h>
+#include <retain.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include "rettest_common.h"
+
+/* Runs each step in a child process so that it gets a fresh tag database
+ * that is loaded from the retention file, just like the server starting
+ * up again. */
+void
+run_step(char *retfile, step_func f)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    assert(pid >= 0);
+    if(pid == 0) {
+        initialize_tagbase();
+        assert(ret_init(retfile, 1000) == 0);
+        f();
+        exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
@@ -0,0 +1,128 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+
+ *  Test for the allocator of the shared memory segment that holds the
+ *  tag data for local modules.
+ */
+
+#include "opendax.h"
+#include "daxtypes.h"
+#include "libcommon.h"
+#include "shmem.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+
+/* These match the fake options in fakefunction.c */
+#define TEST_SHM_SIZE (64 * 1024)
+#define TEST_SHM_NAME "/opendax_test"
+
+static dax_shm_header *
+_map_segment(void) {
+    int fd;
+    void *shm;
+
+    fd = shm_open(TEST_SHM_NAME, O_RDONLY, 0);
+    assert(fd >= 0);
+    shm = mmap(NULL, TEST_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(shm != MAP_FAILED);
+    return shm;
+}
+
+static void
+_test_alloc(void) {
+    uint8_t *a, *b, *c, *d;
+    dax_shm_header *header;
+    int n, max;
+
+    header = _map_segment();
+    assert(header->magic == DAX_SHM_MAGIC);
+    assert(header->size == TEST_SHM_SIZE);
+    max = header->size - header->data_offset - 8;
+
+    a = shmem_alloc(10);
+    b = shmem_alloc(100);
+    c = shmem_alloc(1000);
+    assert(a && b && c);
+    assert(shmem_owns(a) && shmem_owns(b) && shmem_owns(c));
+    assert(a + 10 <= b && b + 100 <= c);
+    for(n = 0; n < 1000; n++) assert(c[n] == 0);
+    memset(a, 0xFF, 10);
+    memset(b, 0xFF, 100);
+    memset(c, 0xFF, 1000);
+
+    /* A hole in the middle should be reused and zeroed */
+    shmem_free(b);
+    d = shmem_alloc(50);
+    assert(d == b);
+    for(n = 0; n < 50; n++) assert(d[n] == 0);
+
+    /* We shouldn't be able to get the whole thing now */
+    assert(shmem_alloc(max) == NULL);
+    /* Free everything in a different order than it was allocated and the
+     * free extents should all be merged back together */
+    shmem_free(a);
+    shmem_free(c);
+    shmem_free(d);
+    a = shmem_alloc(max);
+    assert(a != NULL);
+    assert(shmem_alloc(1) == NULL);
+    shmem_free(a);
+    assert(shmem_alloc(max + 1) == NULL);
+    /* Memory that isn't ours is ignored */
+    assert(!shmem_owns(&n));
+    munmap(header, TEST_SHM_SIZE);
+}
+
+static void
+_test_publish(void) {
+    dax_shm_header *header;
+    dax_shm_slot *slot;
+    uint8_t *data;
+
+    header = _map_segment();
+    slot = (dax_shm_slot *)((uint8_t *)header + header->slot_offset) + 3;
+    data = shmem_alloc(16);
+    shmem_publish(3, data, 16);
+    assert(slot->flags & SHM_SLOT_VALID);
+    assert(slot->size == 16);
+    assert((uint8_t *)header + slot->offset != data); /* Different mappings */
+    assert(slot->seq % 2 == 0);
+    shmem_write_begin(3);
+    assert(slot->seq % 2 == 1);
+    shmem_write_end(3);
+    assert(slot->seq % 2 == 0);
+    shmem_publish(3, NULL, 0);
+    assert(!(slot->flags & SHM_SLOT_VALID));
+    /* Slots past the end are ignored */
+    shmem_publish(header->slot_count, data, 16);
+    shmem_free(data);
+    munmap(header, TEST_SHM_SIZE);
+}
+
+int
+main(int argc, char *argv[]) {
+    assert(shmem_init() == 0);
+    assert(shmem_name() != NULL);
+    _test_alloc();
+    _test_publish();
+    shmem_close();
+    assert(shmem_name() == NULL);
+    assert(shm_open(TEST_SHM_NAME, O_RDONLY, 0) < 0);
+    exit(0);
+}
@@ -0,0 +1,78 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Main source code file for the OpenDAX Bad Module
+ */
+
+/* This test adds enough tags to make the name index grow several times,
+ * then deletes some of them and makes sure that every tag can still be
+ * found by name.  Deleting from the middle of the probe sequences is the
+ * tricky part of the hash table.
+ */
+
+#include <tagbase.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define TEST_COUNT 20000
+
+int
+main(int argc, char *argv[])
+{
+    dax_tag tag;
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_index idx[TEST_COUNT];
+    int n;
+
+    initialize_tagbase();
+    for(n = 0; n < TEST_COUNT; n++) {
+        sprintf(name, "tag%d", n);
+        idx[n] = tag_add(name, DAX_INT, 1, 0);
+        assert(idx[n] >= 0);
+    }
+    /* Adding one again just returns the same tag */
+    assert(tag_add("tag1234", DAX_INT, 1, 0) == idx[1234]);
+
+    for(n = 0; n < TEST_COUNT; n += 3) {
+        assert(tag_del(idx[n]) == 0);
+    }
+    for(n = 0; n < TEST_COUNT; n++) {
+        sprintf(name, "tag%d", n);
+        if(n % 3 == 0) {
+            assert(tag_get_name(name, &tag) == ERR_NOTFOUND);
+        } else {
+            assert(tag_get_name(name, &tag) == 0);
+            assert(tag.idx == idx[n]);
+            assert(strcmp(tag.name, name) == 0);
+        }
+    }
+    /* Put the deleted ones back, they should get new indexes */
+    for(n = 0; n < TEST_COUNT; n += 3) {
+        sprintf(name, "tag%d", n);
+        assert(tag_add(name, DAX_INT, 1, 0) > idx[TEST_COUNT - 1]);
+    }
+    for(n = 0; n < TEST_COUNT; n++) {
+        sprintf(name, "tag%d", n);
+        assert(tag_get_name(name, &tag) == 0);
+    }
+    assert(tag_get_name("tag", &tag) == ERR_NOTFOUND);
+    assert(tag_get_name("_tagcount", &tag) == 0);
+    assert(tag.idx == INDEX_TAGCOUNT);
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test puts a lot of write events with random ranges on one large
+ * array tag and then makes random writes to the tag.  The events that are
+ * sent out through a pipe are compared to what a simple scan of all the
+ * events says should have been sent.  This checks the event index.
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <opendax.h>
+
+#define TAG_COUNT    1000  /* Number of INTs in the tag */
+#define EVENT_COUNT  300
+#define WRITE_COUNT  2000
+
+static int start[EVENT_COUNT], end[EVENT_COUNT], id[EVENT_COUNT];
+static int deleted[EVENT_COUNT];
+
+/* Read all the events that are waiting in the pipe and mark them in hits */
+static void
+_read_events(int fd, uint8_t *hits) {
+    uint32_t buff[4];
+    int n;
+
+    while(read(fd, buff, sizeof(buff)) == sizeof(buff)) {
+        for(n = 0; n < EVENT_COUNT; n++) {
+            if(id[n] == ntohl(buff[3])) {
+                assert(hits[n] == 0); /* Only one message per event */
+                hits[n] = 1;
+            }
+        }
+    }
+}
+
+static void
+_do_writes(tag_index idx, int fd) {
+    uint8_t hits[EVENT_COUNT];
+    dax_int data[TAG_COUNT];
+    int n, i, offset, size;
+
+    bzero(data, sizeof(data));
+    for(n = 0; n < WRITE_COUNT; n++) {
+        offset = (rand() % TAG_COUNT) * sizeof(dax_int);
+        size = (rand() % 8 + 1) * sizeof(dax_int);
+        if(offset + size > TAG_COUNT * sizeof(dax_int)) {
+            size = TAG_COUNT * sizeof(dax_int) - offset;
+        }
+        assert(tag_write(idx, offset, data, size) == 0);
+        bzero(hits, sizeof(hits));
+        _read_events(fd, hits);
+        for(i = 0; i < EVENT_COUNT; i++) {
+            if(!deleted[i] && offset < end[i] && offset + size > start[i]) {
+                assert(hits[i] == 1);
+            } else {
+                assert(hits[i] == 0);
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    dax_module module;
+    tag_handle h;
+    tag_index idx;
+    int fds[2];
+    int n, count;
+
+    initialize_tagbase();
+    assert(pipe(fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    bzero(&module, sizeof(module));
+    module.fd = fds[1];
+
+    idx = tag_add("event_index_test", DAX_INT, TAG_COUNT, 0);
+    assert(idx >= 0);
+    srand(1234);
+    for(n = 0; n < EVENT_COUNT; n++) {
+        /* A few events cover most of the tag */
+        if(n % 50 == 0) {
+            h.count = rand() % (TAG_COUNT / 2) + TAG_COUNT / 2;
+        } else {
+            h.count = rand() % 20 + 1;
+        }
+        h.index = idx;
+        h.byte = (rand() % (TAG_COUNT - h.count + 1)) * sizeof(dax_int);
+        h.bit = 0;
+        h.size = h.count * sizeof(dax_int);
+        h.type = DAX_INT;
+        id[n] = event_add(h, EVENT_WRITE, NULL, &module);
+        assert(id[n] >= 0);
+        start[n] = h.byte;
+        end[n] = h.byte + h.size;
+        deleted[n] = 0;
+    }
+    assert(module.event_count == EVENT_COUNT);
+    _do_writes(idx, fds[0]);
+
+    /* Delete a third of them and check again */
+    for(n = 0; n < EVENT_COUNT; n += 3) {
+        assert(event_del(idx, id[n], &module) == 0);
+        deleted[n] = 1;
+    }
+    assert(event_del(idx, id[0], &module) == ERR_NOTFOUND);
+    _do_writes(idx, fds[0]);
+
+    count = module.event_count;
+    assert(count == EVENT_COUNT - (EVENT_COUNT + 2) / 3);
+    assert(events_cleanup(&module) == 0);
+    assert(module.event_count == 0);
+    for(n = 0; n < EVENT_COUNT; n++) deleted[n] = 1;
+    _do_writes(idx, fds[0]);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test checks the tag retention file.  Each step runs in a child
+ * process so that it gets a fresh tag database, just like the server
+ * starting up again.  The first step writes the retained tags, flushes them
+ * twice and then writes again and exits without closing, like a crash.
+ * The next step should get the data from the last flush back.  Then the
+ * newest copy of the data in the file is damaged to make sure that we fall
+ * back to the older one.  The last steps check that a clean close writes
+ * everything and drops the tags that were not retained again.
+ */
+
+#include <tagbase.h>
+#include <retain.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <opendax.h>
+#include "rettest_common.h"
+
+#define RET_FILE "tagbasetest_007.db"
+#define TAG_COUNT 10
+
+static void
+_write_all(tag_index idx, dax_dint value)
+{
+    dax_dint data[TAG_COUNT];
+    int n;
+
+    for(n = 0; n < TAG_COUNT; n++) data[n] = value + n;
+    tagbase_lock_write();
+    assert(tag_write(idx, 0, data, sizeof(data)) == 0);
+    tagbase_unlock();
+}
+
+static void
+_check_all(char *name, dax_dint value)
+{
+    dax_tag tag;
+    dax_dint data[TAG_COUNT];
+    int n;
+
+    assert(tag_get_name(name, &tag) == 0);
+    assert(tag.type == DAX_DINT && tag.count == TAG_COUNT);
+    assert(tag_read(tag.idx, 0, data, sizeof(data)) == 0);
+    for(n = 0; n < TAG_COUNT; n++) {
+        assert(data[n] == value + n);
+    }
+}
+
+static void
+_step_crash(void)
+{
+    tag_index idx, other;
+
+    idx = tag_add("ret_dint", DAX_DINT, TAG_COUNT, TAG_ATTR_RETAIN);
+    other = tag_add("ret_other", DAX_DINT, TAG_COUNT, TAG_ATTR_RETAIN);
+    assert(idx >= 0 && other >= 0);
+    _write_all(idx, 100);
+    _write_all(other, 5000);
+    assert(ret_flush() == 2);
+    assert(ret_flush() == 0); /* Nothing has changed */
+    _write_all(idx, 200);
+    _write_all(idx, 300); /* Only the last write matters */
+    assert(ret_flush() == 1);
+    _write_all(idx, 400);
+    _exit(0); /* No ret_close() */
+}
+
+static void
+_step_check_flushed(void)
+{
+    _check_all("ret_dint", 300);
+    _check_all("ret_other", 5000);
+    _exit(0); /* Leave the file alone */
+}
+
+/* Reading the file changes it so we keep a copy of it from after the crash */
+static void
+_copy_file(char *from, char *to)
+{
+    char buff[4096];
+    int in, out, size;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(in >= 0 && out >= 0);
+    while((size = read(in, buff, sizeof(buff))) > 0) {
+        assert(write(out, buff, size) == size);
+    }
+    close(in);
+    close(out);
+}
+
+/* Damage the newest copy of ret_dint.  It's the first record in the file.
+ * Adding the tag wrote the first slot, 100 went in the second slot and 300
+ * went back in the first slot */
+static void
+_damage_file(void)
+{
+    int fd;
+    uint8_t byte;
+    off_t slot;
+
+    slot = 16 + 32; /* Header, record and name */
+    fd = open(RET_FILE, O_RDWR);
+    assert(fd >= 0);
+    assert(pread(fd, &byte, 1, slot + 8) == 1);
+    byte ^= 0xFF;
+    assert(pwrite(fd, &byte, 1, slot + 8) == 1);
+    close(fd);
+}
+
+static void
+_step_check_damaged(void)
+{
+    tag_index idx;
+
+    _check_all("ret_dint", 100);
+    /* Only ret_dint is retained again */
+    idx = tag_add("ret_dint", DAX_DINT, TAG_COUNT, TAG_ATTR_RETAIN);
+    assert(idx >= 0);
+    _write_all(idx, 600);
+    assert(ret_close() == 0);
+}
+
+static void
+_step_check_closed(void)
+{
+    dax_tag tag;
+
+    _check_all("ret_dint", 600);
+    assert(tag_get_name("ret_other", &tag) == ERR_NOTFOUND);
+    assert(ret_close() == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unlink(RET_FILE);
+    run_step(RET_FILE, _step_crash);
+    _copy_file(RET_FILE, RET_FILE ".bak");
+    run_step(RET_FILE, _step_check_flushed);
+    _copy_file(RET_FILE ".bak", RET_FILE);
+    unlink(RET_FILE ".bak");
+    _damage_file();
+    run_step(RET_FILE, _step_check_damaged);
+    run_step(RET_FILE, _step_check_closed);
+    unlink(RET_FILE);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test checks the retention of custom data type tags and the
+ * compaction of the retention file.  Like tagbasetest_007 each step runs
+ * in a child process so that it starts with a fresh tag database.  The
+ * first step retains a tag with nested custom data types and then adds and
+ * deletes a lot of retained tags so that most of the file is dead.  The
+ * file is compacted while the tags are still being used and then the next
+ * step checks that the data types and the data come back.
+ */
+
+#include <tagbase.h>
+#include <retain.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <opendax.h>
+#include "rettest_common.h"
+
+#define RET_FILE "tagbasetest_008.db"
+#define DEAD_COUNT 200
+
+static off_t
+_file_size(void)
+{
+    struct stat st;
+
+    assert(stat(RET_FILE, &st) == 0);
+    return st.st_size;
+}
+
+static void
+_write_pattern(tag_index idx, uint8_t start)
+{
+    uint8_t data[512];
+    int n, size;
+
+    size = tag_get_size(idx);
+    assert(size <= sizeof(data));
+    for(n = 0; n < size; n++) data[n] = start + n;
+    tagbase_lock_write();
+    assert(tag_write(idx, 0, data, size) == 0);
+    tagbase_unlock();
+}
+
+static void
+_check_pattern(char *name, tag_type type, uint8_t start)
+{
+    dax_tag tag;
+    uint8_t data[512];
+    int n, size;
+
+    assert(tag_get_name(name, &tag) == 0);
+    assert(tag.type == type);
+    size = tag_get_size(tag.idx);
+    assert(tag_read(tag.idx, 0, data, size) == 0);
+    for(n = 0; n < size; n++) {
+        assert(data[n] == (uint8_t)(start + n));
+    }
+}
+
+/* The new server might create its data types in a different order so we
+ * create one that isn't in the file first to move the indexes around */
+static tag_type
+_create_type(char *desc)
+{
+    char str[256];
+    tag_type type;
+    int error = 0;
+
+    strcpy(str, desc);
+    type = cdt_create(str, &error);
+    assert(type != 0 && error == 0);
+    return type;
+}
+
+static void
+_step_write(void)
+{
+    tag_type outer;
+    tag_index idx, dead[DEAD_COUNT];
+    char name[32];
+    off_t size;
+    int n;
+
+    _create_type("unused:a,DINT,1");
+    _create_type("inner:a,DINT,1:b,INT,3:c,BOOL,5");
+    outer = _create_type("outer:x,inner,2:y,LREAL,1");
+    idx = tag_add("ret_cdt", outer, 2, TAG_ATTR_RETAIN);
+    assert(idx >= 0);
+    _write_pattern(idx, 10);
+    for(n = 0; n < DEAD_COUNT; n++) {
+        sprintf(name, "ret_dead_%d", n);
+        dead[n] = tag_add(name, DAX_DINT, 100, TAG_ATTR_RETAIN);
+        assert(dead[n] >= 0);
+        _write_pattern(dead[n], n);
+    }
+    assert(ret_flush() == DEAD_COUNT + 1);
+    for(n = 0; n < DEAD_COUNT; n++) {
+        if(n != 7) assert(tag_del(dead[n]) == 0);
+    }
+    _write_pattern(idx, 20);
+    size = _file_size();
+    assert(ret_compact() == 0);
+    assert(_file_size() < size / 2);
+    /* The writes still have to go to the right place */
+    _write_pattern(idx, 30);
+    _write_pattern(dead[7], 40);
+    assert(ret_flush() == 2);
+    _exit(0); /* Like a crash */
+}
+
+static void
+_step_check(void)
+{
+    tag_index idx;
+
+    assert(cdt_get_type("unused") == 0);
+    assert(cdt_get_type("inner") != 0);
+    _check_pattern("ret_cdt", cdt_get_type("outer"), 30);
+    _check_pattern("ret_dead_7", DAX_DINT, 40);
+    assert(tag_get_name("ret_dead_8", NULL) == ERR_NOTFOUND);
+    idx = tag_add("ret_cdt", cdt_get_type("outer"), 2, TAG_ATTR_RETAIN);
+    assert(idx >= 0);
+    _write_pattern(idx, 50);
+    assert(ret_close() == 0);
+}
+
+static void
+_step_check_closed(void)
+{
+    dax_tag tag;
+
+    _check_pattern("ret_cdt", cdt_get_type("outer"), 50);
+    assert(tag_get_name("ret_dead_7", &tag) == ERR_NOTFOUND);
+    assert(ret_close() == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unlink(RET_FILE);
+    run_step(RET_FILE, _step_write);
+    run_step(RET_FILE, _step_check);
+    run_step(RET_FILE, _step_check_closed);
+    unlink(RET_FILE);
+    return 0;
+}
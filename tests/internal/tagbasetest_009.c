@@ -0,0 +1,178 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test checks data mappings.  Partial writes to the source have to
+ * copy the mapped data from the right place.  Random bit mappings are
+ * checked against a simple loop over the bits.  Then chains of mappings,
+ * loops and mappings to deleted tags are checked.
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define BIT_TESTS 500
+
+static tag_handle
+_handle(tag_index idx, int byte, int bit, int count, int size, tag_type type)
+{
+    tag_handle h;
+
+    h.index = idx;
+    h.byte = byte;
+    h.bit = bit;
+    h.count = count;
+    h.size = size;
+    h.type = type;
+    return h;
+}
+
+static void
+_test_partial(void)
+{
+    tag_index src, dest;
+    dax_int data[16], out[16];
+    int n;
+
+    src = tag_add("map_int_src", DAX_INT, 16, 0);
+    dest = tag_add("map_int_dest", DAX_INT, 16, 0);
+    assert(src >= 0 && dest >= 0);
+    /* src[2] - src[5] go to dest[8] - dest[11] */
+    assert(map_add(_handle(src, 4, 0, 4, 8, DAX_INT), _handle(dest, 16, 0, 4, 8, DAX_INT)) >= 0);
+    for(n = 0; n < 16; n++) data[n] = n + 100;
+    assert(tag_write(src, 0, data, sizeof(data)) == 0);
+    /* Only write src[3] */
+    data[3] = 555;
+    assert(tag_write(src, 6, &data[3], sizeof(dax_int)) == 0);
+    assert(tag_read(dest, 0, out, sizeof(out)) == 0);
+    for(n = 0; n < 16; n++) {
+        if(n >= 8 && n < 12) {
+            assert(out[n] == data[n - 6]);
+        } else {
+            assert(out[n] == 0);
+        }
+    }
+    /* A write that misses the mapping doesn't change anything */
+    data[0] = 1;
+    assert(tag_write(src, 0, &data[0], sizeof(dax_int)) == 0);
+    assert(tag_read(dest, 0, out, sizeof(out)) == 0);
+    assert(out[0] == 0 && out[8] == 102);
+}
+
+#define GET_BIT(d, b) (((d)[(b) / 8] >> ((b) % 8)) & 0x01)
+
+static void
+_test_bits(void)
+{
+    char name[32];
+    tag_index src, dest;
+    uint8_t data[10], before[10], after[10];
+    int n, i, sb, db, count, size;
+
+    srand(4321);
+    for(n = 0; n < BIT_TESTS; n++) {
+        sprintf(name, "map_bit_src_%d", n);
+        src = tag_add(name, DAX_BOOL, 80, 0);
+        sprintf(name, "map_bit_dest_%d", n);
+        dest = tag_add(name, DAX_BOOL, 80, 0);
+        assert(src >= 0 && dest >= 0);
+        count = rand() % 48 + 1;
+        sb = rand() % (80 - count);
+        db = rand() % (72 - count);
+        size = (sb % 8 + count + 7) / 8;
+        for(i = 0; i < 10; i++) before[i] = rand();
+        assert(tag_write(dest, 0, before, 10) == 0);
+        assert(map_add(_handle(src, sb / 8, sb % 8, count, size, DAX_BOOL),
+                       _handle(dest, db / 8, db % 8, count, size + 1, DAX_BOOL)) >= 0);
+        for(i = 0; i < 10; i++) data[i] = rand();
+        assert(tag_write(src, 0, data, 10) == 0);
+        assert(tag_read(dest, 0, after, 10) == 0);
+        for(i = 0; i < 80; i++) {
+            if(i >= db && i < db + count) {
+                assert(GET_BIT(after, i) == GET_BIT(data, sb + i - db));
+            } else {
+                assert(GET_BIT(after, i) == GET_BIT(before, i));
+            }
+        }
+    }
+}
+
+static void
+_test_chains(void)
+{
+    tag_index a, b, c, d, e;
+    dax_dint value, out[4];
+    int id;
+
+    a = tag_add("map_chain_a", DAX_DINT, 4, 0);
+    b = tag_add("map_chain_b", DAX_DINT, 4, 0);
+    c = tag_add("map_chain_c", DAX_DINT, 4, 0);
+    d = tag_add("map_chain_d", DAX_DINT, 4, 0);
+    e = tag_add("map_chain_e", DAX_DINT, 4, 0);
+    /* a -> b -> d -> e and a -> c -> d */
+    assert(map_add(_handle(a, 0, 0, 1, 4, DAX_DINT), _handle(b, 0, 0, 1, 4, DAX_DINT)) >= 0);
+    assert(map_add(_handle(a, 0, 0, 1, 4, DAX_DINT), _handle(c, 4, 0, 1, 4, DAX_DINT)) >= 0);
+    assert(map_add(_handle(b, 0, 0, 1, 4, DAX_DINT), _handle(d, 0, 0, 1, 4, DAX_DINT)) >= 0);
+    assert(map_add(_handle(c, 4, 0, 1, 4, DAX_DINT), _handle(d, 4, 0, 1, 4, DAX_DINT)) >= 0);
+    assert(map_add(_handle(d, 0, 0, 2, 8, DAX_DINT), _handle(e, 8, 0, 2, 8, DAX_DINT)) >= 0);
+    /* Inside the same tag */
+    assert(map_add(_handle(e, 8, 0, 1, 4, DAX_DINT), _handle(e, 0, 0, 1, 4, DAX_DINT)) >= 0);
+    value = 12345;
+    assert(tag_write(a, 0, &value, sizeof(value)) == 0);
+    assert(tag_read(e, 0, out, sizeof(out)) == 0);
+    assert(out[0] == 12345 && out[1] == 0 && out[2] == 12345 && out[3] == 12345);
+
+    /* This would close the loop */
+    assert(map_add(_handle(e, 0, 0, 1, 4, DAX_DINT), _handle(a, 4, 0, 1, 4, DAX_DINT)) == ERR_ILLEGAL);
+    assert(map_add(_handle(d, 0, 0, 1, 4, DAX_DINT), _handle(b, 4, 0, 1, 4, DAX_DINT)) == ERR_ILLEGAL);
+
+    /* Delete the mapping in the middle of the list */
+    id = map_add(_handle(a, 0, 0, 1, 4, DAX_DINT), _handle(c, 0, 0, 1, 4, DAX_DINT));
+    assert(id >= 0);
+    assert(map_add(_handle(a, 0, 0, 1, 4, DAX_DINT), _handle(c, 8, 0, 1, 4, DAX_DINT)) >= 0);
+    assert(map_del(a, id) == 0);
+    assert(map_del(a, id) == ERR_NOTFOUND);
+    value = 99;
+    assert(tag_write(a, 0, &value, sizeof(value)) == 0);
+    assert(tag_read(c, 0, out, sizeof(out)) == 0);
+    assert(out[0] == 0 && out[1] == 99 && out[2] == 99);
+    assert(tag_read(e, 0, out, sizeof(out)) == 0);
+    assert(out[0] == 99 && out[2] == 99 && out[3] == 99);
+
+    /* The mapping to a deleted tag goes away */
+    assert(tag_del(c) == 0);
+    value = 7;
+    assert(tag_write(a, 0, &value, sizeof(value)) == 0);
+    assert(tag_read(e, 0, out, sizeof(out)) == 0);
+    assert(out[0] == 7 && out[2] == 7 && out[3] == 99);
+    assert(map_del(a, 2) == ERR_NOTFOUND);
+}
+
+int
+main(int argc, char *argv[])
+{
+    initialize_tagbase();
+    _test_partial();
+    _test_bits();
+    _test_chains();
+    return 0;
+}
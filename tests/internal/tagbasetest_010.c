@@ -0,0 +1,152 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test subscribes to a group that has every element of a large array
+ * tag in it and then makes random writes to the tag.  The group messages
+ * that are sent out through a pipe should have exactly the members that
+ * were written since the last time they were sent.
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <groups.h>
+#include <libcommon.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <opendax.h>
+
+#define TAG_COUNT    1000  /* Number of DINTs in the tag and the group */
+#define WRITE_COUNT  500
+
+/* Read all the group messages that are waiting in the pipe and mark the
+ * members that are in them.  Returns the number of messages */
+static int
+_read_group(int fd, uint8_t *hits, dax_dint *data) {
+    uint8_t buff[DAX_MSGMAX];
+    uint32_t size, pos, n, flags = 0;
+    int count = 0;
+
+    while(read(fd, buff, MSG_HDR_SIZE) == MSG_HDR_SIZE) {
+        size = ntohl(*(uint32_t *)&buff[0]);
+        assert(ntohl(*(uint32_t *)&buff[4]) == (MSG_EVENT | EVENT_GROUP));
+        assert(read(fd, buff, size) == size);
+        assert(ntohl(*(uint32_t *)&buff[0]) == 0); /* Group index */
+        flags = ntohl(*(uint32_t *)&buff[4]);
+        for(pos = GROUP_DELTA_HDR_SIZE; pos < size; pos += 4 + sizeof(dax_dint)) {
+            n = ntohl(*(uint32_t *)&buff[pos]);
+            assert(n < TAG_COUNT);
+            assert(hits[n] == 0); /* Only once per message */
+            hits[n] = 1;
+            assert(memcmp(&buff[pos + 4], &data[n], sizeof(dax_dint)) == 0);
+        }
+        count++;
+    }
+    /* The last one always has the flag */
+    if(count) assert(flags & GROUP_DELTA_LAST);
+    return count;
+}
+
+int
+main(int argc, char *argv[])
+{
+    dax_module module;
+    tag_index idx;
+    uint8_t *handles, hits[TAG_COUNT], written[TAG_COUNT];
+    dax_dint data[TAG_COUNT];
+    uint32_t u;
+    int fds[2];
+    int n, i, j, offset, count, index;
+
+    initialize_tagbase();
+    assert(pipe(fds) == 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    bzero(&module, sizeof(module));
+    module.fd = fds[1];
+
+    idx = tag_add("group_sub_test", DAX_DINT, TAG_COUNT, 0);
+    assert(idx >= 0);
+    handles = malloc(TAG_GROUP_HANDLE_SIZE * TAG_COUNT);
+    assert(handles != NULL);
+    bzero(handles, TAG_GROUP_HANDLE_SIZE * TAG_COUNT);
+    for(n = 0; n < TAG_COUNT; n++) {
+        offset = TAG_GROUP_HANDLE_SIZE * n;
+        memcpy(&handles[offset], &idx, 4);
+        u = n * sizeof(dax_dint);
+        memcpy(&handles[offset + 4], &u, 4);
+        u = 1;
+        memcpy(&handles[offset + 9], &u, 4);
+        u = sizeof(dax_dint);
+        memcpy(&handles[offset + 13], &u, 4);
+        u = DAX_DINT;
+        memcpy(&handles[offset + 17], &u, 4);
+    }
+    index = group_add(&module, handles, TAG_COUNT, GROUP_OPT_SUBSCRIBE);
+    assert(index == 0);
+
+    /* The first time everything is sent and it takes more than one message */
+    bzero(data, sizeof(data));
+    bzero(hits, sizeof(hits));
+    group_batch_flush();
+    assert(_read_group(fds[0], hits, data) > 1);
+    for(n = 0; n < TAG_COUNT; n++) assert(hits[n] == 1);
+    group_batch_flush();
+    assert(_read_group(fds[0], hits, data) == 0);
+
+    srand(4321);
+    for(n = 0; n < WRITE_COUNT; n++) {
+        bzero(written, sizeof(written));
+        /* A few writes before each send */
+        for(i = 0; i < n % 4 + 1; i++) {
+            offset = rand() % TAG_COUNT;
+            count = rand() % 10 + 1;
+            if(offset + count > TAG_COUNT) count = TAG_COUNT - offset;
+            for(j = offset; j < offset + count; j++) {
+                data[j] = rand();
+                written[j] = 1;
+            }
+            /* Sometimes only part of a member is written */
+            if(n % 5 == 0) {
+                assert(tag_write(idx, offset * sizeof(dax_dint) + 1, (uint8_t *)&data[offset] + 1,
+                                 count * sizeof(dax_dint) - 2) == 0);
+                assert(tag_read(idx, 0, data, sizeof(data)) == 0);
+            } else {
+                assert(tag_write(idx, offset * sizeof(dax_dint), &data[offset], count * sizeof(dax_dint)) == 0);
+            }
+        }
+        bzero(hits, sizeof(hits));
+        group_batch_flush();
+        assert(_read_group(fds[0], hits, data) == 1);
+        assert(memcmp(hits, written, sizeof(hits)) == 0);
+    }
+
+    /* Nothing is sent after the group is gone */
+    assert(group_del(&module, index) == 0);
+    assert(tag_write(idx, 0, data, sizeof(data)) == 0);
+    group_batch_flush();
+    bzero(hits, sizeof(hits));
+    assert(_read_group(fds[0], hits, data) == 0);
+    assert(groups_cleanup(&module) == 0);
+    free(handles);
+
+    return 0;
+}
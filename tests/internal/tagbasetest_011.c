@@ -0,0 +1,139 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test puts random overrides on a tag and checks that tag_read()
+ * returns the same thing that merging the override data one byte at a time
+ * would.  Reads of random ranges are checked as overrides are added and
+ * deleted and after the tag is made bigger.
+ */
+
+#include <tagbase.h>
+#include <daxtypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define TAG_COUNT   4000  /* Number of BYTEs in the tag */
+#define GROW_COUNT  5003  /* Size of the tag after it's made bigger */
+#define OVRD_COUNT  200
+#define READ_COUNT  5000
+
+static uint8_t data[GROW_COUNT], odata[GROW_COUNT], omask[GROW_COUNT];
+static int overridden;
+
+static void
+_check_reads(tag_index idx, int tag_size)
+{
+    uint8_t buff[GROW_COUNT];
+    int n, i, offset, size;
+
+    for(n = 0; n < READ_COUNT; n++) {
+        offset = rand() % tag_size;
+        if(n % 10 == 0) {
+            size = tag_size - offset;
+        } else {
+            size = rand() % 64 + 1;
+            if(offset + size > tag_size) size = tag_size - offset;
+        }
+        assert(tag_read(idx, offset, buff, size) == 0);
+        for(i = 0; i < size; i++) {
+            if(overridden) {
+                assert(buff[i] == ((data[offset + i] & ~omask[offset + i]) |
+                                   (odata[offset + i] & omask[offset + i])));
+            } else {
+                assert(buff[i] == data[offset + i]);
+            }
+        }
+    }
+}
+
+static void
+_add_overrides(tag_index idx, int tag_size)
+{
+    uint8_t o[32], m[32];
+    int n, i, offset, size;
+
+    for(n = 0; n < OVRD_COUNT; n++) {
+        offset = rand() % tag_size;
+        size = rand() % 32 + 1;
+        if(offset + size > tag_size) size = tag_size - offset;
+        for(i = 0; i < size; i++) {
+            o[i] = rand();
+            m[i] = (rand() % 3) ? rand() : 0;
+            odata[offset + i] = o[i];
+            omask[offset + i] = m[i];
+        }
+        assert(override_add(idx, offset, o, m, size) == 0);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    tag_index idx;
+    uint8_t m[64];
+    int n, offset;
+
+    initialize_tagbase();
+    srand(4321);
+    idx = tag_add("override_test", DAX_BYTE, TAG_COUNT, 0);
+    assert(idx >= 0);
+    for(n = 0; n < GROW_COUNT; n++) data[n] = rand();
+    assert(tag_write(idx, 0, data, TAG_COUNT) == 0);
+
+    /* Nothing is overridden until the flag is set */
+    _add_overrides(idx, TAG_COUNT);
+    _check_reads(idx, TAG_COUNT);
+    assert(override_set(idx, 1) == 0);
+    overridden = 1;
+    _check_reads(idx, TAG_COUNT);
+
+    /* Take some of them out.  Deleting clears the override flag */
+    for(n = 0; n < OVRD_COUNT / 2; n++) {
+        offset = rand() % (TAG_COUNT - sizeof(m));
+        memset(m, 0xFF, sizeof(m));
+        m[0] = 0x0F;
+        assert(override_del(idx, offset, m, sizeof(m)) == 0);
+        omask[offset] &= ~m[0];
+        odata[offset] &= ~m[0];
+        memset(&omask[offset + 1], 0, sizeof(m) - 1);
+        memset(&odata[offset + 1], 0, sizeof(m) - 1);
+    }
+    overridden = 0;
+    _check_reads(idx, TAG_COUNT);
+    assert(override_set(idx, 1) == 0);
+    overridden = 1;
+    _check_reads(idx, TAG_COUNT);
+
+    /* Make it bigger and override the new part too */
+    assert(tag_add("override_test", DAX_BYTE, GROW_COUNT, 0) == idx);
+    assert(tag_write(idx, 0, data, GROW_COUNT) == 0);
+    _check_reads(idx, GROW_COUNT);
+    _add_overrides(idx, GROW_COUNT);
+    _check_reads(idx, GROW_COUNT);
+
+    /* Deleting all of them leaves the tag data alone */
+    memset(omask, 0xFF, sizeof(omask));
+    assert(override_del(idx, 0, omask, GROW_COUNT) == 0);
+    assert(override_set(idx, 1) == ERR_ILLEGAL);
+    overridden = 0;
+    _check_reads(idx, GROW_COUNT);
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test does atomic operations on slices of array tags and checks the
+ *  compare and swap and fetch and add operations.  It also checks that an
+ *  operation on a slice fires a write event once and runs the mappings, that
+ *  slices larger than one message work and that bad handles are refused.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+/* Enough elements that the slice has to be sent in more than one message */
+#define BIG_COUNT 3000
+
+static int event_count;
+
+static void
+_event_callback(dax_state *ds, void *udata) {
+    event_count++;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result, n;
+    tag_handle h, hist, copy;
+    dax_dint data[10], ops[10], prev[10], cas[8];
+    dax_int idata[4], iops[4];
+    dax_real rops[2];
+    dax_dint *big, *bigops;
+    dax_id id;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return -1;
+
+    result = dax_tag_add(ds, &hist, "Hist", DAX_DINT, 10, 0);
+    if(result) return result;
+    result = dax_tag_add(ds, &copy, "HistCopy", DAX_DINT, 10, 0);
+    if(result) return result;
+    result = dax_map_add(ds, &hist, &copy, NULL);
+    if(result) return result;
+    result = dax_event_add(ds, &hist, EVENT_WRITE, NULL, &id, _event_callback, NULL, NULL);
+    if(result) return result;
+    for(n = 0; n < 10; n++) data[n] = n * 10;
+    result = dax_write_tag(ds, hist, data);
+    if(result) return result;
+    result = dax_event_wait(ds, 1000, NULL);
+    if(result) return result;
+    event_count = 0;
+
+    /* Add a different amount to each of five buckets */
+    result = dax_tag_handle(ds, &h, "Hist[2]", 5);
+    if(result) return result;
+    for(n = 0; n < 5; n++) ops[n] = n + 1;
+    result = dax_atomic_op(ds, h, ops, ATOMIC_OP_INC);
+    if(result) return result;
+    result = dax_event_wait(ds, 1000, NULL);
+    if(result) return result;
+    if(dax_event_poll(ds, NULL) != ERR_NOTFOUND || event_count != 1) {
+        DF("Event fired %d times", event_count);
+        return -1;
+    }
+    result = dax_read_tag(ds, copy, data);
+    if(result) return result;
+    for(n = 0; n < 10; n++) {
+        if(data[n] != n * 10 + ((n >= 2 && n < 7) ? n - 1 : 0)) {
+            DF("HistCopy[%d] = %d", n, data[n]);
+            return -1;
+        }
+    }
+
+    /* Fetch and add gives back what was there before */
+    for(n = 0; n < 5; n++) ops[n] = 100;
+    result = dax_atomic_fetch(ds, h, ops, prev, ATOMIC_OP_FETCH_ADD);
+    if(result) return result;
+    for(n = 0; n < 5; n++) {
+        if(prev[n] != data[n + 2]) return -1;
+    }
+    result = dax_read_tag(ds, hist, data);
+    if(result) return result;
+    if(data[2] != 121 || data[6] != 165) return -1;
+
+    /* Compare and swap only works if all of them match */
+    result = dax_tag_handle(ds, &h, "Hist[0]", 4);
+    if(result) return result;
+    memcpy(cas, data, sizeof(dax_dint) * 4);
+    cas[3] = 0; /* Wrong */
+    for(n = 4; n < 8; n++) cas[n] = -1;
+    result = dax_atomic_fetch(ds, h, cas, prev, ATOMIC_OP_CAS);
+    if(result) return result;
+    if(memcmp(prev, data, sizeof(dax_dint) * 4)) return -1;
+    result = dax_read_tag(ds, hist, data);
+    if(result) return result;
+    if(data[0] != 0) return -1;
+    cas[3] = data[3];
+    result = dax_atomic_fetch(ds, h, cas, prev, ATOMIC_OP_CAS);
+    if(result) return result;
+    result = dax_read_tag(ds, hist, data);
+    if(result) return result;
+    for(n = 0; n < 4; n++) {
+        if(data[n] != -1) return -1;
+    }
+
+    /* Min, max, xor and not */
+    result = dax_tag_add(ds, &h, "AtomicInts", DAX_INT, 4, 0);
+    if(result) return result;
+    for(n = 0; n < 4; n++) idata[n] = n * 100;
+    result = dax_write_tag(ds, h, idata);
+    if(result) return result;
+    for(n = 0; n < 4; n++) iops[n] = 150;
+    result = dax_atomic_op(ds, h, iops, ATOMIC_OP_MIN);
+    if(result) return result;
+    result = dax_atomic_op(ds, h, iops, ATOMIC_OP_MAX);
+    if(result) return result;
+    result = dax_read_tag(ds, h, idata);
+    if(result) return result;
+    if(idata[0] != 150 || idata[3] != 150) return -1;
+    iops[0] = 0x00FF;
+    iops[1] = iops[2] = iops[3] = 0;
+    result = dax_atomic_op(ds, h, iops, ATOMIC_OP_XOR);
+    if(result) return result;
+    result = dax_atomic_op(ds, h, NULL, ATOMIC_OP_NOT);
+    if(result) return result;
+    result = dax_read_tag(ds, h, idata);
+    if(result) return result;
+    if(idata[0] != (dax_int)~(150 ^ 0x00FF) || idata[1] != (dax_int)~150) return -1;
+
+    /* Bitwise operations don't work on floating point */
+    result = dax_tag_add(ds, &h, "AtomicReals", DAX_REAL, 2, 0);
+    if(result) return result;
+    rops[0] = rops[1] = 1.5;
+    if(dax_atomic_op(ds, h, rops, ATOMIC_OP_OR) != ERR_ILLEGAL) return -1;
+    result = dax_atomic_op(ds, h, rops, ATOMIC_OP_INC);
+    if(result) return result;
+    /* The operands have to match the handle */
+    h.size = 4;
+    if(dax_atomic_op(ds, h, rops, ATOMIC_OP_INC) != ERR_ARG) return -1;
+
+    /* A slice that is bigger than a single message */
+    big = malloc(sizeof(dax_dint) * BIG_COUNT);
+    bigops = malloc(sizeof(dax_dint) * BIG_COUNT);
+    if(big == NULL || bigops == NULL) return -1;
+    result = dax_tag_add(ds, &h, "AtomicBig", DAX_DINT, BIG_COUNT + 10, 0);
+    if(result) return result;
+    result = dax_tag_handle(ds, &h, "AtomicBig[5]", BIG_COUNT);
+    if(result) return result;
+    for(n = 0; n < BIG_COUNT; n++) bigops[n] = n;
+    result = dax_atomic_op(ds, h, bigops, ATOMIC_OP_INC);
+    if(result) return result;
+    result = dax_atomic_fetch(ds, h, bigops, big, ATOMIC_OP_FETCH_ADD);
+    if(result) return result;
+    for(n = 0; n < BIG_COUNT; n++) {
+        if(big[n] != n) {
+            DF("AtomicBig[%d] = %d", n + 5, big[n]);
+            return -1;
+        }
+    }
+    result = dax_read_tag(ds, h, big);
+    if(result) return result;
+    for(n = 0; n < BIG_COUNT; n++) {
+        if(big[n] != n * 2) return -1;
+    }
+    free(big);
+    free(bigops);
+
+    /* A count that would wrap when it's multiplied by the type size */
+    result = dax_tag_handle(ds, &h, "Hist[0]", 1);
+    if(result) return result;
+    h.count = 0x40000001;
+    if(dax_atomic_op(ds, h, ops, ATOMIC_OP_INC) != ERR_2BIG) return -1;
+    /* The type in the handle has to be the type of the tag */
+    h.count = 2;
+    h.type = DAX_INT;
+    if(dax_atomic_op(ds, h, ops, ATOMIC_OP_INC) != ERR_ARG) return -1;
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
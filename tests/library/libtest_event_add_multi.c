@@ -0,0 +1,187 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test adds a lot of events with a single dax_event_add_multi() call.
+ *  One of the events is for a tag that doesn't exist and should fail without
+ *  affecting the others.  Then it writes to the tag and makes sure that the
+ *  right callbacks are called.  Last it adds some BOOL events that carry data
+ *  between DINT events that carry data to make sure that the data lengths in
+ *  the message line up.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+#define EVENT_COUNT 2000
+#define BAD_EVENT 100
+#define BOOL_COUNT 8
+
+static int hits[EVENT_COUNT];
+static int freed;
+
+static void
+_event_callback(dax_state *ds, void *udata) {
+    hits[*(int *)udata]++;
+}
+
+static void
+_free_callback(void *udata) {
+    freed++;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result, n, i;
+    int *index;
+    dax_event_def *events;
+    tag_handle h, wh, bh, dh;
+    dax_id id;
+    dax_dint temp, equal = 55;
+    dax_byte bit = 1;
+    dax_event_def mixed[BOOL_COUNT * 2];
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    if(dax_tag_add(ds, &h, "EventTag", DAX_DINT, EVENT_COUNT, 0)) return -1;
+    events = malloc(sizeof(dax_event_def) * EVENT_COUNT);
+    index = malloc(sizeof(int) * EVENT_COUNT);
+    if(events == NULL || index == NULL) return -1;
+    for(n = 0; n < EVENT_COUNT; n++) {
+        index[n] = n;
+        events[n].handle = h;
+        events[n].handle.byte = n * 4;
+        events[n].handle.count = 1;
+        events[n].handle.size = 4;
+        if(n % 2) {
+            events[n].event_type = EVENT_EQUAL;
+            events[n].data = &equal;
+        } else {
+            events[n].event_type = EVENT_CHANGE;
+            events[n].data = NULL;
+        }
+        events[n].callback = _event_callback;
+        events[n].udata = &index[n];
+        events[n].free_callback = _free_callback;
+    }
+    events[BAD_EVENT].handle.index = 100000;
+    result = dax_event_add_multi(ds, events, EVENT_COUNT);
+    if(result >= 0) {
+        printf("dax_event_add_multi() returned %d\n", result);
+        return -1;
+    }
+    if(events[BAD_EVENT].id.id != result) return -1;
+    for(n = 0; n < EVENT_COUNT; n++) {
+        if(n != BAD_EVENT && events[n].id.id < 0) {
+            printf("Event %d was not added\n", n);
+            return -1;
+        }
+    }
+    /* Writing to each element should fire only that element's event */
+    for(n = 0; n < 200; n++) {
+        i = (n * 7919) % EVENT_COUNT;
+        if(i == BAD_EVENT) continue;
+        temp = (i % 2) ? equal : n + 1000;
+        if(dax_write_tag(ds, events[i].handle, &temp)) return -1;
+        if(dax_event_wait(ds, 1000, &id)) {
+            printf("No event for element %d\n", i);
+            return -1;
+        }
+        if(id.id != events[i].id.id || id.index != h.index || hits[i] != 1) {
+            printf("Wrong event for element %d\n", i);
+            return -1;
+        }
+        hits[i] = 0;
+        if(dax_event_poll(ds, &id) != ERR_NOTFOUND) return -1;
+    }
+    /* Deleting them should call the free callbacks */
+    for(n = 0; n < EVENT_COUNT; n += 2) {
+        if(n == BAD_EVENT) continue;
+        if(dax_event_del(ds, events[n].id)) return -1;
+    }
+    if(freed != EVENT_COUNT / 2 - 1) return -1;
+    wh = h;
+    wh.count = 1;
+    wh.size = 4;
+    temp = 1;
+    if(dax_write_tag(ds, wh, &temp)) return -1;
+    if(dax_event_wait(ds, 100, NULL) != ERR_TIMEOUT) return -1;
+
+    if(dax_tag_add(ds, &bh, "EventBool", DAX_BOOL, BOOL_COUNT, 0)) return -1;
+    if(dax_tag_add(ds, &dh, "EventMixed", DAX_DINT, BOOL_COUNT, 0)) return -1;
+    memset(hits, 0, sizeof(hits));
+    for(n = 0; n < BOOL_COUNT; n++) {
+        mixed[n * 2].handle = bh;
+        mixed[n * 2].handle.bit = n;
+        mixed[n * 2].handle.count = 1;
+        mixed[n * 2].handle.size = 1;
+        mixed[n * 2].event_type = EVENT_SET;
+        mixed[n * 2].data = &bit;
+        mixed[n * 2].callback = _event_callback;
+        mixed[n * 2].udata = &index[n * 2];
+        mixed[n * 2].free_callback = NULL;
+        mixed[n * 2 + 1].handle = dh;
+        mixed[n * 2 + 1].handle.byte = n * 4;
+        mixed[n * 2 + 1].handle.count = 1;
+        mixed[n * 2 + 1].handle.size = 4;
+        mixed[n * 2 + 1].event_type = EVENT_EQUAL;
+        mixed[n * 2 + 1].data = &equal;
+        mixed[n * 2 + 1].callback = _event_callback;
+        mixed[n * 2 + 1].udata = &index[n * 2 + 1];
+        mixed[n * 2 + 1].free_callback = NULL;
+    }
+    result = dax_event_add_multi(ds, mixed, BOOL_COUNT * 2);
+    if(result) {
+        printf("dax_event_add_multi() returned %d for the BOOL events\n", result);
+        return -1;
+    }
+    for(n = 0; n < BOOL_COUNT; n++) {
+        if(dax_write_tag(ds, mixed[n * 2].handle, &bit)) return -1;
+        if(dax_event_wait(ds, 1000, &id) || id.id != mixed[n * 2].id.id || hits[n * 2] != 1) {
+            printf("Wrong event for BOOL %d\n", n);
+            return -1;
+        }
+        temp = equal;
+        if(dax_write_tag(ds, mixed[n * 2 + 1].handle, &temp)) return -1;
+        if(dax_event_wait(ds, 1000, &id) || id.id != mixed[n * 2 + 1].id.id || hits[n * 2 + 1] != 1) {
+            printf("Wrong event for DINT after BOOL %d\n", n);
+            return -1;
+        }
+    }
+
+    free(events);
+    free(index);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
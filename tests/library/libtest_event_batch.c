@@ -0,0 +1,148 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test fires a lot of events with a single write so that the server
+ *  sends them in a batch and makes sure that each one is received exactly
+ *  once.  Then it uses two mappings to write the same tag twice while the
+ *  server handles a single message to check that an event with the coalesce
+ *  option is only sent once with the latest data.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define EVENT_COUNT 50 /* Keep this within the library event queue */
+
+int counts[EVENT_COUNT];
+int plain_count, coalesce_count;
+dax_int coalesce_data;
+
+void
+array_callback(dax_state *ds, void *udata) {
+    counts[*(int *)udata]++;
+}
+
+void
+plain_callback(dax_state *ds, void *udata) {
+    plain_count++;
+}
+
+void
+coalesce_callback(dax_state *ds, void *udata) {
+    coalesce_count++;
+    dax_event_get_data(ds, &coalesce_data, sizeof(dax_int));
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h, src, dest;
+    int result, n;
+    int index[EVENT_COUNT];
+    char name[32];
+    dax_int data[EVENT_COUNT * 2];
+    dax_id id;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return -1;
+
+    result = dax_tag_add(ds, &h, "BatchArray", DAX_INT, EVENT_COUNT * 2, 0);
+    if(result) return result;
+    for(n = 0; n < EVENT_COUNT; n++) {
+        index[n] = n;
+        sprintf(name, "BatchArray[%d]", n * 2);
+        result = dax_tag_handle(ds, &h, name, 1);
+        if(result) return result;
+        result = dax_event_add(ds, &h, EVENT_WRITE, NULL, &id, array_callback, &index[n], NULL);
+        if(result) return result;
+    }
+    /* One write fires all of them */
+    result = dax_tag_handle(ds, &h, "BatchArray", 0);
+    if(result) return result;
+    bzero(data, sizeof(data));
+    result = dax_write_tag(ds, h, data);
+    if(result) return result;
+    for(n = 0; n < EVENT_COUNT; n++) {
+        result = dax_event_wait(ds, 1000, NULL);
+        if(result) return result;
+    }
+    if(dax_event_poll(ds, NULL) != ERR_NOTFOUND) return -1;
+    for(n = 0; n < EVENT_COUNT; n++) {
+        if(counts[n] != 1) {
+            DF("Event %d received %d times", n, counts[n]);
+            return -1;
+        }
+    }
+
+    /* Both elements of Src are mapped to Dest so writing Src writes Dest twice */
+    result = dax_tag_add(ds, &src, "Src", DAX_INT, 2, 0);
+    if(result) return result;
+    result = dax_tag_add(ds, &dest, "Dest", DAX_INT, 1, 0);
+    if(result) return result;
+    dax_tag_handle(ds, &h, "Src[0]", 1);
+    result = dax_map_add(ds, &h, &dest, NULL);
+    if(result) return result;
+    dax_tag_handle(ds, &h, "Src[1]", 1);
+    result = dax_map_add(ds, &h, &dest, NULL);
+    if(result) return result;
+    result = dax_event_add(ds, &dest, EVENT_WRITE, NULL, &id, plain_callback, NULL, NULL);
+    if(result) return result;
+    result = dax_event_add(ds, &dest, EVENT_WRITE, NULL, &id, coalesce_callback, NULL, NULL);
+    if(result) return result;
+    result = dax_event_options(ds, id, EVENT_OPT_SEND_DATA | EVENT_OPT_COALESCE);
+    if(result) return result;
+
+    data[0] = 11;
+    data[1] = 22;
+    result = dax_write_tag(ds, src, data);
+    if(result) return result;
+    for(n = 0; n < 3; n++) {
+        result = dax_event_wait(ds, 1000, NULL);
+        if(result) return result;
+    }
+    if(dax_event_poll(ds, NULL) != ERR_NOTFOUND) return -1;
+    result = dax_read_tag(ds, dest, data);
+    if(result) return result;
+    if(plain_count != 2 || coalesce_count != 1 || coalesce_data != data[0]) {
+        DF("plain = %d, coalesce = %d, data = %d, Dest = %d", plain_count,
+           coalesce_count, coalesce_data, data[0]);
+        return -1;
+    }
+    dax_disconnect(ds);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
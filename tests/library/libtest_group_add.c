@@ -36,19 +36,20 @@ do_test(int argc, char *argv[])
     int result = 0;
     tag_group_id *idx;
     tag_handle h[100];
+    char name[16];
 
     ds = dax_init("test");
     dax_init_config(ds, "test");
 
     dax_configure(ds, argc, argv, CFG_CMDLINE);
     result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    /* The server checks that the members are real tags */
     for(int n=0;n<10;n++) {
-        h[n].index = n;
-        h[n].size = 4;
-        h[n].byte = 0;
-        h[n].bit = 0;
-        h[n].count = 1;
-        h[n].type = DAX_DINT;
+        sprintf(name, "TEST%d", n);
+        result += dax_tag_add(ds, &h[n], name, DAX_DINT, 1, 0);
     }
     if(result) {
         return -1;
@@ -59,6 +60,17 @@ do_test(int argc, char *argv[])
             printf("Test - Added group at id %p\n", idx);
         }
     }
+    /* A byte offset and size that wrap around when they are added together
+     * must not get past the bounds check */
+    result = dax_tag_add(ds, &h[10], "TESTARRAY", DAX_DINT, 10, 0);
+    if(result) return result;
+    h[10].byte = 0xFFFFFFF0;
+    h[10].size = 0x20;
+    idx = dax_group_add(ds, &result, &h[10], 1, 0);
+    if(idx != NULL || result != ERR_2BIG) {
+        printf("Test - Group with a wrapping offset returned %d\n", result);
+        return -1;
+    }
     return 0;
 }
 
@@ -0,0 +1,129 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes a tag group with 5000 members that is far too big to
+ *  fit in a single message.  Most of the members are next to each other in
+ *  one tag and the rest are spread over a few others.  The group is read
+ *  and written and the data is checked against plain tag reads and writes.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+#define MEMBERS 5000
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0, n;
+    tag_group_id *id;
+    tag_handle *h, big, small[4], bools;
+    dax_dint *data, *check, value;
+    uint8_t bits[2];
+    char name[32];
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result += dax_tag_add(ds, &big, "BIG", DAX_DINT, MEMBERS, 0);
+    for(n = 0; n < 4; n++) {
+        sprintf(name, "SMALL%d", n);
+        result += dax_tag_add(ds, &small[n], name, DAX_DINT, 10, 0);
+    }
+    result += dax_tag_add(ds, &bools, "BOOLS", DAX_BOOL, 16, 0);
+    if(result) return -1;
+
+    h = malloc(sizeof(tag_handle) * MEMBERS);
+    data = malloc(sizeof(dax_dint) * MEMBERS);
+    check = malloc(sizeof(dax_dint) * MEMBERS);
+    if(h == NULL || data == NULL || check == NULL) return -1;
+    /* Every 100th member comes from one of the small tags and the rest
+     * are the elements of BIG in order except for the ones that we skip */
+    for(n = 0; n < MEMBERS - 1; n++) {
+        if(n % 100 == 50) {
+            sprintf(name, "SMALL%d[%d]", (n / 100) % 4, (n / 100) % 10);
+        } else {
+            sprintf(name, "BIG[%d]", n);
+        }
+        result = dax_tag_handle(ds, &h[n], name, 1);
+        if(result) return result;
+    }
+    result = dax_tag_handle(ds, &h[MEMBERS - 1], "BOOLS[3]", 1);
+    if(result) return result;
+    id = dax_group_add(ds, &result, h, MEMBERS, 0);
+    if(result) return result;
+
+    for(n = 0; n < MEMBERS; n++) data[n] = n * 3 + 1;
+    result = dax_write_tag(ds, big, data);
+    if(result) return result;
+    for(n = 0; n < 4; n++) {
+        result = dax_write_tag(ds, small[n], &data[n * 10]);
+        if(result) return result;
+    }
+    bits[0] = 0x08; bits[1] = 0x00;
+    result = dax_write_tag(ds, bools, bits);
+    if(result) return result;
+
+    result = dax_group_read(ds, id, check, sizeof(dax_dint) * MEMBERS);
+    if(result) return result;
+    for(n = 0; n < MEMBERS - 1; n++) {
+        if(n % 100 == 50) {
+            value = data[((n / 100) % 4) * 10 + (n / 100) % 10];
+        } else {
+            value = data[n];
+        }
+        if(check[n] != value) {
+            printf("Member %d = %d, should be %d\n", n, check[n], value);
+            return -1;
+        }
+    }
+    if((((uint8_t *)&check[MEMBERS - 1])[0] & 0x08) == 0) return -1;
+
+    /* Write it all back with new values */
+    for(n = 0; n < MEMBERS - 1; n++) check[n] = -n;
+    result = dax_group_write(ds, id, check);
+    if(result) return result;
+    result = dax_read_tag(ds, big, data);
+    if(result) return result;
+    for(n = 0; n < MEMBERS - 1; n++) {
+        if(n % 100 != 50 && data[n] != -n) {
+            printf("BIG[%d] = %d, should be %d\n", n, data[n], -n);
+            return -1;
+        }
+    }
+    return dax_group_del(ds, id);
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,206 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test subscribes to a tag group and checks that the data that the
+ *  server sends follows the writes to the tags.  Writes that come too close
+ *  together should be sent together and writes to parts of the tags that are
+ *  not in the group should not send anything.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+#define MEMBERS 13
+
+static int _calls;
+
+static void
+_group_callback(dax_state *ds, void *udata) {
+    _calls++;
+}
+
+/* Handle events until the group's callback has been called */
+static int
+_wait_group(dax_state *ds) {
+    int calls, result;
+
+    calls = _calls;
+    while(_calls == calls) {
+        result = dax_event_wait(ds, 1000, NULL);
+        if(result) return result;
+    }
+    return 0;
+}
+
+static int
+_check_group(dax_state *ds, tag_group_id *id, dax_dint *a, dax_int b, int bit) {
+    uint8_t buff[MEMBERS * 4];
+    dax_dint value;
+    dax_int ivalue;
+    int n, result;
+
+    result = dax_group_get_data(ds, id, buff, sizeof(buff));
+    if(result) return result;
+    for(n = 0; n < 10; n++) {
+        memcpy(&value, &buff[n * 4], 4);
+        if(value != a[n]) {
+            printf("A[%d] = %d, should be %d\n", n, value, a[n]);
+            return -1;
+        }
+    }
+    memcpy(&value, &buff[40], 4);
+    if(value != a[50]) {
+        printf("A[50] = %d, should be %d\n", value, a[50]);
+        return -1;
+    }
+    memcpy(&ivalue, &buff[44], 2);
+    if(ivalue != b) {
+        printf("B[3] = %d, should be %d\n", ivalue, b);
+        return -1;
+    }
+    if(((buff[46] >> 5) & 0x01) != bit) {
+        printf("C[5] is wrong\n");
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0, n;
+    tag_group_id *id;
+    tag_handle h[MEMBERS], a, b, c, tmp;
+    dax_dint data[100];
+    dax_int ivalue;
+    uint8_t bits[2];
+    char name[32];
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result += dax_tag_add(ds, &a, "A", DAX_DINT, 100, 0);
+    result += dax_tag_add(ds, &b, "B", DAX_INT, 10, 0);
+    result += dax_tag_add(ds, &c, "C", DAX_BOOL, 16, 0);
+    if(result) return -1;
+
+    for(n = 0; n < 100; n++) data[n] = n + 1000;
+    result = dax_write_tag(ds, a, data);
+    if(result) return result;
+    ivalue = 33;
+    result = dax_tag_handle(ds, &tmp, "B[3]", 1);
+    if(result) return result;
+    result = dax_write_tag(ds, tmp, &ivalue);
+    if(result) return result;
+
+    /* The first ten elements of A are one run in the server */
+    for(n = 0; n < 10; n++) {
+        sprintf(name, "A[%d]", n);
+        result = dax_tag_handle(ds, &h[n], name, 1);
+        if(result) return result;
+    }
+    result += dax_tag_handle(ds, &h[10], "A[50]", 1);
+    result += dax_tag_handle(ds, &h[11], "B[3]", 1);
+    result += dax_tag_handle(ds, &h[12], "C[5]", 1);
+    if(result) return result;
+
+    id = dax_group_add(ds, &result, h, MEMBERS, GROUP_OPT_SUBSCRIBE);
+    if(result) return result;
+    result = dax_group_set_callback(ds, id, _group_callback, NULL);
+    if(result) return result;
+
+    /* The first message has all of the members */
+    result = _wait_group(ds);
+    if(result) return result;
+    result = _check_group(ds, id, data, 33, 0);
+    if(result) return result;
+
+    /* Write some of the members */
+    data[3] = -3;
+    data[4] = -4;
+    result = dax_write(ds, a.index, 3 * sizeof(dax_dint), &data[3], 2 * sizeof(dax_dint));
+    if(result) return result;
+    bits[0] = 0x20; bits[1] = 0x00;
+    result = dax_write_tag(ds, c, bits);
+    if(result) return result;
+    result = _wait_group(ds);
+    if(result) return result;
+    /* The bit could have come in the next one */
+    if(_check_group(ds, id, data, 33, 1)) {
+        result = _wait_group(ds);
+        if(result) return result;
+        result = _check_group(ds, id, data, 33, 1);
+        if(result) return result;
+    }
+
+    /* Lots of writes to the same member in a hurry shouldn't send a
+     * message for each one */
+    _calls = 0;
+    for(n = 0; n < 50; n++) {
+        data[50] = n;
+        result = dax_write(ds, a.index, 50 * sizeof(dax_dint), &data[50], sizeof(dax_dint));
+        if(result) return result;
+    }
+    while(dax_event_wait(ds, 300, NULL) == 0);
+    if(_calls == 0 || _calls >= 50) {
+        printf("%d group messages for 50 writes\n", _calls);
+        return -1;
+    }
+    result = _check_group(ds, id, data, 33, 1);
+    if(result) return result;
+
+    /* Writes outside of the group don't send anything */
+    _calls = 0;
+    data[20] = 99;
+    result = dax_write(ds, a.index, 20 * sizeof(dax_dint), &data[20], sizeof(dax_dint));
+    if(result) return result;
+    ivalue = 5;
+    result = dax_write(ds, b.index, 4 * sizeof(dax_int), &ivalue, sizeof(dax_int));
+    if(result) return result;
+    if(dax_event_wait(ds, 300, NULL) != ERR_TIMEOUT || _calls != 0) {
+        printf("Group message sent for a write outside of the group\n");
+        return -1;
+    }
+
+    /* A group without the option can't be used this way */
+    result = dax_group_del(ds, id);
+    if(result) return result;
+    id = dax_group_add(ds, &result, h, MEMBERS, 0);
+    if(result) return result;
+    if(dax_group_get_data(ds, id, data, sizeof(data)) != ERR_ILLEGAL) return -1;
+    return dax_group_del(ds, id);
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
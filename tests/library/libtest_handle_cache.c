@@ -0,0 +1,128 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test checks that the handles that dax_tag_handle() keeps in it's
+ *  cache are the same as the ones that it works out the first time and that
+ *  they are thrown out when the tag is deleted by another module.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+static int val_byte = -1;
+
+static void
+_iter_callback(cdt_iter member, void *udata)
+{
+    if(strcmp(member.name, "Val") == 0) {
+        val_byte = member.byte;
+    }
+}
+
+static int
+_check_handle(dax_state *ds, char *str, int count, int byte, tag_type type)
+{
+    tag_handle h1, h2;
+    int result;
+
+    result = dax_tag_handle(ds, &h1, str, count);
+    if(result) return result;
+    result = dax_tag_handle(ds, &h2, str, count);
+    if(result) return result;
+    if(memcmp(&h1, &h2, sizeof(tag_handle))) {
+        printf("Cached handle for %s doesn't match\n", str);
+        return -1;
+    }
+    if(h1.byte != byte || h1.type != type) {
+        printf("Handle for %s is byte %d type 0x%X\n", str, h1.byte, h1.type);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds, *ds2;
+    int result = 0;
+    dax_cdt *cdt;
+    tag_type type;
+    tag_handle h;
+    dax_tag tag;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return -1;
+
+    ds2 = dax_init("test2");
+    dax_init_config(ds2, "test2");
+    dax_configure(ds2, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds2);
+    if(result) return -1;
+
+    cdt = dax_cdt_new("HCType", NULL);
+    if(cdt == NULL) return -1;
+    result += dax_cdt_member(ds, cdt, "Bits", DAX_BOOL, 8);
+    result += dax_cdt_member(ds, cdt, "Val", DAX_INT, 1);
+    result += dax_cdt_create(ds, cdt, &type);
+    result += dax_tag_add(ds, &h, "HC_CDT", type, 2, 0);
+    result += dax_tag_add(ds, &h, "HC_TAG", DAX_INT, 10, 0);
+    if(result) return -1;
+
+    result = dax_cdt_iter(ds2, type, NULL, _iter_callback);
+    if(result) return result;
+    if(val_byte != 1) {
+        printf("Val is at byte %d\n", val_byte);
+        return -1;
+    }
+    result += _check_handle(ds2, "HC_CDT[1].Val", 0, 4, DAX_INT);
+    result += _check_handle(ds2, "HC_CDT[0].Bits[7]", 1, 0, DAX_BOOL);
+    result += _check_handle(ds2, "HC_TAG[2]", 1, 4, DAX_INT);
+    result += _check_handle(ds2, "HC_TAG[2]", 3, 4, DAX_INT);
+    if(result) return -1;
+
+    /* Put it back with another type */
+    result = dax_tag_del(ds, h.index);
+    if(result) return result;
+    result = dax_tag_add(ds, &h, "HC_TAG", DAX_DINT, 10, 0);
+    if(result) return result;
+    /* This makes sure that the connection thread has seen the delete */
+    result = dax_tag_byname(ds2, &tag, "HC_CDT");
+    if(result) return result;
+    result = _check_handle(ds2, "HC_TAG[2]", 1, 8, DAX_DINT);
+    if(result) return result;
+
+    dax_disconnect(ds2);
+    dax_free(ds2);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,124 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test reads and writes tags that are much larger than a single
+ *  message to make sure that they are sent in chunks and put back
+ *  together properly.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define TAG_COUNT 100000
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0, n;
+    tag_handle h;
+    dax_dint *wbuff, *rbuff;
+    uint8_t *mask;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result = dax_tag_add(ds, &h, "Big", DAX_DINT, TAG_COUNT, 0);
+    if(result) return -1;
+
+    wbuff = malloc(h.size);
+    rbuff = malloc(h.size);
+    mask = malloc(h.size);
+    if(wbuff == NULL || rbuff == NULL || mask == NULL) return -1;
+
+    for(n = 0; n < TAG_COUNT; n++) wbuff[n] = n * 3;
+    result = dax_write_tag(ds, h, wbuff);
+    if(result) {
+        printf("Large write failed with %d\n", result);
+        return -1;
+    }
+    bzero(rbuff, h.size);
+    result = dax_read_tag(ds, h, rbuff);
+    if(result) {
+        printf("Large read failed with %d\n", result);
+        return -1;
+    }
+    if(memcmp(wbuff, rbuff, h.size)) {
+        printf("Data read does not match data written\n");
+        return -1;
+    }
+
+    /* Read a piece from the middle that still spans several messages */
+    bzero(rbuff, h.size);
+    result = dax_read(ds, h.index, 4001 * 4, rbuff, 20000 * 4);
+    if(result) return -1;
+    for(n = 0; n < 20000; n++) {
+        if(rbuff[n] != (n + 4001) * 3) {
+            printf("Partial read mismatch at %d\n", n);
+            return -1;
+        }
+    }
+
+    /* Masked write that only changes every other element */
+    for(n = 0; n < TAG_COUNT; n++) {
+        wbuff[n] = -1;
+        memset(&mask[n * 4], (n % 2) ? 0xFF : 0x00, 4);
+    }
+    result = dax_mask(ds, h.index, 0, wbuff, mask, h.size);
+    if(result) {
+        printf("Large masked write failed with %d\n", result);
+        return -1;
+    }
+    result = dax_read_tag(ds, h, rbuff);
+    if(result) return -1;
+    for(n = 0; n < TAG_COUNT; n++) {
+        if(rbuff[n] != ((n % 2) ? -1 : n * 3)) {
+            printf("Masked write mismatch at %d\n", n);
+            return -1;
+        }
+    }
+    /* Small messages still work after all that */
+    result = dax_read(ds, h.index, 0, rbuff, 4);
+    if(result || rbuff[0] != 0) return -1;
+
+    free(wbuff);
+    free(rbuff);
+    free(mask);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,130 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test sends several requests to the server back to back on a raw
+ *  socket without waiting for the responses, including a request that is
+ *  split across two writes.  It makes sure that the server answers every
+ *  one of them in order.
+ */
+
+#include <common.h>
+#include <libcommon.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "libtest_common.h"
+
+#define REQUESTS 5
+
+/* Builds a MSG_TAG_GET request by index into buff and returns the size */
+static int
+_build_request(unsigned char *buff, tag_index idx)
+{
+    int size;
+
+    size = MSG_HDR_SIZE + 1 + sizeof(tag_index);
+    *(uint32_t *)&buff[0] = htonl(size);
+    *(uint32_t *)&buff[4] = htonl(MSG_TAG_GET);
+    buff[MSG_HDR_SIZE] = TAG_GET_INDEX;
+    memcpy(&buff[MSG_HDR_SIZE + 1], &idx, sizeof(tag_index));
+    return size;
+}
+
+/* Reads one complete response and returns the index of the tag in it */
+static int
+_read_response(int fd, tag_index *idx)
+{
+    unsigned char buff[DAX_MSGMAX];
+    uint32_t size, type;
+    int index = 0, result;
+
+    while(index < MSG_HDR_SIZE) {
+        result = read(fd, &buff[index], MSG_HDR_SIZE - index);
+        if(result <= 0) return -1;
+        index += result;
+    }
+    /* Responses from the server only count the payload in the size */
+    size = ntohl(*(uint32_t *)&buff[0]) + MSG_HDR_SIZE;
+    type = ntohl(*(uint32_t *)&buff[4]);
+    if(size > DAX_MSGMAX || type != (MSG_TAG_GET | MSG_RESPONSE)) return -1;
+    while(index < size) {
+        result = read(fd, &buff[index], size - index);
+        if(result <= 0) return -1;
+        index += result;
+    }
+    memcpy(idx, &buff[MSG_HDR_SIZE], sizeof(tag_index));
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    unsigned char buff[DAX_MSGMAX];
+    int fd, n, size, half;
+    tag_index idx;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, "/tmp/opendax", sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) return -1;
+
+    /* All but the last request in a single write */
+    size = 0;
+    for(n = 0; n < REQUESTS - 1; n++) {
+        size += _build_request(&buff[size], n);
+    }
+    if(write(fd, buff, size) != size) return -1;
+    /* The last request is split in the middle of the header */
+    size = _build_request(buff, REQUESTS - 1);
+    half = 3;
+    if(write(fd, buff, half) != half) return -1;
+    usleep(50000);
+    if(write(fd, &buff[half], size - half) != size - half) return -1;
+
+    for(n = 0; n < REQUESTS; n++) {
+        if(_read_response(fd, &idx)) {
+            printf("Failed to read response %d\n", n);
+            return -1;
+        }
+        if(idx != n) {
+            printf("Response %d has index %d\n", n, idx);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
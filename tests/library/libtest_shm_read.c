@@ -0,0 +1,176 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test checks reading tags from the server's shared memory segment.
+ *  One thread keeps writing every element of an array tag with the same
+ *  value while we read it through the segment.  If we ever see a mixture
+ *  of values then the sequence locking is broken.  It also checks that
+ *  overridden and deleted tags are handled by the server.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libcommon.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "libtest_common.h"
+
+#define TAG_COUNT 256
+#define WRITE_COUNT 2000
+
+static int _done = 0;
+
+static void *
+_writer_thread(void *arg)
+{
+    dax_state *ds = arg;
+    tag_handle h;
+    dax_dint buff[TAG_COUNT];
+    int n, i;
+
+    if(dax_tag_handle(ds, &h, "ShmTest", 0)) return NULL;
+    for(n = 1; n <= WRITE_COUNT; n++) {
+        for(i = 0; i < TAG_COUNT; i++) buff[i] = n;
+        dax_write_tag(ds, h, buff);
+    }
+    _done = 1;
+    return NULL;
+}
+
+/* Make sure that the server created the segment and that it has our tag */
+static int
+_check_segment(tag_index idx)
+{
+    int fd;
+    struct stat st;
+    uint8_t *shm;
+    dax_shm_header *header;
+    dax_shm_slot *slot;
+    int result = 0;
+
+    fd = shm_open("/opendax", O_RDONLY, 0);
+    if(fd < 0) {
+        printf("Unable to open the shared memory segment\n");
+        return -1;
+    }
+    fstat(fd, &st);
+    shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED) return -1;
+    header = (dax_shm_header *)shm;
+    slot = (dax_shm_slot *)&shm[header->slot_offset] + idx;
+    if(header->magic != DAX_SHM_MAGIC) {
+        printf("Bad magic number in the segment\n");
+        result = -1;
+    } else if(!(slot->flags & SHM_SLOT_VALID) || slot->size != TAG_COUNT * sizeof(dax_dint)) {
+        printf("Slot for the tag is not right\n");
+        result = -1;
+    }
+    munmap(shm, st.st_size);
+    return result;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds, *ds_writer;
+    int result, n, i, reads = 0;
+    tag_handle h;
+    dax_dint buff[TAG_COUNT];
+    pthread_t thread;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    ds_writer = dax_init("writer");
+    dax_init_config(ds_writer, "writer");
+    dax_configure(ds_writer, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds_writer)) return -1;
+
+    result = dax_tag_add(ds, &h, "ShmTest", DAX_DINT, TAG_COUNT, 0);
+    if(result) return -1;
+    if(_check_segment(h.index)) return -1;
+
+    pthread_create(&thread, NULL, _writer_thread, ds_writer);
+    while(!_done) {
+        result = dax_read_tag(ds, h, buff);
+        if(result) {
+            printf("Read failed with %d\n", result);
+            return -1;
+        }
+        for(i = 1; i < TAG_COUNT; i++) {
+            if(buff[i] != buff[0]) {
+                printf("Torn read, buff[0] = %d, buff[%d] = %d\n", buff[0], i, buff[i]);
+                return -1;
+            }
+        }
+        reads++;
+    }
+    pthread_join(thread, NULL);
+    printf("%d reads while writing\n", reads);
+    /* We should see the last write */
+    result = dax_read(ds, h.index, 8, buff, 8);
+    if(result || buff[0] != WRITE_COUNT || buff[1] != WRITE_COUNT) {
+        printf("Last write was not read\n");
+        return -1;
+    }
+
+    /* Overridden tags have to be merged by the server */
+    /* Override the first element only */
+    h.count = 1;
+    h.size = sizeof(dax_dint);
+    n = 42;
+    if(dax_tag_add_override(ds, h, &n)) return -1;
+    if(dax_tag_set_override(ds, h)) return -1;
+    result = dax_read(ds, h.index, 0, buff, 8);
+    if(result || buff[0] != 42 || buff[1] != WRITE_COUNT) {
+        printf("Override not read correctly %d, %d\n", buff[0], buff[1]);
+        return -1;
+    }
+    if(dax_tag_clr_override(ds, h)) return -1;
+    result = dax_read(ds, h.index, 0, buff, 8);
+    if(result || buff[0] != WRITE_COUNT) {
+        printf("Cleared override not read correctly %d\n", buff[0]);
+        return -1;
+    }
+
+    /* Reads of deleted tags should fail */
+    if(dax_tag_del(ds, h.index)) return -1;
+    result = dax_read(ds, h.index, 0, buff, 8);
+    if(result == 0) {
+        printf("Read of a deleted tag succeeded\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
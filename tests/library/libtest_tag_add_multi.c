@@ -0,0 +1,105 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test adds a lot of tags with a single dax_tag_add_multi() call.
+ *  The message is large enough that it has to be sent in chunks.  One of
+ *  the tags has an illegal name and should fail without affecting the
+ *  others.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+#define TAG_COUNT 5000
+#define BAD_TAG 100
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result, n;
+    dax_tag *tags, tag;
+    tag_handle *h;
+    dax_dint temp;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    tags = malloc(sizeof(dax_tag) * TAG_COUNT);
+    h = malloc(sizeof(tag_handle) * TAG_COUNT);
+    if(tags == NULL || h == NULL) return -1;
+    for(n = 0; n < TAG_COUNT; n++) {
+        sprintf(tags[n].name, "Multi%d", n);
+        tags[n].type = (n % 2) ? DAX_DINT : DAX_BOOL;
+        tags[n].count = n % 10 + 1;
+        tags[n].attr = 0;
+    }
+    strcpy(tags[BAD_TAG].name, "_Illegal");
+    result = dax_tag_add_multi(ds, tags, h, TAG_COUNT);
+    if(result != ERR_ILLEGAL) {
+        printf("dax_tag_add_multi() returned %d\n", result);
+        return -1;
+    }
+    for(n = 0; n < TAG_COUNT; n++) {
+        if(n == BAD_TAG) {
+            if(tags[n].idx != ERR_ILLEGAL) return -1;
+            continue;
+        }
+        if(tags[n].idx < 0 || h[n].index != tags[n].idx) {
+            printf("Tag %s was not added\n", tags[n].name);
+            return -1;
+        }
+        if(dax_tag_byname(ds, &tag, tags[n].name)) return -1;
+        if(tag.idx != tags[n].idx || tag.type != tags[n].type || tag.count != tags[n].count) {
+            printf("Tag %s does not match\n", tags[n].name);
+            return -1;
+        }
+    }
+    /* The handles should work */
+    temp = 1234;
+    if(dax_write_tag(ds, h[TAG_COUNT - 1], &temp)) return -1;
+    temp = 0;
+    if(dax_read_tag(ds, h[TAG_COUNT - 1], &temp) || temp != 1234) return -1;
+    if(h[2].size != 1 || h[3].size != 16) return -1;
+
+    /* Adding them all again should give us the same tags */
+    strcpy(tags[BAD_TAG].name, "Multi100");
+    for(n = 0; n < TAG_COUNT; n++) h[n].index = -1;
+    result = dax_tag_add_multi(ds, tags, h, TAG_COUNT);
+    if(result) return -1;
+    if(dax_tag_byname(ds, &tag, "Multi4999") || tag.idx != h[TAG_COUNT - 1].index) return -1;
+
+    free(tags);
+    free(h);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,97 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test uses two connections to the server.  The second one looks up a
+ *  tag that the first one added so that it's in the tag cache and then the
+ *  first one deletes it.  The server should tell the second one to take it
+ *  out of the cache.  The cache counters are checked along the way.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds, *ds2;
+    int result = 0;
+    dax_tag tag;
+    tag_handle h, h2;
+    dax_cache_stats stats;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return -1;
+
+    ds2 = dax_init("test2");
+    dax_init_config(ds2, "test2");
+    dax_configure(ds2, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds2);
+    if(result) return -1;
+
+    result += dax_tag_add(ds, &h, "CACHE_TAG", DAX_DINT, 1, 0);
+    result += dax_tag_add(ds, &h2, "OTHER_TAG", DAX_DINT, 1, 0);
+    if(result) return -1;
+
+    result = dax_tag_byname(ds2, &tag, "CACHE_TAG");
+    if(result) return result;
+    result = dax_tag_byname(ds2, &tag, "CACHE_TAG");
+    if(result) return result;
+    result = dax_tag_byindex(ds2, &tag, h.index);
+    if(result) return result;
+    dax_tag_cache_stats(ds2, &stats);
+    if(stats.hits != 2 || stats.misses != 1 || stats.count != 1) {
+        printf("hits = %llu, misses = %llu, count = %d\n",
+               (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.count);
+        return -1;
+    }
+
+    result = dax_tag_del(ds, h.index);
+    if(result) return result;
+    /* The server sends the notice before anything else that we ask for so
+     * once we get this back it's been handled. */
+    result = dax_tag_byname(ds2, &tag, "OTHER_TAG");
+    if(result) return result;
+    dax_tag_cache_stats(ds2, &stats);
+    if(stats.count != 1) {
+        printf("%d tags in the cache\n", stats.count);
+        return -1;
+    }
+    if(dax_tag_byname(ds2, &tag, "CACHE_TAG") == 0) {
+        printf("Deleted tag was found\n");
+        return -1;
+    }
+    dax_disconnect(ds2);
+    dax_free(ds2);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
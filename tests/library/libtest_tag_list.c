@@ -0,0 +1,133 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test adds a few thousand tags and retrieves them all with
+ *  dax_tag_list().  Then it deletes and adds some tags and checks that
+ *  asking for the changes since the first generation only returns those.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include "libtest_common.h"
+
+#define TAG_COUNT 3000
+
+static tag_handle handles[TAG_COUNT];
+static uint8_t seen[TAG_COUNT];
+static unsigned int counts[TAG_COUNT];
+static int other, deleted, bad;
+
+/* Marks the tags that we added.  The server's own tags are counted in other */
+static void
+_list_callback(dax_state *ds, dax_tag *tag, void *udata) {
+    int n;
+    char name[32];
+
+    if(strncmp(tag->name, "LIST_", 5) == 0) {
+        n = atoi(&tag->name[5]);
+        sprintf(name, "LIST_%d", n);
+        if(n < 0 || n >= TAG_COUNT || strcmp(name, tag->name) || handles[n].index != tag->idx ||
+           tag->type != DAX_DINT) {
+            printf("Bad tag %s at index %d\n", tag->name, tag->idx);
+            bad++;
+            return;
+        }
+        seen[n]++;
+        counts[n] = tag->count;
+    } else if(tag->type == 0) {
+        deleted++;
+    } else {
+        other++;
+    }
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0, n;
+    uint32_t gen, gen2;
+    char name[32];
+    tag_handle h;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    for(n = 0; n < TAG_COUNT; n++) {
+        sprintf(name, "LIST_%d", n);
+        result = dax_tag_add(ds, &handles[n], name, DAX_DINT, n % 10 + 1, 0);
+        if(result) return result;
+    }
+
+    /* Everything */
+    result = dax_tag_list(ds, 0, &gen, _list_callback, NULL);
+    if(result) return result;
+    for(n = 0; n < TAG_COUNT; n++) {
+        if(seen[n] != 1 || counts[n] != n % 10 + 1) {
+            printf("LIST_%d was seen %d times\n", n, seen[n]);
+            return -1;
+        }
+    }
+    if(bad || other == 0 || other > 100 || deleted != 0) return -1;
+
+    /* Nothing has changed */
+    bzero(seen, sizeof(seen));
+    other = 0;
+    result = dax_tag_list(ds, gen, &gen2, _list_callback, NULL);
+    if(result) return result;
+    if(bad || gen2 != gen || other != 0 || deleted != 0) return -1;
+
+    /* Delete some, make some bigger and add a new one */
+    for(n = 0; n < TAG_COUNT; n += 100) {
+        result = dax_tag_del(ds, handles[n].index);
+        if(result) return result;
+    }
+    result = dax_tag_add(ds, &h, "LIST_5", DAX_DINT, 20, 0);
+    if(result) return result;
+    result = dax_tag_add(ds, &h, "NEW_TAG", DAX_INT, 1, 0);
+    if(result) return result;
+    result = dax_tag_list(ds, gen, &gen2, _list_callback, NULL);
+    if(result) return result;
+    if(gen2 <= gen) return -1;
+    if(bad || deleted != TAG_COUNT / 100 || other != 1) {
+        printf("%d deleted and %d others\n", deleted, other);
+        return -1;
+    }
+    if(seen[5] != 1 || counts[5] != 20) return -1;
+    for(n = 0; n < TAG_COUNT; n++) {
+        if(n != 5 && seen[n] != 0) return -1;
+    }
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,132 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test plays the part of a Modbus TCP server for a client that has six
+ *  single register read commands that are close enough together to be merged.
+ *  We should only see one request for registers 10 - 18 and the data should
+ *  be scattered back out to the right tags.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../modtest_common.h"
+
+#define BLOCK_START 10
+#define BLOCK_LEN   9
+
+int
+main(int argc, char *argv[])
+{
+    int s, fd, one = 1, exit_status = 0;
+    dax_state *ds;
+    tag_handle h;
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    uint8_t req[12], res[9 + BLOCK_LEN * 2];
+    uint16_t reg, count;
+    dax_uint buff[6];
+    int regs[6] = {10, 11, 12, 15, 16, 18};
+    int status, n, result;
+    pid_t server_pid, mod_pid;
+
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(5512);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 1)) {
+        fprintf(stderr, "Unable to listen - %s\n", strerror(errno));
+        exit(-1);
+    }
+    /* Run the tag server and the modbus module */
+    server_pid = run_server();
+    mod_pid = run_module("../../../src/modules/modbus/daxmodbus", "conf/mb_client_blocks.conf");
+
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 3000) != 1 || (fd = accept(s, NULL, NULL)) < 0) {
+        fprintf(stderr, "Client never connected\n");
+        exit_status = 1;
+    } else {
+        pfd.fd = fd;
+        if(poll(&pfd, 1, 2000) != 1 || read(fd, req, sizeof(req)) != sizeof(req)) {
+            fprintf(stderr, "Didn't get the request\n");
+            exit_status = 1;
+        } else {
+            reg = (req[8] << 8) | req[9];
+            count = (req[10] << 8) | req[11];
+            if(req[7] != 3 || reg != BLOCK_START || count != BLOCK_LEN) {
+                fprintf(stderr, "Expected one read of %d registers at %d, got %d at %d\n",
+                        BLOCK_LEN, BLOCK_START, count, reg);
+                exit_status = 1;
+            }
+            memcpy(res, req, 8);
+            res[4] = 0;
+            res[5] = 3 + BLOCK_LEN * 2;
+            res[8] = BLOCK_LEN * 2;
+            for(n = 0; n < BLOCK_LEN; n++) {
+                res[9 + n * 2] = (BLOCK_START + n + 100) >> 8;
+                res[10 + n * 2] = (BLOCK_START + n + 100) & 0xFF;
+            }
+            write(fd, res, sizeof(res));
+            /* There shouldn't be any more requests on this scan */
+            if(poll(&pfd, 1, 200) != 0) {
+                fprintf(stderr, "Got more than one request\n");
+                exit_status = 1;
+            }
+        }
+        ds = dax_init("test");
+        if(ds == NULL) {
+            dax_fatal(ds, "Unable to Allocate DaxState Object\n");
+        }
+        dax_init_config(ds, "test");
+        dax_configure(ds, argc, argv, CFG_CMDLINE);
+        result = dax_connect(ds);
+        if(result) return result;
+        result = dax_tag_handle(ds, &h, "mb_block", 0);
+        if(result) return result;
+        dax_read_tag(ds, h, buff);
+        for(n = 0; n < 6; n++) {
+            if(buff[n] != regs[n] + 100) {
+                fprintf(stderr, "mb_block[%d] = %d\n", n, buff[n]);
+                exit_status = 1;
+            }
+        }
+        dax_disconnect(ds);
+        close(fd);
+    }
+    close(s);
+
+    kill(mod_pid, SIGINT);
+    kill(server_pid, SIGINT);
+    if( waitpid(mod_pid, &status, 0) != mod_pid )
+        fprintf(stderr, "Error killing modbus module\n");
+    if( waitpid(server_pid, &status, 0) != server_pid )
+        fprintf(stderr, "Error killing tag server\n");
+
+    exit(exit_status);
+}
@@ -0,0 +1,118 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test plays the part of a Modbus TCP server for a client that has a
+ *  single register write that is sent when the data tag changes.  The port's
+ *  scanrate is five seconds so the request should show up right after we
+ *  change the tag and it should carry the new value.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../modtest_common.h"
+
+#define TEST_VALUE 0x1234
+
+int
+main(int argc, char *argv[])
+{
+    int s, fd, one = 1, exit_status = 0;
+    dax_state *ds;
+    tag_handle h;
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    uint8_t req[12];
+    uint16_t reg, value;
+    dax_uint x;
+    int status, n, result;
+    pid_t server_pid, mod_pid;
+
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(5514);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 1)) {
+        fprintf(stderr, "Unable to listen - %s\n", strerror(errno));
+        exit(-1);
+    }
+    /* Run the tag server and the modbus module */
+    server_pid = run_server();
+    mod_pid = run_module("../../../src/modules/modbus/daxmodbus", "conf/mb_client_onchange.conf");
+
+    ds = dax_init("test");
+    if(ds == NULL) {
+        dax_fatal(ds, "Unable to Allocate DaxState Object\n");
+    }
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return result;
+    /* Wait for the module to add the tag and set up it's events */
+    for(n = 0; n < 20; n++) {
+        if(dax_tag_handle(ds, &h, "mb_out", 0) == 0) break;
+        usleep(100000);
+    }
+    usleep(500000);
+    x = TEST_VALUE;
+    dax_write_tag(ds, h, &x);
+
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 2000) != 1 || (fd = accept(s, NULL, NULL)) < 0) {
+        fprintf(stderr, "Client never connected\n");
+        exit_status = 1;
+    } else {
+        pfd.fd = fd;
+        if(poll(&pfd, 1, 2000) != 1 || read(fd, req, sizeof(req)) != sizeof(req)) {
+            fprintf(stderr, "Didn't get the request\n");
+            exit_status = 1;
+        } else {
+            reg = (req[8] << 8) | req[9];
+            value = (req[10] << 8) | req[11];
+            if(req[7] != 6 || reg != 20 || value != TEST_VALUE) {
+                fprintf(stderr, "Expected write of 0x%X to 20, got function %d 0x%X to %d\n",
+                        TEST_VALUE, req[7], value, reg);
+                exit_status = 1;
+            }
+            /* Echo the request back as the response */
+            write(fd, req, sizeof(req));
+        }
+        close(fd);
+    }
+    dax_disconnect(ds);
+    close(s);
+
+    kill(mod_pid, SIGINT);
+    kill(server_pid, SIGINT);
+    if( waitpid(mod_pid, &status, 0) != mod_pid )
+        fprintf(stderr, "Error killing modbus module\n");
+    if( waitpid(server_pid, &status, 0) != server_pid )
+        fprintf(stderr, "Error killing tag server\n");
+
+    exit(exit_status);
+}
@@ -0,0 +1,179 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test plays the part of two Modbus TCP servers for the client.  The
+ *  client should send all four of it's requests to each server before it
+ *  gets any responses, each with it's own transaction ID.  The responses are
+ *  sent back in the reverse order and the data should still end up in the
+ *  right place in the tag.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../modtest_common.h"
+
+#define REQ_COUNT 4
+#define REQ_SIZE  12
+
+static int
+_listen(int port) {
+    int s, one = 1;
+    struct sockaddr_in addr;
+
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 1)) {
+        fprintf(stderr, "Unable to listen on port %d - %s\n", port, strerror(errno));
+        exit(-1);
+    }
+    return s;
+}
+
+/* Reads the given number of bytes waiting no longer than timeout mSec */
+static int
+_read_all(int fd, uint8_t *buff, int size, int timeout) {
+    struct pollfd pfd;
+    int result, count = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(count < size) {
+        if(poll(&pfd, 1, timeout) != 1) return -1;
+        result = read(fd, &buff[count], size - count);
+        if(result <= 0) return -1;
+        count += result;
+    }
+    return count;
+}
+
+/* Accepts the client, waits for all the requests and then answers them
+ * in the reverse order.  The value in each register is base + register */
+static int
+_serve(int s, uint16_t base) {
+    struct pollfd pfd;
+    uint8_t req[REQ_COUNT][REQ_SIZE], res[11];
+    uint16_t tid, reg;
+    int fd, n, i;
+
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 3000) != 1) {
+        fprintf(stderr, "Client never connected\n");
+        return -1;
+    }
+    fd = accept(s, NULL, NULL);
+    if(fd < 0) return -1;
+    /* All of the requests should come before we have sent any responses */
+    if(_read_all(fd, (uint8_t *)req, sizeof(req), 500) < 0) {
+        fprintf(stderr, "Didn't get all %d requests at once\n", REQ_COUNT);
+        return -1;
+    }
+    for(n = 0; n < REQ_COUNT; n++) {
+        for(i = 0; i < n; i++) {
+            if(req[i][0] == req[n][0] && req[i][1] == req[n][1]) {
+                fprintf(stderr, "Requests %d and %d have the same transaction ID\n", i, n);
+                return -1;
+            }
+        }
+    }
+    for(n = REQ_COUNT - 1; n >= 0; n--) {
+        tid = (req[n][0] << 8) | req[n][1];
+        reg = ((req[n][8] << 8) | req[n][9]) + base;
+        res[0] = tid >> 8;
+        res[1] = tid;
+        res[2] = 0;
+        res[3] = 0;
+        res[4] = 0;
+        res[5] = 5;
+        res[6] = req[n][6];
+        res[7] = 3;
+        res[8] = 2;
+        res[9] = reg >> 8;
+        res[10] = reg;
+        if(write(fd, res, sizeof(res)) != sizeof(res)) return -1;
+    }
+    return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int s1, s2, fd1, fd2, exit_status = 0;
+    dax_state *ds;
+    tag_handle h;
+    dax_uint buff[8];
+    int status, n, result;
+    pid_t server_pid, mod_pid;
+
+    s1 = _listen(5510);
+    s2 = _listen(5511);
+    /* Run the tag server and the modbus module */
+    server_pid = run_server();
+    mod_pid = run_module("../../../src/modules/modbus/daxmodbus", "conf/mb_client_pipeline.conf");
+
+    fd1 = _serve(s1, 1000);
+    fd2 = _serve(s2, 2000);
+    if(fd1 < 0 || fd2 < 0) {
+        exit_status = 1;
+    } else {
+        usleep(200000);
+        ds = dax_init("test");
+        if(ds == NULL) {
+            dax_fatal(ds, "Unable to Allocate DaxState Object\n");
+        }
+        dax_init_config(ds, "test");
+        dax_configure(ds, argc, argv, CFG_CMDLINE);
+        result = dax_connect(ds);
+        if(result) return result;
+        result = dax_tag_handle(ds, &h, "mb_pipe", 0);
+        if(result) return result;
+        dax_read_tag(ds, h, buff);
+        for(n = 0; n < 8; n++) {
+            if(buff[n] != (n < 4 ? 1000 + n : 2000 + n)) {
+                fprintf(stderr, "mb_pipe[%d] = %d\n", n, buff[n]);
+                exit_status = 1;
+            }
+        }
+        dax_disconnect(ds);
+        close(fd1);
+        close(fd2);
+    }
+    close(s1);
+    close(s2);
+
+    kill(mod_pid, SIGINT);
+    kill(server_pid, SIGINT);
+    if( waitpid(mod_pid, &status, 0) != mod_pid )
+        fprintf(stderr, "Error killing modbus module\n");
+    if( waitpid(server_pid, &status, 0) != server_pid )
+        fprintf(stderr, "Error killing tag server\n");
+
+    exit(exit_status);
+}
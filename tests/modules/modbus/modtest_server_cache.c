@@ -0,0 +1,152 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2022 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  Test the local copy of the tables in the modbus server.  Changes to
+ *  the tags should show up in the responses and writes from the client
+ *  should make it to the tags.  Neither happens right away so each check
+ *  is retried for a while before it fails.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "../modtest_common.h"
+#include "modbus_common.h"
+
+#define TRIES 100
+
+/* Reads the holding registers until they match 'buff' */
+static int
+_wait_registers(int s, uint16_t addr, uint16_t count, uint16_t *buff)
+{
+    uint16_t rbuff[128];
+    int n;
+
+    for(n = 0; n < TRIES; n++) {
+        if(read_holding_registers(s, addr, count, rbuff)) return 1;
+        if(memcmp(rbuff, buff, count * 2) == 0) return 0;
+        usleep(10000);
+    }
+    fprintf(stderr, "Holding registers at %d never matched\n", addr);
+    return 1;
+}
+
+/* Reads the tag until it matches 'buff' */
+static int
+_wait_tag(dax_state *ds, tag_handle h, void *buff)
+{
+    uint8_t rbuff[h.size];
+    int n;
+
+    for(n = 0; n < TRIES; n++) {
+        if(dax_read_tag(ds, h, rbuff)) return 1;
+        if(memcmp(rbuff, buff, h.size) == 0) return 0;
+        usleep(10000);
+    }
+    fprintf(stderr, "Tag data never matched\n");
+    return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int s, exit_status = 0;
+    dax_state *ds;
+    tag_handle h;
+    uint16_t buff[128];
+    uint8_t bits[8], rbits[8];
+    struct sockaddr_in serverAddr;
+    socklen_t addr_size;
+    int status, i;
+    int result;
+    pid_t server_pid, mod_pid;
+
+    /* Run the tag server and the modbus module */
+    server_pid = run_server();
+    mod_pid = run_module("../../../src/modules/modbus/daxmodbus", "conf/mb_server_cache.conf");
+    /* Connect to the tag server */
+    ds = dax_init("test");
+    if(ds == NULL) {
+        dax_fatal(ds, "Unable to Allocate DaxState Object\n");
+    }
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) return result;
+
+    /* Open a socket to do the modbus stuff */
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(5513);
+    serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    /*---- Connect the socket to the server using the address struct ----*/
+    addr_size = sizeof serverAddr;
+    result = connect(s, (struct sockaddr *) &serverAddr, addr_size);
+    if(result) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        exit(result);
+    }
+
+    /* Changes to the tag in the server show up in the responses.  The
+     * second write lands in a different part of the table */
+    for(i = 0; i < 10; i++) buff[i] = 0x1100 + i;
+    result = dax_tag_handle(ds, &h, "mb_hreg[5]", 10);
+    if(result) return result;
+    dax_write_tag(ds, h, buff);
+    exit_status += _wait_registers(s, 5, 10, buff);
+
+    buff[0] = 0xBEEF;
+    result = dax_tag_handle(ds, &h, "mb_hreg[290]", 1);
+    if(result) return result;
+    dax_write_tag(ds, h, buff);
+    exit_status += _wait_registers(s, 290, 1, buff);
+
+    /* Writes from the client are answered from the copy right away and
+     * make it to the tag a little later */
+    for(i = 0; i < 64; i++) buff[i] = 2000 + i;
+    exit_status += write_multiple_registers(s, 200, 64, buff);
+    exit_status += read_holding_registers(s, 200, 64, &buff[64]);
+    if(memcmp(buff, &buff[64], 128)) exit_status++;
+    result = dax_tag_handle(ds, &h, "mb_hreg[200]", 64);
+    if(result) return result;
+    exit_status += _wait_tag(ds, h, buff);
+
+    /* Coils that don't start on a byte boundary */
+    bits[0] = 0xA5; bits[1] = 0x03;
+    exit_status += write_multiple_coils(s, 1003, 10, bits);
+    result = dax_tag_handle(ds, &h, "mb_creg[1003]", 10);
+    if(result) return result;
+    exit_status += _wait_tag(ds, h, bits);
+    exit_status += read_coils(s, 1003, 10, rbits);
+    if(rbits[0] != bits[0] || (rbits[1] & 0x03) != bits[1]) exit_status++;
+
+    close(s);
+    dax_disconnect(ds);
+
+    kill(mod_pid, SIGINT);
+    kill(server_pid, SIGINT);
+    if( waitpid(mod_pid, &status, 0) != mod_pid )
+        fprintf(stderr, "Error killing modbus module\n");
+    if( waitpid(server_pid, &status, 0) != server_pid )
+        fprintf(stderr, "Error killing tag server\n");
+
+    exit(exit_status);
+}